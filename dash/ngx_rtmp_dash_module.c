@@ -2,10 +2,16 @@
 
 #include <ngx_config.h>
 #include <ngx_core.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 #include <ngx_rtmp.h>
 #include <ngx_rtmp_codec_module.h>
 #include "ngx_rtmp_live_module.h"
 #include "ngx_rtmp_mp4.h"
+#include "ngx_rtmp_aio.h"
+#include "ngx_rtmp_expire.h"
+#include "ngx_rtmp_store.h"
+#include "ngx_rtmp_dash_module.h"
 
 
 static ngx_rtmp_publish_pt              next_publish;
@@ -14,6 +20,7 @@ static ngx_rtmp_stream_begin_pt         next_stream_begin;
 static ngx_rtmp_stream_eof_pt           next_stream_eof;
 
 
+static ngx_int_t ngx_rtmp_dash_preconfiguration(ngx_conf_t *cf);
 static ngx_int_t ngx_rtmp_dash_postconfiguration(ngx_conf_t *cf);
 static void * ngx_rtmp_dash_create_app_conf(ngx_conf_t *cf);
 static char * ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf,
@@ -24,8 +31,26 @@ static ngx_int_t ngx_rtmp_dash_write_init_segments(ngx_rtmp_session_t *s);
 #define NGX_RTMP_DASH_BUFSIZE           (1024*1024)
 #define NGX_RTMP_DASH_MAX_MDAT          (10*1024*1024)
 #define NGX_RTMP_DASH_MAX_SAMPLES       1024
+#define NGX_RTMP_DASH_MAX_SUBSAMPLES    (NGX_RTMP_DASH_MAX_SAMPLES * 4)
 #define NGX_RTMP_DASH_DIR_ACCESS        0744
 
+/* room for styp, sidx, moof and mdat header in front of the samples,
+ * with saiz, saio and senc listing the subsamples when encrypted */
+#define NGX_RTMP_DASH_HEADER_SIZE       (NGX_RTMP_DASH_MAX_SAMPLES * 19      \
+                                         + NGX_RTMP_DASH_MAX_SUBSAMPLES * 6  \
+                                         + 1024)
+
+/* cbcs: slices longer than 48 bytes are protected past their length,
+ * header and a clear leader of 32 bytes, one block out of every ten;
+ * audio samples whole, the tail shorter than a block stays clear */
+#define NGX_RTMP_DASH_NAL_MIN           48
+#define NGX_RTMP_DASH_NAL_LEADER        32
+#define NGX_RTMP_DASH_CRYPT_PATTERN     160
+
+
+ngx_rtmp_dash_stat_t                    ngx_rtmp_dash_stat;
+ngx_rtmp_dash_fragment_pt               ngx_rtmp_dash_fragment;
+
 
 typedef struct {
     uint32_t                            timestamp;
@@ -39,11 +64,16 @@ typedef struct {
     ngx_uint_t                          mdat_size;
     ngx_uint_t                          sample_count;
     ngx_uint_t                          sample_mask;
-    ngx_fd_t                            fd;
+    ngx_fd_t                            fd;        /* spilled to disk */
+    u_char                             *data;      /* header room + mdat */
+    size_t                              data_size;
+    size_t                              last_mdat_size;
     char                                type;
     uint32_t                            earliest_pres_time;
     uint32_t                            latest_pres_time;
     ngx_rtmp_mp4_sample_t               samples[NGX_RTMP_DASH_MAX_SAMPLES];
+    ngx_rtmp_mp4_subsample_t           *subsamples; /* encrypted video */
+    ngx_uint_t                          nsubsamples;
 } ngx_rtmp_dash_track_t;
 
 
@@ -59,8 +89,10 @@ typedef struct {
     ngx_rtmp_dash_frag_t               *frags; /* circular 2 * winfrags + 1 */
 
     unsigned                            opened:1;
+    unsigned                            failed:1;  /* data lost */
     unsigned                            has_video:1;
     unsigned                            has_audio:1;
+    unsigned                            encrypted:1;
 
     ngx_file_t                          video_file;
     ngx_file_t                          audio_file;
@@ -69,6 +101,14 @@ typedef struct {
 
     ngx_rtmp_dash_track_t               audio;
     ngx_rtmp_dash_track_t               video;
+
+    ngx_rtmp_aio_queue_t               *aio;
+    ngx_uint_t                          aio_errors;  /* when opened */
+
+    /* cbcs, a key for each publishing */
+    EVP_CIPHER_CTX                     *cipher;      /* kept across them */
+    u_char                              key[16];
+    ngx_rtmp_mp4_encryption_t           encryption;
 } ngx_rtmp_dash_ctx_t;
 
 
@@ -87,9 +127,18 @@ typedef struct {
     ngx_uint_t                          winfrags;
     ngx_flag_t                          cleanup;
     ngx_path_t                         *slot;
+    ngx_rtmp_expire_t                  *expire;
+    ngx_rtmp_aio_conf_t                *aio;
+    ngx_rtmp_store_t                   *store;
+    size_t                              frag_buffer;
+    ngx_flag_t                          keys;
 } ngx_rtmp_dash_app_conf_t;
 
 
+static ngx_int_t ngx_rtmp_dash_reserve(ngx_rtmp_session_t *s,
+       ngx_rtmp_dash_track_t *t, size_t size);
+
+
 static ngx_command_t ngx_rtmp_dash_commands[] = {
 
     { ngx_string("dash"),
@@ -134,12 +183,40 @@ static ngx_command_t ngx_rtmp_dash_commands[] = {
       offsetof(ngx_rtmp_dash_app_conf_t, nested),
       NULL },
 
+    { ngx_string("dash_aio"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE12,
+      ngx_rtmp_aio_set_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_dash_app_conf_t, aio),
+      NULL },
+
+    { ngx_string("dash_fragment_buffer"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_dash_app_conf_t, frag_buffer),
+      NULL },
+
+    { ngx_string("dash_store"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_rtmp_store_set_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_dash_app_conf_t, store),
+      NULL },
+
+    { ngx_string("dash_keys"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_dash_app_conf_t, keys),
+      NULL },
+
     ngx_null_command
 };
 
 
 static ngx_rtmp_module_t  ngx_rtmp_dash_module_ctx = {
-    NULL,                               /* preconfiguration */
+    ngx_rtmp_dash_preconfiguration,     /* preconfiguration */
     ngx_rtmp_dash_postconfiguration,    /* postconfiguration */
 
     NULL,                               /* create main configuration */
@@ -199,26 +276,11 @@ ngx_rtmp_dash_next_frag(ngx_rtmp_session_t *s)
 }
 
 
-static ngx_int_t
-ngx_rtmp_dash_rename_file(u_char *src, u_char *dst)
-{
-    /* rename file with overwrite */
-
-#if (NGX_WIN32)
-    return MoveFileEx((LPCTSTR) src, (LPCTSTR) dst, MOVEFILE_REPLACE_EXISTING);
-#else
-    return ngx_rename_file(src, dst);
-#endif
-}
-
-
 static ngx_int_t
 ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
 {
     char                      *sep;
-    u_char                    *p, *last;
-    ssize_t                    n;
-    ngx_fd_t                   fd;
+    u_char                    *p, *last, *k;
     struct tm                  tm;
     ngx_str_t                  noname, *name;
     ngx_uint_t                 i;
@@ -230,6 +292,8 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     static u_char              buffer[NGX_RTMP_DASH_BUFSIZE];
     static u_char              start_time[sizeof("1970-09-28T12:00:00Z")];
     static u_char              pub_time[sizeof("1970-09-28T12:00:00Z")];
+    static u_char              kid[sizeof("00000000-0000-0000-0000-"
+                                          "000000000000")];
 
     dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
@@ -243,15 +307,6 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
         ngx_rtmp_dash_write_init_segments(s);
     }
 
-    fd = ngx_open_file(ctx->playlist_bak.data, NGX_FILE_WRONLY,
-                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
-
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: open failed: '%V'", &ctx->playlist_bak);
-        return NGX_ERROR;
-    }
-
 
 #define NGX_RTMP_DASH_MANIFEST_HEADER                                          \
     "<?xml version=\"1.0\"?>\n"                                                \
@@ -266,6 +321,7 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     "    profiles=\"urn:hbbtv:dash:profile:isoff-live:2012,"                   \
                    "urn:mpeg:dash:profile:isoff-live:2011\"\n"                 \
     "    xmlns:xsi=\"http://www.w3.org/2011/XMLSchema-instance\"\n"            \
+    "    xmlns:cenc=\"urn:mpeg:cenc:2013\"\n"                                  \
     "    xsi:schemaLocation=\"urn:mpeg:DASH:schema:MPD:2011 DASH-MPD.xsd\">\n" \
     "  <Period start=\"PT0S\" id=\"dash\">\n"
 
@@ -285,11 +341,21 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     "          height=\"%ui\"\n"                                               \
     "          frameRate=\"%ui\"\n"                                            \
     "          startWithSAP=\"1\"\n"                                           \
-    "          bandwidth=\"%ui\">\n"                                           \
+    "          bandwidth=\"%ui\">\n"
+
+
+#define NGX_RTMP_DASH_MANIFEST_PROTECTION                                      \
+    "        <ContentProtection\n"                                             \
+    "            schemeIdUri=\"urn:mpeg:dash:mp4protection:2011\"\n"           \
+    "            value=\"cbcs\"\n"                                             \
+    "            cenc:default_KID=\"%s\"/>\n"
+
+
+#define NGX_RTMP_DASH_MANIFEST_TEMPLATE                                        \
     "        <SegmentTemplate\n"                                               \
     "            timescale=\"1000\"\n"                                         \
-    "            media=\"%V%s$Time$.m4v\"\n"                                   \
-    "            initialization=\"%V%sinit.m4v\">\n"                           \
+    "            media=\"%V%s$Time$.m4%c\"\n"                                  \
+    "            initialization=\"%V%sinit.m4%c\">\n"                          \
     "          <SegmentTimeline>\n"
 
 
@@ -318,12 +384,7 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     "          codecs=\"mp4a.%s\"\n"                                           \
     "          audioSamplingRate=\"%ui\"\n"                                    \
     "          startWithSAP=\"1\"\n"                                           \
-    "          bandwidth=\"%ui\">\n"                                           \
-    "        <SegmentTemplate\n"                                               \
-    "            timescale=\"1000\"\n"                                         \
-    "            media=\"%V%s$Time$.m4a\"\n"                                   \
-    "            initialization=\"%V%sinit.m4a\">\n"                           \
-    "          <SegmentTimeline>\n"
+    "          bandwidth=\"%ui\">\n"
 
 
 #define NGX_RTMP_DASH_MANIFEST_AUDIO_FOOTER                                    \
@@ -351,6 +412,23 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
                 tm.tm_mday, tm.tm_hour,
                 tm.tm_min, tm.tm_sec);
 
+    /* the key ID as a UUID */
+
+    if (ctx->encrypted) {
+        k = ctx->encryption.kid;
+
+        p = ngx_hex_dump(kid, k, 4);
+        *p++ = '-';
+        p = ngx_hex_dump(p, k + 4, 2);
+        *p++ = '-';
+        p = ngx_hex_dump(p, k + 6, 2);
+        *p++ = '-';
+        p = ngx_hex_dump(p, k + 8, 2);
+        *p++ = '-';
+        p = ngx_hex_dump(p, k + 10, 6);
+        *p = 0;
+    }
+
     last = buffer + sizeof(buffer);
 
     p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_HEADER,
@@ -360,15 +438,13 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
                      (ngx_uint_t) (dacf->fraglen / 500),
                      (ngx_uint_t) (dacf->playlen / 1000));
 
-    n = ngx_write_fd(fd, buffer, p - buffer);
-
     ngx_str_null(&noname);
 
     name = (dacf->nested ? &noname : &ctx->name);
     sep = (dacf->nested ? "" : "-");
 
     if (ctx->has_video) {
-        p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_VIDEO,
+        p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_VIDEO,
                          codec_ctx->width,
                          codec_ctx->height,
                          codec_ctx->frame_rate,
@@ -379,9 +455,14 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
                          codec_ctx->width,
                          codec_ctx->height,
                          codec_ctx->frame_rate,
-                         (ngx_uint_t) (codec_ctx->video_data_rate * 1000),
-                         name, sep,
-                         name, sep);
+                         (ngx_uint_t) (codec_ctx->video_data_rate * 1000));
+
+        if (ctx->encrypted) {
+            p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_PROTECTION, kid);
+        }
+
+        p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_TEMPLATE,
+                         name, sep, 'v', name, sep, 'v');
 
         for (i = 0; i < ctx->nfrags; i++) {
             f = ngx_rtmp_dash_get_frag(s, i);
@@ -390,19 +471,22 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
         }
 
         p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_VIDEO_FOOTER);
-
-        n = ngx_write_fd(fd, buffer, p - buffer);
     }
 
     if (ctx->has_audio) {
-        p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_AUDIO,
+        p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_AUDIO,
                          &ctx->name,
                          codec_ctx->audio_codec_id == NGX_RTMP_AUDIO_AAC ?
                          (codec_ctx->aac_sbr ? "40.5" : "40.2") : "6b",
                          codec_ctx->sample_rate,
-                         (ngx_uint_t) (codec_ctx->audio_data_rate * 1000),
-                         name, sep,
-                         name, sep);
+                         (ngx_uint_t) (codec_ctx->audio_data_rate * 1000));
+
+        if (ctx->encrypted) {
+            p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_PROTECTION, kid);
+        }
+
+        p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_TEMPLATE,
+                         name, sep, 'a', name, sep, 'a');
 
         for (i = 0; i < ctx->nfrags; i++) {
             f = ngx_rtmp_dash_get_frag(s, i);
@@ -411,29 +495,24 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
         }
 
         p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_AUDIO_FOOTER);
-
-        n = ngx_write_fd(fd, buffer, p - buffer);
     }
 
-    p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_FOOTER);
-    n = ngx_write_fd(fd, buffer, p - buffer);
+    p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_FOOTER);
 
-    if (n < 0) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: write failed: '%V'", &ctx->playlist_bak);
-        ngx_close_file(fd);
+    if (ngx_rtmp_aio_replace(ctx->aio, &ctx->playlist_bak, &ctx->playlist,
+                             buffer, p - buffer)
+        == NGX_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "dash: failed to write '%V'", &ctx->playlist);
         return NGX_ERROR;
     }
 
-    ngx_close_file(fd);
-
-    if (ngx_rtmp_dash_rename_file(ctx->playlist_bak.data, ctx->playlist.data)
-        == NGX_FILE_ERROR)
-    {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: rename failed: '%V'->'%V'",
-                      &ctx->playlist_bak, &ctx->playlist);
-        return NGX_ERROR;
+    if (dacf->store) {
+        (void) ngx_rtmp_store_put(dacf->store, &ctx->playlist, buffer,
+                                  p - buffer, dacf->playlen / 1000,
+                                  NGX_RTMP_STORE_VOLATILE, 0,
+                                  s->connection->log);
     }
 
     return NGX_OK;
@@ -443,13 +522,13 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
 static ngx_int_t
 ngx_rtmp_dash_write_init_segments(ngx_rtmp_session_t *s)
 {
-    ngx_fd_t               fd;
-    ngx_int_t              rc;
-    ngx_buf_t              b;
-    ngx_rtmp_dash_ctx_t   *ctx;
-    ngx_rtmp_codec_ctx_t  *codec_ctx;
+    ngx_buf_t                   b;
+    ngx_str_t                   path;
+    ngx_rtmp_dash_ctx_t        *ctx;
+    ngx_rtmp_codec_ctx_t       *codec_ctx;
+    ngx_rtmp_mp4_encryption_t  *enc;
 
-    static u_char          buffer[NGX_RTMP_DASH_BUFSIZE];
+    static u_char               buffer[NGX_RTMP_DASH_BUFSIZE];
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
     codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
@@ -458,60 +537,50 @@ ngx_rtmp_dash_write_init_segments(ngx_rtmp_session_t *s)
         return NGX_ERROR;
     }
 
-    /* init video */
+    enc = ctx->encrypted ? &ctx->encryption : NULL;
 
-    *ngx_sprintf(ctx->stream.data + ctx->stream.len, "init.m4v") = 0;
+    path.data = ctx->stream.data;
 
-    fd = ngx_open_file(ctx->stream.data, NGX_FILE_RDWR, NGX_FILE_TRUNCATE,
-                       NGX_FILE_DEFAULT_ACCESS);
+    /* init video */
 
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: error creating video init file");
-        return NGX_ERROR;
-    }
+    path.len = ngx_sprintf(path.data + ctx->stream.len, "init.m4v")
+               - path.data;
+    path.data[path.len] = 0;
 
     b.start = buffer;
     b.end = b.start + sizeof(buffer);
     b.pos = b.last = b.start;
 
     ngx_rtmp_mp4_write_ftyp(&b);
-    ngx_rtmp_mp4_write_moov(s, &b, NGX_RTMP_MP4_VIDEO_TRACK);
+    ngx_rtmp_mp4_write_moov(s, &b, NGX_RTMP_MP4_VIDEO_TRACK, enc);
 
-    rc = ngx_write_fd(fd, b.start, (size_t) (b.last - b.start));
-    if (rc == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+    if (ngx_rtmp_aio_replace(ctx->aio, NULL, &path, b.start,
+                             (size_t) (b.last - b.start))
+        == NGX_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                       "dash: writing video init failed");
     }
 
-    ngx_close_file(fd);
-
     /* init audio */
 
-    *ngx_sprintf(ctx->stream.data + ctx->stream.len, "init.m4a") = 0;
-
-    fd = ngx_open_file(ctx->stream.data, NGX_FILE_RDWR, NGX_FILE_TRUNCATE,
-                       NGX_FILE_DEFAULT_ACCESS);
-
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: error creating dash audio init file");
-        return NGX_ERROR;
-    }
+    path.len = ngx_sprintf(path.data + ctx->stream.len, "init.m4a")
+               - path.data;
+    path.data[path.len] = 0;
 
     b.pos = b.last = b.start;
 
     ngx_rtmp_mp4_write_ftyp(&b);
-    ngx_rtmp_mp4_write_moov(s, &b, NGX_RTMP_MP4_AUDIO_TRACK);
+    ngx_rtmp_mp4_write_moov(s, &b, NGX_RTMP_MP4_AUDIO_TRACK, enc);
 
-    rc = ngx_write_fd(fd, b.start, (size_t) (b.last - b.start));
-    if (rc == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+    if (ngx_rtmp_aio_replace(ctx->aio, NULL, &path, b.start,
+                             (size_t) (b.last - b.start))
+        == NGX_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                       "dash: writing audio init failed");
     }
 
-    ngx_close_file(fd);
-
     return NGX_OK;
 }
 
@@ -520,12 +589,13 @@ static void
 ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
 {
     u_char                    *pos, *pos1;
-    size_t                     left;
-    ssize_t                    n;
+    size_t                     size;
     ngx_fd_t                   fd;
     ngx_buf_t                  b;
+    ngx_str_t                  path;
     ngx_rtmp_dash_ctx_t       *ctx;
     ngx_rtmp_dash_frag_t      *f;
+    ngx_rtmp_dash_app_conf_t  *dacf;
 
     static u_char              buffer[NGX_RTMP_DASH_BUFSIZE];
 
@@ -549,7 +619,8 @@ ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
     b.last += 44; /* leave room for sidx */
 
     ngx_rtmp_mp4_write_moof(&b, t->earliest_pres_time, t->sample_count,
-                            t->samples, t->sample_mask, t->id);
+                            t->samples, t->sample_mask, t->id,
+                            ctx->encrypted ? t->subsamples : NULL);
     pos1 = b.last;
     b.last = pos;
 
@@ -558,7 +629,19 @@ ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
     b.last = pos1;
     ngx_rtmp_mp4_write_mdat(&b, t->mdat_size + 8);
 
-    /* move the data down to make room for the headers */
+    size = b.last - b.pos;
+
+    ngx_rtmp_dash_stat.segments++;
+    ngx_rtmp_dash_stat.bytes += size + t->mdat_size;
+    ngx_rtmp_dash_stat.last_bytes = size + t->mdat_size;
+
+    if (ngx_rtmp_dash_stat.last_bytes > ngx_rtmp_dash_stat.max_bytes) {
+        ngx_rtmp_dash_stat.max_bytes = ngx_rtmp_dash_stat.last_bytes;
+    }
+
+    t->last_mdat_size = t->mdat_size;
+
+    /* write the headers followed by the raw media data */
 
     f = ngx_rtmp_dash_get_frag(s, ctx->nfrags);
 
@@ -574,48 +657,75 @@ ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
         goto done;
     }
 
-    if (ngx_write_fd(fd, b.pos, (size_t) (b.last - b.pos)) == NGX_ERROR) {
-        goto done;
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+
+    if (dacf->expire) {
+        (void) ngx_rtmp_expire_add(dacf->expire, ctx->stream.data,
+                                   ngx_strlen(ctx->stream.data), 0);
     }
 
-    left = (size_t) t->mdat_size;
+    if (t->fd == NGX_INVALID_FILE) {
 
-#if (NGX_WIN32)
-    if (SetFilePointer(t->fd, 0, 0, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                      "dash: SetFilePointer error");
-        goto done;
-    }
-#else
-    if (lseek(t->fd, 0, SEEK_SET) == -1) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: lseek error");
-        goto done;
-    }
-#endif
+        /* samples are in memory, put the header right in front of them
+         * and write the whole file at once; the buffer is passed on */
 
-    while (left > 0) {
+        if (t->data == NULL && ngx_rtmp_dash_reserve(s, t, 0) != NGX_OK) {
+            goto done;
+        }
 
-        n = ngx_read_fd(t->fd, buffer, ngx_min(sizeof(buffer), left));
-        if (n == 0 || n == NGX_ERROR) {
-            break;
+        pos = t->data + NGX_RTMP_DASH_HEADER_SIZE - size;
+        ngx_memcpy(pos, b.pos, size);
+
+        /* published before the playlist refers to it */
+
+        if (dacf->store) {
+            path.data = ctx->stream.data;
+            path.len = ngx_strlen(path.data);
+
+            (void) ngx_rtmp_store_put(dacf->store, &path, pos,
+                                      size + t->mdat_size, dacf->playlen / 500,
+                                      0, 0, s->connection->log);
         }
 
-        n = ngx_write_fd(fd, buffer, (size_t) n);
-        if (n == 0 || n == NGX_ERROR) {
-            break;
+        if (ngx_rtmp_aio_write_buf(ctx->aio, fd, 0, t->data, pos,
+                                   size + t->mdat_size)
+            != NGX_OK)
+        {
+            ctx->failed = 1;
         }
 
-        left -= n;
+        t->data = NULL;
+        t->data_size = 0;
+
+        goto done;
+    }
+
+    /* header, then media data moved from the raw file */
+
+    ngx_rtmp_dash_stat.spilled++;
+
+    if (ngx_rtmp_aio_write(ctx->aio, fd, -1, b.pos, size) != NGX_OK
+        || ngx_rtmp_aio_copy(ctx->aio, fd, t->fd, (size_t) t->mdat_size)
+           != NGX_OK)
+    {
+        ctx->failed = 1;
     }
 
 done:
 
     if (fd != NGX_INVALID_FILE) {
-        ngx_close_file(fd);
+        (void) ngx_rtmp_aio_close(ctx->aio, fd);
+    }
+
+    if (t->fd != NGX_INVALID_FILE) {
+        (void) ngx_rtmp_aio_close(ctx->aio, t->fd);
     }
 
-    ngx_close_file(t->fd);
+    if (t->data) {
+        ngx_free(t->data);
+        t->data = NULL;
+        t->data_size = 0;
+    }
 
     t->fd = NGX_INVALID_FILE;
     t->opened = 0;
@@ -625,7 +735,9 @@ done:
 static ngx_int_t
 ngx_rtmp_dash_close_fragments(ngx_rtmp_session_t *s)
 {
-    ngx_rtmp_dash_ctx_t  *ctx;
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_dash_frag_t      *f;
+    ngx_rtmp_dash_fragment_t   v;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
     if (ctx == NULL || !ctx->opened) {
@@ -638,6 +750,21 @@ ngx_rtmp_dash_close_fragments(ngx_rtmp_session_t *s)
     ngx_rtmp_dash_close_fragment(s, &ctx->video);
     ngx_rtmp_dash_close_fragment(s, &ctx->audio);
 
+    if (ctx->failed || ctx->aio->errors != ctx->aio_errors) {
+
+        /* never listed, the slot is reused */
+
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "dash: fragment %ui is incomplete, skipped", ctx->id);
+
+        ctx->id++;
+        ctx->opened = 0;
+
+        return NGX_OK;
+    }
+
+    f = ngx_rtmp_dash_get_frag(s, ctx->nfrags);
+
     ngx_rtmp_dash_next_frag(s);
 
     ngx_rtmp_dash_write_playlist(s);
@@ -645,6 +772,52 @@ ngx_rtmp_dash_close_fragments(ngx_rtmp_session_t *s)
     ctx->id++;
     ctx->opened = 0;
 
+    /* the same files are listed by hls in cmaf format */
+
+    ngx_memzero(&v, sizeof(ngx_rtmp_dash_fragment_t));
+
+    v.playlist = ctx->playlist;
+    v.stream = ctx->stream;
+    v.timestamp = f->timestamp;
+    v.duration = f->duration;
+    v.has_video = ctx->has_video;
+    v.has_audio = ctx->has_audio;
+    v.iv = ctx->encrypted ? ctx->encryption.iv : NULL;
+    v.aio = ctx->aio;
+
+    return ngx_rtmp_dash_fragment(s, &v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_dash_open_raw(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
+    char type)
+{
+    ngx_rtmp_dash_ctx_t   *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    *ngx_sprintf(ctx->stream.data + ctx->stream.len, "raw.m4%c", type) = 0;
+
+    t->fd = ngx_open_file(ctx->stream.data, NGX_FILE_RDWR,
+                          NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (t->fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: error creating fragment file");
+        return NGX_ERROR;
+    }
+
+    /* queued copy still reads the previous raw file, keep it apart */
+
+    if (ngx_rtmp_aio_threaded(ctx->aio)
+        && ngx_delete_file(ctx->stream.data) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: " ngx_delete_file_n " failed: '%s'",
+                      ctx->stream.data);
+    }
+
     return NGX_OK;
 }
 
@@ -653,7 +826,7 @@ static ngx_int_t
 ngx_rtmp_dash_open_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
     ngx_uint_t id, char type)
 {
-    ngx_rtmp_dash_ctx_t   *ctx;
+    ngx_rtmp_dash_app_conf_t  *dacf;
 
     if (t->opened) {
         return NGX_OK;
@@ -662,16 +835,14 @@ ngx_rtmp_dash_open_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
     ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "dash: open fragment id=%ui, type='%c'", id, type);
 
-    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
 
-    *ngx_sprintf(ctx->stream.data + ctx->stream.len, "raw.m4%c", type) = 0;
+    /* with a fragment buffer samples are kept in memory until closing */
 
-    t->fd = ngx_open_file(ctx->stream.data, NGX_FILE_RDWR,
-                          NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+    t->fd = NGX_INVALID_FILE;
 
-    if (t->fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: error creating fragment file");
+    if (dacf->frag_buffer == 0 && ngx_rtmp_dash_open_raw(s, t, type) != NGX_OK)
+    {
         return NGX_ERROR;
     }
 
@@ -681,6 +852,7 @@ ngx_rtmp_dash_open_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
     t->earliest_pres_time = 0;
     t->latest_pres_time = 0;
     t->mdat_size = 0;
+    t->nsubsamples = 0;
     t->opened = 1;
 
     if (type == 'v') {
@@ -716,6 +888,8 @@ ngx_rtmp_dash_open_fragments(ngx_rtmp_session_t *s)
     ngx_rtmp_dash_open_fragment(s, &ctx->audio, ctx->id, 'a');
 
     ctx->opened = 1;
+    ctx->failed = 0;
+    ctx->aio_errors = ctx->aio->errors;
 
     return NGX_OK;
 }
@@ -818,14 +992,102 @@ ngx_rtmp_dash_ensure_directory(ngx_rtmp_session_t *s)
 }
 
 
+static void
+ngx_rtmp_dash_free_cipher(void *data)
+{
+    EVP_CIPHER_CTX  *cipher = data;
+
+    EVP_CIPHER_CTX_free(cipher);
+}
+
+
+/* the key is "cbcs.key" next to the fragments, players fetch it the way
+ * hls players fetch theirs */
+
+static ngx_int_t
+ngx_rtmp_dash_init_encryption(ngx_rtmp_session_t *s)
+{
+    u_char               *p;
+    ngx_str_t             path;
+    ngx_pool_cleanup_t   *cln;
+    ngx_rtmp_dash_ctx_t  *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    if (ctx->cipher == NULL) {
+        cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->cipher = EVP_CIPHER_CTX_new();
+        if (ctx->cipher == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_rtmp_dash_free_cipher;
+        cln->data = ctx->cipher;
+    }
+
+    if (ctx->video.subsamples == NULL) {
+        ctx->video.subsamples = ngx_palloc(s->connection->pool,
+                                           sizeof(ngx_rtmp_mp4_subsample_t)
+                                           * NGX_RTMP_DASH_MAX_SUBSAMPLES);
+        if (ctx->video.subsamples == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (RAND_bytes(ctx->key, 16) != 1
+        || RAND_bytes(ctx->encryption.kid, 16) != 1
+        || RAND_bytes(ctx->encryption.iv, 16) != 1)
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "dash: failed to create key");
+        return NGX_ERROR;
+    }
+
+    /* partial blocks are left clear, there is no padding */
+
+    if (EVP_EncryptInit_ex(ctx->cipher, EVP_aes_128_cbc(), NULL, ctx->key,
+                           ctx->encryption.iv)
+        != 1
+        || EVP_CIPHER_CTX_set_padding(ctx->cipher, 0) != 1)
+    {
+        return NGX_ERROR;
+    }
+
+    p = ngx_sprintf(ctx->stream.data + ctx->stream.len, "cbcs.key");
+    *p = 0;
+
+    path.data = ctx->stream.data;
+    path.len = p - path.data;
+
+    if (ngx_rtmp_aio_replace(ctx->aio, NULL, &path, ctx->key, 16)
+        == NGX_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "dash: failed to write key file '%V'", &path);
+        return NGX_ERROR;
+    }
+
+    ctx->encrypted = 1;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_dash_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
 {
     u_char                    *p;
     size_t                     len;
+    EVP_CIPHER_CTX            *cipher;
     ngx_rtmp_dash_ctx_t       *ctx;
     ngx_rtmp_dash_frag_t      *f;
+    ngx_rtmp_aio_queue_t      *aio;
     ngx_rtmp_dash_app_conf_t  *dacf;
+    ngx_rtmp_mp4_subsample_t  *subsamples;
 
     dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
     if (dacf == NULL || !dacf->dash || dacf->path.len == 0) {
@@ -854,8 +1116,22 @@ ngx_rtmp_dash_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         }
 
         f = ctx->frags;
+        aio = ctx->aio;
+        cipher = ctx->cipher;
+        subsamples = ctx->video.subsamples;
         ngx_memzero(ctx, sizeof(ngx_rtmp_dash_ctx_t));
         ctx->frags = f;
+        ctx->aio = aio;
+        ctx->cipher = cipher;
+        ctx->video.subsamples = subsamples;
+    }
+
+    if (ctx->aio == NULL) {
+        ctx->aio = ngx_rtmp_aio_create_queue(dacf->aio, s->connection->pool,
+                                             s->connection->log);
+        if (ctx->aio == NULL) {
+            return NGX_ERROR;
+        }
     }
 
     if (ctx->frags == NULL) {
@@ -944,11 +1220,51 @@ ngx_rtmp_dash_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         return NGX_ERROR;
     }
 
+    if (dacf->keys && ngx_rtmp_dash_init_encryption(s) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "dash: failed to initialize encryption");
+        return NGX_ERROR;
+    }
+
 next:
     return next_publish(s, v);
 }
 
 
+static void
+ngx_rtmp_dash_expire_stream(ngx_rtmp_session_t *s)
+{
+    u_char                    *p;
+    ngx_uint_t                 n;
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_dash_app_conf_t  *dacf;
+
+    static const char         *files[] = {
+        "init.m4v", "init.m4a", "raw.m4v", "raw.m4a", "cbcs.key"
+    };
+
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    /* the playlist goes first, the rest of the stream is useless then */
+
+    (void) ngx_rtmp_expire_add(dacf->expire, ctx->playlist.data,
+                               ctx->playlist.len, 0);
+
+    for (n = 0; n < sizeof(files) / sizeof(files[0]); n++) {
+        p = ngx_sprintf(ctx->stream.data + ctx->stream.len, "%s", files[n]);
+
+        (void) ngx_rtmp_expire_add(dacf->expire, ctx->stream.data,
+                                   p - ctx->stream.data, 0);
+    }
+
+    if (dacf->nested) {
+        (void) ngx_rtmp_expire_add(dacf->expire, ctx->stream.data,
+                                   ctx->stream.len - 1, NGX_RTMP_EXPIRE_DIR);
+    }
+}
+
+
 static ngx_int_t
 ngx_rtmp_dash_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
 {
@@ -968,6 +1284,10 @@ ngx_rtmp_dash_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
 
     ngx_rtmp_dash_close_fragments(s);
 
+    if (dacf->expire) {
+        ngx_rtmp_dash_expire_stream(s);
+    }
+
 next:
     return next_close_stream(s, v);
 }
@@ -1031,32 +1351,368 @@ ngx_rtmp_dash_update_fragments(ngx_rtmp_session_t *s, ngx_int_t boundary,
 }
 
 
+/* makes room for size more bytes of samples in memory */
 static ngx_int_t
-ngx_rtmp_dash_append(ngx_rtmp_session_t *s, ngx_chain_t *in,
-    ngx_rtmp_dash_track_t *t, ngx_int_t key, uint32_t timestamp, uint32_t delay)
+ngx_rtmp_dash_reserve(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
+    size_t size)
+{
+    u_char                    *p;
+    size_t                     need, n;
+    ngx_rtmp_dash_app_conf_t  *dacf;
+
+    need = NGX_RTMP_DASH_HEADER_SIZE + t->mdat_size + size;
+
+    if (need <= t->data_size) {
+        return NGX_OK;
+    }
+
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+
+    if (need > NGX_RTMP_DASH_HEADER_SIZE + dacf->frag_buffer) {
+        return NGX_DECLINED;
+    }
+
+    /* start with the size of the previous fragment */
+
+    if (t->data_size) {
+        n = t->data_size * 2;
+
+    } else {
+        n = NGX_RTMP_DASH_HEADER_SIZE + t->last_mdat_size
+            + t->last_mdat_size / 4;
+    }
+
+    n = ngx_max(n, need);
+    n = ngx_min(n, NGX_RTMP_DASH_HEADER_SIZE + dacf->frag_buffer);
+
+    p = ngx_alloc(n, s->connection->log);
+    if (p == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (t->data) {
+        ngx_memcpy(p + NGX_RTMP_DASH_HEADER_SIZE,
+                   t->data + NGX_RTMP_DASH_HEADER_SIZE, t->mdat_size);
+        ngx_free(t->data);
+    }
+
+    t->data = p;
+    t->data_size = n;
+
+    return NGX_OK;
+}
+
+
+/* moves the samples collected so far to the raw file */
+static ngx_int_t
+ngx_rtmp_dash_spill(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
 {
-    u_char                 *p;
-    size_t                  size, bsize;
+    ngx_int_t             rc;
+    ngx_rtmp_dash_ctx_t  *ctx;
+
+    ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                  "dash: fragment id=%ui, type=%c exceeds "
+                  "dash_fragment_buffer, using raw file", t->id, t->type);
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    if (ngx_rtmp_dash_open_raw(s, t, t->type) != NGX_OK) {
+        rc = NGX_ERROR;
+        goto failed;
+    }
+
+    if (t->data == NULL) {
+        return NGX_OK;
+    }
+
+    rc = ngx_rtmp_aio_write_buf(ctx->aio, t->fd, -1, t->data,
+                                t->data + NGX_RTMP_DASH_HEADER_SIZE,
+                                t->mdat_size);
+    t->data = NULL;
+    t->data_size = 0;
+
+    if (rc == NGX_OK) {
+        return NGX_OK;
+    }
+
+failed:
+
+    /* the samples are lost, keep the fragment consistent */
+
+    if (t->data) {
+        ngx_free(t->data);
+        t->data = NULL;
+        t->data_size = 0;
+    }
+
+    t->sample_count = 0;
+    t->mdat_size = 0;
+
+    return rc;
+}
+
+
+/* AES-CBC in place, each protected range starts over with the IV */
+
+static ngx_int_t
+ngx_rtmp_dash_encrypt(ngx_rtmp_session_t *s, u_char *p, size_t n,
+    ngx_uint_t pattern)
+{
+    int                   len;
+    size_t                skip;
+    ngx_rtmp_dash_ctx_t  *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    if (EVP_EncryptInit_ex(ctx->cipher, NULL, NULL, NULL, ctx->encryption.iv)
+        != 1)
+    {
+        goto failed;
+    }
+
+    if (!pattern) {
+        n &= ~0x0f;
+
+        if (n && (EVP_EncryptUpdate(ctx->cipher, p, &len, p, (int) n) != 1
+                  || (size_t) len != n))
+        {
+            goto failed;
+        }
+
+        return NGX_OK;
+    }
+
+    while (n >= 16) {
+        if (EVP_EncryptUpdate(ctx->cipher, p, &len, p, 16) != 1
+            || len != 16)
+        {
+            goto failed;
+        }
+
+        skip = ngx_min(n, NGX_RTMP_DASH_CRYPT_PATTERN);
+
+        p += skip;
+        n -= skip;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                  "dash: encryption failed");
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * Adds the subsample of the clear bytes from *clear to data and the
+ * protected ones from data to *next.  Clear runs too long for the entry
+ * take clear ones of their own; with a single entry left the rest of
+ * the sample goes in it.
+ */
+
+static ngx_int_t
+ngx_rtmp_dash_subsample(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
+    ngx_rtmp_mp4_sample_t *smpl, u_char **clear, u_char *data,
+    u_char **next, u_char *last)
+{
+    ngx_uint_t                 left;
+    ngx_rtmp_mp4_subsample_t  *ss;
+
+    for ( ;; ) {
+        left = ngx_min(NGX_RTMP_MP4_MAX_SUBSAMPLES - smpl->nsubsamples,
+                       NGX_RTMP_DASH_MAX_SUBSAMPLES - t->nsubsamples);
+
+        if (left == 0) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                          "dash: too many slices in fragment id=%ui",
+                          t->id);
+            return NGX_ERROR;
+        }
+
+        ss = &t->subsamples[t->nsubsamples++];
+        smpl->nsubsamples++;
+
+        if (left == 1) {
+            data = ngx_min(data, *clear + 0xffff);
+            *next = last;
+        }
+
+        if (data - *clear <= 0xffff) {
+            break;
+        }
+
+        ss->clear_bytes = 0xffff;
+        ss->protected_bytes = 0;
+
+        *clear += 0xffff;
+    }
+
+    ss->clear_bytes = (uint16_t) (data - *clear);
+    ss->protected_bytes = (uint32_t) (*next - data);
+
+    *clear = *next;
+
+    return ngx_rtmp_dash_encrypt(s, data, *next - data, 1);
+}
+
+
+/* samples are length prefixed NAL units, only slices are protected */
+
+static ngx_int_t
+ngx_rtmp_dash_encrypt_video(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
+    u_char *pos, size_t size)
+{
+    u_char                 *p, *last, *clear, *data, *next;
+    size_t                  len;
+    ngx_uint_t              i, nal_bytes, type;
+    ngx_rtmp_codec_ctx_t   *codec_ctx;
     ngx_rtmp_mp4_sample_t  *smpl;
 
+    codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    nal_bytes = codec_ctx->avc_nal_bytes;
+
+    smpl = &t->samples[t->sample_count];
+
+    last = pos + size;
+    clear = pos;
+
+    for (p = pos; (size_t) (last - p) > nal_bytes; p = next) {
+
+        len = 0;
+
+        for (i = 0; i < nal_bytes; i++) {
+            len = (len << 8) | p[i];
+        }
+
+        len = ngx_min(len, (size_t) (last - p) - nal_bytes);
+        next = p + nal_bytes + len;
+
+        type = p[nal_bytes] & 0x1f;
+
+        if ((type != 1 && type != 5) || len <= NGX_RTMP_DASH_NAL_MIN) {
+            continue;
+        }
+
+        data = p + nal_bytes + NGX_RTMP_DASH_NAL_LEADER;
+
+        if (ngx_rtmp_dash_subsample(s, t, smpl, &clear, data, &next, last)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    /* the clear tail, every sample has a subsample at least */
+
+    if (clear < last || smpl->nsubsamples == 0) {
+        next = last;
+
+        if (ngx_rtmp_dash_subsample(s, t, smpl, &clear, last, &next, last)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_dash_write_sample(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
+    ngx_chain_t *in, size_t size)
+{
+    u_char                 *p, *start;
+    size_t                  bsize, n;
+    ngx_int_t               rc;
+    ngx_uint_t              nsubsamples;
+    ngx_rtmp_dash_ctx_t    *ctx;
+
     static u_char           buffer[NGX_RTMP_DASH_BUFSIZE];
 
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
     p = buffer;
-    size = 0;
 
-    for (; in && size < sizeof(buffer); in = in->next) {
+    if (t->fd == NGX_INVALID_FILE) {
+
+        rc = ngx_rtmp_dash_reserve(s, t, size);
+
+        if (rc == NGX_OK) {
+            p = t->data + NGX_RTMP_DASH_HEADER_SIZE + t->mdat_size;
 
-        bsize = (size_t) (in->buf->last - in->buf->pos);
-        if (size + bsize > sizeof(buffer)) {
-            bsize = (size_t) (sizeof(buffer) - size);
+        } else {
+            rc = ngx_rtmp_dash_spill(s, t);
+            if (rc != NGX_OK) {
+                return rc;
+            }
         }
+    }
 
+    start = p;
+
+    for (n = 0; in && n < size; in = in->next) {
+        bsize = ngx_min((size_t) (in->buf->last - in->buf->pos), size - n);
         p = ngx_cpymem(p, in->buf->pos, bsize);
-        size += bsize;
+        n += bsize;
+    }
+
+    /* encrypted in the copy, the size does not change */
+
+    t->samples[t->sample_count].nsubsamples = 0;
+
+    if (ctx->encrypted) {
+        nsubsamples = t->nsubsamples;
+
+        if (t->subsamples) {
+            rc = ngx_rtmp_dash_encrypt_video(s, t, start, size);
+
+        } else {
+            rc = ngx_rtmp_dash_encrypt(s, start, size, 0);
+        }
+
+        if (rc != NGX_OK) {
+            t->nsubsamples = nsubsamples;
+            return rc;
+        }
+    }
+
+    if (t->fd == NGX_INVALID_FILE) {
+        return NGX_OK;
+    }
+
+    return ngx_rtmp_aio_write(ctx->aio, t->fd, -1, buffer, size);
+}
+
+
+static ngx_int_t
+ngx_rtmp_dash_append(ngx_rtmp_session_t *s, ngx_chain_t *in,
+    ngx_rtmp_dash_track_t *t, ngx_int_t key, uint32_t timestamp, uint32_t delay)
+{
+    size_t                  size;
+    ngx_int_t               rc;
+    ngx_chain_t            *cl;
+    ngx_rtmp_dash_ctx_t    *ctx;
+    ngx_rtmp_mp4_sample_t  *smpl;
+
+    size = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        size += (size_t) (cl->buf->last - cl->buf->pos);
     }
 
+    size = ngx_min(size, NGX_RTMP_DASH_BUFSIZE);
+
     ngx_rtmp_dash_update_fragments(s, key, timestamp);
 
+    if (!t->opened) {
+        return NGX_OK;
+    }
+
     if (t->sample_count == 0) {
         t->earliest_pres_time = timestamp;
     }
@@ -1065,9 +1721,11 @@ ngx_rtmp_dash_append(ngx_rtmp_session_t *s, ngx_chain_t *in,
 
     if (t->sample_count < NGX_RTMP_DASH_MAX_SAMPLES) {
 
-        if (ngx_write_fd(t->fd, buffer, size) == NGX_ERROR) {
-            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                          "dash: " ngx_write_fd_n " failed");
+        rc = ngx_rtmp_dash_write_sample(s, t, in, size);
+
+        if (rc != NGX_OK) {
+            ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+            ctx->failed = 1;
             return NGX_ERROR;
         }
 
@@ -1312,13 +1970,11 @@ ngx_rtmp_dash_cleanup_dir(ngx_str_t *ppath, ngx_msec_t playlen)
             continue;
         }
 
-        if (name.len >= 8 && name.data[name.len - 8] == 'i' &&
-                             name.data[name.len - 7] == 'n' &&
-                             name.data[name.len - 6] == 'i' &&
-                             name.data[name.len - 5] == 't' &&
-                             name.data[name.len - 4] == '.' &&
-                             name.data[name.len - 3] == 'm' &&
-                             name.data[name.len - 2] == '4')
+        /* init segments and the key go with the manifest */
+
+        if (name.len >= 8
+            && (ngx_strncmp(name.data + name.len - 8, "init.m4", 7) == 0
+                || ngx_strncmp(name.data + name.len - 8, "cbcs.key", 8) == 0))
         {
             if (name.len == 8) {
                 ngx_str_set(&mpd, "index");
@@ -1365,6 +2021,12 @@ ngx_rtmp_dash_cleanup_dir(ngx_str_t *ppath, ngx_msec_t playlen)
         {
             max_age = playlen / 500;
 
+        } else if (name.len >= 5
+                   && ngx_strncmp(name.data + name.len - 5, ".m3u8", 5) == 0)
+        {
+            /* hls playlists listing these fragments in cmaf format */
+            max_age = playlen / 500;
+
         } else if (name.len >= 4 && name.data[name.len - 4] == '.' &&
                                     name.data[name.len - 3] == 'r' &&
                                     name.data[name.len - 2] == 'a' &&
@@ -1408,12 +2070,14 @@ ngx_rtmp_dash_cleanup(void *data)
 {
     ngx_rtmp_dash_cleanup_t *cleanup = data;
 
+    /* files of running streams are expired by the workers */
+
     ngx_rtmp_dash_cleanup_dir(&cleanup->path, cleanup->playlen);
 
 #if (nginx_version >= 1011005)
-    return cleanup->playlen * 2;
+    return NGX_RTMP_EXPIRE_RESCAN * 1000;
 #else
-    return cleanup->playlen / 500;
+    return NGX_RTMP_EXPIRE_RESCAN;
 #endif
 }
 
@@ -1433,6 +2097,10 @@ ngx_rtmp_dash_create_app_conf(ngx_conf_t *cf)
     conf->playlen = NGX_CONF_UNSET_MSEC;
     conf->cleanup = NGX_CONF_UNSET;
     conf->nested = NGX_CONF_UNSET;
+    conf->aio = NGX_CONF_UNSET_PTR;
+    conf->store = NGX_CONF_UNSET_PTR;
+    conf->frag_buffer = NGX_CONF_UNSET_SIZE;
+    conf->keys = NGX_CONF_UNSET;
 
     return conf;
 }
@@ -1450,6 +2118,11 @@ ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_msec_value(conf->playlen, prev->playlen, 30000);
     ngx_conf_merge_value(conf->cleanup, prev->cleanup, 1);
     ngx_conf_merge_value(conf->nested, prev->nested, 0);
+    ngx_conf_merge_ptr_value(conf->aio, prev->aio, NULL);
+    ngx_conf_merge_ptr_value(conf->store, prev->store, NULL);
+    ngx_conf_merge_size_value(conf->frag_buffer, prev->frag_buffer,
+                              4 * 1024 * 1024);
+    ngx_conf_merge_value(conf->keys, prev->keys, 0);
 
     if (conf->fraglen) {
         conf->winfrags = conf->playlen / conf->fraglen;
@@ -1488,10 +2161,46 @@ ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_str_value(conf->path, prev->path, "");
 
+    if (conf->dash && conf->path.len && conf->cleanup) {
+        conf->expire = ngx_rtmp_expire_create(cf->pool, conf->playlen / 500);
+        if (conf->expire == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     return NGX_CONF_OK;
 }
 
 
+static ngx_int_t
+ngx_rtmp_dash_fragment_init(ngx_rtmp_session_t *s, ngx_rtmp_dash_fragment_t *v)
+{
+    return NGX_OK;
+}
+
+
+ngx_flag_t
+ngx_rtmp_dash_enabled(void **app_conf)
+{
+    ngx_rtmp_dash_app_conf_t  *dacf;
+
+    dacf = app_conf[ngx_rtmp_dash_module.ctx_index];
+
+    return dacf && dacf->dash;
+}
+
+
+static ngx_int_t
+ngx_rtmp_dash_preconfiguration(ngx_conf_t *cf)
+{
+    /* set before any postconfiguration, whatever the module order */
+
+    ngx_rtmp_dash_fragment = ngx_rtmp_dash_fragment_init;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_dash_postconfiguration(ngx_conf_t *cf)
 {
@@ -0,0 +1,52 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#ifndef _NGX_RTMP_DASH_MODULE_H_INCLUDED_
+#define _NGX_RTMP_DASH_MODULE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp.h"
+#include "ngx_rtmp_aio.h"
+
+
+/* per-worker counters of closed fragment files */
+typedef struct {
+    ngx_uint_t                          segments;
+    uint64_t                            bytes;
+    size_t                              last_bytes;
+    size_t                              max_bytes;
+    ngx_uint_t                          spilled;    /* assembled on disk */
+} ngx_rtmp_dash_stat_t;
+
+
+/* a fragment just closed, for playlists of other formats to list */
+typedef struct {
+    ngx_str_t                           playlist;   /* the manifest */
+    ngx_str_t                           stream;     /* file path prefix */
+    uint32_t                            timestamp;  /* names the files */
+    uint32_t                            duration;
+    unsigned                            has_video:1;
+    unsigned                            has_audio:1;
+    u_char                             *iv;         /* cbcs, NULL if clear */
+    ngx_rtmp_aio_queue_t               *aio;        /* the files are on */
+} ngx_rtmp_dash_fragment_t;
+
+
+typedef ngx_int_t (*ngx_rtmp_dash_fragment_pt)(ngx_rtmp_session_t *s,
+        ngx_rtmp_dash_fragment_t *v);
+
+
+/* "dash" of an application, once the configuration is merged */
+ngx_flag_t ngx_rtmp_dash_enabled(void **app_conf);
+
+
+extern ngx_rtmp_dash_stat_t             ngx_rtmp_dash_stat;
+extern ngx_rtmp_dash_fragment_pt        ngx_rtmp_dash_fragment;
+
+
+#endif /* _NGX_RTMP_DASH_MODULE_H_INCLUDED_ */
@@ -535,15 +535,70 @@ ngx_rtmp_mp4_write_avcc(ngx_rtmp_session_t *s, ngx_buf_t *b)
 }
 
 
+/* protection of an encv or enca sample entry, the original is in frma */
+
 static ngx_int_t
-ngx_rtmp_mp4_write_video(ngx_rtmp_session_t *s, ngx_buf_t *b)
+ngx_rtmp_mp4_write_sinf(ngx_buf_t *b, ngx_rtmp_mp4_track_type_t ttype,
+    ngx_rtmp_mp4_encryption_t *enc)
+{
+    u_char  *pos, *schi, *tenc;
+
+    pos = ngx_rtmp_mp4_start_box(b, "sinf");
+
+    /* original format */
+    ngx_rtmp_mp4_field_32(b, 12);
+    ngx_rtmp_mp4_box(b, "frma");
+    ngx_rtmp_mp4_box(b, ttype == NGX_RTMP_MP4_VIDEO_TRACK ? "avc1" : "mp4a");
+
+    /* scheme type & version */
+    ngx_rtmp_mp4_field_32(b, 20);
+    ngx_rtmp_mp4_box(b, "schm");
+    ngx_rtmp_mp4_field_32(b, 0);
+    ngx_rtmp_mp4_box(b, "cbcs");
+    ngx_rtmp_mp4_field_32(b, 0x00010000);
+
+    schi = ngx_rtmp_mp4_start_box(b, "schi");
+    tenc = ngx_rtmp_mp4_start_box(b, "tenc");
+
+    /* version 1 for the pattern */
+    ngx_rtmp_mp4_field_32(b, 0x01000000);
+
+    /* reserved */
+    ngx_rtmp_mp4_field_8(b, 0);
+
+    /* crypt & skip blocks: 1 out of 10 in video, all of audio */
+    ngx_rtmp_mp4_field_8(b, ttype == NGX_RTMP_MP4_VIDEO_TRACK ? 0x19 : 0);
+
+    /* protected */
+    ngx_rtmp_mp4_field_8(b, 1);
+
+    /* per sample IV size, none with a constant IV */
+    ngx_rtmp_mp4_field_8(b, 0);
+
+    ngx_rtmp_mp4_data(b, enc->kid, 16);
+
+    /* constant IV */
+    ngx_rtmp_mp4_field_8(b, 16);
+    ngx_rtmp_mp4_data(b, enc->iv, 16);
+
+    ngx_rtmp_mp4_update_box_size(b, tenc);
+    ngx_rtmp_mp4_update_box_size(b, schi);
+    ngx_rtmp_mp4_update_box_size(b, pos);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_mp4_write_video(ngx_rtmp_session_t *s, ngx_buf_t *b,
+    ngx_rtmp_mp4_encryption_t *enc)
 {
     u_char                *pos;
     ngx_rtmp_codec_ctx_t  *codec_ctx;
 
     codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
 
-    pos = ngx_rtmp_mp4_start_box(b, "avc1");
+    pos = ngx_rtmp_mp4_start_box(b, enc ? "encv" : "avc1");
 
     /* reserved */
     ngx_rtmp_mp4_field_32(b, 0);
@@ -591,6 +646,10 @@ ngx_rtmp_mp4_write_video(ngx_rtmp_session_t *s, ngx_buf_t *b)
 
     ngx_rtmp_mp4_write_avcc(s, b);
 
+    if (enc) {
+        ngx_rtmp_mp4_write_sinf(b, NGX_RTMP_MP4_VIDEO_TRACK, enc);
+    }
+
     ngx_rtmp_mp4_update_box_size(b, pos);
 
     return NGX_OK;
@@ -678,14 +737,15 @@ ngx_rtmp_mp4_write_esds(ngx_rtmp_session_t *s, ngx_buf_t *b)
 
 
 static ngx_int_t
-ngx_rtmp_mp4_write_audio(ngx_rtmp_session_t *s, ngx_buf_t *b)
+ngx_rtmp_mp4_write_audio(ngx_rtmp_session_t *s, ngx_buf_t *b,
+    ngx_rtmp_mp4_encryption_t *enc)
 {
     u_char                *pos;
     ngx_rtmp_codec_ctx_t  *codec_ctx;
 
     codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
 
-    pos = ngx_rtmp_mp4_start_box(b, "mp4a");
+    pos = ngx_rtmp_mp4_start_box(b, enc ? "enca" : "mp4a");
 
     /* reserved */
     ngx_rtmp_mp4_field_32(b, 0);
@@ -714,6 +774,10 @@ ngx_rtmp_mp4_write_audio(ngx_rtmp_session_t *s, ngx_buf_t *b)
     ngx_rtmp_mp4_field_16(b, (uint16_t) codec_ctx->sample_rate);
 
     ngx_rtmp_mp4_write_esds(s, b);
+
+    if (enc) {
+        ngx_rtmp_mp4_write_sinf(b, NGX_RTMP_MP4_AUDIO_TRACK, enc);
+    }
 #if 0
     /* tag size*/
     ngx_rtmp_mp4_field_32(b, 8);
@@ -729,7 +793,7 @@ ngx_rtmp_mp4_write_audio(ngx_rtmp_session_t *s, ngx_buf_t *b)
 
 static ngx_int_t
 ngx_rtmp_mp4_write_stsd(ngx_rtmp_session_t *s, ngx_buf_t *b,
-    ngx_rtmp_mp4_track_type_t ttype)
+    ngx_rtmp_mp4_track_type_t ttype, ngx_rtmp_mp4_encryption_t *enc)
 {
     u_char  *pos;
 
@@ -742,9 +806,9 @@ ngx_rtmp_mp4_write_stsd(ngx_rtmp_session_t *s, ngx_buf_t *b,
     ngx_rtmp_mp4_field_32(b, 1);
 
     if (ttype == NGX_RTMP_MP4_VIDEO_TRACK) {
-        ngx_rtmp_mp4_write_video(s, b);
+        ngx_rtmp_mp4_write_video(s, b, enc);
     } else {
-        ngx_rtmp_mp4_write_audio(s, b);
+        ngx_rtmp_mp4_write_audio(s, b, enc);
     }
 
     ngx_rtmp_mp4_update_box_size(b, pos);
@@ -820,13 +884,13 @@ ngx_rtmp_mp4_write_stco(ngx_buf_t *b)
 
 static ngx_int_t
 ngx_rtmp_mp4_write_stbl(ngx_rtmp_session_t *s, ngx_buf_t *b,
-    ngx_rtmp_mp4_track_type_t ttype)
+    ngx_rtmp_mp4_track_type_t ttype, ngx_rtmp_mp4_encryption_t *enc)
 {
     u_char  *pos;
 
     pos = ngx_rtmp_mp4_start_box(b, "stbl");
 
-    ngx_rtmp_mp4_write_stsd(s, b, ttype);
+    ngx_rtmp_mp4_write_stsd(s, b, ttype, enc);
     ngx_rtmp_mp4_write_stts(b);
     ngx_rtmp_mp4_write_stsc(b);
     ngx_rtmp_mp4_write_stsz(b);
@@ -840,7 +904,7 @@ ngx_rtmp_mp4_write_stbl(ngx_rtmp_session_t *s, ngx_buf_t *b,
 
 static ngx_int_t
 ngx_rtmp_mp4_write_minf(ngx_rtmp_session_t *s, ngx_buf_t *b,
-    ngx_rtmp_mp4_track_type_t ttype)
+    ngx_rtmp_mp4_track_type_t ttype, ngx_rtmp_mp4_encryption_t *enc)
 {
     u_char  *pos;
 
@@ -853,7 +917,7 @@ ngx_rtmp_mp4_write_minf(ngx_rtmp_session_t *s, ngx_buf_t *b,
     }
 
     ngx_rtmp_mp4_write_dinf(b);
-    ngx_rtmp_mp4_write_stbl(s, b, ttype);
+    ngx_rtmp_mp4_write_stbl(s, b, ttype, enc);
 
     ngx_rtmp_mp4_update_box_size(b, pos);
 
@@ -863,7 +927,7 @@ ngx_rtmp_mp4_write_minf(ngx_rtmp_session_t *s, ngx_buf_t *b,
 
 static ngx_int_t
 ngx_rtmp_mp4_write_mdia(ngx_rtmp_session_t *s, ngx_buf_t *b,
-    ngx_rtmp_mp4_track_type_t ttype)
+    ngx_rtmp_mp4_track_type_t ttype, ngx_rtmp_mp4_encryption_t *enc)
 {
     u_char  *pos;
 
@@ -871,7 +935,7 @@ ngx_rtmp_mp4_write_mdia(ngx_rtmp_session_t *s, ngx_buf_t *b,
 
     ngx_rtmp_mp4_write_mdhd(b);
     ngx_rtmp_mp4_write_hdlr(b, ttype);
-    ngx_rtmp_mp4_write_minf(s, b, ttype);
+    ngx_rtmp_mp4_write_minf(s, b, ttype, enc);
 
     ngx_rtmp_mp4_update_box_size(b, pos);
 
@@ -880,14 +944,14 @@ ngx_rtmp_mp4_write_mdia(ngx_rtmp_session_t *s, ngx_buf_t *b,
 
 static ngx_int_t
 ngx_rtmp_mp4_write_trak(ngx_rtmp_session_t *s, ngx_buf_t *b,
-    ngx_rtmp_mp4_track_type_t ttype)
+    ngx_rtmp_mp4_track_type_t ttype, ngx_rtmp_mp4_encryption_t *enc)
 {
     u_char  *pos;
 
     pos = ngx_rtmp_mp4_start_box(b, "trak");
 
     ngx_rtmp_mp4_write_tkhd(s, b, ttype);
-    ngx_rtmp_mp4_write_mdia(s, b, ttype);
+    ngx_rtmp_mp4_write_mdia(s, b, ttype, enc);
 
     ngx_rtmp_mp4_update_box_size(b, pos);
 
@@ -932,7 +996,7 @@ ngx_rtmp_mp4_write_mvex(ngx_buf_t *b)
 
 ngx_int_t
 ngx_rtmp_mp4_write_moov(ngx_rtmp_session_t *s, ngx_buf_t *b,
-    ngx_rtmp_mp4_track_type_t ttype)
+    ngx_rtmp_mp4_track_type_t ttype, ngx_rtmp_mp4_encryption_t *enc)
 {
     u_char  *pos;
 
@@ -940,7 +1004,7 @@ ngx_rtmp_mp4_write_moov(ngx_rtmp_session_t *s, ngx_buf_t *b,
 
     ngx_rtmp_mp4_write_mvhd(b);
     ngx_rtmp_mp4_write_mvex(b);
-    ngx_rtmp_mp4_write_trak(s, b, ttype);
+    ngx_rtmp_mp4_write_trak(s, b, ttype, enc);
 
     ngx_rtmp_mp4_update_box_size(b, pos);
 
@@ -984,6 +1048,83 @@ ngx_rtmp_mp4_write_tfdt(ngx_buf_t *b, uint32_t earliest_pres_time)
 }
 
 
+/*
+ * The subsamples of each sample in senc, described by saiz and saio as
+ * sample auxiliary information.  Samples protected whole with the
+ * constant IV of tenc need none of it.
+ */
+
+static ngx_int_t
+ngx_rtmp_mp4_write_senc(ngx_buf_t *b, uint32_t sample_count,
+    ngx_rtmp_mp4_sample_t *samples, ngx_rtmp_mp4_subsample_t *subsamples,
+    u_char *moof_pos)
+{
+    u_char    *pos, *saio, *last;
+    uint32_t   i, n;
+
+    pos = ngx_rtmp_mp4_start_box(b, "saiz");
+
+    /* version & flags */
+    ngx_rtmp_mp4_field_32(b, 0);
+
+    /* default sample info size, none: sizes follow */
+    ngx_rtmp_mp4_field_8(b, 0);
+
+    ngx_rtmp_mp4_field_32(b, sample_count);
+
+    for (i = 0; i < sample_count; i++) {
+        ngx_rtmp_mp4_field_8(b, (uint8_t) (2 + samples[i].nsubsamples * 6));
+    }
+
+    ngx_rtmp_mp4_update_box_size(b, pos);
+
+    /* size is always 20, the offset is known once senc is written */
+
+    saio = b->last;
+
+    ngx_rtmp_mp4_field_32(b, 20);
+    ngx_rtmp_mp4_box(b, "saio");
+
+    /* version & flags */
+    ngx_rtmp_mp4_field_32(b, 0);
+
+    /* entry count */
+    ngx_rtmp_mp4_field_32(b, 1);
+
+    /* offset */
+    ngx_rtmp_mp4_field_32(b, 0);
+
+    pos = ngx_rtmp_mp4_start_box(b, "senc");
+
+    /* version & flags: subsamples present */
+    ngx_rtmp_mp4_field_32(b, 0x00000002);
+
+    ngx_rtmp_mp4_field_32(b, sample_count);
+
+    for (i = 0; i < sample_count; i++) {
+        ngx_rtmp_mp4_field_16(b, (uint16_t) samples[i].nsubsamples);
+
+        for (n = 0; n < samples[i].nsubsamples; n++, subsamples++) {
+            ngx_rtmp_mp4_field_16(b, subsamples->clear_bytes);
+            ngx_rtmp_mp4_field_32(b, subsamples->protected_bytes);
+        }
+    }
+
+    ngx_rtmp_mp4_update_box_size(b, pos);
+
+    /* the first entry, relative to moof as tfhd has it */
+
+    last = b->last;
+    b->last = saio + 16;
+
+    ngx_rtmp_mp4_field_32(b, (uint32_t) (pos + 16 - moof_pos));
+
+    b->last = last;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_mp4_write_trun(ngx_buf_t *b, uint32_t sample_count,
     ngx_rtmp_mp4_sample_t *samples, ngx_uint_t sample_mask, u_char *moof_pos)
@@ -1052,7 +1193,8 @@ ngx_rtmp_mp4_write_trun(ngx_buf_t *b, uint32_t sample_count,
 static ngx_int_t
 ngx_rtmp_mp4_write_traf(ngx_buf_t *b, uint32_t earliest_pres_time,
     uint32_t sample_count, ngx_rtmp_mp4_sample_t *samples,
-    ngx_uint_t sample_mask, u_char *moof_pos)
+    ngx_uint_t sample_mask, u_char *moof_pos,
+    ngx_rtmp_mp4_subsample_t *subsamples)
 {
     u_char  *pos;
 
@@ -1060,6 +1202,14 @@ ngx_rtmp_mp4_write_traf(ngx_buf_t *b, uint32_t earliest_pres_time,
 
     ngx_rtmp_mp4_write_tfhd(b);
     ngx_rtmp_mp4_write_tfdt(b, earliest_pres_time);
+
+    /* trun goes last, its data offset counts on mdat following it */
+
+    if (subsamples) {
+        ngx_rtmp_mp4_write_senc(b, sample_count, samples, subsamples,
+                                moof_pos);
+    }
+
     ngx_rtmp_mp4_write_trun(b, sample_count, samples, sample_mask, moof_pos);
 
     ngx_rtmp_mp4_update_box_size(b, pos);
@@ -1140,7 +1290,8 @@ ngx_rtmp_mp4_write_sidx(ngx_buf_t *b, ngx_uint_t reference_size,
 ngx_int_t
 ngx_rtmp_mp4_write_moof(ngx_buf_t *b, uint32_t earliest_pres_time,
     uint32_t sample_count, ngx_rtmp_mp4_sample_t *samples,
-    ngx_uint_t sample_mask, uint32_t index)
+    ngx_uint_t sample_mask, uint32_t index,
+    ngx_rtmp_mp4_subsample_t *subsamples)
 {
     u_char  *pos;
 
@@ -1148,7 +1299,7 @@ ngx_rtmp_mp4_write_moof(ngx_buf_t *b, uint32_t earliest_pres_time,
 
     ngx_rtmp_mp4_write_mfhd(b, index);
     ngx_rtmp_mp4_write_traf(b, earliest_pres_time, sample_count, samples,
-                            sample_mask, pos);
+                            sample_mask, pos, subsamples);
 
     ngx_rtmp_mp4_update_box_size(b, pos);
 
@@ -14,16 +14,33 @@
 #define NGX_RTMP_MP4_SAMPLE_DELAY       0x04
 #define NGX_RTMP_MP4_SAMPLE_KEY         0x08
 
+/* saiz has a byte for the size of the subsample list of a sample */
+#define NGX_RTMP_MP4_MAX_SUBSAMPLES     42
+
 
 typedef struct {
     uint32_t        size;
     uint32_t        duration;
     uint32_t        delay;
     uint32_t        timestamp;
+    uint32_t        nsubsamples;    /* encrypted, in the list of the track */
     unsigned        key:1;
 } ngx_rtmp_mp4_sample_t;
 
 
+typedef struct {
+    uint16_t        clear_bytes;
+    uint32_t        protected_bytes;
+} ngx_rtmp_mp4_subsample_t;
+
+
+/* "cbcs" common encryption of a track, the IV is constant */
+typedef struct {
+    u_char          kid[16];
+    u_char          iv[16];
+} ngx_rtmp_mp4_encryption_t;
+
+
 typedef enum {
     NGX_RTMP_MP4_FILETYPE_INIT,
     NGX_RTMP_MP4_FILETYPE_SEG
@@ -39,10 +56,11 @@ typedef enum {
 ngx_int_t ngx_rtmp_mp4_write_ftyp(ngx_buf_t *b);
 ngx_int_t ngx_rtmp_mp4_write_styp(ngx_buf_t *b);
 ngx_int_t ngx_rtmp_mp4_write_moov(ngx_rtmp_session_t *s, ngx_buf_t *b,
-    ngx_rtmp_mp4_track_type_t ttype);
+    ngx_rtmp_mp4_track_type_t ttype, ngx_rtmp_mp4_encryption_t *enc);
 ngx_int_t ngx_rtmp_mp4_write_moof(ngx_buf_t *b, uint32_t earliest_pres_time,
     uint32_t sample_count, ngx_rtmp_mp4_sample_t *samples,
-    ngx_uint_t sample_mask, uint32_t index);
+    ngx_uint_t sample_mask, uint32_t index,
+    ngx_rtmp_mp4_subsample_t *subsamples);
 ngx_int_t ngx_rtmp_mp4_write_sidx(ngx_buf_t *b,
     ngx_uint_t reference_size, uint32_t earliest_pres_time,
     uint32_t latest_pres_time);
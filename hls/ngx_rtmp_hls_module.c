@@ -11,28 +11,52 @@
 #include <ngx_rtmp_codec_module.h>
 #include "ngx_rtmp_mpegts.h"
 #include "ngx_rtmp_bitop.h"
+#include "ngx_rtmp_aio.h"
+#include "ngx_rtmp_expire.h"
+#include "dash/ngx_rtmp_dash_module.h"
 
 
 static ngx_rtmp_publish_pt              next_publish;
 static ngx_rtmp_close_stream_pt         next_close_stream;
 static ngx_rtmp_stream_begin_pt         next_stream_begin;
 static ngx_rtmp_stream_eof_pt           next_stream_eof;
+static ngx_rtmp_dash_fragment_pt        next_dash_fragment;
 
 
 static char * ngx_rtmp_hls_variant(ngx_conf_t *cf, ngx_command_t *cmd,
        void *conf);
 static ngx_int_t ngx_rtmp_hls_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_rtmp_hls_check_cmaf(ngx_conf_t *cf,
+       ngx_array_t *applications);
 static void * ngx_rtmp_hls_create_app_conf(ngx_conf_t *cf);
 static char * ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf,
        void *parent, void *child);
 static ngx_int_t ngx_rtmp_hls_flush_audio(ngx_rtmp_session_t *s);
+static ngx_int_t ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s);
 static ngx_int_t ngx_rtmp_hls_ensure_directory(ngx_rtmp_session_t *s,
        ngx_str_t *path);
+static void ngx_rtmp_hls_restored(void *data, ngx_uint_t errors);
 
 
 #define NGX_RTMP_HLS_BUFSIZE            (1024*1024)
+#define NGX_RTMP_HLS_WRITE_BUFSIZE      (64*1024)
 #define NGX_RTMP_HLS_DIR_ACCESS         0744
 
+/* parts of a fragment listed, the rest of it goes to the last one */
+#define NGX_RTMP_HLS_MAX_PARTS          64
+
+/* complete fragments still listed with their parts */
+#define NGX_RTMP_HLS_PART_FRAGS         2
+
+
+/* byte range of the fragment file */
+typedef struct {
+    double                              duration;
+    off_t                               offset;
+    size_t                              size;
+    unsigned                            independent:1;
+} ngx_rtmp_hls_part_t;
+
 
 typedef struct {
     uint64_t                            id;
@@ -40,6 +64,9 @@ typedef struct {
     double                              duration;
     unsigned                            active:1;
     unsigned                            discont:1; /* before */
+
+    ngx_uint_t                          nparts;
+    ngx_rtmp_hls_part_t                 parts[NGX_RTMP_HLS_MAX_PARTS];
 } ngx_rtmp_hls_frag_t;
 
 
@@ -51,6 +78,7 @@ typedef struct {
 
 typedef struct {
     unsigned                            opened:1;
+    unsigned                            failed:1;  /* last frag skipped */
 
     ngx_rtmp_mpegts_file_t              file;
 
@@ -65,6 +93,10 @@ typedef struct {
 
     uint64_t                            frag;
     uint64_t                            frag_ts;
+    uint64_t                            part_ts;
+    uint64_t                            part_last_ts;
+    off_t                               part_offset;
+    unsigned                            part_key:1;
     uint64_t                            key_id;
     ngx_uint_t                          nfrags;
     ngx_rtmp_hls_frag_t                *frags; /* circular 2 * winfrags + 1 */
@@ -80,6 +112,8 @@ typedef struct {
     uint64_t                            aframe_pts;
 
     ngx_rtmp_hls_variant_t             *var;
+
+    ngx_uint_t                          restoring; /* media is skipped */
 } ngx_rtmp_hls_ctx_t;
 
 
@@ -94,6 +128,8 @@ typedef struct {
     ngx_flag_t                          hls;
     ngx_msec_t                          fraglen;
     ngx_msec_t                          max_fraglen;
+    ngx_msec_t                          part_length;
+    ngx_uint_t                          format;
     ngx_msec_t                          muxdelay;
     ngx_msec_t                          sync;
     ngx_msec_t                          playlen;
@@ -107,11 +143,17 @@ typedef struct {
     ngx_path_t                         *slot;
     ngx_msec_t                          max_audio_delay;
     size_t                              audio_buffer_size;
+    size_t                              write_buffer_size;
+    ngx_rtmp_aio_conf_t                *aio;
+    ngx_rtmp_store_t                   *store;
     ngx_flag_t                          cleanup;
+    ngx_rtmp_expire_t                  *expire_frags;
+    ngx_rtmp_expire_t                  *expire_playlists;
     ngx_array_t                        *variant;
     ngx_str_t                           base_url;
     ngx_int_t                           granularity;
     ngx_flag_t                          keys;
+    ngx_uint_t                          key_method;
     ngx_str_t                           key_path;
     ngx_str_t                           key_url;
     ngx_uint_t                          frags_per_key;
@@ -131,6 +173,10 @@ typedef struct {
 #define NGX_RTMP_HLS_TYPE_EVENT         2
 
 
+#define NGX_RTMP_HLS_FORMAT_MPEGTS      1
+#define NGX_RTMP_HLS_FORMAT_CMAF        2
+
+
 static ngx_conf_enum_t                  ngx_rtmp_hls_naming_slots[] = {
     { ngx_string("sequential"),         NGX_RTMP_HLS_NAMING_SEQUENTIAL },
     { ngx_string("timestamp"),          NGX_RTMP_HLS_NAMING_TIMESTAMP  },
@@ -153,6 +199,20 @@ static ngx_conf_enum_t                  ngx_rtmp_hls_type_slots[] = {
 };
 
 
+static ngx_conf_enum_t                  ngx_rtmp_hls_format_slots[] = {
+    { ngx_string("mpegts"),             NGX_RTMP_HLS_FORMAT_MPEGTS },
+    { ngx_string("cmaf"),               NGX_RTMP_HLS_FORMAT_CMAF   },
+    { ngx_null_string,                  0 }
+};
+
+
+static ngx_conf_enum_t                  ngx_rtmp_hls_key_method_slots[] = {
+    { ngx_string("aes-128"),            NGX_RTMP_MPEGTS_AES_128    },
+    { ngx_string("sample-aes"),         NGX_RTMP_MPEGTS_SAMPLE_AES },
+    { ngx_null_string,                  0 }
+};
+
+
 static ngx_command_t ngx_rtmp_hls_commands[] = {
 
     { ngx_string("hls"),
@@ -176,6 +236,20 @@ static ngx_command_t ngx_rtmp_hls_commands[] = {
       offsetof(ngx_rtmp_hls_app_conf_t, max_fraglen),
       NULL },
 
+    { ngx_string("hls_part_length"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, part_length),
+      NULL },
+
+    { ngx_string("hls_fragment_format"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, format),
+      &ngx_rtmp_hls_format_slots },
+
     { ngx_string("hls_path"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
@@ -253,6 +327,27 @@ static ngx_command_t ngx_rtmp_hls_commands[] = {
       offsetof(ngx_rtmp_hls_app_conf_t, audio_buffer_size),
       NULL },
 
+    { ngx_string("hls_write_buffer_size"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, write_buffer_size),
+      NULL },
+
+    { ngx_string("hls_aio"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE12,
+      ngx_rtmp_aio_set_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, aio),
+      NULL },
+
+    { ngx_string("hls_store"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_rtmp_store_set_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, store),
+      NULL },
+
     { ngx_string("hls_cleanup"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_flag_slot,
@@ -288,6 +383,13 @@ static ngx_command_t ngx_rtmp_hls_commands[] = {
       offsetof(ngx_rtmp_hls_app_conf_t, keys),
       NULL },
 
+    { ngx_string("hls_key_method"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, key_method),
+      &ngx_rtmp_hls_key_method_slots },
+
     { ngx_string("hls_key_path"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
@@ -374,27 +476,12 @@ ngx_rtmp_hls_next_frag(ngx_rtmp_session_t *s)
 }
 
 
-static ngx_int_t
-ngx_rtmp_hls_rename_file(u_char *src, u_char *dst)
-{
-    /* rename file with overwrite */
-
-#if (NGX_WIN32)
-    return MoveFileEx((LPCTSTR) src, (LPCTSTR) dst, MOVEFILE_REPLACE_EXISTING);
-#else
-    return ngx_rename_file(src, dst);
-#endif
-}
-
-
 static ngx_int_t
 ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s)
 {
-    static u_char             buffer[1024];
+    static u_char             buffer[NGX_RTMP_HLS_BUFSIZE];
 
     u_char                   *p, *last;
-    ssize_t                   rc;
-    ngx_fd_t                  fd;
     ngx_str_t                *arg;
     ngx_uint_t                n, k;
     ngx_rtmp_hls_ctx_t       *ctx;
@@ -404,35 +491,14 @@ ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s)
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
 
-    fd = ngx_open_file(ctx->var_playlist_bak.data, NGX_FILE_WRONLY,
-                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
-
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_open_file_n " failed: '%V'",
-                      &ctx->var_playlist_bak);
-
-        return NGX_ERROR;
-    }
-
-#define NGX_RTMP_HLS_VAR_HEADER "#EXTM3U\n#EXT-X-VERSION:3\n"
+    p = buffer;
+    last = buffer + sizeof(buffer);
 
-    rc = ngx_write_fd(fd, NGX_RTMP_HLS_VAR_HEADER,
-                      sizeof(NGX_RTMP_HLS_VAR_HEADER) - 1);
-    if (rc < 0) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_write_fd_n " failed: '%V'",
-                      &ctx->var_playlist_bak);
-        ngx_close_file(fd);
-        return NGX_ERROR;
-    }
+    p = ngx_slprintf(p, last, "#EXTM3U\n#EXT-X-VERSION:3\n");
 
     var = hacf->variant->elts;
     for (n = 0; n < hacf->variant->nelts; n++, var++)
     {
-        p = buffer;
-        last = buffer + sizeof(buffer);
-
         p = ngx_slprintf(p, last, "#EXT-X-STREAM-INF:PROGRAM-ID=1");
 
         arg = var->args.elts;
@@ -453,62 +519,70 @@ ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s)
         }
 
         p = ngx_slprintf(p, last, "%s", ".m3u8\n");
-
-        rc = ngx_write_fd(fd, buffer, p - buffer);
-        if (rc < 0) {
-            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                          "hls: " ngx_write_fd_n " failed '%V'",
-                          &ctx->var_playlist_bak);
-            ngx_close_file(fd);
-            return NGX_ERROR;
-        }
     }
 
-    ngx_close_file(fd);
-
-    if (ngx_rtmp_hls_rename_file(ctx->var_playlist_bak.data,
-                                 ctx->var_playlist.data)
-        == NGX_FILE_ERROR)
+    if (ngx_rtmp_aio_replace(ctx->file.aio, &ctx->var_playlist_bak,
+                             &ctx->var_playlist, buffer, p - buffer)
+        == NGX_ERROR)
     {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: rename failed: '%V'->'%V'",
-                      &ctx->var_playlist_bak, &ctx->var_playlist);
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "hls: failed to write '%V'", &ctx->var_playlist);
         return NGX_ERROR;
     }
 
+    if (hacf->store) {
+        (void) ngx_rtmp_store_put(hacf->store, &ctx->var_playlist, buffer,
+                                  p - buffer, hacf->playlen / 1000,
+                                  NGX_RTMP_STORE_VOLATILE, 0,
+                                  s->connection->log);
+    }
+
     return NGX_OK;
 }
 
 
+static u_char *
+ngx_rtmp_hls_write_parts(ngx_rtmp_session_t *s, u_char *p, u_char *end,
+    ngx_rtmp_hls_frag_t *f, ngx_str_t *name_part, const char *sep)
+{
+    ngx_uint_t                      n;
+    ngx_rtmp_hls_part_t            *part;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+
+    for (n = 0; n < f->nparts; n++) {
+        part = &f->parts[n];
+
+        p = ngx_slprintf(p, end,
+                         "#EXT-X-PART:DURATION=%.3f,"
+                         "URI=\"%V%V%s%uL.ts\",BYTERANGE=\"%uz@%O\"%s\n",
+                         part->duration, &hacf->base_url, name_part, sep,
+                         f->id, part->size, part->offset,
+                         part->independent ? ",INDEPENDENT=YES" : "");
+    }
+
+    return p;
+}
+
+
 static ngx_int_t
 ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s)
 {
-    static u_char                   buffer[1024];
-    ngx_fd_t                        fd;
+    static u_char                   buffer[NGX_RTMP_HLS_BUFSIZE];
     u_char                         *p, *end;
     ngx_rtmp_hls_ctx_t             *ctx;
-    ssize_t                         n;
     ngx_rtmp_hls_app_conf_t        *hacf;
     ngx_rtmp_hls_frag_t            *f;
     ngx_uint_t                      i, max_frag;
     ngx_str_t                       name_part, key_name_part;
-    uint64_t                        prev_key_id;
+    uint64_t                        prev_key_id, version;
     const char                     *sep, *key_sep;
 
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
 
-    fd = ngx_open_file(ctx->playlist_bak.data, NGX_FILE_WRONLY,
-                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
-
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_open_file_n " failed: '%V'",
-                      &ctx->playlist_bak);
-        return NGX_ERROR;
-    }
-
     max_frag = hacf->fraglen / 1000;
 
     for (i = 0; i < ctx->nfrags; i++) {
@@ -518,27 +592,31 @@ ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s)
         }
     }
 
+    /* the whole playlist is built in memory and written at once */
+
     p = buffer;
     end = p + sizeof(buffer);
 
     p = ngx_slprintf(p, end,
                      "#EXTM3U\n"
-                     "#EXT-X-VERSION:3\n"
+                     "#EXT-X-VERSION:%d\n"
                      "#EXT-X-MEDIA-SEQUENCE:%uL\n"
                      "#EXT-X-TARGETDURATION:%ui\n",
-                     ctx->frag, max_frag);
+                     hacf->part_length ? 9 : 3, ctx->frag, max_frag);
 
-    if (hacf->type == NGX_RTMP_HLS_TYPE_EVENT) {
-        p = ngx_slprintf(p, end, "#EXT-X-PLAYLIST-TYPE: EVENT\n");
+    /* blocking reloads are answered from the store only */
+
+    if (hacf->part_length) {
+        p = ngx_slprintf(p, end,
+                         "#EXT-X-SERVER-CONTROL:%sPART-HOLD-BACK=%.3f\n"
+                         "#EXT-X-PART-INF:PART-TARGET=%.3f\n",
+                         hacf->store ? "CAN-BLOCK-RELOAD=YES," : "",
+                         hacf->part_length * 3 / 1000.,
+                         hacf->part_length / 1000.);
     }
 
-    n = ngx_write_fd(fd, buffer, p - buffer);
-    if (n < 0) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_write_fd_n " failed: '%V'",
-                      &ctx->playlist_bak);
-        ngx_close_file(fd);
-        return NGX_ERROR;
+    if (hacf->type == NGX_RTMP_HLS_TYPE_EVENT) {
+        p = ngx_slprintf(p, end, "#EXT-X-PLAYLIST-TYPE: EVENT\n");
     }
 
     sep = hacf->nested ? (hacf->base_url.len ? "/" : "") : "-";
@@ -559,22 +637,25 @@ ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s)
     for (i = 0; i < ctx->nfrags; i++) {
         f = ngx_rtmp_hls_get_frag(s, i);
 
-        p = buffer;
-        end = p + sizeof(buffer);
-
         if (f->discont) {
             p = ngx_slprintf(p, end, "#EXT-X-DISCONTINUITY\n");
         }
 
         if (hacf->keys && (i == 0 || f->key_id != prev_key_id)) {
-            p = ngx_slprintf(p, end, "#EXT-X-KEY:METHOD=AES-128,"
+            p = ngx_slprintf(p, end, "#EXT-X-KEY:METHOD=%s,"
                              "URI=\"%V%V%s%uL.key\",IV=0x%032XL\n",
+                             hacf->key_method == NGX_RTMP_MPEGTS_SAMPLE_AES
+                             ? "SAMPLE-AES" : "AES-128",
                              &hacf->key_url, &key_name_part,
                              key_sep, f->key_id, f->key_id);
         }
 
         prev_key_id = f->key_id;
 
+        if (hacf->part_length && i + NGX_RTMP_HLS_PART_FRAGS >= ctx->nfrags) {
+            p = ngx_rtmp_hls_write_parts(s, p, end, f, &name_part, sep);
+        }
+
         p = ngx_slprintf(p, end,
                          "#EXTINF:%.3f,\n"
                          "%V%V%s%uL.ts\n",
@@ -584,28 +665,50 @@ ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s)
                        "hls: fragment frag=%uL, n=%ui/%ui, duration=%.3f, "
                        "discont=%i",
                        ctx->frag, i + 1, ctx->nfrags, f->duration, f->discont);
+    }
 
-        n = ngx_write_fd(fd, buffer, p - buffer);
-        if (n < 0) {
-            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                          "hls: " ngx_write_fd_n " failed '%V'",
-                          &ctx->playlist_bak);
-            ngx_close_file(fd);
-            return NGX_ERROR;
+    /* the fragment being written, as far as it is cut into parts */
+
+    version = (ctx->frag + ctx->nfrags) << 16;
+
+    if (hacf->part_length && ctx->opened) {
+        f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+
+        if (f->discont) {
+            p = ngx_slprintf(p, end, "#EXT-X-DISCONTINUITY\n");
         }
+
+        p = ngx_rtmp_hls_write_parts(s, p, end, f, &name_part, sep);
+
+        p = ngx_slprintf(p, end,
+                         "#EXT-X-PRELOAD-HINT:TYPE=PART,"
+                         "URI=\"%V%V%s%uL.ts\",BYTERANGE-START=%O\n",
+                         &hacf->base_url, &name_part, sep, f->id,
+                         ctx->part_offset);
+
+        version |= f->nparts;
     }
 
-    ngx_close_file(fd);
+    /* queued after the data it refers to, never lists partial data */
 
-    if (ngx_rtmp_hls_rename_file(ctx->playlist_bak.data, ctx->playlist.data)
-        == NGX_FILE_ERROR)
+    if (ngx_rtmp_aio_replace(ctx->file.aio, &ctx->playlist_bak,
+                             &ctx->playlist, buffer, p - buffer)
+        == NGX_ERROR)
     {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: rename failed: '%V'->'%V'",
-                      &ctx->playlist_bak, &ctx->playlist);
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "hls: failed to write '%V'", &ctx->playlist);
         return NGX_ERROR;
     }
 
+    /* swapped at once, readers get either the old or the new one */
+
+    if (hacf->store) {
+        (void) ngx_rtmp_store_put(hacf->store, &ctx->playlist, buffer,
+                                  p - buffer, hacf->playlen / 1000,
+                                  NGX_RTMP_STORE_VOLATILE, version,
+                                  s->connection->log);
+    }
+
     if (ctx->var) {
         return ngx_rtmp_hls_write_variant_playlist(s);
     }
@@ -910,10 +1013,99 @@ ngx_rtmp_hls_get_fragment_id(ngx_rtmp_session_t *s, uint64_t ts)
 }
 
 
+static void
+ngx_rtmp_hls_add_part(ngx_rtmp_session_t *s, double duration)
+{
+    ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_frag_t        *f;
+    ngx_rtmp_hls_part_t        *part;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+
+    if (f->nparts == NGX_RTMP_HLS_MAX_PARTS
+        || ctx->file.offset == ctx->part_offset)
+    {
+        return;
+    }
+
+    part = &f->parts[f->nparts++];
+
+    part->duration = duration;
+    part->offset = ctx->part_offset;
+    part->size = (size_t) (ctx->file.offset - ctx->part_offset);
+    part->independent = ctx->part_key;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: part n=%ui, duration=%.3f, range=%uz@%O",
+                   f->nparts, duration, part->size, part->offset);
+}
+
+
+static void
+ngx_rtmp_hls_update_part(ngx_rtmp_session_t *s, uint64_t ts, ngx_uint_t key)
+{
+    int64_t                     d, step;
+    ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_frag_t        *f;
+    ngx_rtmp_hls_app_conf_t    *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    if (hacf->part_length == 0 || !ctx->opened) {
+        return;
+    }
+
+    d = (int64_t) (ts - ctx->part_ts);
+    step = (int64_t) (ts - ctx->part_last_ts);
+
+    ctx->part_last_ts = ts;
+
+    /* cut before the next frame would make the part too long */
+
+    if (d <= 0 || d + step <= (int64_t) hacf->part_length * 90) {
+        return;
+    }
+
+    /* the last one is left for the rest of the fragment */
+
+    f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+    if (f->nparts + 1 >= NGX_RTMP_HLS_MAX_PARTS) {
+        return;
+    }
+
+    ngx_rtmp_hls_flush_audio(s);
+
+    if (ngx_rtmp_mpegts_flush_file(&ctx->file) != NGX_OK) {
+        return;
+    }
+
+    ngx_rtmp_hls_add_part(s, d / 90000.);
+
+    ctx->part_ts = ts;
+    ctx->part_offset = ctx->file.offset;
+    ctx->part_key = key;
+
+    /* held preload hint requests get the part before it is listed */
+
+    if (ctx->file.node) {
+        ngx_rtmp_store_commit(hacf->store, ctx->file.node,
+                              (size_t) ctx->file.offset);
+    }
+
+    ngx_rtmp_hls_write_playlist(s);
+}
+
+
 static ngx_int_t
 ngx_rtmp_hls_close_fragment(ngx_rtmp_session_t *s)
 {
+    double                      duration;
     ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_frag_t        *f;
+    ngx_rtmp_hls_app_conf_t    *hacf;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
     if (ctx == NULL || !ctx->opened) {
@@ -923,7 +1115,53 @@ ngx_rtmp_hls_close_fragment(ngx_rtmp_session_t *s)
     ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "hls: close fragment n=%uL", ctx->frag);
 
-    ngx_rtmp_mpegts_close_file(&ctx->file);
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+
+    if (ngx_rtmp_mpegts_close_file(&ctx->file) != NGX_OK) {
+
+        /* the slot is reused and the next fragment follows a gap */
+
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "hls: fragment '%s' is incomplete, skipped",
+                      ctx->stream.data);
+
+        if (ctx->file.node) {
+            ngx_rtmp_store_abort(hacf->store, ctx->file.node);
+            ctx->file.node = NULL;
+        }
+
+        ctx->opened = 0;
+        ctx->failed = 1;
+
+        ngx_rtmp_hls_write_playlist(s);
+
+        return NGX_OK;
+    }
+
+    if (hacf->part_length) {
+        f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+        duration = f->duration - (ctx->part_ts - ctx->frag_ts) / 90000.;
+
+        ngx_rtmp_hls_add_part(s, ngx_max(duration, 0));
+    }
+
+    if (ctx->file.node) {
+        if (hacf->part_length) {
+            ngx_rtmp_store_finish(hacf->store, ctx->file.node,
+                                  hacf->playlen / 500);
+
+        } else {
+            ngx_rtmp_store_publish(hacf->store, ctx->file.node,
+                                   hacf->playlen / 500, 0);
+        }
+
+        ctx->file.node = NULL;
+    }
+
+    if (hacf->expire_frags) {
+        (void) ngx_rtmp_expire_add(hacf->expire_frags, ctx->stream.data,
+                                   ngx_strlen(ctx->stream.data), 0);
+    }
 
     ctx->opened = 0;
 
@@ -940,7 +1178,8 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
     ngx_int_t discont)
 {
     uint64_t                  id;
-    ngx_fd_t                  fd;
+    ngx_buf_t                *b;
+    ngx_str_t                 keyfile;
     ngx_uint_t                g;
     ngx_rtmp_hls_ctx_t       *ctx;
     ngx_rtmp_hls_frag_t      *f;
@@ -966,6 +1205,16 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
         return NGX_ERROR;
     }
 
+    /* SAMPLE-AES is defined for H.264 slices only */
+
+    if (hacf->keys && hacf->key_method == NGX_RTMP_MPEGTS_SAMPLE_AES
+        && codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H265)
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "hls: sample-aes does not support h265");
+        return NGX_ERROR;
+    }
+
     id = ngx_rtmp_hls_get_fragment_id(s, ts);
 
     if (hacf->granularity) {
@@ -989,25 +1238,25 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
 
             ngx_sprintf(ctx->keyfile.data + ctx->keyfile.len, "%uL.key%Z", id);
 
-            fd = ngx_open_file(ctx->keyfile.data, NGX_FILE_WRONLY,
-                               NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
-
-            if (fd == NGX_INVALID_FILE) {
-                ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                              "hls: failed to open key file '%s'",
-                              ctx->keyfile.data);
-                return NGX_ERROR;
-            }
+            keyfile.data = ctx->keyfile.data;
+            keyfile.len = ngx_strlen(keyfile.data);
 
-            if (ngx_write_fd(fd, ctx->key, 16) != 16) {
-                ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+            if (ngx_rtmp_aio_replace(ctx->file.aio, NULL, &keyfile, ctx->key,
+                                     16)
+                == NGX_ERROR)
+            {
+                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                               "hls: failed to write key file '%s'",
                               ctx->keyfile.data);
-                ngx_close_file(fd);
                 return NGX_ERROR;
             }
 
-            ngx_close_file(fd);
+            /* stays queued while fragments keep touching it */
+
+            if (hacf->expire_frags) {
+                (void) ngx_rtmp_expire_add(hacf->expire_frags,
+                                           keyfile.data, keyfile.len, 0);
+            }
 
         } else {
             if (hacf->frags_per_key) {
@@ -1032,7 +1281,9 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
                    ctx->frag, ctx->nfrags, ts, discont);
 
     if (hacf->keys &&
-        ngx_rtmp_mpegts_init_encryption(&ctx->file, ctx->key, 16, ctx->key_id)
+        ngx_rtmp_mpegts_init_encryption(&ctx->file, s->connection->pool,
+                                        ctx->key, 16, ctx->key_id,
+                                        hacf->key_method)
         != NGX_OK)
     {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
@@ -1040,13 +1291,42 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
         return NGX_ERROR;
     }
 
+    /* SAMPLE-AES lists the AAC setup in the PMT */
+
+    ngx_str_null(&ctx->file.audio_config);
+
+    if (ctx->file.sample_aes && codec_ctx->aac_header) {
+        b = codec_ctx->aac_header->buf;
+
+        if (b->last - b->pos > 2) {
+            ctx->file.audio_config.data = b->pos + 2;
+            ctx->file.audio_config.len = b->last - b->pos - 2;
+        }
+    }
+
           
     ctx->file.video_codec_id = codec_ctx->video_codec_id;
 
+    /* the header written on open goes to the memory copy as well */
+
+    ctx->file.store = hacf->store;
+    ctx->file.node = NULL;
+
+    if (hacf->store) {
+        ctx->file.node = ngx_rtmp_store_open(hacf->store, ctx->stream.data,
+                                             ngx_strlen(ctx->stream.data),
+                                             s->connection->log);
+    }
+
     if (ngx_rtmp_mpegts_open_file(&ctx->file, ctx->stream.data,
                                   s->connection->log)
         != NGX_OK)
     {
+        if (ctx->file.node) {
+            ngx_rtmp_store_abort(hacf->store, ctx->file.node);
+            ctx->file.node = NULL;
+        }
+
         return NGX_ERROR;
     }
 
@@ -1057,12 +1337,26 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
     ngx_memzero(f, sizeof(*f));
 
     f->active = 1;
-    f->discont = discont;
+    f->discont = discont || ctx->failed;
     f->id = id;
+
+    ctx->failed = 0;
     f->key_id = ctx->key_id;
 
     ctx->frag_ts = ts;
 
+    ctx->part_ts = ts;
+    ctx->part_last_ts = ts;
+    ctx->part_offset = 0;
+    ctx->part_key = 1;
+
+    /* parts are read from memory while the fragment is written */
+
+    if (ctx->file.node && hacf->part_length) {
+        ngx_rtmp_store_publish(hacf->store, ctx->file.node, 0,
+                               NGX_RTMP_STORE_GROWING);
+    }
+
     /* start fragment with audio to make iPhone happy */
 
     ngx_rtmp_hls_flush_audio(s);
@@ -1381,13 +1675,31 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
     size_t                          len;
     ngx_rtmp_hls_variant_t         *var;
     ngx_uint_t                      n;
+    ngx_buf_t                      *wb;
+    EVP_CIPHER_CTX                 *cipher;
+    ngx_rtmp_aio_queue_t           *aio;
+    ngx_uint_t                      restoring;
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
-    if (hacf == NULL || !hacf->hls || hacf->path.len == 0) {
+    if (hacf == NULL || !hacf->hls || s->auto_pushed) {
+        goto next;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    /* the playlists follow the dash fragments, see below */
+
+    if (hacf->format == NGX_RTMP_HLS_FORMAT_CMAF) {
+        if (ctx) {
+            ctx->frag = 0;
+            ctx->nfrags = 0;
+            ctx->playlist.len = 0;
+        }
+
         goto next;
     }
 
-    if (s->auto_pushed) {
+    if (hacf->path.len == 0) {
         goto next;
     }
 
@@ -1395,8 +1707,6 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
                    "hls: publish: name='%s' type='%s'",
                    v->name, v->type);
 
-    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
-
     if (ctx == NULL) {
 
         ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_hls_ctx_t));
@@ -1406,11 +1716,19 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
 
         f = ctx->frags;
         b = ctx->aframe;
+        wb = ctx->file.wbuf;
+        cipher = ctx->file.cipher;
+        aio = ctx->file.aio;
+        restoring = ctx->restoring;
 
         ngx_memzero(ctx, sizeof(ngx_rtmp_hls_ctx_t));
 
         ctx->frags = f;
         ctx->aframe = b;
+        ctx->file.wbuf = wb;
+        ctx->file.cipher = cipher;
+        ctx->file.aio = aio;
+        ctx->restoring = restoring;
 
         if (b) {
             b->pos = b->last = b->start;
@@ -1426,6 +1744,29 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         }
     }
 
+    if (ctx->file.aio == NULL) {
+        ctx->file.aio = ngx_rtmp_aio_create_queue(hacf->aio,
+                                                  s->connection->pool,
+                                                  s->connection->log);
+        if (ctx->file.aio == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* queued writes are never smaller than the write buffer, and
+     * encryption is done on whole buffers rather than packets */
+
+    if (ctx->file.wbuf == NULL
+        && ngx_rtmp_mpegts_init_buffer(&ctx->file, s->connection->pool,
+                                       hacf->write_buffer_size == 0
+                                       && (hacf->aio || hacf->keys)
+                                       ? NGX_RTMP_HLS_WRITE_BUFSIZE
+                                       : hacf->write_buffer_size)
+           != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
     if (ngx_strstr(v->name, "..")) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                       "hls: bad stream name: '%s'", v->name);
@@ -1565,8 +1906,26 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
                    &ctx->playlist, &ctx->playlist_bak,
                    &ctx->stream, &ctx->keyfile);
 
+    /* playlist of the previous publish may still be in queue */
+
     if (hacf->continuous) {
-        ngx_rtmp_hls_restore_stream(s);
+        s->count++;
+        ctx->restoring++;
+
+        if (ngx_rtmp_aio_notify(ctx->file.aio, ngx_rtmp_hls_restored, s)
+            != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                          "hls: restoring '%V' before the queue is done",
+                          &ctx->playlist);
+
+            s->count--;
+            ctx->restoring--;
+
+            if (ctx->restoring == 0) {
+                ngx_rtmp_hls_restore_stream(s);
+            }
+        }
     }
 
 next:
@@ -1574,6 +1933,365 @@ next:
 }
 
 
+static void
+ngx_rtmp_hls_restored(void *data, ngx_uint_t errors)
+{
+    ngx_rtmp_session_t             *s;
+    ngx_rtmp_hls_ctx_t             *ctx;
+
+    s = data;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    /* the last publish restores, a closed session has nothing to */
+
+    if (ctx && --ctx->restoring == 0 && !s->closed) {
+        ngx_rtmp_hls_restore_stream(s);
+    }
+
+    ngx_rtmp_release_session(s);
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_cmaf_replace(ngx_rtmp_session_t *s, ngx_rtmp_aio_queue_t *aio,
+    ngx_str_t *path, u_char *data, size_t size, uint64_t version)
+{
+    ngx_str_t                       bak;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+    static u_char                   buf[NGX_MAX_PATH + 1];
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+
+    if (path->len + sizeof(".bak") > sizeof(buf)) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "hls: path too long: '%V'", path);
+        return NGX_ERROR;
+    }
+
+    bak.data = buf;
+    bak.len = ngx_sprintf(buf, "%V.bak%Z", path) - buf - 1;
+
+    /* queued on the dash queue, after the fragment it lists */
+
+    if (ngx_rtmp_aio_replace(aio, &bak, path, data, size) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "hls: failed to write '%V'", path);
+        return NGX_ERROR;
+    }
+
+    if (hacf->store) {
+        (void) ngx_rtmp_store_put(hacf->store, path, data, size,
+                                  hacf->playlen / 1000,
+                                  NGX_RTMP_STORE_VOLATILE, version,
+                                  s->connection->log);
+    }
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_rtmp_hls_cmaf_media(ngx_rtmp_session_t *s, u_char *p, u_char *end,
+    ngx_str_t *name, char type, u_char *iv)
+{
+    ngx_uint_t                      i, max_frag;
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_hls_frag_t            *f;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    max_frag = 1;
+
+    for (i = 0; i < ctx->nfrags; i++) {
+        f = ngx_rtmp_hls_get_frag(s, i);
+        if (f->duration > max_frag) {
+            max_frag = (ngx_uint_t) (f->duration + .5);
+        }
+    }
+
+    p = ngx_slprintf(p, end,
+                     "#EXTM3U\n"
+                     "#EXT-X-VERSION:7\n"
+                     "#EXT-X-INDEPENDENT-SEGMENTS\n"
+                     "#EXT-X-MEDIA-SEQUENCE:%uL\n"
+                     "#EXT-X-TARGETDURATION:%ui\n",
+                     ctx->frag, max_frag);
+
+    if (hacf->type == NGX_RTMP_HLS_TYPE_EVENT) {
+        p = ngx_slprintf(p, end, "#EXT-X-PLAYLIST-TYPE: EVENT\n");
+    }
+
+    /* dash encrypts the fragments with a key of its own, cbcs */
+
+    if (iv) {
+        p = ngx_slprintf(p, end, "#EXT-X-KEY:METHOD=SAMPLE-AES,"
+                         "URI=\"%V%Vcbcs.key\",IV=0x%s\n",
+                         &hacf->key_url, name, iv);
+    }
+
+    p = ngx_slprintf(p, end, "#EXT-X-MAP:URI=\"%V%Vinit.m4%c\"\n",
+                     &hacf->base_url, name, type);
+
+    for (i = 0; i < ctx->nfrags; i++) {
+        f = ngx_rtmp_hls_get_frag(s, i);
+
+        p = ngx_slprintf(p, end,
+                         "#EXTINF:%.3f,\n"
+                         "%V%V%uL.m4%c\n",
+                         f->duration, &hacf->base_url, name, f->id, type);
+    }
+
+    return p;
+}
+
+
+/*
+ * cmaf: no packaging of its own, the playlists list the fragments the
+ * dash module has just written, video and audio apart as dash has them
+ */
+static ngx_int_t
+ngx_rtmp_hls_cmaf_write_playlists(ngx_rtmp_session_t *s,
+    ngx_rtmp_dash_fragment_t *v)
+{
+    u_char                         *p, *end, *iv;
+    uint64_t                        version;
+    ngx_str_t                       name, path;
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_codec_ctx_t           *codec_ctx;
+    static u_char                   buffer[NGX_RTMP_HLS_BUFSIZE];
+    static u_char                   iv_hex[33];
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+    codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    if (codec_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* files are named after the stream, relative to the playlist */
+
+    name.data = ctx->stream.data + ctx->stream.len;
+    while (name.data > ctx->stream.data && name.data[-1] != '/') {
+        name.data--;
+    }
+
+    name.len = ctx->stream.data + ctx->stream.len - name.data;
+
+    iv = NULL;
+
+    if (v->iv) {
+        iv = iv_hex;
+        *ngx_hex_dump(iv, v->iv, 16) = 0;
+    }
+
+    end = buffer + sizeof(buffer);
+    version = (ctx->frag + ctx->nfrags) << 16;
+
+    path.data = ctx->stream.data;
+
+    if (v->has_video) {
+        p = ngx_rtmp_hls_cmaf_media(s, buffer, end, &name, 'v', iv);
+
+        path.len = ngx_sprintf(path.data + ctx->stream.len, "video.m3u8%Z")
+                   - path.data - 1;
+
+        (void) ngx_rtmp_hls_cmaf_replace(s, v->aio, &path, buffer,
+                                         p - buffer, version);
+    }
+
+    if (v->has_audio) {
+        p = ngx_rtmp_hls_cmaf_media(s, buffer, end, &name, 'a', iv);
+
+        path.len = ngx_sprintf(path.data + ctx->stream.len, "audio.m3u8%Z")
+                   - path.data - 1;
+
+        (void) ngx_rtmp_hls_cmaf_replace(s, v->aio, &path, buffer,
+                                         p - buffer, version);
+    }
+
+    /* the master playlist, codecs and bandwidth as in the manifest */
+
+    p = ngx_slprintf(buffer, end,
+                     "#EXTM3U\n"
+                     "#EXT-X-VERSION:7\n"
+                     "#EXT-X-INDEPENDENT-SEGMENTS\n");
+
+    if (v->has_video && v->has_audio) {
+        p = ngx_slprintf(p, end,
+                         "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"audio\","
+                         "NAME=\"audio\",DEFAULT=YES,AUTOSELECT=YES,"
+                         "URI=\"%Vaudio.m3u8\"\n"
+                         "#EXT-X-STREAM-INF:BANDWIDTH=%ui,"
+                         "CODECS=\"avc1.%02uxi%02uxi%02uxi,mp4a.%s\","
+                         "AUDIO=\"audio\"\n"
+                         "%Vvideo.m3u8\n",
+                         &name,
+                         (ngx_uint_t) ((codec_ctx->video_data_rate
+                                        + codec_ctx->audio_data_rate) * 1000),
+                         codec_ctx->avc_profile, codec_ctx->avc_compat,
+                         codec_ctx->avc_level,
+                         codec_ctx->audio_codec_id == NGX_RTMP_AUDIO_AAC ?
+                         (codec_ctx->aac_sbr ? "40.5" : "40.2") : "6b",
+                         &name);
+
+    } else if (v->has_video) {
+        p = ngx_slprintf(p, end,
+                         "#EXT-X-STREAM-INF:BANDWIDTH=%ui,"
+                         "CODECS=\"avc1.%02uxi%02uxi%02uxi\"\n"
+                         "%Vvideo.m3u8\n",
+                         (ngx_uint_t) (codec_ctx->video_data_rate * 1000),
+                         codec_ctx->avc_profile, codec_ctx->avc_compat,
+                         codec_ctx->avc_level, &name);
+
+    } else if (v->has_audio) {
+        p = ngx_slprintf(p, end,
+                         "#EXT-X-STREAM-INF:BANDWIDTH=%ui,"
+                         "CODECS=\"mp4a.%s\"\n"
+                         "%Vaudio.m3u8\n",
+                         (ngx_uint_t) (codec_ctx->audio_data_rate * 1000),
+                         codec_ctx->audio_codec_id == NGX_RTMP_AUDIO_AAC ?
+                         (codec_ctx->aac_sbr ? "40.5" : "40.2") : "6b",
+                         &name);
+    }
+
+    return ngx_rtmp_hls_cmaf_replace(s, v->aio, &ctx->playlist, buffer,
+                                     p - buffer, 0);
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_cmaf_init(ngx_rtmp_session_t *s, ngx_rtmp_dash_fragment_t *v)
+{
+    u_char                         *p;
+    size_t                          len;
+    ngx_rtmp_hls_ctx_t             *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    /* next to the manifest: name.mpd -> name.m3u8 */
+
+    len = v->playlist.len - (sizeof(".mpd") - 1);
+
+    ctx->playlist.data = ngx_palloc(s->connection->pool,
+                                    len + sizeof(".m3u8"));
+    if (ctx->playlist.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(ctx->playlist.data, v->playlist.data, len);
+    p = ngx_cpymem(p, ".m3u8", sizeof(".m3u8") - 1);
+    *p = 0;
+
+    ctx->playlist.len = p - ctx->playlist.data;
+
+    /* media playlists are "<stream prefix>video.m3u8" and so on */
+
+    ctx->stream.len = v->stream.len;
+    ctx->stream.data = ngx_palloc(s->connection->pool,
+                                  v->stream.len + sizeof("video.m3u8"));
+    if (ctx->stream.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(ctx->stream.data, v->stream.data, v->stream.len);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: cmaf playlist='%V' stream_pattern='%V'",
+                   &ctx->playlist, &ctx->stream);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_dash_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_fragment_t *v)
+{
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_hls_frag_t            *f;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    if (hacf == NULL || !hacf->hls
+        || hacf->format != NGX_RTMP_HLS_FORMAT_CMAF)
+    {
+        goto next;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_hls_ctx_t));
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_hls_module);
+    }
+
+    if (ctx->frags == NULL) {
+        ctx->frags = ngx_pcalloc(s->connection->pool,
+                                 sizeof(ngx_rtmp_hls_frag_t) *
+                                 (hacf->winfrags * 2 + 1));
+        if (ctx->frags == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ctx->playlist.len == 0 && ngx_rtmp_hls_cmaf_init(s, v) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: cmaf fragment timestamp=%uD, duration=%uD",
+                   v->timestamp, v->duration);
+
+    f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+
+    f->id = v->timestamp;
+    f->duration = v->duration / 1000.;
+    f->active = 1;
+    f->discont = 0;
+    f->nparts = 0;
+
+    ngx_rtmp_hls_next_frag(s);
+
+    ngx_rtmp_hls_cmaf_write_playlists(s, v);
+
+next:
+    return next_dash_fragment(s, v);
+}
+
+
+static void
+ngx_rtmp_hls_cmaf_expire(ngx_rtmp_session_t *s)
+{
+    u_char                         *p;
+    ngx_uint_t                      n;
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+
+    static const char              *files[] = { "video.m3u8", "audio.m3u8" };
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    /* the fragments are expired by dash */
+
+    (void) ngx_rtmp_expire_add(hacf->expire_playlists, ctx->playlist.data,
+                               ctx->playlist.len, 0);
+
+    for (n = 0; n < sizeof(files) / sizeof(files[0]); n++) {
+        p = ngx_sprintf(ctx->stream.data + ctx->stream.len, "%s", files[n]);
+
+        (void) ngx_rtmp_expire_add(hacf->expire_playlists, ctx->stream.data,
+                                   p - ctx->stream.data, 0);
+    }
+}
+
+
 static ngx_int_t
 ngx_rtmp_hls_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
 {
@@ -1591,8 +2309,33 @@ ngx_rtmp_hls_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
     ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "hls: close stream");
 
+    if (hacf->format == NGX_RTMP_HLS_FORMAT_CMAF) {
+        if (hacf->expire_playlists && ctx->playlist.len) {
+            ngx_rtmp_hls_cmaf_expire(s);
+        }
+
+        goto next;
+    }
+
     ngx_rtmp_hls_close_fragment(s);
 
+    if (hacf->expire_playlists) {
+        (void) ngx_rtmp_expire_add(hacf->expire_playlists, ctx->playlist.data,
+                                   ctx->playlist.len, 0);
+
+        if (ctx->var) {
+            (void) ngx_rtmp_expire_add(hacf->expire_playlists,
+                                       ctx->var_playlist.data,
+                                       ctx->var_playlist.len, 0);
+        }
+
+        if (hacf->nested) {
+            (void) ngx_rtmp_expire_add(hacf->expire_frags, ctx->stream.data,
+                                       ctx->stream.len - 1,
+                                       NGX_RTMP_EXPIRE_DIR);
+        }
+    }
+
 next:
     return next_close_stream(s, v);
 }
@@ -1795,8 +2538,9 @@ ngx_rtmp_hls_audio(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
 
-    if (hacf == NULL || !hacf->hls || ctx == NULL ||
-        codec_ctx == NULL  || h->mlen < 2)
+    if (hacf == NULL || !hacf->hls || ctx == NULL || ctx->restoring ||
+        codec_ctx == NULL  || h->mlen < 2 ||
+        hacf->format != NGX_RTMP_HLS_FORMAT_MPEGTS)
     {
         return NGX_OK;
     }
@@ -1844,6 +2588,10 @@ ngx_rtmp_hls_audio(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     ngx_rtmp_hls_update_fragment(s, pts, codec_ctx->avc_header == NULL, 2);
 
+    if (codec_ctx->avc_header == NULL) {
+        ngx_rtmp_hls_update_part(s, pts, 1);
+    }
+
     if (b->last + size > b->end) {
         ngx_rtmp_hls_flush_audio(s);
     }
@@ -1960,8 +2708,9 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
 
-    if (hacf == NULL || !hacf->hls || ctx == NULL || codec_ctx == NULL ||
-        codec_ctx->avc_header == NULL || h->mlen < 1)
+    if (hacf == NULL || !hacf->hls || ctx == NULL || ctx->restoring ||
+        codec_ctx == NULL || codec_ctx->avc_header == NULL || h->mlen < 1 ||
+        hacf->format != NGX_RTMP_HLS_FORMAT_MPEGTS)
     {
         return NGX_OK;
     }
@@ -2214,6 +2963,8 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         return NGX_OK;
     }
 
+    ngx_rtmp_hls_update_part(s, frame.dts, frame.key);
+
     ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "hls: video pts=%uL, dts=%uL", frame.pts, frame.dts);
 
@@ -2401,12 +3152,17 @@ ngx_rtmp_hls_cleanup(void *data)
 {
     ngx_rtmp_hls_cleanup_t *cleanup = data;
 
+    /*
+     * workers expire the files they write themselves, the scan
+     * only picks up what was left by previous or crashed ones
+     */
+
     ngx_rtmp_hls_cleanup_dir(&cleanup->path, cleanup->playlen);
 
 #if (nginx_version >= 1011005)
-    return cleanup->playlen * 2;
+    return NGX_RTMP_EXPIRE_RESCAN * 1000;
 #else
-    return cleanup->playlen / 500;
+    return NGX_RTMP_EXPIRE_RESCAN;
 #endif
 }
 
@@ -2476,6 +3232,8 @@ ngx_rtmp_hls_create_app_conf(ngx_conf_t *cf)
     conf->hls = NGX_CONF_UNSET;
     conf->fraglen = NGX_CONF_UNSET_MSEC;
     conf->max_fraglen = NGX_CONF_UNSET_MSEC;
+    conf->part_length = NGX_CONF_UNSET_MSEC;
+    conf->format = NGX_CONF_UNSET_UINT;
     conf->muxdelay = NGX_CONF_UNSET_MSEC;
     conf->sync = NGX_CONF_UNSET_MSEC;
     conf->playlen = NGX_CONF_UNSET_MSEC;
@@ -2486,9 +3244,13 @@ ngx_rtmp_hls_create_app_conf(ngx_conf_t *cf)
     conf->type = NGX_CONF_UNSET_UINT;
     conf->max_audio_delay = NGX_CONF_UNSET_MSEC;
     conf->audio_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->write_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->aio = NGX_CONF_UNSET_PTR;
+    conf->store = NGX_CONF_UNSET_PTR;
     conf->cleanup = NGX_CONF_UNSET;
     conf->granularity = NGX_CONF_UNSET;
     conf->keys = NGX_CONF_UNSET;
+    conf->key_method = NGX_CONF_UNSET_UINT;
     conf->frags_per_key = NGX_CONF_UNSET_UINT;
 
     return conf;
@@ -2521,13 +3283,46 @@ ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
                               300);
     ngx_conf_merge_size_value(conf->audio_buffer_size, prev->audio_buffer_size,
                               NGX_RTMP_HLS_BUFSIZE);
+    ngx_conf_merge_size_value(conf->write_buffer_size, prev->write_buffer_size,
+                              NGX_RTMP_HLS_WRITE_BUFSIZE);
+    ngx_conf_merge_ptr_value(conf->aio, prev->aio, NULL);
+    ngx_conf_merge_ptr_value(conf->store, prev->store, NULL);
     ngx_conf_merge_value(conf->cleanup, prev->cleanup, 1);
     ngx_conf_merge_str_value(conf->base_url, prev->base_url, "");
     ngx_conf_merge_value(conf->granularity, prev->granularity, 0);
     ngx_conf_merge_value(conf->keys, prev->keys, 0);
+    ngx_conf_merge_uint_value(conf->key_method, prev->key_method,
+                              NGX_RTMP_MPEGTS_AES_128);
     ngx_conf_merge_str_value(conf->key_path, prev->key_path, "");
     ngx_conf_merge_str_value(conf->key_url, prev->key_url, "");
     ngx_conf_merge_uint_value(conf->frags_per_key, prev->frags_per_key, 0);
+    ngx_conf_merge_msec_value(conf->part_length, prev->part_length, 0);
+    ngx_conf_merge_uint_value(conf->format, prev->format,
+                              NGX_RTMP_HLS_FORMAT_MPEGTS);
+
+    /* cmaf playlists list the dash fragments, which are not split and
+     * are encrypted by dash_keys if at all */
+
+    if (conf->format == NGX_RTMP_HLS_FORMAT_CMAF
+        && (conf->part_length || conf->keys))
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "hls_part_length and hls_keys are ignored "
+                           "with hls_fragment_format cmaf");
+        conf->part_length = 0;
+        conf->keys = 0;
+    }
+
+    /* parts of a fragment encrypted as a whole cannot be decoded alone,
+     * SAMPLE-AES parts can */
+
+    if (conf->part_length && conf->keys
+        && conf->key_method == NGX_RTMP_MPEGTS_AES_128)
+    {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "hls_part_length is ignored with hls_keys");
+        conf->part_length = 0;
+    }
 
     if (conf->fraglen) {
         conf->winfrags = conf->playlen / conf->fraglen;
@@ -2568,6 +3363,20 @@ ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_str_value(conf->path, prev->path, "");
 
+    if (conf->hls
+        && (conf->path.len || conf->format == NGX_RTMP_HLS_FORMAT_CMAF)
+        && conf->cleanup && conf->type != NGX_RTMP_HLS_TYPE_EVENT)
+    {
+        conf->expire_frags = ngx_rtmp_expire_create(cf->pool,
+                                                    conf->playlen / 500);
+        conf->expire_playlists = ngx_rtmp_expire_create(cf->pool,
+                                                        conf->playlen / 1000);
+
+        if (conf->expire_frags == NULL || conf->expire_playlists == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     if (conf->keys && conf->cleanup && conf->key_path.len &&
         ngx_strcmp(conf->key_path.data, conf->path.data) != 0 &&
         conf->type != NGX_RTMP_HLS_TYPE_EVENT)
@@ -2610,14 +3419,57 @@ ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
 }
 
 
+/* cmaf playlists are written from the dash fragment hook only */
+
+static ngx_int_t
+ngx_rtmp_hls_check_cmaf(ngx_conf_t *cf, ngx_array_t *applications)
+{
+    ngx_uint_t                   n;
+    ngx_rtmp_hls_app_conf_t     *hacf;
+    ngx_rtmp_core_app_conf_t   **cacfp;
+
+    cacfp = applications->elts;
+
+    for (n = 0; n < applications->nelts; n++) {
+        hacf = cacfp[n]->app_conf[ngx_rtmp_hls_module.ctx_index];
+
+        if (hacf->hls && hacf->format == NGX_RTMP_HLS_FORMAT_CMAF
+            && !ngx_rtmp_dash_enabled(cacfp[n]->app_conf))
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"hls_fragment_format cmaf\" requires "
+                               "\"dash on\" in application \"%V\"",
+                               &cacfp[n]->name);
+            return NGX_ERROR;
+        }
+
+        if (ngx_rtmp_hls_check_cmaf(cf, &cacfp[n]->applications) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_hls_postconfiguration(ngx_conf_t *cf)
 {
+    ngx_uint_t                   n;
     ngx_rtmp_core_main_conf_t   *cmcf;
+    ngx_rtmp_core_srv_conf_t   **cscfp;
     ngx_rtmp_handler_pt         *h;
 
     cmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_core_module);
 
+    cscfp = cmcf->servers.elts;
+
+    for (n = 0; n < cmcf->servers.nelts; n++) {
+        if (ngx_rtmp_hls_check_cmaf(cf, &cscfp[n]->applications) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
     h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_VIDEO]);
     *h = ngx_rtmp_hls_video;
 
@@ -2636,5 +3488,8 @@ ngx_rtmp_hls_postconfiguration(ngx_conf_t *cf)
     next_stream_eof = ngx_rtmp_stream_eof;
     ngx_rtmp_stream_eof = ngx_rtmp_hls_stream_eof;
 
+    next_dash_fragment = ngx_rtmp_dash_fragment;
+    ngx_rtmp_dash_fragment = ngx_rtmp_hls_dash_fragment;
+
     return NGX_OK;
 }
@@ -87,6 +87,323 @@ static u_char ngx_rtmp_mpegts_header[] = {
 /* 700 ms PCR delay */
 #define NGX_RTMP_HLS_DELAY  63000
 
+/* encrypted at once when packets are written unbuffered */
+#define NGX_RTMP_MPEGTS_CRYPT_BUFSIZE  (64 * 1024)
+
+/* a SAMPLE-AES video frame, escaping may add half again */
+#define NGX_RTMP_MPEGTS_SAMPLE_BUFSIZE (2 * 1024 * 1024)
+
+/* SAMPLE-AES: slices longer than 48 bytes are encrypted past a clear
+ * leader of 32 bytes, one block out of every ten; AAC frames past the
+ * ADTS header and 16 clear bytes, the tail shorter than a block is
+ * left clear in both */
+#define NGX_RTMP_MPEGTS_NAL_MIN        48
+#define NGX_RTMP_MPEGTS_NAL_LEADER     32
+#define NGX_RTMP_MPEGTS_NAL_SKIP       144
+#define NGX_RTMP_MPEGTS_ADTS_LEADER    16
+
+
+/* AES-CBC without padding, in place if out is in */
+
+static ngx_int_t
+ngx_rtmp_mpegts_encrypt(ngx_rtmp_mpegts_file_t *file, u_char *out, u_char *in,
+    size_t n)
+{
+    int  len;
+
+    if (EVP_EncryptUpdate(file->cipher, out, &len, in, (int) n) != 1
+        || (size_t) len != n)
+    {
+        ngx_log_error(NGX_LOG_ERR, file->log, 0,
+                      "mpegts: EVP_EncryptUpdate() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/* each SAMPLE-AES sample is a CBC chain of its own */
+
+static ngx_int_t
+ngx_rtmp_mpegts_restart(ngx_rtmp_mpegts_file_t *file)
+{
+    if (EVP_EncryptInit_ex(file->cipher, NULL, NULL, NULL, file->iv) != 1) {
+        ngx_log_error(NGX_LOG_ERR, file->log, 0,
+                      "mpegts: EVP_EncryptInit_ex() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/* ADTS frames are encrypted in place, their size does not change */
+
+static ngx_int_t
+ngx_rtmp_mpegts_encrypt_audio(ngx_rtmp_mpegts_file_t *file, ngx_buf_t *b)
+{
+    u_char  *p, *data;
+    size_t   size, header, n;
+
+    for (p = b->pos; p < b->last; p += size) {
+
+        if (b->last - p < 7 || p[0] != 0xff || (p[1] & 0xf0) != 0xf0) {
+            goto failed;
+        }
+
+        size = ((size_t) (p[3] & 0x03) << 11) | ((size_t) p[4] << 3)
+               | (p[5] >> 5);
+
+        /* no CRC with protection_absent */
+        header = (p[1] & 0x01) ? 7 : 9;
+
+        if (size < header || size > (size_t) (b->last - p)) {
+            goto failed;
+        }
+
+        if (size <= header + NGX_RTMP_MPEGTS_ADTS_LEADER) {
+            continue;
+        }
+
+        n = (size - header - NGX_RTMP_MPEGTS_ADTS_LEADER) & ~0x0f;
+
+        if (n == 0) {
+            continue;
+        }
+
+        data = p + header + NGX_RTMP_MPEGTS_ADTS_LEADER;
+
+        if (ngx_rtmp_mpegts_restart(file) != NGX_OK
+            || ngx_rtmp_mpegts_encrypt(file, data, data, n) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+
+failed:
+
+    ngx_log_error(NGX_LOG_ERR, file->log, 0,
+                  "mpegts: bad ADTS frame, not encrypted");
+
+    return NGX_ERROR;
+}
+
+
+/* the start code at or after p, last if there is none */
+
+static u_char *
+ngx_rtmp_mpegts_find_nal(u_char *p, u_char *last)
+{
+    for ( /* void */ ; last - p >= 3; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+            return p;
+        }
+    }
+
+    return last;
+}
+
+
+/*
+ * A slice is encrypted without its emulation prevention bytes, which
+ * are put back afterwards, as ciphertext may look like a start code.
+ * The unescaped slice is encrypted in place of the escaped one.
+ */
+
+static u_char *
+ngx_rtmp_mpegts_encrypt_nal(ngx_rtmp_mpegts_file_t *file, u_char *nal,
+    u_char *last, u_char *out, u_char *end)
+{
+    u_char      *p, *r;
+    size_t       rem, n;
+    ngx_uint_t   zeros;
+
+    zeros = 0;
+    r = nal;
+
+    for (p = nal; p < last; p++) {
+        if (zeros >= 2 && *p == 0x03) {
+            zeros = 0;
+            continue;
+        }
+
+        zeros = (*p == 0) ? zeros + 1 : 0;
+        *r++ = *p;
+    }
+
+    if (ngx_rtmp_mpegts_restart(file) != NGX_OK) {
+        return NULL;
+    }
+
+    p = nal + NGX_RTMP_MPEGTS_NAL_LEADER;
+    rem = (r > p) ? (size_t) (r - p) : 0;
+
+    while (rem) {
+        if (rem > 16) {
+            if (ngx_rtmp_mpegts_encrypt(file, p, p, 16) != NGX_OK) {
+                return NULL;
+            }
+
+            p += 16;
+            rem -= 16;
+        }
+
+        n = ngx_min(rem, NGX_RTMP_MPEGTS_NAL_SKIP);
+
+        p += n;
+        rem -= n;
+    }
+
+    if ((size_t) (end - out) < (size_t) (r - nal) / 2 * 3 + 2) {
+        return NULL;
+    }
+
+    zeros = 0;
+
+    for (p = nal; p < r; p++) {
+        if (zeros == 2 && *p <= 0x03) {
+            *out++ = 0x03;
+            zeros = 0;
+        }
+
+        zeros = (*p == 0) ? zeros + 1 : 0;
+        *out++ = *p;
+    }
+
+    return out;
+}
+
+
+/* the frame is copied to a static buffer with its slices encrypted,
+ * b is made to point to it */
+
+static ngx_int_t
+ngx_rtmp_mpegts_encrypt_video(ngx_rtmp_mpegts_file_t *file, ngx_buf_t *b)
+{
+    u_char      *p, *nal, *next, *last, *out, *end;
+    ngx_uint_t   type;
+
+    static u_char  buf[NGX_RTMP_MPEGTS_SAMPLE_BUFSIZE];
+
+    out = buf;
+    end = buf + sizeof(buf);
+    last = b->last;
+
+    p = b->pos;
+    nal = ngx_rtmp_mpegts_find_nal(p, last);
+
+    while (nal < last) {
+
+        /* everything up to the NAL unit is copied as is */
+
+        nal += 3;
+
+        if ((size_t) (end - out) < (size_t) (nal - p)) {
+            goto failed;
+        }
+
+        out = ngx_cpymem(out, p, nal - p);
+
+        next = ngx_rtmp_mpegts_find_nal(nal, last);
+
+        /* zero bytes in front of a start code are not in the NAL unit */
+
+        p = next;
+
+        while (next > nal && next[-1] == 0) {
+            next--;
+        }
+
+        type = (next > nal) ? (nal[0] & 0x1f) : 0;
+
+        if ((type == 1 || type == 5)
+            && next - nal > NGX_RTMP_MPEGTS_NAL_MIN)
+        {
+            out = ngx_rtmp_mpegts_encrypt_nal(file, nal, next, out, end);
+            if (out == NULL) {
+                goto failed;
+            }
+
+            nal = next;
+        }
+
+        if ((size_t) (end - out) < (size_t) (p - nal)) {
+            goto failed;
+        }
+
+        out = ngx_cpymem(out, nal, p - nal);
+
+        nal = p;
+    }
+
+    if ((size_t) (end - out) < (size_t) (last - p)) {
+        goto failed;
+    }
+
+    out = ngx_cpymem(out, p, last - p);
+
+    b->pos = buf;
+    b->last = out;
+
+    return NGX_OK;
+
+failed:
+
+    ngx_log_error(NGX_LOG_ERR, file->log, 0,
+                  "mpegts: video frame not encrypted");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_rtmp_mpegts_write_fd(ngx_rtmp_mpegts_file_t *file, u_char *p, size_t n)
+{
+    ssize_t  rc;
+
+    if (file->node
+        && ngx_rtmp_store_append(file->store, file->node, p, n) != NGX_OK)
+    {
+        /* the fragment is served from the disk only */
+        ngx_rtmp_store_abort(file->store, file->node);
+        file->node = NULL;
+    }
+
+    file->offset += n;
+
+    if (file->aio) {
+        if (ngx_rtmp_aio_write(file->aio, file->fd, -1, p, n) != NGX_OK) {
+            file->failed = 1;
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
+
+    rc = ngx_write_fd(file->fd, p, n);
+    if (rc < 0 || (size_t) rc != n) {
+        file->failed = 1;
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_mpegts_close_fd(ngx_rtmp_mpegts_file_t *file)
+{
+    if (file->aio) {
+        (void) ngx_rtmp_aio_close(file->aio, file->fd);
+        return;
+    }
+
+    ngx_close_file(file->fd);
+}
+
 
 static ngx_int_t
 ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
@@ -94,20 +411,14 @@ ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
 {
     u_char   *out;
     size_t    out_size, n;
-    ssize_t   rc;
 
-    static u_char  buf[1024];
+    static u_char  buf[NGX_RTMP_MPEGTS_CRYPT_BUFSIZE];
 
     if (!file->encrypt) {
         ngx_log_debug1(NGX_LOG_DEBUG_CORE, file->log, 0,
                        "mpegts: write %uz bytes", in_size);
 
-        rc = ngx_write_fd(file->fd, in, in_size);
-        if (rc < 0) {
-            return NGX_ERROR;
-        }
-
-        return NGX_OK;
+        return ngx_rtmp_mpegts_write_fd(file, in, in_size);
     }
 
     /* encrypt */
@@ -124,7 +435,9 @@ ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
         in += 16 - file->size;
         in_size -= 16 - file->size;
 
-        AES_cbc_encrypt(file->buf, out, 16, &file->key, file->iv, AES_ENCRYPT);
+        if (ngx_rtmp_mpegts_encrypt(file, out, file->buf, 16) != NGX_OK) {
+            return NGX_ERROR;
+        }
 
         out += 16;
         out_size -= 16;
@@ -140,7 +453,9 @@ ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
                 n = out_size;
             }
 
-            AES_cbc_encrypt(in, out, n, &file->key, file->iv, AES_ENCRYPT);
+            if (ngx_rtmp_mpegts_encrypt(file, out, in, n) != NGX_OK) {
+                return NGX_ERROR;
+            }
 
             in += n;
             in_size -= n;
@@ -149,8 +464,7 @@ ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
             break;
         }
 
-        rc = ngx_write_fd(file->fd, buf, out - buf + n);
-        if (rc < 0) {
+        if (ngx_rtmp_mpegts_write_fd(file, buf, out - buf + n) != NGX_OK) {
             return NGX_ERROR;
         }
 
@@ -167,9 +481,179 @@ ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
 }
 
 
+/* Write out buffered packets. When encrypting, the buffer is
+ * encrypted in place in one pass and the tail which does not fill
+ * an AES block is kept at the buffer start for the next flush */
+
+static ngx_int_t
+ngx_rtmp_mpegts_flush_buffer(ngx_rtmp_mpegts_file_t *file)
+{
+    size_t      size, n;
+    ngx_buf_t  *b;
+
+    b = file->wbuf;
+
+    size = b->last - b->start;
+    if (size == 0) {
+        return NGX_OK;
+    }
+
+    n = size;
+
+    if (file->encrypt) {
+        n &= ~0x0f;
+
+        if (n == 0) {
+            return NGX_OK;
+        }
+
+        if (ngx_rtmp_mpegts_encrypt(file, b->start, b->start, n) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, file->log, 0,
+                   "mpegts: flush %uz bytes, %uz left", n, size - n);
+
+    if (ngx_rtmp_mpegts_write_fd(file, b->start, n) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    b->last = ngx_movemem(b->start, b->start + n, size - n);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_mpegts_write_buffer(ngx_rtmp_mpegts_file_t *file, u_char *in,
+    size_t in_size)
+{
+    size_t      n;
+    ngx_buf_t  *b;
+
+    b = file->wbuf;
+
+    while (in_size) {
+        if (b->last == b->end
+            && ngx_rtmp_mpegts_flush_buffer(file) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        n = ngx_min((size_t) (b->end - b->last), in_size);
+
+        b->last = ngx_cpymem(b->last, in, n);
+
+        in += n;
+        in_size -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+/* MPEG-2 CRC, MSB first, of PSI sections */
+
+static uint32_t
+ngx_rtmp_mpegts_crc32(u_char *p, size_t len)
+{
+    uint32_t    crc;
+    ngx_uint_t  i;
+
+    crc = 0xffffffff;
+
+    while (len--) {
+        crc ^= (uint32_t) *p++ << 24;
+
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+        }
+    }
+
+    return crc;
+}
+
+
+/*
+ * SAMPLE-AES PMT: H.264 and AAC get the stream types of their encrypted
+ * forms, with a private data indicator each; the AAC one carries the
+ * audio setup in an "apad" registration descriptor as well.
+ */
+
+static void
+ngx_rtmp_mpegts_write_pmt(ngx_rtmp_mpegts_file_t *file, u_char *packet)
+{
+    u_char      *p, *section;
+    size_t       len;
+    uint32_t     crc;
+    ngx_uint_t   objtype;
+
+    p = ngx_cpymem(packet, "\x47\x50\x00\x10\x00", 5);
+
+    section = p;
+
+    p = ngx_cpymem(p, "\x02\x00\x00" "\x00\x01\xc1\x00\x00"
+                      "\xe1\x00" "\xf0\x00", 12);
+
+    /* h264 */
+    p = ngx_cpymem(p, "\xdb\xe1\x00\xf0\x06" "\x0f\x04" "zavc", 11);
+
+    /* a few bytes really, the packet has room for 131 */
+    len = ngx_min(file->audio_config.len, 64);
+
+    if (len == 0) {
+        /* no audio, nothing to describe */
+        p = ngx_cpymem(p, "\x0f\xe1\x01\xf0\x00", 5);
+
+    } else {
+        /* aac */
+        p = ngx_cpymem(p, "\xcf\xe1\x01\xf0", 4);
+        *p++ = (u_char) (20 + len);
+
+        p = ngx_cpymem(p, "\x0f\x04" "aacd", 6);
+
+        *p++ = 0x05;
+        *p++ = (u_char) (14 + len);
+        p = ngx_cpymem(p, "apad", 4);
+
+        objtype = file->audio_config.data[0] >> 3;
+
+        p = ngx_cpymem(p, objtype == 5 ? "zach" : objtype == 29 ? "zacp"
+                                                                : "zaac", 4);
+
+        *p++ = 0x00; /* priming */
+        *p++ = 0x00;
+        *p++ = 0x01; /* version */
+        *p++ = (u_char) len;
+        p = ngx_cpymem(p, file->audio_config.data, len);
+    }
+
+    /* the CRC is in the section length */
+
+    len = p + 4 - (section + 3);
+
+    section[1] = (u_char) (0xb0 | (len >> 8));
+    section[2] = (u_char) len;
+
+    crc = ngx_rtmp_mpegts_crc32(section, p - section);
+
+    *p++ = (u_char) (crc >> 24);
+    *p++ = (u_char) (crc >> 16);
+    *p++ = (u_char) (crc >> 8);
+    *p++ = (u_char) crc;
+
+    ngx_memset(p, 0xff, packet + NGX_RTMP_MPEGTS_PACKET_SIZE - p);
+}
+
+
 static ngx_int_t
 ngx_rtmp_mpegts_write_header(ngx_rtmp_mpegts_file_t *file)
 {
+    u_char  *header;
+
+    static u_char  sample_aes_header[sizeof(ngx_rtmp_mpegts_header)];
+
     //tag codec id  hevc=12 avc=7
     if(file->video_codec_id == NGX_RTMP_VIDEOTAG_CODECID_HEVC){
         //hevc stream_type=0x24
@@ -188,7 +672,25 @@ ngx_rtmp_mpegts_write_header(ngx_rtmp_mpegts_file_t *file)
         ngx_rtmp_mpegts_header[217] = 0xb9;
         ngx_rtmp_mpegts_header[218] = 0x9b;
     }
-    return ngx_rtmp_mpegts_write_file(file, ngx_rtmp_mpegts_header, sizeof(ngx_rtmp_mpegts_header));
+
+    header = ngx_rtmp_mpegts_header;
+
+    if (file->sample_aes) {
+        header = sample_aes_header;
+
+        ngx_memcpy(header, ngx_rtmp_mpegts_header,
+                   NGX_RTMP_MPEGTS_PACKET_SIZE);
+
+        ngx_rtmp_mpegts_write_pmt(file, header + NGX_RTMP_MPEGTS_PACKET_SIZE);
+    }
+
+    if (file->wbuf) {
+        return ngx_rtmp_mpegts_write_buffer(file, header,
+                                            sizeof(ngx_rtmp_mpegts_header));
+    }
+
+    return ngx_rtmp_mpegts_write_file(file, header,
+                                      sizeof(ngx_rtmp_mpegts_header));
 }
 
 
@@ -231,8 +733,10 @@ ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
     ngx_rtmp_mpegts_frame_t *f, ngx_buf_t *b)
 {
     ngx_uint_t  pes_size, header_size, body_size, in_size, stuff_size, flags;
-    u_char      packet[188], *p, *base;
+    u_char      buf[NGX_RTMP_MPEGTS_PACKET_SIZE], *packet, *p, *base;
     ngx_int_t   first, rc;
+    size_t      need;
+    ngx_buf_t  *wb, eb;
 
     ngx_log_debug6(NGX_LOG_DEBUG_CORE, file->log, 0,
                    "mpegts: pid=%ui, sid=%ui, pts=%uL, "
@@ -240,9 +744,55 @@ ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
                    f->pid, f->sid, f->pts, f->dts,
                    (ngx_uint_t) f->key, (size_t) (b->last - b->pos));
 
+    /* SAMPLE-AES encrypts the payload before it is split in packets */
+
+    if (file->sample_aes) {
+        eb = *b;
+
+        rc = (f->sid == 0xe0) ? ngx_rtmp_mpegts_encrypt_video(file, &eb)
+                              : ngx_rtmp_mpegts_encrypt_audio(file, &eb);
+
+        b->pos = b->last;
+
+        if (rc != NGX_OK) {
+            file->failed = 1;
+            return rc;
+        }
+
+        b = &eb;
+    }
+
     first = 1;
+    packet = buf;
+    wb = file->wbuf;
+
+    if (wb) {
+
+        /* flush on frame boundary unless the whole frame fits;
+         * PES and adaptation headers take at most 31 bytes */
+
+        need = ((b->last - b->pos) + 31) / (NGX_RTMP_MPEGTS_PACKET_SIZE - 4)
+               + 1;
+
+        if ((size_t) (wb->end - wb->last) < need * NGX_RTMP_MPEGTS_PACKET_SIZE
+            && ngx_rtmp_mpegts_flush_buffer(file) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
 
     while (b->pos < b->last) {
+
+        if (wb) {
+            if (wb->end - wb->last < NGX_RTMP_MPEGTS_PACKET_SIZE
+                && ngx_rtmp_mpegts_flush_buffer(file) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            packet = wb->last;
+        }
+
         p = packet;
         /* f->cc++; */
 
@@ -308,7 +858,7 @@ ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
             first = 0;
         }
 
-        body_size = (ngx_uint_t) (packet + sizeof(packet) - p);
+        body_size = (ngx_uint_t) (packet + NGX_RTMP_MPEGTS_PACKET_SIZE - p);
         in_size = (ngx_uint_t) (b->last - b->pos);
 
         if (body_size <= in_size) {
@@ -346,10 +896,16 @@ ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
             b->pos = b->last;
         }
         ngx_rtmp_hex_dump(file->log, "ngx_rtmp_mpegts_write_frame ts:", packet, packet+188);
- 
-        rc = ngx_rtmp_mpegts_write_file(file, packet, sizeof(packet));
-        if (rc != NGX_OK) {
-            return rc;
+
+        if (wb) {
+            wb->last += NGX_RTMP_MPEGTS_PACKET_SIZE;
+
+        } else {
+            rc = ngx_rtmp_mpegts_write_file(file, packet,
+                                            NGX_RTMP_MPEGTS_PACKET_SIZE);
+            if (rc != NGX_OK) {
+                return rc;
+            }
         }
 
         //ffmpeg idr frame cc bgein from 0
@@ -360,26 +916,118 @@ ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
 }
 
 
+ngx_int_t
+ngx_rtmp_mpegts_init_buffer(ngx_rtmp_mpegts_file_t *file, ngx_pool_t *pool,
+    size_t size)
+{
+    ngx_buf_t  *b;
+
+    if (size == 0) {
+        file->wbuf = NULL;
+        return NGX_OK;
+    }
+
+    /* room for the AES carry left over from the previous flush */
+    size = ngx_max(size, NGX_RTMP_MPEGTS_PACKET_SIZE) + 16;
+
+    b = ngx_calloc_buf(pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->start = ngx_pmemalign(pool, size, 16);
+    if (b->start == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->pos = b->start;
+    b->last = b->start;
+    b->end = b->start + size;
+    b->temporary = 1;
+
+    file->wbuf = b;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_mpegts_free_cipher(void *data)
+{
+    EVP_CIPHER_CTX  *cipher = data;
+
+    EVP_CIPHER_CTX_free(cipher);
+}
+
+
 ngx_int_t
 ngx_rtmp_mpegts_init_encryption(ngx_rtmp_mpegts_file_t *file,
-    u_char *key, size_t key_len, uint64_t iv)
+    ngx_pool_t *pool, u_char *key, size_t key_len, uint64_t iv,
+    ngx_uint_t method)
 {
-    if (AES_set_encrypt_key(key, key_len * 8, &file->key)) {
+    u_char              *ivec;
+    const EVP_CIPHER    *cipher;
+    ngx_pool_cleanup_t  *cln;
+
+    switch (key_len) {
+
+    case 16:
+        cipher = EVP_aes_128_cbc();
+        break;
+
+    case 24:
+        cipher = EVP_aes_192_cbc();
+        break;
+
+    case 32:
+        cipher = EVP_aes_256_cbc();
+        break;
+
+    default:
         return NGX_ERROR;
     }
 
-    ngx_memzero(file->iv, 8);
+    /* EVP picks the fastest implementation there is, AES-NI included */
+
+    if (file->cipher == NULL) {
+        cln = ngx_pool_cleanup_add(pool, 0);
+        if (cln == NULL) {
+            return NGX_ERROR;
+        }
+
+        file->cipher = EVP_CIPHER_CTX_new();
+        if (file->cipher == NULL) {
+            return NGX_ERROR;
+        }
+
+        cln->handler = ngx_rtmp_mpegts_free_cipher;
+        cln->data = file->cipher;
+    }
+
+    ivec = file->iv;
+
+    ngx_memzero(ivec, 8);
 
-    file->iv[8]  = (u_char) (iv >> 56);
-    file->iv[9]  = (u_char) (iv >> 48);
-    file->iv[10] = (u_char) (iv >> 40);
-    file->iv[11] = (u_char) (iv >> 32);
-    file->iv[12] = (u_char) (iv >> 24);
-    file->iv[13] = (u_char) (iv >> 16);
-    file->iv[14] = (u_char) (iv >> 8);
-    file->iv[15] = (u_char) (iv);
+    ivec[8]  = (u_char) (iv >> 56);
+    ivec[9]  = (u_char) (iv >> 48);
+    ivec[10] = (u_char) (iv >> 40);
+    ivec[11] = (u_char) (iv >> 32);
+    ivec[12] = (u_char) (iv >> 24);
+    ivec[13] = (u_char) (iv >> 16);
+    ivec[14] = (u_char) (iv >> 8);
+    ivec[15] = (u_char) (iv);
 
-    file->encrypt = 1;
+    /* padding of the last block is done on closing, SAMPLE-AES leaves
+     * partial blocks clear */
+
+    if (EVP_EncryptInit_ex(file->cipher, cipher, NULL, key, ivec) != 1
+        || EVP_CIPHER_CTX_set_padding(file->cipher, 0) != 1)
+    {
+        return NGX_ERROR;
+    }
+
+    file->encrypt = (method == NGX_RTMP_MPEGTS_AES_128);
+    file->sample_aes = (method == NGX_RTMP_MPEGTS_SAMPLE_AES);
 
     return NGX_OK;
 }
@@ -401,11 +1049,18 @@ ngx_rtmp_mpegts_open_file(ngx_rtmp_mpegts_file_t *file, u_char *path,
     }
 
     file->size = 0;
+    file->offset = 0;
+    file->failed = 0;
+    file->aio_errors = file->aio ? file->aio->errors : 0;
+
+    if (file->wbuf) {
+        file->wbuf->last = file->wbuf->start;
+    }
 
     if (ngx_rtmp_mpegts_write_header(file) != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
                       "hls: error writing fragment header");
-        ngx_close_file(file->fd);
+        ngx_rtmp_mpegts_close_fd(file);
         return NGX_ERROR;
     }
 
@@ -417,20 +1072,54 @@ ngx_int_t
 ngx_rtmp_mpegts_close_file(ngx_rtmp_mpegts_file_t *file)
 {
     u_char   buf[16];
-    ssize_t  rc;
+
+    if (file->wbuf) {
+        if (ngx_rtmp_mpegts_flush_buffer(file) != NGX_OK) {
+            ngx_rtmp_mpegts_close_fd(file);
+            return NGX_ERROR;
+        }
+
+        /* AES carry shorter than a block goes to padding below */
+
+        file->size = file->wbuf->last - file->wbuf->start;
+        ngx_memcpy(file->buf, file->wbuf->start, file->size);
+
+        file->wbuf->last = file->wbuf->start;
+    }
 
     if (file->encrypt) {
         ngx_memset(file->buf + file->size, 16 - file->size, 16 - file->size);
 
-        AES_cbc_encrypt(file->buf, buf, 16, &file->key, file->iv, AES_ENCRYPT);
-
-        rc = ngx_write_fd(file->fd, buf, 16);
-        if (rc < 0) {
+        if (ngx_rtmp_mpegts_encrypt(file, buf, file->buf, 16) != NGX_OK
+            || ngx_rtmp_mpegts_write_fd(file, buf, 16) != NGX_OK)
+        {
+            ngx_rtmp_mpegts_close_fd(file);
             return NGX_ERROR;
         }
     }
 
-    ngx_close_file(file->fd);
+    ngx_rtmp_mpegts_close_fd(file);
+
+    /* queued writes still running are not known to fail yet */
+
+    if (file->failed
+        || (file->aio && file->aio->errors != file->aio_errors))
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_rtmp_mpegts_flush_file(ngx_rtmp_mpegts_file_t *file)
+{
+    /* with encryption a tail shorter than an AES block stays behind */
+
+    if (file->wbuf) {
+        return ngx_rtmp_mpegts_flush_buffer(file);
+    }
 
     return NGX_OK;
 }
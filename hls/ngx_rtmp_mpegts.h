@@ -10,18 +10,45 @@
 
 #include <ngx_config.h>
 #include <ngx_core.h>
-#include <openssl/aes.h>
+#include <openssl/evp.h>
+#include "ngx_rtmp_aio.h"
+#include "ngx_rtmp_store.h"
+
+
+#define NGX_RTMP_MPEGTS_AES_128      1
+#define NGX_RTMP_MPEGTS_SAMPLE_AES   2
 
 
 typedef struct {
     ngx_fd_t    fd;
     ngx_log_t  *log;
     unsigned    encrypt:1;
+    unsigned    sample_aes:1;
     unsigned    size:4;
     u_char      buf[16];
-    u_char      iv[16];
-    AES_KEY     key;
+    u_char      iv[16];     /* each sample starts over with it */
+    EVP_CIPHER_CTX  *cipher;    /* kept across fragments */
     unsigned    video_codec_id;
+
+    /* AudioSpecificConfig, SAMPLE-AES lists it in the PMT */
+    ngx_str_t   audio_config;
+
+    /* optional output buffer, TS packets are assembled in place */
+    ngx_buf_t  *wbuf;
+
+    /* bytes handed to the file so far */
+    off_t       offset;
+
+    /* optional write queue, owned by caller */
+    ngx_rtmp_aio_queue_t  *aio;
+    ngx_uint_t             aio_errors;   /* when opened */
+
+    /* some data did not make it to the file */
+    unsigned               failed:1;
+
+    /* optional copy kept in memory, opened and published by caller */
+    ngx_rtmp_store_t       *store;
+    ngx_rtmp_store_node_t  *node;
 } ngx_rtmp_mpegts_file_t;
 
 
@@ -35,11 +62,22 @@ typedef struct {
 } ngx_rtmp_mpegts_frame_t;
 
 
+#define NGX_RTMP_MPEGTS_PACKET_SIZE  188
+
+
+ngx_int_t ngx_rtmp_mpegts_init_buffer(ngx_rtmp_mpegts_file_t *file,
+    ngx_pool_t *pool, size_t size);
+/* the cipher context is freed with the pool; AES-128 encrypts the
+ * whole file, SAMPLE-AES the H.264 slices and AAC frames only */
 ngx_int_t ngx_rtmp_mpegts_init_encryption(ngx_rtmp_mpegts_file_t *file,
-    u_char *key, size_t key_len, uint64_t iv);
+    ngx_pool_t *pool, u_char *key, size_t key_len, uint64_t iv,
+    ngx_uint_t method);
 ngx_int_t ngx_rtmp_mpegts_open_file(ngx_rtmp_mpegts_file_t *file, u_char *path,
     ngx_log_t *log);
+/* NGX_ERROR if the file is known to miss data */
 ngx_int_t ngx_rtmp_mpegts_close_file(ngx_rtmp_mpegts_file_t *file);
+/* writes out buffered packets, offset is the file size then */
+ngx_int_t ngx_rtmp_mpegts_flush_file(ngx_rtmp_mpegts_file_t *file);
 ngx_int_t ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
     ngx_rtmp_mpegts_frame_t *f, ngx_buf_t *b);
 
@@ -8,6 +8,8 @@
 #include <ngx_http.h>
 #include "ngx_http_flv_live_module.h"
 #include "ngx_rtmp_bandwidth.h"
+#include "ngx_rtmp_steer.h"
+#include "ngx_rtmp_ssl_module.h"
 
 
 static ngx_rtmp_play_pt         next_play;
@@ -21,6 +23,8 @@ static char *ngx_http_flv_live_merge_loc_conf(ngx_conf_t *cf,
 
 
 static ngx_int_t ngx_http_flv_live_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_flv_live_steer(ngx_http_request_t *r,
+    ngx_http_flv_live_ctx_t *ctx);
 static void ngx_http_flv_live_cleanup(void *data);
 static ngx_int_t ngx_http_flv_live_init_process(ngx_cycle_t *cycle);
 
@@ -176,10 +180,6 @@ static ngx_str_t ngx_http_status_lines[] = {
 
 extern ngx_rtmp_live_proc_handler_t  ngx_rtmp_live_proc_handler;
 static ngx_rtmp_live_proc_handler_t  ngx_http_flv_live_proc_handler = {
-    NULL,
-    NULL,
-    NULL,
-    NULL,
     ngx_http_flv_live_send_message,
     ngx_http_flv_live_meta_message,
     ngx_http_flv_live_append_message,
@@ -203,6 +203,7 @@ static void ngx_http_flv_live_free_request(ngx_rtmp_session_t *s);
 
 static void ngx_http_flv_live_read_handler(ngx_event_t *rev);
 static void ngx_http_flv_live_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_http_flv_live_send_chain(ngx_rtmp_session_t *s);
 
 static ngx_int_t ngx_http_flv_live_preprocess(ngx_http_request_t *r,
     ngx_rtmp_connection_t *rconn);
@@ -235,6 +236,13 @@ static ngx_command_t ngx_http_flv_live_commands[] = {
       offsetof(ngx_http_flv_live_conf_t, flv_live),
       NULL },
 
+    { ngx_string("flv_live_steer"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_flv_live_conf_t, steer),
+      NULL },
+
     ngx_null_command
 };
 
@@ -286,6 +294,7 @@ ngx_http_flv_live_create_loc_conf(ngx_conf_t *cf)
     }
 
     conf->flv_live = NGX_CONF_UNSET;
+    conf->steer = NGX_CONF_UNSET;
 
     return (void *) conf;
 }
@@ -299,6 +308,11 @@ ngx_http_flv_live_merge_loc_conf(ngx_conf_t *cf,
     ngx_http_flv_live_conf_t *conf = child;
 
     ngx_conf_merge_value(conf->flv_live, prev->flv_live, 0);
+    ngx_conf_merge_value(conf->steer, prev->steer, 0);
+
+    if (conf->flv_live && conf->steer) {
+        ngx_rtmp_steer_enable(cf);
+    }
 
     return NGX_CONF_OK;
 }
@@ -935,6 +949,18 @@ ngx_http_flv_live_send_message(ngx_rtmp_session_t *s,
     ngx_chain_t *out, ngx_uint_t priority)
 {
     ngx_uint_t                      nmsg;
+    ngx_chain_t                    *cl;
+    size_t                          size;
+
+    if (s->out == NULL) {
+        s->out = ngx_pcalloc(s->connection->pool,
+                             ngx_rtmp_out_ring_size(s->out_queue));
+        if (s->out == NULL) {
+            return NGX_ERROR;
+        }
+
+        s->out_time = (ngx_msec_t *) &s->out[s->out_queue];
+    }
 
     nmsg = (s->out_last + s->out_queue - s->out_pos) % s->out_queue + 1;
 
@@ -942,19 +968,38 @@ ngx_http_flv_live_send_message(ngx_rtmp_session_t *s,
         priority = 3;
     }
 
-    /* drop packet?
-     * Note we always leave 1 slot free */
-    if (nmsg + priority * s->out_queue / 4 >= s->out_queue) {
-        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                "flv live: HTTP drop message bufs=%ui, priority=%ui",
-                nmsg, priority);
+    size = 0;
+
+    for (cl = out; cl; cl = cl->next) {
+        size += cl->buf->last - cl->buf->pos;
+    }
+
+    /*
+     * drop packet?
+     * tags vary too much in size for the slots to tell how far behind a
+     * viewer is, the bytes and time queued do; the slots are only a
+     * backstop, 1 of them is always left free
+     */
+    if (nmsg >= s->out_queue
+        || ngx_rtmp_out_over_budget(s, size, priority))
+    {
+        ngx_log_debug4(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                "flv live: HTTP drop message bufs=%ui, queued=%uz+%uz, "
+                "priority=%ui", nmsg, s->out_queued, size, priority);
 
         return NGX_AGAIN;
     }
 
+    s->out_time[s->out_last] = ngx_current_msec;
     s->out[s->out_last++] = out;
     s->out_last %= s->out_queue;
 
+    s->out_queued += size;
+
+    if (s->out_queued > s->out_queued_max) {
+        s->out_queued_max = s->out_queued;
+    }
+
     ngx_rtmp_acquire_shared_chain(out);
 
     ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
@@ -1056,7 +1101,7 @@ ngx_http_flv_live_join(ngx_rtmp_session_t *s, u_char *name,
     unsigned int publisher)
 {
     ngx_rtmp_live_ctx_t            *ctx;
-    ngx_rtmp_live_stream_t        **stream;
+    ngx_rtmp_live_stream_t         *stream;
     ngx_rtmp_live_app_conf_t       *lacf;
 
     /* only for subscribers */
@@ -1092,7 +1137,7 @@ ngx_http_flv_live_join(ngx_rtmp_session_t *s, u_char *name,
     stream = ngx_rtmp_live_get_stream(s, name, lacf->idle_streams);
 
     if (stream == NULL ||
-        !(publisher || (*stream)->publishing || lacf->idle_streams))
+        !(publisher || stream->publishing || lacf->idle_streams))
     {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                 "flv live: stream not found");
@@ -1100,12 +1145,12 @@ ngx_http_flv_live_join(ngx_rtmp_session_t *s, u_char *name,
         return NGX_ERROR;
     }
 
-    ctx->stream = *stream;
+    ctx->stream = stream;
     ctx->publishing = publisher;
-    ctx->next = (*stream)->ctx;
+    ctx->next = stream->ctx;
     ctx->protocol = NGX_RTMP_PROTOCOL_HTTP;
 
-    (*stream)->ctx = ctx;
+    stream->ctx = ctx;
 
     if (ctx->stream->pub_ctx) {
         s->publisher = ctx->stream->pub_ctx->session;
@@ -1510,8 +1555,28 @@ ngx_http_flv_live_write_handler(ngx_event_t *wev)
         s->out_bpos = s->out_chain->buf->pos;
     }
 
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    if (cscf->out_vectored && s->out_chain && !ngx_rtmp_steer_muted(c)) {
+        n = ngx_http_flv_live_send_chain(s);
+
+        if (n == NGX_AGAIN) {
+            ngx_add_timer(c->write, s->timeout);
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                ngx_rtmp_finalize_session(s);
+            }
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_rtmp_finalize_session(s);
+            return;
+        }
+    }
+
     while (s->out_chain) {
         n = c->send(c, s->out_bpos, s->out_chain->buf->last - s->out_bpos);
+        ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out_calls, 1);
 
         if (n == NGX_AGAIN || n == 0) {
             ngx_add_timer(c->write, s->timeout);
@@ -1527,6 +1592,7 @@ ngx_http_flv_live_write_handler(ngx_event_t *wev)
         }
 
         s->out_bytes += n;
+        s->out_queued -= n;
         s->ping_reset = 1;
         ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out, n);
         s->out_bpos += n;
@@ -1556,6 +1622,155 @@ ngx_http_flv_live_write_handler(ngx_event_t *wev)
 }
 
 
+/*
+ * Queued messages are handed to send_chain at once through buffers of
+ * their own, the shared ones are queued for other viewers as well and
+ * must not be moved.  Sending is synchronous, so one set of them does
+ * for all the sessions of a worker.
+ *
+ * What was sent is told by c->sent, which the TLS library counts as it
+ * takes data into a buffer of its own, before it is on the wire; the
+ * same data would be given again.  So with TLS the chain is only sent
+ * when the kernel makes the records and nothing is buffered, otherwise
+ * NGX_DECLINED is returned and the caller sends message by message.
+ */
+static ngx_int_t
+ngx_http_flv_live_send_chain(ngx_rtmp_session_t *s)
+{
+    static ngx_buf_t            bufs[NGX_IOVS_PREALLOCATE];
+    static ngx_chain_t          links[NGX_IOVS_PREALLOCATE];
+
+    ngx_connection_t           *c;
+    ngx_chain_t                *cl;
+    ngx_buf_t                  *b;
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    ngx_send_chain_pt           send_chain;
+    ngx_uint_t                  nbufs, pos;
+    u_char                     *p;
+    size_t                      size, total, len;
+    off_t                       sent;
+
+    c = s->connection;
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    send_chain = c->send_chain;
+
+#if (NGX_HTTP_SSL)
+    if (c->ssl) {
+        if (!ngx_rtmp_ssl_ktls(c) || (c->buffered & NGX_SSL_BUFFERED)) {
+            return NGX_DECLINED;
+        }
+
+        send_chain = ngx_io.send_chain;
+    }
+#endif
+
+    while (s->out_chain) {
+
+        nbufs = 0;
+        total = 0;
+
+        pos = s->out_pos;
+        cl = s->out_chain;
+        p = s->out_bpos;
+
+        for ( ;; ) {
+
+            if (p != cl->buf->last) {
+                b = &bufs[nbufs];
+                ngx_memzero(b, sizeof(ngx_buf_t));
+
+                b->start = b->pos = p;
+                b->end = b->last = cl->buf->last;
+                b->memory = 1;
+
+                links[nbufs].buf = b;
+                links[nbufs].next = &links[nbufs + 1];
+
+                total += b->last - b->pos;
+
+                if (++nbufs == NGX_IOVS_PREALLOCATE) {
+                    break;
+                }
+            }
+
+            cl = cl->next;
+            if (cl == NULL) {
+                pos = (pos + 1) % s->out_queue;
+                if (pos == s->out_last) {
+                    break;
+                }
+                cl = s->out[pos];
+            }
+
+            p = cl->buf->pos;
+        }
+
+        sent = 0;
+
+        if (nbufs) {
+            links[nbufs - 1].next = NULL;
+
+            sent = c->sent;
+
+            cl = send_chain(c, links, 0);
+            ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out_calls, 1);
+
+            if (cl == NGX_CHAIN_ERROR) {
+                c->error = 1;
+                return NGX_ERROR;
+            }
+
+            sent = c->sent - sent;
+
+            ngx_log_debug3(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                    "flv live: send chain bufs=%ui size=%uz sent=%O",
+                    nbufs, total, sent);
+
+            s->out_bytes += sent;
+            s->out_queued -= sent;
+            s->ping_reset = 1;
+            ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out, sent);
+        }
+
+        /* advance output position in bytes, releasing sent messages */
+
+        len = (size_t) sent;
+
+        for ( ;; ) {
+            size = s->out_chain->buf->last - s->out_bpos;
+
+            if (len < size) {
+                s->out_bpos += len;
+                break;
+            }
+
+            len -= size;
+
+            s->out_chain = s->out_chain->next;
+            if (s->out_chain == NULL) {
+                ngx_rtmp_free_shared_chain(cscf, s->out[s->out_pos]);
+                s->out[s->out_pos] = NULL;
+                ++s->out_pos;
+                s->out_pos %= s->out_queue;
+                if (s->out_pos == s->out_last) {
+                    return NGX_OK;
+                }
+                s->out_chain = s->out[s->out_pos];
+            }
+
+            s->out_bpos = s->out_chain->buf->pos;
+        }
+
+        if ((size_t) sent < total) {
+            return NGX_AGAIN;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_flv_live_preprocess(ngx_http_request_t *r,
     ngx_rtmp_connection_t *rconn)
@@ -1835,7 +2050,7 @@ ngx_http_flv_live_init_session(ngx_http_request_t *r,
     s = ngx_pcalloc(c->pool, sizeof(ngx_rtmp_session_t));
     if (s == NULL) {
         /* let other handlers process */
-        goto failed;
+        return NULL;
     }
 
     s->rtmp_connection = c->data;
@@ -1849,7 +2064,7 @@ ngx_http_flv_live_init_session(ngx_http_request_t *r,
 
     ctx = ngx_palloc(c->pool, sizeof(ngx_rtmp_error_log_ctx_t));
     if (ctx == NULL) {
-        goto failed;
+        return NULL;
     }
 
     ctx->client = &c->addr_text;
@@ -1864,36 +2079,18 @@ ngx_http_flv_live_init_session(ngx_http_request_t *r,
 
     s->ctx = ngx_pcalloc(c->pool, sizeof(void *) * ngx_rtmp_max_module);
     if (s->ctx == NULL) {
-        goto failed;
-    }
-
-    s->out_pool = ngx_create_pool(4096, c->log);
-    if (s->out_pool == NULL) {
-        goto failed;
-    }
-
-    s->out = ngx_pcalloc(s->out_pool, sizeof(ngx_chain_t *)
-                         * ((ngx_rtmp_core_srv_conf_t *)
-                            addr_conf->default_server->ctx->srv_conf
-                            [ngx_rtmp_core_module.ctx_index])->out_queue);
-    if (s->out == NULL) {
-        goto failed;
+        return NULL;
     }
 
-    s->in_streams_pool = ngx_create_pool(4096, c->log);
-    if (s->in_streams_pool == NULL) {
-        goto failed;
-    }
+    /*
+     * a viewer never gets RTMP chunks, so there are no input streams,
+     * and the output ring is allocated along with the first message
+     */
 
     cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
     s->out_queue = cscf->out_queue;
     s->out_cork = cscf->out_cork;
-    s->in_streams = ngx_pcalloc(s->in_streams_pool, sizeof(ngx_rtmp_stream_t)
-            * cscf->max_streams);
-    if (s->in_streams == NULL) {
-        goto failed;
-    }
 
 #if (nginx_version >= 1007005)
     ngx_queue_init(&s->posted_dry_events);
@@ -1902,28 +2099,15 @@ ngx_http_flv_live_init_session(ngx_http_request_t *r,
     s->epoch = ngx_current_msec;
     s->timeout = cscf->timeout;
     s->buflen = cscf->buflen;
-    ngx_rtmp_set_chunk_size(s, NGX_RTMP_DEFAULT_CHUNK_SIZE);
+    s->in_chunk_size = NGX_RTMP_DEFAULT_CHUNK_SIZE;
 
     if (ngx_rtmp_fire_event(s, NGX_RTMP_CONNECT, NULL, NULL) != NGX_OK) {
-        goto failed;
+        return NULL;
     }
 
     s->data = (void *) r;
 
     return s;
-
-failed:
-    if (s->out_pool) {
-        ngx_destroy_pool(s->out_pool);
-        s->out_pool = NULL;
-    }
-
-    if (s->in_streams_pool) {
-        ngx_destroy_pool(s->in_streams_pool);
-        s->in_streams_pool = NULL;
-    }
-
-    return NULL;
 }
 
 
@@ -2240,6 +2424,62 @@ ngx_http_flv_live_cleanup(void *data)
 }
 
 
+static ngx_int_t
+ngx_http_flv_live_steer(ngx_http_request_t *r, ngx_http_flv_live_ctx_t *ctx)
+{
+    ngx_int_t                        owner;
+    ngx_buf_t                       *b;
+    ngx_connection_t                *c;
+    ngx_rtmp_steer_conn_t           *sc;
+
+    c = r->connection;
+    b = c->buffer;
+
+    sc = ngx_rtmp_steer_conn(c);
+    if (sc && sc->steered) {
+        return NGX_DECLINED;
+    }
+
+    /**
+     * only a request whose header is still in the connection
+     * buffer can be replayed by the owner of the stream
+     **/
+    if (r != r->main || b == NULL || r->header_in != b
+        || r->request_start < b->start || r->request_start >= b->last
+#if (NGX_HTTP_SSL)
+        || c->ssl
+#endif
+#if (nginx_version >= 1005012)
+        || r->http_connection->addr_conf->proxy_protocol
+#endif
+       )
+    {
+        return NGX_DECLINED;
+    }
+
+    owner = ngx_rtmp_steer_owner(&ctx->app, &ctx->stream);
+    if (owner == NGX_DECLINED || (ngx_uint_t) owner == ngx_worker) {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_rtmp_steer_handoff(c, owner, 0, r->request_start,
+                               b->last - r->request_start)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "flv live: stream '%V/%V' handed off to worker %i",
+                  &ctx->app, &ctx->stream, owner);
+
+    /* the owner logs the request */
+    r->logged = 1;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_flv_live_handler(ngx_http_request_t *r)
 {
@@ -2308,6 +2548,11 @@ ngx_http_flv_live_handler(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
+    if (hfcf->steer && ngx_http_flv_live_steer(r, ctx) == NGX_OK) {
+        /* the socket belongs to another worker, nothing may be sent */
+        return NGX_ERROR;
+    }
+
     s = ngx_http_flv_live_init_connection(r, rconn);
     if (s == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
@@ -44,15 +44,11 @@ typedef struct ngx_http_flv_live_ctx_s {
 
 typedef struct ngx_http_flv_live_conf_s {
     ngx_flag_t    flv_live;
+    ngx_flag_t    steer;
 } ngx_http_flv_live_conf_t;
 
 
 typedef struct {
-    ngx_chain_t  *meta;
-    ngx_chain_t  *apkt;
-    ngx_chain_t  *acopkt;
-    ngx_chain_t  *rpkt;
-
     ngx_int_t (*send_message_pt)(ngx_rtmp_session_t *s,
         ngx_chain_t *out, ngx_uint_t priority);
     ngx_chain_t *(*meta_message_pt)(ngx_rtmp_session_t *s,
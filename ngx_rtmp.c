@@ -893,6 +893,8 @@ ngx_rtmp_add_addrs(ngx_conf_t *cf, ngx_rtmp_port_t *mport,
         addrs[i].addr = sin->sin_addr.s_addr;
         addrs[i].conf.default_server = addr[i].default_server;
         addrs[i].conf.proxy_protocol = addr[i].opt.proxy_protocol;
+        addrs[i].conf.steer = addr[i].opt.steer;
+        addrs[i].conf.ssl = addr[i].opt.ssl;
 
         len = ngx_sock_ntop(&addr[i].opt.sockaddr.sockaddr,
 #if (nginx_version >= 1005003)
@@ -970,6 +972,8 @@ ngx_rtmp_add_addrs6(ngx_conf_t *cf, ngx_rtmp_port_t *mport,
         addrs6[i].addr6 = sin6->sin6_addr;
         addrs6[i].conf.default_server = addr[i].default_server;
         addrs6[i].conf.proxy_protocol = addr[i].opt.proxy_protocol;
+        addrs6[i].conf.steer = addr[i].opt.steer;
+        addrs6[i].conf.ssl = addr[i].opt.ssl;
 
         len = ngx_sock_ntop(&addr[i].opt.sockaddr.sockaddr,
 #if (nginx_version >= 1005003)
@@ -1303,7 +1307,12 @@ ngx_rtmp_set_virtual_server(ngx_rtmp_session_t *s, ngx_str_t *host)
     s->server_changed = 1;
     s->srv_conf = cscf->ctx->srv_conf;
 
-    if (dcscf->out_queue != cscf->out_queue) {
+    if (dcscf->out_queue != cscf->out_queue && s->out_pool == NULL) {
+        /* HTTP-FLV viewer, ring allocated by the first message */
+        s->out = NULL;
+        s->out_queue = cscf->out_queue;
+
+    } else if (dcscf->out_queue != cscf->out_queue) {
         /* use new pool */
         s->out_temp_pool = ngx_create_pool(4096, s->connection->log);
         if (s->out_temp_pool == NULL) {
@@ -1316,15 +1325,18 @@ ngx_rtmp_set_virtual_server(ngx_rtmp_session_t *s, ngx_str_t *host)
         s->out_pool = s->out_temp_pool;
 
         /* send not used yet, need not copy data */
-        s->out = ngx_pcalloc(s->out_pool, sizeof(ngx_chain_t *)
-                    * ((ngx_rtmp_core_srv_conf_t *)
-                        cscf->ctx->srv_conf[ngx_rtmp_core_module
-                            .ctx_index])->out_queue);
+        s->out = ngx_pcalloc(s->out_pool,
+                             ngx_rtmp_out_ring_size(cscf->out_queue));
+        if (s->out == NULL) {
+            ngx_rtmp_finalize_session(s);
+            return NGX_ERROR;
+        }
 
+        s->out_time = (ngx_msec_t *) &s->out[cscf->out_queue];
         s->out_queue = cscf->out_queue;
     }
 
-    if (dcscf->max_streams != cscf->max_streams) {
+    if (s->in_streams && dcscf->max_streams != cscf->max_streams) {
         /* use new pool */
         s->in_streams_temp_pool = ngx_create_pool(4096, s->connection->log);
         if (s->in_streams_temp_pool == NULL) {
@@ -49,6 +49,8 @@ typedef struct {
     ngx_rtmp_virtual_names_t  *virtual_names;
 
     unsigned                   proxy_protocol:1;
+    unsigned                   steer:1;
+    unsigned                   ssl:1;
 } ngx_rtmp_addr_conf_t;
 
 typedef struct {
@@ -110,6 +112,8 @@ typedef struct {
     unsigned                   reuseport:1;
     unsigned                   so_keepalive:2;
     unsigned                   proxy_protocol:1;
+    unsigned                   steer:1;
+    unsigned                   ssl:1;
 
     int                        backlog;
     int                        rcvbuf;
@@ -250,6 +254,23 @@ typedef struct {
 } ngx_rtmp_header_t;
 
 
+/*
+ * A block read at once in bulk ingest mode.  Chunk payloads are handed
+ * to message handlers where they are in the block, which is reused once
+ * no message pending on any chunk stream is referring to it.
+ */
+typedef struct ngx_rtmp_in_block_s  ngx_rtmp_in_block_t;
+
+struct ngx_rtmp_in_block_s {
+    ngx_rtmp_in_block_t    *next;       /* free list */
+    ngx_uint_t              refs;       /* chunks of pending messages */
+    u_char                 *pos;        /* parsed up to */
+    u_char                 *last;       /* read up to */
+    u_char                 *start;
+    u_char                 *end;
+};
+
+
 typedef struct {
     ngx_rtmp_header_t       hdr;
     uint32_t                dtime;
@@ -336,6 +357,17 @@ struct ngx_rtmp_session_s {
     unsigned                       relay:1;
     unsigned                       static_relay:1;
 
+    /* handed over to or from another worker by "steer"; the worker
+     * that accepted the client reports its connect, the owner its
+     * disconnect */
+    unsigned                       steered_in:1;
+    unsigned                       steered_out:1;
+
+    /* work still to complete, such as queued disk writes; a closed
+     * session is freed by the last ngx_rtmp_release_session() */
+    ngx_uint_t                     count;
+    unsigned                       closed:1;
+
     /* URI with "/." and on Win32 with "//" */
     unsigned                       complex_uri:1;
     /* URI with "%" */
@@ -392,18 +424,29 @@ struct ngx_rtmp_session_s {
     ngx_pool_t                    *in_old_pool;
     ngx_int_t                      in_chunk_size_changing;
 
+    /* bulk ingest, the chunk size changes in place */
+    unsigned                       in_bulk:1;
+    ngx_rtmp_in_block_t           *in_block;
+    ngx_rtmp_in_block_t           *in_free_blocks;
+
     ngx_connection_t              *connection;
 
     /* circular buffer of RTMP message pointers */
     ngx_msec_t                     timeout;
     uint32_t                       out_bytes;
     size_t                         out_pos, out_last;
+    size_t                         out_queued;   /* bytes not sent yet */
     ngx_chain_t                   *out_chain;
     u_char                        *out_bpos;
     unsigned                       out_buffer:1;
     size_t                         out_queue;
     size_t                         out_cork;
     ngx_chain_t                  **out;
+    ngx_msec_t                    *out_time;     /* when each was queued */
+
+    /* high-water marks of the output queue */
+    size_t                         out_queued_max;
+    ngx_msec_t                     out_delay_max;
 };
 
 
@@ -481,6 +524,10 @@ struct ngx_rtmp_core_srv_conf_s {
     ngx_flag_t              busy;
     size_t                  out_queue;
     size_t                  out_cork;
+    size_t                  out_queue_size;
+    ngx_msec_t              out_queue_duration;
+    ngx_flag_t              out_vectored;
+    size_t                  in_bulk;
     ngx_msec_t              buflen;
 
     ngx_rtmp_conf_ctx_t    *ctx;
@@ -587,6 +634,7 @@ void ngx_rtmp_init_connection(ngx_connection_t *c);
 ngx_rtmp_session_t * ngx_rtmp_init_session(ngx_connection_t *c,
      ngx_rtmp_addr_conf_t *addr_conf);
 void ngx_rtmp_finalize_session(ngx_rtmp_session_t *s);
+void ngx_rtmp_release_session(ngx_rtmp_session_t *s);
 void ngx_rtmp_handshake(ngx_rtmp_session_t *s);
 void ngx_rtmp_client_handshake(ngx_rtmp_session_t *s, unsigned async);
 void ngx_rtmp_free_handshake_buffers(ngx_rtmp_session_t *s);
@@ -632,6 +680,14 @@ ngx_rtmp_r64(uint64_t n)
 }
 
 
+/* inodes are unique on one device only */
+#if (NGX_WIN32)
+#define ngx_rtmp_file_dev(fi)   ((uint64_t) (fi)->dwVolumeSerialNumber)
+#else
+#define ngx_rtmp_file_dev(fi)   ((uint64_t) (fi)->st_dev)
+#endif
+
+
 /* Receiving messages */
 ngx_int_t ngx_rtmp_receive_message(ngx_rtmp_session_t *s,
         ngx_rtmp_header_t *h, ngx_chain_t *in);
@@ -681,6 +737,13 @@ void ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         ngx_rtmp_header_t *lh, ngx_chain_t *out);
 ngx_int_t ngx_rtmp_send_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
         ngx_uint_t priority);
+ngx_uint_t ngx_rtmp_out_over_budget(ngx_rtmp_session_t *s, size_t size,
+        ngx_uint_t priority);
+ngx_msec_t ngx_rtmp_out_delay(ngx_rtmp_session_t *s);
+
+/* the ring of n messages followed by the times they were queued at */
+#define ngx_rtmp_out_ring_size(n)                                            \
+    ((sizeof(ngx_chain_t *) + sizeof(ngx_msec_t)) * (n))
 
 /* Note on priorities:
  * the bigger value the lower the priority.
@@ -794,6 +857,10 @@ ngx_rtmp_is_codec_header(ngx_chain_t *in)
 extern ngx_rtmp_bandwidth_t                 ngx_rtmp_bw_out;
 extern ngx_rtmp_bandwidth_t                 ngx_rtmp_bw_in;
 
+/* output and input syscalls, "bytes" counts calls */
+extern ngx_rtmp_bandwidth_t                 ngx_rtmp_bw_out_calls;
+extern ngx_rtmp_bandwidth_t                 ngx_rtmp_bw_in_calls;
+
 
 extern ngx_uint_t                           ngx_rtmp_naccepted;
 #if (nginx_version >= 1007011)
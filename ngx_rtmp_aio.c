@@ -0,0 +1,940 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp_aio.h"
+
+
+#define NGX_RTMP_AIO_COPY_BUFSIZE       (64 * 1024)
+
+
+static void ngx_rtmp_aio_run(ngx_rtmp_aio_op_t *op);
+static ngx_int_t ngx_rtmp_aio_write_fd(ngx_fd_t fd, off_t offset, u_char *p,
+    size_t size);
+static ngx_int_t ngx_rtmp_aio_done(ngx_rtmp_aio_queue_t *q,
+    ngx_rtmp_aio_op_t *op);
+#if (NGX_THREADS)
+static ngx_uint_t ngx_rtmp_aio_full(ngx_rtmp_aio_queue_t *q, size_t size);
+static ngx_rtmp_aio_op_t *ngx_rtmp_aio_alloc_op(ngx_rtmp_aio_queue_t *q,
+    size_t size);
+static void ngx_rtmp_aio_start(ngx_rtmp_aio_queue_t *q);
+static void ngx_rtmp_aio_finish(ngx_rtmp_aio_queue_t *q);
+static void ngx_rtmp_aio_thread_handler(void *data, ngx_log_t *log);
+static void ngx_rtmp_aio_event_handler(ngx_event_t *ev);
+static void ngx_rtmp_aio_cleanup(void *data);
+static void ngx_rtmp_aio_free(ngx_rtmp_aio_queue_t *q);
+#endif
+
+
+ngx_rtmp_aio_stat_t                     ngx_rtmp_aio_stat;
+
+
+char *
+ngx_rtmp_aio_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char  *p = conf;
+
+    ngx_str_t              *value;
+    ngx_rtmp_aio_conf_t   **field;
+#if (NGX_THREADS)
+    ssize_t                 size;
+    ngx_str_t               name, s;
+    ngx_uint_t              i;
+    ngx_rtmp_aio_conf_t    *aio;
+#endif
+
+    field = (ngx_rtmp_aio_conf_t **) (p + cmd->offset);
+
+    if (*field != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0 && cf->args->nelts == 2) {
+        *field = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "threads", 7) != 0
+        || (value[1].len > 7 && value[1].data[7] != '='))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_THREADS)
+
+    aio = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_aio_conf_t));
+    if (aio == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (value[1].len > 8) {
+        name.len = value[1].len - 8;
+        name.data = value[1].data + 8;
+
+    } else {
+        ngx_str_set(&name, "default");
+    }
+
+    aio->thread_pool = ngx_thread_pool_add(cf, &name);
+    if (aio->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    aio->max_queue = NGX_RTMP_AIO_MAX_QUEUE;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "max_queue=", 10) == 0) {
+            s.len = value[i].len - 10;
+            s.data = value[i].data + 10;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_queue \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            aio->max_queue = (size_t) size;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    *field = aio;
+
+    return NGX_CONF_OK;
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"%V threads\" requires nginx built with threads",
+                       &cmd->name);
+    return NGX_CONF_ERROR;
+
+#endif
+}
+
+
+ngx_rtmp_aio_queue_t *
+ngx_rtmp_aio_create_queue(ngx_rtmp_aio_conf_t *conf, ngx_pool_t *pool,
+    ngx_log_t *log)
+{
+    ngx_rtmp_aio_queue_t   *q;
+#if (NGX_THREADS)
+    ngx_pool_cleanup_t     *cln;
+#endif
+
+#if (NGX_THREADS)
+
+    if (conf && conf->thread_pool) {
+        cln = ngx_pool_cleanup_add(pool, 0);
+        if (cln == NULL) {
+            return NULL;
+        }
+
+        q = ngx_calloc(sizeof(ngx_rtmp_aio_queue_t), log);
+        if (q == NULL) {
+            return NULL;
+        }
+
+        q->log = log;
+        q->thread_pool = conf->thread_pool;
+        q->max_queue = conf->max_queue;
+        q->last = &q->pending;
+
+        q->task.ctx = q;
+        q->task.handler = ngx_rtmp_aio_thread_handler;
+        q->task.event.data = q;
+        q->task.event.handler = ngx_rtmp_aio_event_handler;
+        q->task.event.log = log;
+
+        cln->handler = ngx_rtmp_aio_cleanup;
+        cln->data = q;
+
+        ngx_rtmp_aio_stat.queues++;
+
+        return q;
+    }
+
+#endif
+
+    q = ngx_pcalloc(pool, sizeof(ngx_rtmp_aio_queue_t));
+    if (q == NULL) {
+        return NULL;
+    }
+
+    q->log = log;
+
+    return q;
+}
+
+
+ngx_int_t
+ngx_rtmp_aio_write(ngx_rtmp_aio_queue_t *q, ngx_fd_t fd, off_t offset,
+    u_char *data, size_t size)
+{
+    ngx_rtmp_aio_op_t   sop;
+#if (NGX_THREADS)
+    ngx_rtmp_aio_op_t  *op;
+
+    if (ngx_rtmp_aio_threaded(q)) {
+        if (ngx_rtmp_aio_full(q, size)) {
+            return NGX_ERROR;
+        }
+
+        op = ngx_rtmp_aio_alloc_op(q, size);
+        if (op == NULL) {
+            return NGX_ERROR;
+        }
+
+        op->fd = fd;
+        op->offset = offset;
+        op->last = ngx_cpymem(op->pos, data, size);
+
+        ngx_rtmp_aio_post(q, op);
+
+        return NGX_OK;
+    }
+#endif
+
+    ngx_memzero(&sop, sizeof(sop));
+
+    sop.type = NGX_RTMP_AIO_WRITE;
+    sop.fd = fd;
+    sop.offset = offset;
+    sop.pos = data;
+    sop.last = data + size;
+
+    ngx_rtmp_aio_run(&sop);
+
+    return ngx_rtmp_aio_done(q, &sop);
+}
+
+
+ngx_int_t
+ngx_rtmp_aio_write_buf(ngx_rtmp_aio_queue_t *q, ngx_fd_t fd, off_t offset,
+    u_char *buf, u_char *pos, size_t size)
+{
+    ngx_int_t           rc;
+    ngx_rtmp_aio_op_t   sop;
+#if (NGX_THREADS)
+    ngx_rtmp_aio_op_t  *op;
+
+    if (ngx_rtmp_aio_threaded(q)) {
+        if (ngx_rtmp_aio_full(q, size)) {
+            ngx_free(buf);
+            return NGX_ERROR;
+        }
+
+        op = ngx_alloc(sizeof(ngx_rtmp_aio_op_t), q->log);
+        if (op == NULL) {
+            ngx_free(buf);
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(op, sizeof(ngx_rtmp_aio_op_t));
+
+        op->type = NGX_RTMP_AIO_WRITE;
+        op->fd = fd;
+        op->offset = offset;
+        op->pos = pos;
+        op->last = pos + size;
+        op->buf = buf;
+
+        ngx_rtmp_aio_post(q, op);
+
+        return NGX_OK;
+    }
+#endif
+
+    ngx_memzero(&sop, sizeof(sop));
+
+    sop.type = NGX_RTMP_AIO_WRITE;
+    sop.fd = fd;
+    sop.offset = offset;
+    sop.pos = pos;
+    sop.last = pos + size;
+
+    ngx_rtmp_aio_run(&sop);
+
+    rc = ngx_rtmp_aio_done(q, &sop);
+
+    ngx_free(buf);
+
+    return rc;
+}
+
+
+ngx_int_t
+ngx_rtmp_aio_copy(ngx_rtmp_aio_queue_t *q, ngx_fd_t fd, ngx_fd_t src,
+    size_t size)
+{
+    ngx_rtmp_aio_op_t   *op, sop;
+
+    op = &sop;
+
+#if (NGX_THREADS)
+    if (ngx_rtmp_aio_threaded(q)) {
+        op = ngx_alloc(sizeof(ngx_rtmp_aio_op_t), q->log);
+        if (op == NULL) {
+            return NGX_ERROR;
+        }
+    }
+#endif
+
+    ngx_memzero(op, sizeof(ngx_rtmp_aio_op_t));
+
+    op->type = NGX_RTMP_AIO_COPY;
+    op->fd = fd;
+    op->src = src;
+    op->size = size;
+
+#if (NGX_THREADS)
+    if (ngx_rtmp_aio_threaded(q)) {
+        ngx_rtmp_aio_post(q, op);
+        return NGX_OK;
+    }
+#endif
+
+    ngx_rtmp_aio_run(op);
+
+    return ngx_rtmp_aio_done(q, op);
+}
+
+
+ngx_int_t
+ngx_rtmp_aio_close(ngx_rtmp_aio_queue_t *q, ngx_fd_t fd)
+{
+    ngx_rtmp_aio_op_t   *op, sop;
+
+    op = &sop;
+
+#if (NGX_THREADS)
+    if (ngx_rtmp_aio_threaded(q)) {
+        op = ngx_alloc(sizeof(ngx_rtmp_aio_op_t), q->log);
+
+        if (op == NULL) {
+            if (q->busy || q->pending) {
+                ngx_log_error(NGX_LOG_ALERT, q->log, 0,
+                              "aio: fd:%d is left open", fd);
+                return NGX_ERROR;
+            }
+
+            /* nothing can write to the descriptor any more */
+            op = &sop;
+        }
+    }
+#endif
+
+    ngx_memzero(op, sizeof(ngx_rtmp_aio_op_t));
+
+    op->type = NGX_RTMP_AIO_CLOSE;
+    op->fd = fd;
+
+#if (NGX_THREADS)
+    if (op != &sop) {
+        ngx_rtmp_aio_post(q, op);
+        return NGX_OK;
+    }
+#endif
+
+    ngx_rtmp_aio_run(op);
+
+    return ngx_rtmp_aio_done(q, op);
+}
+
+
+ngx_int_t
+ngx_rtmp_aio_replace(ngx_rtmp_aio_queue_t *q, ngx_str_t *temp,
+    ngx_str_t *path, u_char *data, size_t size)
+{
+    ngx_rtmp_aio_op_t   sop;
+#if (NGX_THREADS)
+    size_t              len;
+    ngx_rtmp_aio_op_t  *op;
+
+    if (ngx_rtmp_aio_threaded(q)) {
+        if (ngx_rtmp_aio_full(q, size)) {
+            return NGX_ERROR;
+        }
+
+        len = size + path->len + 1 + (temp ? temp->len + 1 : 0);
+
+        op = ngx_rtmp_aio_alloc_op(q, len);
+        if (op == NULL) {
+            return NGX_ERROR;
+        }
+
+        op->type = NGX_RTMP_AIO_REPLACE;
+        op->last = ngx_cpymem(op->pos, data, size);
+
+        op->path = op->last;
+        *ngx_cpymem(op->path, path->data, path->len) = 0;
+
+        if (temp) {
+            op->temp = op->path + path->len + 1;
+            *ngx_cpymem(op->temp, temp->data, temp->len) = 0;
+        }
+
+        ngx_rtmp_aio_post(q, op);
+
+        return NGX_OK;
+    }
+#endif
+
+    ngx_memzero(&sop, sizeof(sop));
+
+    sop.type = NGX_RTMP_AIO_REPLACE;
+    sop.path = path->data;
+    sop.temp = temp ? temp->data : NULL;
+    sop.pos = data;
+    sop.last = data + size;
+
+    ngx_rtmp_aio_run(&sop);
+
+    return ngx_rtmp_aio_done(q, &sop);
+}
+
+
+ngx_rtmp_aio_op_t *
+ngx_rtmp_aio_alloc(ngx_rtmp_aio_queue_t *q, size_t size)
+{
+#if (NGX_THREADS)
+
+    if (ngx_rtmp_aio_full(q, size)) {
+        return NULL;
+    }
+
+    return ngx_rtmp_aio_alloc_op(q, size);
+
+#else
+
+    return NULL;
+
+#endif
+}
+
+
+void
+ngx_rtmp_aio_post(ngx_rtmp_aio_queue_t *q, ngx_rtmp_aio_op_t *op)
+{
+#if (NGX_THREADS)
+
+    size_t  size;
+
+    size = op->last - op->pos;
+
+    op->next = NULL;
+
+    *q->last = op;
+    q->last = &op->next;
+
+    q->queued += size;
+
+    ngx_rtmp_aio_stat.queued += size;
+
+    if (ngx_rtmp_aio_stat.queued > ngx_rtmp_aio_stat.max_queued) {
+        ngx_rtmp_aio_stat.max_queued = ngx_rtmp_aio_stat.queued;
+    }
+
+    if (!q->busy) {
+        ngx_rtmp_aio_start(q);
+    }
+
+#endif
+}
+
+
+ngx_int_t
+ngx_rtmp_aio_notify(ngx_rtmp_aio_queue_t *q, ngx_rtmp_aio_handler_pt handler,
+    void *data)
+{
+    ngx_uint_t          errors;
+#if (NGX_THREADS)
+    ngx_rtmp_aio_op_t  *op;
+
+    if (ngx_rtmp_aio_threaded(q) && (q->busy || q->pending)) {
+        op = ngx_alloc(sizeof(ngx_rtmp_aio_op_t), q->log);
+        if (op == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(op, sizeof(ngx_rtmp_aio_op_t));
+
+        op->type = NGX_RTMP_AIO_NOTIFY;
+        op->handler = handler;
+        op->data = data;
+
+        ngx_rtmp_aio_post(q, op);
+
+        return NGX_OK;
+    }
+#endif
+
+    errors = 0;
+
+    if (q) {
+        errors = q->errors - q->notified;
+        q->notified = q->errors;
+    }
+
+    handler(data, errors);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_aio_write_fd(ngx_fd_t fd, off_t offset, u_char *p, size_t size)
+{
+    ssize_t  n;
+
+    while (size) {
+
+#if !(NGX_WIN32)
+        if (offset >= 0) {
+            n = pwrite(fd, p, size, offset);
+
+        } else
+#endif
+        {
+            n = ngx_write_fd(fd, p, size);
+        }
+
+        if (n == -1) {
+            if (ngx_errno == NGX_EINTR) {
+                continue;
+            }
+
+            return NGX_ERROR;
+        }
+
+        if (offset >= 0) {
+            offset += n;
+        }
+
+        p += n;
+        size -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+/* may be called in a thread, must not log */
+static void
+ngx_rtmp_aio_run(ngx_rtmp_aio_op_t *op)
+{
+    size_t     left;
+    ssize_t    n;
+    ngx_fd_t   fd;
+#if (NGX_HAVE_COPY_FILE_RANGE)
+    loff_t     off;
+#endif
+    u_char     buf[NGX_RTMP_AIO_COPY_BUFSIZE];
+
+    switch (op->type) {
+
+    case NGX_RTMP_AIO_WRITE:
+
+        if (ngx_rtmp_aio_write_fd(op->fd, op->offset, op->pos,
+                                  op->last - op->pos)
+            != NGX_OK)
+        {
+            op->err = ngx_errno;
+            op->failed = ngx_write_fd_n;
+        }
+
+        return;
+
+    case NGX_RTMP_AIO_COPY:
+
+#if (NGX_HAVE_COPY_FILE_RANGE)
+
+        /* data never leaves the kernel, falls back to read()/write()
+         * if the file systems do not support it */
+
+        off = 0;
+
+        for (left = op->size; left; left -= n) {
+
+            n = copy_file_range(op->src, &off, op->fd, NULL, left, 0);
+
+            if (n == -1 && ngx_errno == NGX_EINTR) {
+                n = 0;
+                continue;
+            }
+
+            if (n == -1 && left == op->size
+                && (ngx_errno == NGX_EXDEV || ngx_errno == NGX_ENOSYS
+                    || ngx_errno == NGX_EINVAL
+                    || ngx_errno == NGX_EOPNOTSUPP))
+            {
+                break;
+            }
+
+            if (n == 0 || n == -1) {
+                op->err = n ? ngx_errno : 0;
+                op->failed = "copy_file_range()";
+                return;
+            }
+        }
+
+        if (left == 0) {
+            return;
+        }
+
+#endif
+
+#if (NGX_WIN32)
+        if (SetFilePointer(op->src, 0, 0, FILE_BEGIN)
+            == INVALID_SET_FILE_POINTER)
+        {
+            op->err = ngx_errno;
+            op->failed = "SetFilePointer()";
+            return;
+        }
+#else
+        if (lseek(op->src, 0, SEEK_SET) == -1) {
+            op->err = ngx_errno;
+            op->failed = "lseek()";
+            return;
+        }
+#endif
+
+        for (left = op->size; left; left -= n) {
+
+            n = ngx_read_fd(op->src, buf, ngx_min(sizeof(buf), left));
+
+            if (n == -1 && ngx_errno == NGX_EINTR) {
+                n = 0;
+                continue;
+            }
+
+            if (n == 0 || n == -1) {
+                op->err = n ? ngx_errno : 0;
+                op->failed = ngx_read_fd_n;
+                return;
+            }
+
+            if (ngx_rtmp_aio_write_fd(op->fd, -1, buf, n) != NGX_OK) {
+                op->err = ngx_errno;
+                op->failed = ngx_write_fd_n;
+                return;
+            }
+        }
+
+        return;
+
+    case NGX_RTMP_AIO_CLOSE:
+
+        if (ngx_close_file(op->fd) == NGX_FILE_ERROR) {
+            op->err = ngx_errno;
+            op->failed = ngx_close_file_n;
+        }
+
+        return;
+
+    case NGX_RTMP_AIO_REPLACE:
+
+        fd = ngx_open_file(op->temp ? op->temp : op->path, NGX_FILE_WRONLY,
+                           NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+        if (fd == NGX_INVALID_FILE) {
+            op->err = ngx_errno;
+            op->failed = ngx_open_file_n;
+            return;
+        }
+
+        if (ngx_rtmp_aio_write_fd(fd, -1, op->pos, op->last - op->pos)
+            != NGX_OK)
+        {
+            op->err = ngx_errno;
+            op->failed = ngx_write_fd_n;
+            ngx_close_file(fd);
+            return;
+        }
+
+        if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+            op->err = ngx_errno;
+            op->failed = ngx_close_file_n;
+            return;
+        }
+
+        if (op->temp == NULL) {
+            return;
+        }
+
+#if (NGX_WIN32)
+        if (MoveFileEx((LPCTSTR) op->temp, (LPCTSTR) op->path,
+                       MOVEFILE_REPLACE_EXISTING) == 0)
+#else
+        if (ngx_rename_file(op->temp, op->path) == NGX_FILE_ERROR)
+#endif
+        {
+            op->err = ngx_errno;
+            op->failed = ngx_rename_file_n;
+        }
+
+        return;
+
+    case NGX_RTMP_AIO_NOTIFY:
+
+        /* handled on the event loop */
+
+        return;
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_aio_done(ngx_rtmp_aio_queue_t *q, ngx_rtmp_aio_op_t *op)
+{
+    if (op->failed == NULL) {
+        return NGX_OK;
+    }
+
+    q->errors++;
+
+    if (op->path) {
+        ngx_log_error(NGX_LOG_ERR, q->log, op->err,
+                      "aio: %s \"%s\" failed",
+                      op->failed, op->temp ? op->temp : op->path);
+
+    } else {
+        ngx_log_error(NGX_LOG_ERR, q->log, op->err,
+                      "aio: %s fd:%d failed", op->failed, op->fd);
+    }
+
+    return NGX_ERROR;
+}
+
+
+#if (NGX_THREADS)
+
+/*
+ * The disk does not keep up: the worker must not wait for it, so the
+ * data is refused and its writer gives up the file it was meant for.
+ * What is already queued is kept, files are closed in order.
+ */
+
+static ngx_uint_t
+ngx_rtmp_aio_full(ngx_rtmp_aio_queue_t *q, size_t size)
+{
+    if (q->max_queue == 0 || q->queued + size <= q->max_queue) {
+        return 0;
+    }
+
+    if (q->dropped++ == 0) {
+        ngx_log_error(NGX_LOG_WARN, q->log, 0,
+                      "aio: queue is full, %uz bytes queued, "
+                      "dropping data", q->queued);
+    }
+
+    ngx_rtmp_aio_stat.dropped++;
+    ngx_rtmp_aio_stat.dropped_bytes += size;
+
+    return 1;
+}
+
+
+static ngx_rtmp_aio_op_t *
+ngx_rtmp_aio_alloc_op(ngx_rtmp_aio_queue_t *q, size_t size)
+{
+    ngx_rtmp_aio_op_t  *op;
+
+    op = ngx_alloc(sizeof(ngx_rtmp_aio_op_t) + size, q->log);
+    if (op == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(op, sizeof(ngx_rtmp_aio_op_t));
+
+    op->type = NGX_RTMP_AIO_WRITE;
+    op->offset = -1;
+    op->pos = (u_char *) (op + 1);
+    op->last = op->pos;
+
+    return op;
+}
+
+
+static void
+ngx_rtmp_aio_start(ngx_rtmp_aio_queue_t *q)
+{
+    ngx_rtmp_aio_op_t  *op;
+
+    q->running = q->pending;
+    q->pending = NULL;
+    q->last = &q->pending;
+
+    if (ngx_thread_task_post(q->thread_pool, &q->task) == NGX_OK) {
+        q->busy = 1;
+        return;
+    }
+
+    /* thread pool queue overflow: the data is lost rather than
+     * written here, only descriptors are closed */
+
+    for (op = q->running; op; op = op->next) {
+        switch (op->type) {
+
+        case NGX_RTMP_AIO_CLOSE:
+        case NGX_RTMP_AIO_NOTIFY:
+            ngx_rtmp_aio_run(op);
+            break;
+
+        default:
+            op->err = 0;
+            op->failed = "ngx_thread_task_post()";
+        }
+    }
+
+    /* what handlers queue meanwhile is started afterwards */
+
+    q->busy = 1;
+
+    ngx_rtmp_aio_finish(q);
+
+    q->busy = 0;
+
+    if (q->pending) {
+        ngx_rtmp_aio_start(q);
+        return;
+    }
+
+    if (q->detached) {
+        ngx_rtmp_aio_free(q);
+    }
+}
+
+
+static void
+ngx_rtmp_aio_finish(ngx_rtmp_aio_queue_t *q)
+{
+    size_t              size;
+    ngx_uint_t          errors;
+    ngx_rtmp_aio_op_t  *op, *next;
+
+    /* handlers may queue more operations, those are left pending */
+
+    for (op = q->running; op; op = next) {
+        next = op->next;
+
+        size = op->last - op->pos;
+
+        q->queued -= size;
+
+        ngx_rtmp_aio_stat.queued -= size;
+
+        if (op->type == NGX_RTMP_AIO_NOTIFY) {
+            errors = q->errors - q->notified;
+            q->notified = q->errors;
+
+            op->handler(op->data, errors);
+
+            ngx_free(op);
+            continue;
+        }
+
+        ngx_rtmp_aio_stat.ops++;
+
+        if (ngx_rtmp_aio_done(q, op) == NGX_OK) {
+            ngx_rtmp_aio_stat.bytes += op->type == NGX_RTMP_AIO_COPY
+                                       ? op->size : size;
+
+        } else {
+            ngx_rtmp_aio_stat.errors++;
+        }
+
+        if (op->buf) {
+            ngx_free(op->buf);
+        }
+
+        ngx_free(op);
+    }
+
+    q->running = NULL;
+}
+
+
+static void
+ngx_rtmp_aio_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_rtmp_aio_queue_t *q = data;
+
+    ngx_rtmp_aio_op_t  *op;
+
+    for (op = q->running; op; op = op->next) {
+        ngx_rtmp_aio_run(op);
+    }
+}
+
+
+static void
+ngx_rtmp_aio_event_handler(ngx_event_t *ev)
+{
+    ngx_rtmp_aio_queue_t *q = ev->data;
+
+    /* still busy: a handler closing the owner only detaches the queue */
+
+    ngx_rtmp_aio_finish(q);
+
+    q->busy = 0;
+
+    if (q->pending) {
+        ngx_rtmp_aio_start(q);
+        return;
+    }
+
+    if (q->detached) {
+        ngx_rtmp_aio_free(q);
+    }
+}
+
+
+static void
+ngx_rtmp_aio_cleanup(void *data)
+{
+    ngx_rtmp_aio_queue_t *q = data;
+
+    /* the owner is gone, keep writing in background */
+
+    q->log = ngx_cycle->log;
+    q->task.event.log = ngx_cycle->log;
+
+    if (q->busy) {
+        q->detached = 1;
+        return;
+    }
+
+    ngx_rtmp_aio_free(q);
+}
+
+
+static void
+ngx_rtmp_aio_free(ngx_rtmp_aio_queue_t *q)
+{
+    if (q->dropped) {
+        ngx_log_error(NGX_LOG_INFO, q->log, 0,
+                      "aio: queue dropped data %ui times", q->dropped);
+    }
+
+    ngx_rtmp_aio_stat.queues--;
+
+    ngx_free(q);
+}
+
+#endif
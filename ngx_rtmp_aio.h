@@ -0,0 +1,147 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#ifndef _NGX_RTMP_AIO_H_INCLUDED_
+#define _NGX_RTMP_AIO_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_RTMP_AIO_WRITE              1
+#define NGX_RTMP_AIO_COPY               2
+#define NGX_RTMP_AIO_CLOSE              3
+#define NGX_RTMP_AIO_REPLACE            4
+#define NGX_RTMP_AIO_NOTIFY             5
+
+
+#define NGX_RTMP_AIO_MAX_QUEUE          (8 * 1024 * 1024)
+
+
+typedef struct ngx_rtmp_aio_op_s        ngx_rtmp_aio_op_t;
+
+/* errors: operations failed since the previous notification */
+typedef void (*ngx_rtmp_aio_handler_pt)(void *data, ngx_uint_t errors);
+
+
+struct ngx_rtmp_aio_op_s {
+    ngx_rtmp_aio_op_t                  *next;
+    ngx_uint_t                          type;
+    ngx_fd_t                            fd;
+    ngx_fd_t                            src;      /* copy source */
+    off_t                               offset;   /* -1: file position */
+    size_t                              size;     /* copy length */
+    u_char                             *path;     /* replace target */
+    u_char                             *temp;     /* NULL: write in place */
+    u_char                             *pos;
+    u_char                             *last;
+    u_char                             *buf;      /* freed when done */
+    ngx_rtmp_aio_handler_pt             handler;  /* notify */
+    void                               *data;
+    ngx_err_t                           err;
+    const char                         *failed;
+};
+
+
+typedef struct {
+#if (NGX_THREADS)
+    ngx_thread_pool_t                  *thread_pool;
+#endif
+    size_t                              max_queue;
+} ngx_rtmp_aio_conf_t;
+
+
+typedef struct {
+    ngx_log_t                          *log;
+
+    /* failed operations so far, compared by writers of a file */
+    ngx_uint_t                          errors;
+    ngx_uint_t                          notified; /* errors then */
+
+#if (NGX_THREADS)
+    ngx_thread_pool_t                  *thread_pool;
+    ngx_thread_task_t                   task;
+
+    ngx_rtmp_aio_op_t                  *pending;
+    ngx_rtmp_aio_op_t                 **last;
+    ngx_rtmp_aio_op_t                  *running;
+
+    size_t                              queued;   /* bytes in memory */
+    size_t                              max_queue;
+    ngx_uint_t                          dropped;
+
+    unsigned                            busy:1;
+    unsigned                            detached:1;
+#endif
+} ngx_rtmp_aio_queue_t;
+
+
+/* per-worker counters of threaded queues */
+typedef struct {
+    ngx_uint_t                          queues;
+    ngx_uint_t                          ops;
+    ngx_uint_t                          errors;
+    uint64_t                            bytes;
+    size_t                              queued;
+    size_t                              max_queued;
+    ngx_uint_t                          dropped;  /* queue was full */
+    uint64_t                            dropped_bytes;
+} ngx_rtmp_aio_stat_t;
+
+
+#if (NGX_THREADS)
+#define ngx_rtmp_aio_threaded(q)        ((q) && (q)->thread_pool)
+#else
+#define ngx_rtmp_aio_threaded(q)        0
+#endif
+
+
+extern ngx_rtmp_aio_stat_t              ngx_rtmp_aio_stat;
+
+
+/* "off" | "threads[=pool] [max_queue=size]",
+ * stores ngx_rtmp_aio_conf_t * (NULL for off) */
+char *ngx_rtmp_aio_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+
+/* A queue runs its operations strictly in order, either on the
+ * thread pool or, when conf is NULL, synchronously in place.
+ * Threaded queues outlive the pool they are created for
+ * until the last operation completes.  The worker never waits
+ * for the disk: data that does not fit in a full queue is refused */
+ngx_rtmp_aio_queue_t *ngx_rtmp_aio_create_queue(ngx_rtmp_aio_conf_t *conf,
+    ngx_pool_t *pool, ngx_log_t *log);
+
+/* NGX_ERROR is returned for failures known at once, a full queue
+ * included, and the file is then missing data; failures of
+ * queued operations are only counted in q->errors */
+ngx_int_t ngx_rtmp_aio_write(ngx_rtmp_aio_queue_t *q, ngx_fd_t fd,
+    off_t offset, u_char *data, size_t size);
+/* Same as ngx_rtmp_aio_write(), but writes pos..pos+size in place
+ * and takes over buf allocated with ngx_alloc(), whatever the result */
+ngx_int_t ngx_rtmp_aio_write_buf(ngx_rtmp_aio_queue_t *q, ngx_fd_t fd,
+    off_t offset, u_char *buf, u_char *pos, size_t size);
+/* Appends size bytes from the start of src, in kernel when possible */
+ngx_int_t ngx_rtmp_aio_copy(ngx_rtmp_aio_queue_t *q, ngx_fd_t fd,
+    ngx_fd_t src, size_t size);
+ngx_int_t ngx_rtmp_aio_close(ngx_rtmp_aio_queue_t *q, ngx_fd_t fd);
+ngx_int_t ngx_rtmp_aio_replace(ngx_rtmp_aio_queue_t *q, ngx_str_t *temp,
+    ngx_str_t *path, u_char *data, size_t size);
+
+/* Calls handler on the event loop once every operation queued so
+ * far is complete, at once if there is none; on NGX_ERROR it is
+ * never called */
+ngx_int_t ngx_rtmp_aio_notify(ngx_rtmp_aio_queue_t *q,
+    ngx_rtmp_aio_handler_pt handler, void *data);
+
+/* Threaded queues only; the caller fills op->pos..op->last,
+ * NULL if the queue is full */
+ngx_rtmp_aio_op_t *ngx_rtmp_aio_alloc(ngx_rtmp_aio_queue_t *q, size_t size);
+void ngx_rtmp_aio_post(ngx_rtmp_aio_queue_t *q, ngx_rtmp_aio_op_t *op);
+
+
+#endif /* _NGX_RTMP_AIO_H_INCLUDED_ */
@@ -7,10 +7,14 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include "ngx_rtmp_cmd_module.h"
+#include "ngx_rtmp_codec_module.h"
 #include "ngx_rtmp_relay_module.h"
+#include "ngx_rtmp_streams.h"
+#include "ngx_rtmp_bus.h"
 
 
 static ngx_rtmp_publish_pt          next_publish;
+static ngx_rtmp_play_pt             next_play;
 static ngx_rtmp_delete_stream_pt    next_delete_stream;
 
 
@@ -18,11 +22,19 @@ static ngx_int_t ngx_rtmp_auto_push_init_process(ngx_cycle_t *cycle);
 static void ngx_rtmp_auto_push_exit_process(ngx_cycle_t *cycle);
 static void * ngx_rtmp_auto_push_create_conf(ngx_cycle_t *cf);
 static char * ngx_rtmp_auto_push_init_conf(ngx_cycle_t *cycle, void *conf);
+static char *ngx_rtmp_auto_push_bus(ngx_conf_t *cf, ngx_command_t *cmd,
+       void *conf);
+static ngx_int_t ngx_rtmp_auto_push_postconfiguration(ngx_conf_t *cf);
 #if (NGX_HAVE_UNIX_DOMAIN)
 static ngx_int_t ngx_rtmp_auto_push_publish(ngx_rtmp_session_t *s,
        ngx_rtmp_publish_t *v);
+static ngx_int_t ngx_rtmp_auto_push_play(ngx_rtmp_session_t *s,
+       ngx_rtmp_play_t *v);
 static ngx_int_t ngx_rtmp_auto_push_delete_stream(ngx_rtmp_session_t *s,
        ngx_rtmp_delete_stream_t *v);
+static ngx_int_t ngx_rtmp_auto_push_bus_av(ngx_rtmp_session_t *s,
+       ngx_rtmp_header_t *h, ngx_chain_t *in);
+static void ngx_rtmp_auto_push_bus_poll(ngx_event_t *ev);
 #endif
 
 
@@ -33,6 +45,16 @@ struct ngx_rtmp_auto_push_ctx_s {
     u_char                          name[NGX_RTMP_MAX_NAME];
     u_char                          args[NGX_RTMP_MAX_ARGS];
     ngx_event_t                     push_evt;
+
+    /* publisher: media written to the bus */
+    ngx_rtmp_bus_ring_t            *ring;
+
+    /* auto pushed session: media read from the bus */
+    ngx_rtmp_bus_reader_t           reader;
+    ngx_event_t                     bus_evt;
+    u_char                         *buf;
+    size_t                          buf_size;
+    unsigned                        synced:1;
 };
 
 
@@ -40,6 +62,9 @@ typedef struct {
     ngx_flag_t                      auto_push;
     ngx_str_t                       socket_dir;
     ngx_msec_t                      push_reconnect;
+    ngx_rtmp_bus_t                 *bus;
+    size_t                          bus_ring;
+    ngx_msec_t                      bus_poll;
 } ngx_rtmp_auto_push_conf_t;
 
 
@@ -66,6 +91,27 @@ static ngx_command_t  ngx_rtmp_auto_push_commands[] = {
       offsetof(ngx_rtmp_auto_push_conf_t, socket_dir),
       NULL },
 
+    { ngx_string("rtmp_auto_push_bus"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_rtmp_auto_push_bus,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("rtmp_auto_push_bus_ring"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(ngx_rtmp_auto_push_conf_t, bus_ring),
+      NULL },
+
+    { ngx_string("rtmp_auto_push_bus_poll"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      0,
+      offsetof(ngx_rtmp_auto_push_conf_t, bus_poll),
+      NULL },
+
       ngx_null_command
 };
 
@@ -95,7 +141,7 @@ ngx_module_t  ngx_rtmp_auto_push_module = {
 
 static ngx_rtmp_module_t  ngx_rtmp_auto_push_index_module_ctx = {
     NULL,                                   /* preconfiguration */
-    NULL,                                   /* postconfiguration */
+    ngx_rtmp_auto_push_postconfiguration,   /* postconfiguration */
     NULL,                                   /* create main configuration */
     NULL,                                   /* init main configuration */
     NULL,                                   /* create server configuration */
@@ -152,6 +198,11 @@ ngx_rtmp_auto_push_init_process(ngx_cycle_t *cycle)
     next_delete_stream = ngx_rtmp_delete_stream;
     ngx_rtmp_delete_stream = ngx_rtmp_auto_push_delete_stream;
 
+    if (apcf->bus) {
+        next_play = ngx_rtmp_play;
+        ngx_rtmp_play = ngx_rtmp_auto_push_play;
+    }
+
     reuseaddr = 1;
     s = (ngx_socket_t) -1;
 
@@ -303,6 +354,8 @@ ngx_rtmp_auto_push_create_conf(ngx_cycle_t *cycle)
 
     apcf->auto_push = NGX_CONF_UNSET;
     apcf->push_reconnect = NGX_CONF_UNSET_MSEC;
+    apcf->bus_ring = NGX_CONF_UNSET_SIZE;
+    apcf->bus_poll = NGX_CONF_UNSET_MSEC;
 
     return apcf;
 }
@@ -313,6 +366,10 @@ ngx_rtmp_auto_push_init_conf(ngx_cycle_t *cycle, void *conf)
 {
     ngx_rtmp_auto_push_conf_t      *apcf = conf;
 
+    size_t                          size;
+    ngx_uint_t                      n;
+    ngx_rtmp_core_srv_conf_t      **cscfp;
+
     ngx_conf_init_value(apcf->auto_push, 0);
     ngx_conf_init_msec_value(apcf->push_reconnect, 100);
 
@@ -320,10 +377,106 @@ ngx_rtmp_auto_push_init_conf(ngx_cycle_t *cycle, void *conf)
         ngx_str_set(&apcf->socket_dir, "/tmp");
     }
 
+    ngx_conf_init_size_value(apcf->bus_ring, NGX_RTMP_BUS_RING_SIZE);
+    ngx_conf_init_msec_value(apcf->bus_poll, 10);
+
+    if (apcf->bus == NULL) {
+        return NGX_CONF_OK;
+    }
+
+    /* every message a publisher may send has to fit in the ring */
+
+    if (ngx_rtmp_core_main_conf) {
+        cscfp = ngx_rtmp_core_main_conf->servers.elts;
+
+        for (n = 0; n < ngx_rtmp_core_main_conf->servers.nelts; n++) {
+            size = ngx_rtmp_bus_ring_min(cscfp[n]->max_message);
+
+            if (apcf->bus_ring < size) {
+                ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                              "\"rtmp_auto_push_bus_ring\" is raised to %uz "
+                              "to fit \"max_message\" %uz",
+                              size, cscfp[n]->max_message);
+
+                apcf->bus_ring = size;
+            }
+        }
+    }
+
+    apcf->bus->ring_size = apcf->bus_ring;
+
     return NGX_CONF_OK;
 }
 
 
+static char *
+ngx_rtmp_auto_push_bus(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_rtmp_auto_push_conf_t      *apcf = conf;
+
+    ssize_t                         size;
+    ngx_str_t                      *value, name;
+
+    if (apcf->bus) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    size = ngx_parse_size(&value[1]);
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid bus size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_set(&name, "rtmp_auto_push_bus");
+
+    apcf->bus = ngx_rtmp_bus_add(cf, &name, size, &ngx_rtmp_auto_push_module);
+    if (apcf->bus == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_auto_push_postconfiguration(ngx_conf_t *cf)
+{
+#if (NGX_HAVE_UNIX_DOMAIN)
+    ngx_rtmp_core_main_conf_t      *cmcf;
+    ngx_rtmp_handler_pt            *h;
+
+    cmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_core_module);
+
+    h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_AUDIO]);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+    *h = ngx_rtmp_auto_push_bus_av;
+
+    h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_VIDEO]);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+    *h = ngx_rtmp_auto_push_bus_av;
+
+    h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_AMF_META]);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+    *h = ngx_rtmp_auto_push_bus_av;
+#endif
+
+    return NGX_OK;
+}
+
+
 #if (NGX_HAVE_UNIX_DOMAIN)
 static void
 ngx_rtmp_auto_push_reconnect(ngx_event_t *ev)
@@ -473,18 +626,238 @@ ngx_rtmp_auto_push_reconnect(ngx_event_t *ev)
 }
 
 
+static void
+ngx_rtmp_auto_push_bus_name(ngx_rtmp_session_t *s, u_char *stream,
+    ngx_str_t *name, u_char *buf)
+{
+    name->data = buf;
+    name->len = ngx_snprintf(buf, NGX_RTMP_MAX_NAME - 1, "%V/%s",
+                             &s->app, stream) - buf;
+    buf[name->len] = '\0';
+}
+
+
+static void
+ngx_rtmp_auto_push_bus_dispatch(ngx_rtmp_session_t *s,
+    ngx_rtmp_bus_rec_t *rec, u_char *data)
+{
+    ngx_buf_t                       b;
+    ngx_chain_t                     cl;
+    ngx_rtmp_header_t               h;
+
+    ngx_memzero(&h, sizeof(h));
+
+    h.type = (uint8_t) rec->type;
+    h.timestamp = rec->timestamp;
+    h.mlen = rec->mlen;
+    h.msid = NGX_RTMP_MSID;
+
+    switch (h.type) {
+    case NGX_RTMP_MSG_AUDIO:
+        h.csid = NGX_RTMP_CSID_AUDIO;
+        break;
+    case NGX_RTMP_MSG_VIDEO:
+        h.csid = NGX_RTMP_CSID_VIDEO;
+        break;
+    default:
+        h.csid = NGX_RTMP_CSID_AMF;
+    }
+
+    ngx_memzero(&b, sizeof(b));
+
+    b.start = b.pos = data;
+    b.end = b.last = data + rec->mlen;
+    b.memory = 1;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    ngx_rtmp_receive_message(s, &h, &cl);
+}
+
+
+static void
+ngx_rtmp_auto_push_bus_sync(ngx_rtmp_session_t *s,
+    ngx_rtmp_auto_push_ctx_t *ctx)
+{
+    u_char                         *p, *last;
+    ssize_t                         n;
+    ngx_rtmp_bus_rec_t              rec;
+    ngx_rtmp_auto_push_conf_t      *apcf;
+
+    apcf = (ngx_rtmp_auto_push_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                                    ngx_rtmp_auto_push_module);
+
+    n = ngx_rtmp_bus_sync(apcf->bus, &ctx->reader, ctx->buf, ctx->buf_size);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "auto_push: bus sync headers=%z overruns=%ui",
+                   n, ctx->reader.overruns);
+
+    /* the sticky records are not aligned, copy headers out */
+
+    for (p = ctx->buf, last = ctx->buf + n;
+         last - p >= (ssize_t) sizeof(rec);
+         p += sizeof(rec) + rec.mlen)
+    {
+        ngx_memcpy(&rec, p, sizeof(rec));
+
+        if ((size_t) (last - p) - sizeof(rec) < rec.mlen) {
+            break;
+        }
+
+        ngx_rtmp_auto_push_bus_dispatch(s, &rec, p + sizeof(rec));
+    }
+
+    ctx->synced = 1;
+}
+
+
+static void
+ngx_rtmp_auto_push_bus_poll(ngx_event_t *ev)
+{
+    ngx_rtmp_session_t             *s = ev->data;
+
+    ngx_int_t                       rc;
+    ngx_rtmp_bus_rec_t              rec;
+    ngx_rtmp_auto_push_ctx_t       *ctx;
+    ngx_rtmp_auto_push_conf_t      *apcf;
+
+    apcf = (ngx_rtmp_auto_push_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                                    ngx_rtmp_auto_push_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_auto_push_index_module);
+    if (ctx == NULL || ctx->reader.ring == NULL) {
+        return;
+    }
+
+    if (!ctx->synced) {
+        ngx_rtmp_auto_push_bus_sync(s, ctx);
+    }
+
+    for ( ;; ) {
+        if (s->connection->destroyed) {
+            return;
+        }
+
+        rc = ngx_rtmp_bus_read(&ctx->reader, &rec, ctx->buf, ctx->buf_size);
+
+        if (rc == NGX_OK) {
+            ngx_rtmp_auto_push_bus_dispatch(s, &rec, ctx->buf);
+            continue;
+        }
+
+        if (rc == NGX_DECLINED) {
+            ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                          "auto_push: bus reader overrun, name='%s'",
+                          ctx->name);
+            ngx_rtmp_auto_push_bus_sync(s, ctx);
+            continue;
+        }
+
+        break;
+    }
+
+    if (rc == NGX_DONE) {
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "auto_push: bus closed, name='%s'", ctx->name);
+        return;
+    }
+
+    ngx_add_timer(ev, apcf->bus_poll);
+}
+
+
+static ngx_int_t
+ngx_rtmp_auto_push_bus_attach(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
+{
+    ngx_rtmp_auto_push_conf_t      *apcf;
+    ngx_rtmp_auto_push_ctx_t       *ctx;
+    ngx_rtmp_core_srv_conf_t       *cscf;
+    ngx_str_t                       name;
+    u_char                          buf[NGX_RTMP_MAX_NAME];
+
+    apcf = (ngx_rtmp_auto_push_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                                    ngx_rtmp_auto_push_module);
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_auto_push_index_module);
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(s->connection->pool,
+                          sizeof(ngx_rtmp_auto_push_ctx_t));
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+        ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_auto_push_index_module);
+    }
+
+    if (ctx->reader.ring) {
+        return NGX_OK;
+    }
+
+    ngx_rtmp_auto_push_bus_name(s, v->name, &name, buf);
+
+    if (ngx_rtmp_bus_attach(apcf->bus, &name, &ctx->reader) != NGX_OK) {
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "auto_push: no bus ring for '%V'", &name);
+        return NGX_DECLINED;
+    }
+
+    if (ctx->buf == NULL) {
+        ctx->buf_size = cscf->max_message;
+        ctx->buf = ngx_palloc(s->connection->pool, ctx->buf_size);
+        if (ctx->buf == NULL) {
+            ngx_rtmp_bus_release(apcf->bus, ctx->reader.ring, 0);
+            ctx->reader.ring = NULL;
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_memcpy(ctx->name, v->name, sizeof(ctx->name));
+
+    ctx->synced = 0;
+
+    ctx->bus_evt.data = s;
+    ctx->bus_evt.log = s->connection->log;
+    ctx->bus_evt.handler = ngx_rtmp_auto_push_bus_poll;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "auto_push: bus reader attached to '%V'", &name);
+
+    ngx_post_event(&ctx->bus_evt, &ngx_posted_events);
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_auto_push_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
 {
     ngx_rtmp_auto_push_conf_t      *apcf;
     ngx_rtmp_auto_push_ctx_t       *ctx;
+    ngx_int_t                       rc;
+    ngx_str_t                       name;
+    u_char                          buf[NGX_RTMP_MAX_NAME];
+
+    apcf = (ngx_rtmp_auto_push_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                                    ngx_rtmp_auto_push_module);
+
+    if (s->auto_pushed && apcf->bus) {
+        rc = next_publish(s, v);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+
+        if (ngx_rtmp_auto_push_bus_attach(s, v) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+    }
 
     if (s->auto_pushed || (s->relay && !s->static_relay)) {
         goto next;
     }
 
-    apcf = (ngx_rtmp_auto_push_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
-                                                    ngx_rtmp_auto_push_module);
     if (apcf->auto_push == 0) {
         goto next;
     }
@@ -498,6 +871,8 @@ ngx_rtmp_auto_push_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         }
         ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_auto_push_index_module);
 
+    } else if (ctx->ring) {
+        ngx_rtmp_bus_release(apcf->bus, ctx->ring, 1);
     }
     ngx_memzero(ctx, sizeof(*ctx));
 
@@ -514,6 +889,13 @@ ngx_rtmp_auto_push_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
     ngx_memcpy(ctx->name, v->name, sizeof(ctx->name));
     ngx_memcpy(ctx->args, v->args, sizeof(ctx->args));
 
+    /* the ring must exist before other workers accept the push */
+
+    if (apcf->bus) {
+        ngx_rtmp_auto_push_bus_name(s, v->name, &name, buf);
+        ctx->ring = ngx_rtmp_bus_create(apcf->bus, &name, s->connection->log);
+    }
+
     ngx_rtmp_auto_push_reconnect(&ctx->push_evt);
 
 next:
@@ -521,6 +903,104 @@ next:
 }
 
 
+static ngx_int_t
+ngx_rtmp_auto_push_play(ngx_rtmp_session_t *s, ngx_rtmp_play_t *v)
+{
+    ngx_rtmp_relay_ctx_t           *rctx;
+    ngx_rtmp_auto_push_ctx_t       *pctx;
+
+    if (!s->relay) {
+        goto next;
+    }
+
+    rctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_relay_module);
+    if (rctx == NULL ||
+        rctx->tag != &ngx_rtmp_auto_push_module ||
+        rctx->publish == NULL)
+    {
+        goto next;
+    }
+
+    pctx = ngx_rtmp_get_module_ctx(rctx->publish->session,
+                                   ngx_rtmp_auto_push_index_module);
+    if (pctx == NULL || pctx->ring == NULL) {
+        goto next;
+    }
+
+    /* media goes through the bus, the push connection stays idle */
+
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "auto_push: bus carries '%s', not joining stream",
+                   v->name);
+
+    return NGX_OK;
+
+next:
+    return next_play(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_auto_push_bus_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+    ngx_chain_t *in)
+{
+    ngx_rtmp_auto_push_conf_t      *apcf;
+    ngx_rtmp_auto_push_ctx_t       *ctx;
+    ngx_rtmp_codec_ctx_t           *codec_ctx;
+    ngx_uint_t                      flags;
+    ngx_buf_t                      *b;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_auto_push_index_module);
+    if (ctx == NULL || ctx->ring == NULL || in == NULL) {
+        return NGX_OK;
+    }
+
+    apcf = (ngx_rtmp_auto_push_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                                    ngx_rtmp_auto_push_module);
+
+    flags = 0;
+
+    switch (h->type) {
+    case NGX_RTMP_MSG_VIDEO:
+        if (ngx_rtmp_is_codec_header(in)) {
+            flags = NGX_RTMP_BUS_STICKY_VIDEO + 1;
+
+        } else if (ngx_rtmp_get_video_frame_type(in)
+                   == NGX_RTMP_VIDEO_KEY_FRAME)
+        {
+            flags = NGX_RTMP_BUS_KEY;
+        }
+        break;
+
+    case NGX_RTMP_MSG_AUDIO:
+        codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+        if (codec_ctx &&
+            codec_ctx->audio_codec_id == NGX_RTMP_AUDIO_AAC &&
+            ngx_rtmp_is_codec_header(in))
+        {
+            flags = NGX_RTMP_BUS_STICKY_AUDIO + 1;
+        }
+        break;
+
+    default:
+        b = in->buf;
+        if (ngx_strlcasestrn(b->pos, b->last, (u_char *) "onmetadata",
+                             sizeof("onmetadata") - 2))
+        {
+            flags = NGX_RTMP_BUS_STICKY_META + 1;
+        }
+    }
+
+    if (ngx_rtmp_bus_write(apcf->bus, ctx->ring, h, in, flags) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "auto_push: message too large for bus, "
+                      "type=%d mlen=%uD", (int) h->type, h->mlen);
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_auto_push_delete_stream(ngx_rtmp_session_t *s,
     ngx_rtmp_delete_stream_t *v)
@@ -541,6 +1021,25 @@ ngx_rtmp_auto_push_delete_stream(ngx_rtmp_session_t *s,
         if (ctx->push_evt.timer_set) {
             ngx_del_timer(&ctx->push_evt);
         }
+
+        if (ctx->bus_evt.timer_set) {
+            ngx_del_timer(&ctx->bus_evt);
+        }
+
+        if (ctx->bus_evt.posted) {
+            ngx_delete_posted_event(&ctx->bus_evt);
+        }
+
+        if (ctx->ring) {
+            ngx_rtmp_bus_release(apcf->bus, ctx->ring, 1);
+            ctx->ring = NULL;
+        }
+
+        if (ctx->reader.ring) {
+            ngx_rtmp_bus_release(apcf->bus, ctx->reader.ring, 0);
+            ctx->reader.ring = NULL;
+        }
+
         goto next;
     }
 
@@ -0,0 +1,463 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp_bus.h"
+
+
+static ngx_int_t ngx_rtmp_bus_init_zone(ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_rtmp_bus_copy_in(ngx_rtmp_bus_ring_t *ring,
+    ngx_atomic_uint_t pos, u_char *src, size_t n);
+static void ngx_rtmp_bus_copy_out(ngx_rtmp_bus_ring_t *ring,
+    ngx_atomic_uint_t pos, u_char *dst, size_t n);
+static void ngx_rtmp_bus_free_ring(ngx_rtmp_bus_t *bus,
+    ngx_rtmp_bus_ring_t *ring);
+static ngx_rtmp_bus_ring_t *ngx_rtmp_bus_find(ngx_rtmp_bus_t *bus,
+    ngx_str_t *name);
+
+
+ngx_rtmp_bus_t *
+ngx_rtmp_bus_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
+{
+    ngx_rtmp_bus_t  *bus;
+    ngx_shm_zone_t  *shm_zone;
+
+    bus = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_bus_t));
+    if (bus == NULL) {
+        return NULL;
+    }
+
+    bus->ring_size = NGX_RTMP_BUS_RING_SIZE;
+
+    shm_zone = ngx_shared_memory_add(cf, name, size, tag);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", name);
+        return NULL;
+    }
+
+    shm_zone->init = ngx_rtmp_bus_init_zone;
+    shm_zone->data = bus;
+
+    bus->shm_zone = shm_zone;
+
+    return bus;
+}
+
+
+static ngx_int_t
+ngx_rtmp_bus_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_rtmp_bus_t  *obus = data;
+
+    size_t           len;
+    ngx_rtmp_bus_t  *bus;
+
+    bus = shm_zone->data;
+
+    if (obus) {
+        bus->sh = obus->sh;
+        bus->shpool = obus->shpool;
+        return NGX_OK;
+    }
+
+    bus->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        bus->sh = bus->shpool->data;
+        return NGX_OK;
+    }
+
+    bus->sh = ngx_slab_calloc(bus->shpool, sizeof(ngx_rtmp_bus_sh_t));
+    if (bus->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    bus->shpool->data = bus->sh;
+
+    len = sizeof(" in rtmp bus zone \"\"") + shm_zone->shm.name.len;
+
+    bus->shpool->log_ctx = ngx_slab_alloc(bus->shpool, len);
+    if (bus->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(bus->shpool->log_ctx, " in rtmp bus zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+ngx_rtmp_bus_ring_t *
+ngx_rtmp_bus_create(ngx_rtmp_bus_t *bus, ngx_str_t *name, ngx_log_t *log)
+{
+    size_t                size;
+    ngx_rtmp_bus_ring_t  *ring, *r;
+
+    /* names are kept whole, a truncated one could match another stream */
+
+    if (name->len >= NGX_RTMP_MAX_NAME) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "bus: stream name \"%V\" is too long", name);
+        return NULL;
+    }
+
+    for (size = ngx_pagesize; size < bus->ring_size; size <<= 1) {
+        /* void */
+    }
+
+    ngx_shmtx_lock(&bus->shpool->mutex);
+
+    /* a republished stream takes over from the previous publisher */
+
+    while ((r = ngx_rtmp_bus_find(bus, name)) != NULL) {
+        r->closed = 1;
+    }
+
+    ring = ngx_slab_calloc_locked(bus->shpool, sizeof(ngx_rtmp_bus_ring_t));
+    if (ring == NULL) {
+        goto failed;
+    }
+
+    ring->data = ngx_slab_alloc_locked(bus->shpool, size);
+    if (ring->data == NULL) {
+        ngx_slab_free_locked(bus->shpool, ring);
+        goto failed;
+    }
+
+    ngx_cpystrn(ring->name, name->data, name->len + 1);
+
+    ring->size = size;
+    ring->refs = 1;
+
+    ring->next = bus->sh->rings;
+    bus->sh->rings = ring;
+
+    ngx_shmtx_unlock(&bus->shpool->mutex);
+
+    return ring;
+
+failed:
+
+    ngx_shmtx_unlock(&bus->shpool->mutex);
+
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+                  "bus: no memory for stream \"%V\", ring size %uz",
+                  name, size);
+
+    return NULL;
+}
+
+
+ngx_int_t
+ngx_rtmp_bus_attach(ngx_rtmp_bus_t *bus, ngx_str_t *name,
+    ngx_rtmp_bus_reader_t *rd)
+{
+    ngx_rtmp_bus_ring_t  *r;
+
+    if (name->len >= NGX_RTMP_MAX_NAME) {
+        return NGX_DECLINED;
+    }
+
+    ngx_shmtx_lock(&bus->shpool->mutex);
+
+    r = ngx_rtmp_bus_find(bus, name);
+    if (r) {
+        r->refs++;
+    }
+
+    ngx_shmtx_unlock(&bus->shpool->mutex);
+
+    if (r == NULL) {
+        return NGX_DECLINED;
+    }
+
+    rd->ring = r;
+    rd->pos = r->head;
+    rd->overruns = 0;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_rtmp_bus_release(ngx_rtmp_bus_t *bus, ngx_rtmp_bus_ring_t *ring,
+    ngx_uint_t producer)
+{
+    ngx_rtmp_bus_ring_t  **rr;
+
+    ngx_shmtx_lock(&bus->shpool->mutex);
+
+    if (producer) {
+        ring->closed = 1;
+    }
+
+    if (--ring->refs == 0 && ring->closed) {
+        for (rr = &bus->sh->rings; *rr; rr = &(*rr)->next) {
+            if (*rr == ring) {
+                *rr = ring->next;
+                break;
+            }
+        }
+
+        ngx_rtmp_bus_free_ring(bus, ring);
+    }
+
+    ngx_shmtx_unlock(&bus->shpool->mutex);
+}
+
+
+/* under shpool mutex, name->len is below NGX_RTMP_MAX_NAME */
+
+static ngx_rtmp_bus_ring_t *
+ngx_rtmp_bus_find(ngx_rtmp_bus_t *bus, ngx_str_t *name)
+{
+    ngx_rtmp_bus_ring_t  *r;
+
+    for (r = bus->sh->rings; r; r = r->next) {
+        if (!r->closed && ngx_strncmp(r->name, name->data, name->len) == 0
+            && r->name[name->len] == '\0')
+        {
+            return r;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_rtmp_bus_free_ring(ngx_rtmp_bus_t *bus, ngx_rtmp_bus_ring_t *ring)
+{
+    ngx_uint_t  n;
+
+    for (n = 0; n < NGX_RTMP_BUS_STICKY_MAX; n++) {
+        if (ring->sticky[n]) {
+            ngx_slab_free_locked(bus->shpool, ring->sticky[n]);
+        }
+    }
+
+    ngx_slab_free_locked(bus->shpool, ring->data);
+    ngx_slab_free_locked(bus->shpool, ring);
+}
+
+
+ngx_int_t
+ngx_rtmp_bus_write(ngx_rtmp_bus_t *bus, ngx_rtmp_bus_ring_t *ring,
+    ngx_rtmp_header_t *h, ngx_chain_t *in, ngx_uint_t flags)
+{
+    u_char               *p;
+    size_t                mlen, n;
+    ngx_uint_t            slot;
+    ngx_chain_t          *cl;
+    ngx_atomic_uint_t     pos, wpos;
+    ngx_rtmp_bus_rec_t    rec;
+
+    mlen = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        mlen += cl->buf->last - cl->buf->pos;
+    }
+
+    n = ngx_rtmp_bus_rec_size(mlen);
+
+    if (n > ring->size / 2) {
+        return NGX_DECLINED;
+    }
+
+    rec.mlen = (uint32_t) mlen;
+    rec.timestamp = h->timestamp;
+    rec.type = h->type;
+    rec.reserved = 0;
+
+    pos = ring->head;
+
+    /* readers treat everything up to reserve as overwritten */
+
+    ring->reserve = pos + n;
+    ngx_memory_barrier();
+
+    ngx_rtmp_bus_copy_in(ring, pos, (u_char *) &rec, sizeof(rec));
+    wpos = pos + sizeof(rec);
+
+    for (cl = in; cl; cl = cl->next) {
+        ngx_rtmp_bus_copy_in(ring, wpos, cl->buf->pos,
+                             cl->buf->last - cl->buf->pos);
+        wpos += cl->buf->last - cl->buf->pos;
+    }
+
+    ngx_memory_barrier();
+    ring->head = pos + n;
+
+    if (flags & NGX_RTMP_BUS_KEY) {
+        ring->key = pos;
+        ring->has_key = 1;
+    }
+
+    slot = flags & 0x0f;
+
+    if (slot == 0 || slot > NGX_RTMP_BUS_STICKY_MAX) {
+        return NGX_OK;
+    }
+
+    slot--;
+
+    /* sticky copies are rare (metadata and codec headers), lock them */
+
+    ngx_shmtx_lock(&bus->shpool->mutex);
+
+    if (ring->sticky[slot]) {
+        ngx_slab_free_locked(bus->shpool, ring->sticky[slot]);
+        ring->sticky[slot] = NULL;
+        ring->sticky_len[slot] = 0;
+    }
+
+    p = ngx_slab_alloc_locked(bus->shpool, sizeof(rec) + mlen);
+
+    if (p) {
+        ring->sticky[slot] = p;
+        ring->sticky_len[slot] = sizeof(rec) + mlen;
+
+        p = ngx_cpymem(p, &rec, sizeof(rec));
+
+        for (cl = in; cl; cl = cl->next) {
+            p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+        }
+    }
+
+    ngx_shmtx_unlock(&bus->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+ssize_t
+ngx_rtmp_bus_sync(ngx_rtmp_bus_t *bus, ngx_rtmp_bus_reader_t *rd,
+    u_char *buf, size_t size)
+{
+    u_char               *p;
+    ngx_uint_t            n;
+    ngx_atomic_uint_t     head, key;
+    ngx_rtmp_bus_ring_t  *ring;
+
+    ring = rd->ring;
+    p = buf;
+
+    ngx_shmtx_lock(&bus->shpool->mutex);
+
+    for (n = 0; n < NGX_RTMP_BUS_STICKY_MAX; n++) {
+        if (ring->sticky[n] && ring->sticky_len[n] <= size - (p - buf)) {
+            p = ngx_cpymem(p, ring->sticky[n], ring->sticky_len[n]);
+        }
+    }
+
+    ngx_shmtx_unlock(&bus->shpool->mutex);
+
+    head = ring->head;
+    ngx_memory_barrier();
+    key = ring->key;
+
+    if (ring->has_key && head - key <= ring->size) {
+        rd->pos = key;
+
+    } else {
+        rd->pos = head;
+    }
+
+    return p - buf;
+}
+
+
+ngx_int_t
+ngx_rtmp_bus_read(ngx_rtmp_bus_reader_t *rd, ngx_rtmp_bus_rec_t *rec,
+    u_char *buf, size_t size)
+{
+    size_t                n;
+    ngx_atomic_uint_t     head;
+    ngx_rtmp_bus_ring_t  *ring;
+
+    ring = rd->ring;
+
+    for ( ;; ) {
+        head = ring->head;
+        ngx_memory_barrier();
+
+        if (rd->pos == head) {
+            return ring->closed ? NGX_DONE : NGX_AGAIN;
+        }
+
+        if (head - rd->pos > ring->size) {
+            break;
+        }
+
+        ngx_rtmp_bus_copy_out(ring, rd->pos, (u_char *) rec, sizeof(*rec));
+
+        n = ngx_rtmp_bus_rec_size(rec->mlen);
+
+        if (n > head - rd->pos) {
+            break;
+        }
+
+        if (rec->mlen <= size) {
+            ngx_rtmp_bus_copy_out(ring, rd->pos + sizeof(*rec), buf,
+                                  rec->mlen);
+        }
+
+        /* the copy is only valid if the producer has not reached it */
+
+        ngx_memory_barrier();
+
+        if (ring->reserve - rd->pos > ring->size) {
+            break;
+        }
+
+        rd->pos += n;
+
+        if (rec->mlen > size) {
+            continue;
+        }
+
+        return NGX_OK;
+    }
+
+    rd->overruns++;
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_rtmp_bus_copy_in(ngx_rtmp_bus_ring_t *ring, ngx_atomic_uint_t pos,
+    u_char *src, size_t n)
+{
+    size_t  off, len;
+
+    off = pos & (ring->size - 1);
+    len = ngx_min(n, ring->size - off);
+
+    ngx_memcpy(ring->data + off, src, len);
+    ngx_memcpy(ring->data, src + len, n - len);
+}
+
+
+static void
+ngx_rtmp_bus_copy_out(ngx_rtmp_bus_ring_t *ring, ngx_atomic_uint_t pos,
+    u_char *dst, size_t n)
+{
+    size_t  off, len;
+
+    off = pos & (ring->size - 1);
+    len = ngx_min(n, ring->size - off);
+
+    ngx_memcpy(dst, ring->data + off, len);
+    ngx_memcpy(dst + len, ring->data, n - len);
+}
@@ -0,0 +1,120 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#ifndef _NGX_RTMP_BUS_H_INCLUDED_
+#define _NGX_RTMP_BUS_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp.h"
+#include "ngx_rtmp_cmd_module.h"
+
+
+#define NGX_RTMP_BUS_RING_SIZE          (4 * 1024 * 1024)
+
+/* messages every reader needs before the first keyframe */
+#define NGX_RTMP_BUS_STICKY_META        0
+#define NGX_RTMP_BUS_STICKY_VIDEO       1
+#define NGX_RTMP_BUS_STICKY_AUDIO       2
+#define NGX_RTMP_BUS_STICKY_MAX         3
+
+#define NGX_RTMP_BUS_KEY                0x10
+
+
+typedef struct ngx_rtmp_bus_ring_s      ngx_rtmp_bus_ring_t;
+
+
+/* ring record header, followed by mlen bytes of message payload */
+typedef struct {
+    uint32_t                            mlen;
+    uint32_t                            timestamp;
+    uint32_t                            type;
+    uint32_t                            reserved;
+} ngx_rtmp_bus_rec_t;
+
+
+#define ngx_rtmp_bus_rec_size(mlen)                                          \
+    ngx_align(sizeof(ngx_rtmp_bus_rec_t) + (mlen), 8)
+
+/* a ring takes records of up to half its size */
+#define ngx_rtmp_bus_ring_min(mlen)     (2 * ngx_rtmp_bus_rec_size(mlen))
+
+
+/*
+ * Single producer, multiple consumer byte ring in shared memory.
+ * The producer announces the area it is about to overwrite in
+ * "reserve" and publishes it in "head"; readers keep their own
+ * positions and detect overruns by comparing against "reserve" after
+ * copying, so neither side ever takes a lock on the data path.
+ */
+struct ngx_rtmp_bus_ring_s {
+    ngx_rtmp_bus_ring_t                *next;
+    u_char                              name[NGX_RTMP_MAX_NAME];
+
+    ngx_uint_t                          refs;      /* under shpool mutex */
+    ngx_atomic_t                        closed;
+
+    ngx_atomic_t                        reserve;
+    ngx_atomic_t                        head;
+    ngx_atomic_t                        key;       /* last keyframe record */
+    ngx_atomic_t                        has_key;
+
+    u_char                             *sticky[NGX_RTMP_BUS_STICKY_MAX];
+    size_t                              sticky_len[NGX_RTMP_BUS_STICKY_MAX];
+
+    size_t                              size;      /* power of 2 */
+    u_char                             *data;
+};
+
+
+typedef struct {
+    ngx_rtmp_bus_ring_t                *rings;
+} ngx_rtmp_bus_sh_t;
+
+
+typedef struct {
+    ngx_rtmp_bus_sh_t                  *sh;
+    ngx_slab_pool_t                    *shpool;
+    ngx_shm_zone_t                     *shm_zone;
+    size_t                              ring_size;
+} ngx_rtmp_bus_t;
+
+
+typedef struct {
+    ngx_rtmp_bus_ring_t                *ring;
+    ngx_atomic_uint_t                   pos;
+    ngx_uint_t                          overruns;
+} ngx_rtmp_bus_reader_t;
+
+
+ngx_rtmp_bus_t *ngx_rtmp_bus_add(ngx_conf_t *cf, ngx_str_t *name,
+    size_t size, void *tag);
+
+/* names of NGX_RTMP_MAX_NAME bytes or more are refused */
+ngx_rtmp_bus_ring_t *ngx_rtmp_bus_create(ngx_rtmp_bus_t *bus,
+    ngx_str_t *name, ngx_log_t *log);
+ngx_int_t ngx_rtmp_bus_attach(ngx_rtmp_bus_t *bus, ngx_str_t *name,
+    ngx_rtmp_bus_reader_t *rd);
+void ngx_rtmp_bus_release(ngx_rtmp_bus_t *bus, ngx_rtmp_bus_ring_t *ring,
+    ngx_uint_t producer);
+
+/* flags: NGX_RTMP_BUS_KEY and/or (sticky slot + 1) in the low bits */
+ngx_int_t ngx_rtmp_bus_write(ngx_rtmp_bus_t *bus, ngx_rtmp_bus_ring_t *ring,
+    ngx_rtmp_header_t *h, ngx_chain_t *in, ngx_uint_t flags);
+
+/* positions the reader at the last keyframe and returns the sticky
+ * messages to replay before it, as records in buf */
+ssize_t ngx_rtmp_bus_sync(ngx_rtmp_bus_t *bus, ngx_rtmp_bus_reader_t *rd,
+    u_char *buf, size_t size);
+
+/* NGX_OK: one record in rec/buf, NGX_AGAIN: nothing new,
+ * NGX_DECLINED: reader was overrun and must sync, NGX_DONE: closed */
+ngx_int_t ngx_rtmp_bus_read(ngx_rtmp_bus_reader_t *rd,
+    ngx_rtmp_bus_rec_t *rec, u_char *buf, size_t size);
+
+
+#endif /* _NGX_RTMP_BUS_H_INCLUDED_ */
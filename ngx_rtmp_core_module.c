@@ -10,6 +10,8 @@
 #include <ngx_event.h>
 #include <nginx.h>
 #include "ngx_rtmp.h"
+#include "ngx_rtmp_steer.h"
+#include "ngx_rtmp_ssl_module.h"
 
 
 static ngx_int_t ngx_rtmp_core_preconfiguration(ngx_conf_t *cf);
@@ -162,6 +164,34 @@ static ngx_command_t  ngx_rtmp_core_commands[] = {
       offsetof(ngx_rtmp_core_srv_conf_t, out_cork),
       NULL },
 
+    { ngx_string("out_queue_size"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_core_srv_conf_t, out_queue_size),
+      NULL },
+
+    { ngx_string("out_queue_duration"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_core_srv_conf_t, out_queue_duration),
+      NULL },
+
+    { ngx_string("out_vectored"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_core_srv_conf_t, out_vectored),
+      NULL },
+
+    { ngx_string("in_bulk"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_core_srv_conf_t, in_bulk),
+      NULL },
+
     { ngx_string("busy"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_flag_slot,
@@ -361,6 +391,10 @@ ngx_rtmp_core_create_srv_conf(ngx_conf_t *cf)
     conf->max_message = NGX_CONF_UNSET_SIZE;
     conf->out_queue = NGX_CONF_UNSET_SIZE;
     conf->out_cork = NGX_CONF_UNSET_SIZE;
+    conf->out_queue_size = NGX_CONF_UNSET_SIZE;
+    conf->out_queue_duration = NGX_CONF_UNSET_MSEC;
+    conf->out_vectored = NGX_CONF_UNSET;
+    conf->in_bulk = NGX_CONF_UNSET_SIZE;
     conf->play_time_fix = NGX_CONF_UNSET;
     conf->publish_time_fix = NGX_CONF_UNSET;
     conf->buflen = NGX_CONF_UNSET_MSEC;
@@ -395,6 +429,20 @@ ngx_rtmp_core_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->out_queue, prev->out_queue, 256);
     ngx_conf_merge_size_value(conf->out_cork, prev->out_cork,
             conf->out_queue / 8);
+    ngx_conf_merge_size_value(conf->out_queue_size, prev->out_queue_size,
+                              8 * 1024 * 1024);
+    ngx_conf_merge_msec_value(conf->out_queue_duration,
+                              prev->out_queue_duration, 10000);
+
+    /* a quarter of it is what the lowest priority gets */
+
+    if (conf->out_queue_duration && conf->out_queue_duration < 4) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"out_queue_duration\" must be at least 4ms");
+        return NGX_CONF_ERROR;
+    }
+    ngx_conf_merge_value(conf->out_vectored, prev->out_vectored, 0);
+    ngx_conf_merge_size_value(conf->in_bulk, prev->in_bulk, 0);
     ngx_conf_merge_value(conf->play_time_fix, prev->play_time_fix, 1);
     ngx_conf_merge_value(conf->publish_time_fix, prev->publish_time_fix, 1);
     ngx_conf_merge_msec_value(conf->buflen, prev->buflen, 1000);
@@ -704,7 +752,7 @@ ngx_rtmp_add_addresses(ngx_conf_t *cf, ngx_rtmp_core_srv_conf_t *cscf,
     ngx_uint_t             proxy_protocol;
 #endif
 
-    ngx_uint_t             i, default_server;
+    ngx_uint_t             i, default_server, steer, ssl;
     ngx_rtmp_conf_addr_t  *addr;
 
     /*
@@ -765,6 +813,8 @@ ngx_rtmp_add_addresses(ngx_conf_t *cf, ngx_rtmp_core_srv_conf_t *cscf,
 
         /* preserve default_server bit during listen options overwriting */
         default_server = addr[i].opt.default_server;
+        steer = lsopt->steer || addr[i].opt.steer;
+        ssl = lsopt->ssl || addr[i].opt.ssl;
 #if (nginx_version >= 1005012)
         proxy_protocol = lsopt->proxy_protocol || addr[i].opt.proxy_protocol;
 #endif
@@ -795,6 +845,8 @@ ngx_rtmp_add_addresses(ngx_conf_t *cf, ngx_rtmp_core_srv_conf_t *cscf,
         }
 
         addr[i].opt.default_server = default_server;
+        addr[i].opt.steer = steer;
+        addr[i].opt.ssl = ssl;
 #if (nginx_version >= 1005012)
         addr[i].opt.proxy_protocol = proxy_protocol;
 #endif
@@ -1377,11 +1429,42 @@ ngx_rtmp_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[n].data, "steer") == 0) {
+            lsopt.steer = 1;
+            continue;
+        }
+
+        if (ngx_strcmp(value[n].data, "ssl") == 0) {
+            lsopt.ssl = 1;
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[n]);
         return NGX_CONF_ERROR;
     }
 
+    if (lsopt.ssl) {
+        if (lsopt.steer) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"ssl\" cannot be used with \"steer\"");
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_rtmp_ssl_listen(cf);
+    }
+
+    if (lsopt.steer) {
+        if (lsopt.proxy_protocol) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"steer\" cannot be used with "
+                               "\"proxy_protocol\"");
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_rtmp_steer_enable(cf);
+    }
+
     if (ngx_rtmp_add_listen(cf, cscf, &lsopt) == NGX_OK) {
         return NGX_CONF_OK;
     }
@@ -0,0 +1,185 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp_expire.h"
+
+
+typedef struct {
+    ngx_queue_t                         queue;
+    time_t                              expire;
+    ngx_uint_t                          flags;
+    u_char                              path[1];
+} ngx_rtmp_expire_file_t;
+
+
+static void ngx_rtmp_expire_handler(ngx_event_t *ev);
+
+
+ngx_rtmp_expire_t *
+ngx_rtmp_expire_create(ngx_pool_t *pool, time_t age)
+{
+    ngx_rtmp_expire_t  *ex;
+
+    ex = ngx_pcalloc(pool, sizeof(ngx_rtmp_expire_t));
+    if (ex == NULL) {
+        return NULL;
+    }
+
+    ngx_queue_init(&ex->files);
+
+    ex->age = age;
+
+    ex->event.data = ex;
+    ex->event.handler = ngx_rtmp_expire_handler;
+    ex->event.cancelable = 1;
+
+    return ex;
+}
+
+
+static void
+ngx_rtmp_expire_insert(ngx_rtmp_expire_t *ex, ngx_rtmp_expire_file_t *f)
+{
+    ngx_queue_t             *q;
+    ngx_rtmp_expire_file_t  *p;
+
+    /* most files go to the tail, look for the place from there */
+
+    for (q = ngx_queue_last(&ex->files);
+         q != ngx_queue_sentinel(&ex->files);
+         q = ngx_queue_prev(q))
+    {
+        p = ngx_queue_data(q, ngx_rtmp_expire_file_t, queue);
+
+        if (p->expire <= f->expire) {
+            break;
+        }
+    }
+
+    ngx_queue_insert_after(q, &f->queue);
+}
+
+
+static void
+ngx_rtmp_expire_schedule(ngx_rtmp_expire_t *ex)
+{
+    ngx_rtmp_expire_file_t  *f;
+    time_t                   now;
+
+    if (ngx_queue_empty(&ex->files)) {
+        return;
+    }
+
+    f = ngx_queue_data(ngx_queue_head(&ex->files), ngx_rtmp_expire_file_t,
+                       queue);
+
+    now = ngx_time();
+
+    ex->event.log = ngx_cycle->log;
+
+    ngx_add_timer(&ex->event,
+                  (ngx_msec_t) (f->expire > now ? f->expire - now : 1) * 1000);
+}
+
+
+ngx_int_t
+ngx_rtmp_expire_add(ngx_rtmp_expire_t *ex, u_char *path, size_t len,
+    ngx_uint_t flags)
+{
+    ngx_rtmp_expire_file_t  *f;
+
+    f = ngx_alloc(sizeof(ngx_rtmp_expire_file_t) + len, ngx_cycle->log);
+    if (f == NULL) {
+        return NGX_ERROR;
+    }
+
+    *ngx_cpymem(f->path, path, len) = 0;
+
+    f->flags = flags;
+    f->expire = ngx_time() + ex->age;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                   "expire: add '%s' in %T", f->path, ex->age);
+
+    ngx_rtmp_expire_insert(ex, f);
+
+    if (!ex->event.timer_set || ngx_queue_head(&ex->files) == &f->queue) {
+        ngx_rtmp_expire_schedule(ex);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_expire_handler(ngx_event_t *ev)
+{
+    ngx_rtmp_expire_t       *ex;
+    ngx_rtmp_expire_file_t  *f;
+    ngx_queue_t             *q;
+    ngx_file_info_t          fi;
+    time_t                   now, mtime;
+
+    ex = ev->data;
+    now = ngx_time();
+
+    while (!ngx_queue_empty(&ex->files)) {
+        q = ngx_queue_head(&ex->files);
+        f = ngx_queue_data(q, ngx_rtmp_expire_file_t, queue);
+
+        if (f->expire > now) {
+            break;
+        }
+
+        ngx_queue_remove(q);
+
+        if (f->flags & NGX_RTMP_EXPIRE_DIR) {
+
+            /* fails while the stream is back and writes to it */
+
+            if (ngx_delete_dir(f->path) == NGX_FILE_ERROR) {
+                ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, ngx_errno,
+                               "expire: dir '%s' kept", f->path);
+            }
+
+            ngx_free(f);
+            continue;
+        }
+
+        if (ngx_file_info(f->path, &fi) == NGX_FILE_ERROR) {
+            ngx_free(f);
+            continue;
+        }
+
+        mtime = ngx_file_mtime(&fi);
+
+        if (mtime + ex->age > now) {
+            ngx_log_debug1(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                           "expire: '%s' modified, delayed", f->path);
+
+            f->expire = mtime + ex->age;
+            ngx_rtmp_expire_insert(ex, f);
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                       "expire: delete '%s' age=%T", f->path, now - mtime);
+
+        if (ngx_delete_file(f->path) == NGX_FILE_ERROR
+            && ngx_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_ERR, ev->log, ngx_errno,
+                          "expire: " ngx_delete_file_n " failed on '%s'",
+                          f->path);
+        }
+
+        ngx_free(f);
+    }
+
+    ngx_rtmp_expire_schedule(ex);
+}
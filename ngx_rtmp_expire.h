@@ -0,0 +1,41 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#ifndef _NGX_RTMP_EXPIRE_H_INCLUDED_
+#define _NGX_RTMP_EXPIRE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/* seconds between directory scans once files expire from the queue */
+#define NGX_RTMP_EXPIRE_RESCAN          3600
+
+/* removed once empty, its own time does not matter */
+#define NGX_RTMP_EXPIRE_DIR             0x01
+
+
+/*
+ * Files a worker has written, oldest first, each one deleted when it
+ * has not been modified for "age" seconds.  A file written again in
+ * the meantime is moved back by its new modification time, so the
+ * owner only has to add it once after finishing with it.
+ */
+typedef struct {
+    ngx_queue_t                         files;
+    ngx_event_t                         event;
+    time_t                              age;
+} ngx_rtmp_expire_t;
+
+
+ngx_rtmp_expire_t *ngx_rtmp_expire_create(ngx_pool_t *pool, time_t age);
+
+ngx_int_t ngx_rtmp_expire_add(ngx_rtmp_expire_t *ex, u_char *path,
+    size_t len, ngx_uint_t flags);
+
+
+#endif /* _NGX_RTMP_EXPIRE_H_INCLUDED_ */
@@ -12,6 +12,9 @@
 
 
 static ngx_int_t ngx_rtmp_flv_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_rtmp_flv_init_process(ngx_cycle_t *cycle);
+static void ngx_rtmp_flv_cache_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 static void ngx_rtmp_flv_read_meta(ngx_rtmp_session_t *s, ngx_file_t *f);
 static ngx_int_t ngx_rtmp_flv_timestamp_to_offset(ngx_rtmp_session_t *s,
        ngx_file_t *f, ngx_int_t timestamp);
@@ -21,6 +24,7 @@ static ngx_int_t ngx_rtmp_flv_start(ngx_rtmp_session_t *s, ngx_file_t *f);
 static ngx_int_t ngx_rtmp_flv_seek(ngx_rtmp_session_t *s, ngx_file_t *f,
        ngx_uint_t offset);
 static ngx_int_t ngx_rtmp_flv_stop(ngx_rtmp_session_t *s, ngx_file_t *f);
+static ngx_int_t ngx_rtmp_flv_done(ngx_rtmp_session_t *s, ngx_file_t *f);
 static ngx_int_t ngx_rtmp_flv_send(ngx_rtmp_session_t *s, ngx_file_t *f,
                                    ngx_uint_t *ts);
 
@@ -31,6 +35,27 @@ typedef struct {
 } ngx_rtmp_flv_index_t;
 
 
+typedef struct {
+    uint32_t                            timestamp;  /* msec */
+    off_t                               offset;
+} ngx_rtmp_flv_keyframe_t;
+
+
+/* keyframe table of a file, shared by the sessions playing it */
+typedef struct {
+    ngx_rbtree_node_t                   node;       /* key: inode */
+    ngx_queue_t                         queue;      /* least recent first */
+    uint64_t                            dev;
+    ngx_file_uniq_t                     uniq;
+    time_t                              mtime;
+    off_t                               size;
+    ngx_uint_t                          refs;
+    unsigned                            cached:1;
+    ngx_uint_t                          nelts;
+    ngx_rtmp_flv_keyframe_t            *elts;
+} ngx_rtmp_flv_keyframes_t;
+
+
 typedef struct {
     ngx_int_t                           offset;
     ngx_int_t                           start_timestamp;
@@ -41,8 +66,15 @@ typedef struct {
     uint32_t                            epoch;
 
     unsigned                            meta_read:1;
+    unsigned                            cacheable:1;
     ngx_rtmp_flv_index_t                filepositions;
     ngx_rtmp_flv_index_t                times;
+
+    uint64_t                            dev;
+    ngx_file_uniq_t                     uniq;
+    time_t                              mtime;
+    off_t                               size;
+    ngx_rtmp_flv_keyframes_t           *keyframes;
 } ngx_rtmp_flv_ctx_t;
 
 
@@ -51,6 +83,9 @@ typedef struct {
 #define NGX_RTMP_FLV_TAG_HEADER         11
 #define NGX_RTMP_FLV_DATA_OFFSET        13
 
+/* files whose keyframe tables are kept by a worker */
+#define NGX_RTMP_FLV_CACHE_FILES        256
+
 
 static u_char                           ngx_rtmp_flv_buffer[
                                         NGX_RTMP_FLV_BUFFER];
@@ -58,6 +93,12 @@ static u_char                           ngx_rtmp_flv_header[
                                         NGX_RTMP_FLV_TAG_HEADER];
 
 
+static ngx_rbtree_t                     ngx_rtmp_flv_cache;
+static ngx_rbtree_node_t                ngx_rtmp_flv_cache_sentinel;
+static ngx_queue_t                      ngx_rtmp_flv_cache_queue;
+static ngx_uint_t                       ngx_rtmp_flv_cache_files;
+
+
 static ngx_rtmp_module_t  ngx_rtmp_flv_module_ctx = {
     NULL,                                   /* preconfiguration */
     ngx_rtmp_flv_postconfiguration,         /* postconfiguration */
@@ -77,7 +118,7 @@ ngx_module_t  ngx_rtmp_flv_module = {
     NGX_RTMP_MODULE,                        /* module type */
     NULL,                                   /* init master */
     NULL,                                   /* init module */
-    NULL,                                   /* init process */
+    ngx_rtmp_flv_init_process,              /* init process */
     NULL,                                   /* init thread */
     NULL,                                   /* exit thread */
     NULL,                                   /* exit process */
@@ -86,6 +127,151 @@ ngx_module_t  ngx_rtmp_flv_module = {
 };
 
 
+static ngx_int_t
+ngx_rtmp_flv_init_process(ngx_cycle_t *cycle)
+{
+    ngx_rbtree_init(&ngx_rtmp_flv_cache, &ngx_rtmp_flv_cache_sentinel,
+                    ngx_rtmp_flv_cache_insert_value);
+    ngx_queue_init(&ngx_rtmp_flv_cache_queue);
+
+    ngx_rtmp_flv_cache_files = 0;
+
+    return NGX_OK;
+}
+
+
+/* files are ordered by inode, then by device */
+
+static void
+ngx_rtmp_flv_cache_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t         **p;
+    ngx_rtmp_flv_keyframes_t   *kf, *kft;
+
+    for ( ;; ) {
+
+        if (node->key != temp->key) {
+            p = (node->key < temp->key) ? &temp->left : &temp->right;
+
+        } else {
+            kf = (ngx_rtmp_flv_keyframes_t *) node;
+            kft = (ngx_rtmp_flv_keyframes_t *) temp;
+
+            p = (kf->dev < kft->dev) ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static void
+ngx_rtmp_flv_uncache(ngx_rtmp_flv_keyframes_t *kf)
+{
+    ngx_rbtree_delete(&ngx_rtmp_flv_cache, &kf->node);
+    ngx_queue_remove(&kf->queue);
+
+    ngx_rtmp_flv_cache_files--;
+    kf->cached = 0;
+
+    /* sessions still playing it keep it until they are done */
+
+    if (kf->refs == 0) {
+        ngx_free(kf);
+    }
+}
+
+
+static void
+ngx_rtmp_flv_release(ngx_rtmp_flv_keyframes_t *kf)
+{
+    if (--kf->refs == 0 && !kf->cached) {
+        ngx_free(kf);
+    }
+}
+
+
+static ngx_rtmp_flv_keyframes_t *
+ngx_rtmp_flv_cache_get(ngx_rtmp_flv_ctx_t *ctx)
+{
+    ngx_rbtree_key_t           key;
+    ngx_rbtree_node_t         *node, *sentinel;
+    ngx_rtmp_flv_keyframes_t  *kf;
+
+    key = (ngx_rbtree_key_t) ctx->uniq;
+
+    node = ngx_rtmp_flv_cache.root;
+    sentinel = ngx_rtmp_flv_cache.sentinel;
+
+    while (node != sentinel) {
+
+        if (key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        kf = (ngx_rtmp_flv_keyframes_t *) node;
+
+        if (ctx->dev != kf->dev) {
+            node = (ctx->dev < kf->dev) ? node->left : node->right;
+            continue;
+        }
+
+        if (kf->uniq != ctx->uniq || kf->mtime != ctx->mtime
+            || kf->size != ctx->size)
+        {
+            /* the file has been replaced since */
+            ngx_rtmp_flv_uncache(kf);
+            return NULL;
+        }
+
+        ngx_queue_remove(&kf->queue);
+        ngx_queue_insert_tail(&ngx_rtmp_flv_cache_queue, &kf->queue);
+
+        kf->refs++;
+
+        return kf;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_rtmp_flv_cache_add(ngx_rtmp_flv_keyframes_t *kf)
+{
+    ngx_queue_t  *q;
+
+    if (ngx_rtmp_flv_cache_files >= NGX_RTMP_FLV_CACHE_FILES) {
+        q = ngx_queue_head(&ngx_rtmp_flv_cache_queue);
+        ngx_rtmp_flv_uncache(ngx_queue_data(q, ngx_rtmp_flv_keyframes_t,
+                                            queue));
+    }
+
+    ngx_rbtree_insert(&ngx_rtmp_flv_cache, &kf->node);
+    ngx_queue_insert_tail(&ngx_rtmp_flv_cache_queue, &kf->queue);
+
+    ngx_rtmp_flv_cache_files++;
+    kf->cached = 1;
+}
+
+
 static ngx_int_t
 ngx_rtmp_flv_fill_index(ngx_rtmp_amf_ctx_t *ctx, ngx_rtmp_flv_index_t *idx)
 {
@@ -111,6 +297,92 @@ ngx_rtmp_flv_fill_index(ngx_rtmp_amf_ctx_t *ctx, ngx_rtmp_flv_index_t *idx)
 }
 
 
+static double
+ngx_rtmp_flv_index_value(void *src)
+{
+    double      v;
+
+    ngx_rtmp_rmemcpy(&v, src, 8);
+
+    return v;
+}
+
+
+/*
+ * Both arrays are within the metadata read at once, so the whole table
+ * is built right from it, however many keyframes there are.
+ */
+static ngx_rtmp_flv_keyframes_t *
+ngx_rtmp_flv_parse_keyframes(ngx_rtmp_session_t *s, ngx_buf_t *b)
+{
+    u_char                     *t, *p;
+    size_t                      size;
+    ngx_uint_t                  i, n;
+    ngx_rtmp_flv_ctx_t         *ctx;
+    ngx_rtmp_flv_keyframes_t   *kf;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_flv_module);
+
+    n = ngx_min(ctx->times.nelts, ctx->filepositions.nelts);
+    if (n == 0) {
+        return NULL;
+    }
+
+    size = b->last - b->pos;
+
+    if (ctx->times.offset + n * 9 > size
+        || ctx->filepositions.offset + n * 9 > size)
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "flv: keyframes index out of metadata");
+        return NULL;
+    }
+
+    kf = ngx_alloc(sizeof(ngx_rtmp_flv_keyframes_t)
+                   + n * sizeof(ngx_rtmp_flv_keyframe_t),
+                   s->connection->log);
+    if (kf == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(kf, sizeof(ngx_rtmp_flv_keyframes_t));
+
+    kf->node.key = (ngx_rbtree_key_t) ctx->uniq;
+    kf->dev = ctx->dev;
+    kf->uniq = ctx->uniq;
+    kf->mtime = ctx->mtime;
+    kf->size = ctx->size;
+    kf->refs = 1;
+    kf->elts = (ngx_rtmp_flv_keyframe_t *) (kf + 1);
+
+    /* strict arrays of AMF numbers, type byte first */
+
+    t = b->pos + ctx->times.offset;
+    p = b->pos + ctx->filepositions.offset;
+
+    for (i = 0; i < n; i++, t += 9, p += 9) {
+        if (t[0] != NGX_RTMP_AMF_NUMBER || p[0] != NGX_RTMP_AMF_NUMBER) {
+            break;
+        }
+
+        kf->elts[i].timestamp = (uint32_t)
+                                (ngx_rtmp_flv_index_value(t + 1) * 1000);
+        kf->elts[i].offset = (off_t) ngx_rtmp_flv_index_value(p + 1);
+    }
+
+    kf->nelts = i;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "flv: keyframes parsed nelts=%ui of %ui", kf->nelts, n);
+
+    if (ctx->cacheable) {
+        ngx_rtmp_flv_cache_add(kf);
+    }
+
+    return kf;
+}
+
+
 static ngx_int_t
 ngx_rtmp_flv_init_index(ngx_rtmp_session_t *s, ngx_chain_t *in)
 {
@@ -194,18 +466,15 @@ ngx_rtmp_flv_init_index(ngx_rtmp_session_t *s, ngx_chain_t *in)
                   "flv: times nelts=%ui offset=%ui",
                    ctx->times.nelts, ctx->times.offset);
 
-    return  NGX_OK;
-}
-
-
-static double
-ngx_rtmp_flv_index_value(void *src)
-{
-    double      v;
+    if (ctx->keyframes == NULL && ctx->cacheable) {
+        ctx->keyframes = ngx_rtmp_flv_cache_get(ctx);
+    }
 
-    ngx_rtmp_rmemcpy(&v, src, 8);
+    if (ctx->keyframes == NULL) {
+        ctx->keyframes = ngx_rtmp_flv_parse_keyframes(s, in->buf);
+    }
 
-    return v;
+    return  NGX_OK;
 }
 
 
@@ -213,10 +482,9 @@ static ngx_int_t
 ngx_rtmp_flv_timestamp_to_offset(ngx_rtmp_session_t *s, ngx_file_t *f,
     ngx_int_t timestamp)
 {
+    ngx_uint_t                      lo, hi, mid;
     ngx_rtmp_flv_ctx_t             *ctx;
-    ssize_t                         n, size;
-    ngx_uint_t                      offset, index, ret, nelts;
-    double                          v;
+    ngx_rtmp_flv_keyframes_t       *kf;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_flv_module);
 
@@ -233,71 +501,33 @@ ngx_rtmp_flv_timestamp_to_offset(ngx_rtmp_session_t *s, ngx_file_t *f,
         ctx->meta_read = 1;
     }
 
-    if (timestamp <= 0 || ctx->filepositions.nelts == 0
-                       || ctx->times.nelts == 0)
-    {
-        goto rewind;
-    }
-
-    /* read index table from file given offset */
-    offset = NGX_RTMP_FLV_DATA_OFFSET + NGX_RTMP_FLV_TAG_HEADER +
-             ctx->times.offset;
-
-    /* index should fit in the buffer */
-    nelts = ngx_min(ctx->times.nelts, sizeof(ngx_rtmp_flv_buffer) / 9);
-    size = nelts * 9;
+    kf = ctx->keyframes;
 
-    n = ngx_read_file(f, ngx_rtmp_flv_buffer, size, offset);
-
-    if (n != size) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                     "flv: could not read times index");
+    if (timestamp <= 0 || kf == NULL || kf->nelts == 0) {
         goto rewind;
     }
 
-    /*TODO: implement binary search */
-    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                  "flv: lookup times nelts=%ui", nelts);
+    /* the first keyframe past the timestamp, or the last one */
 
-    for (index = 0; index < nelts - 1; ++index) {
-        v = ngx_rtmp_flv_index_value(ngx_rtmp_flv_buffer +
-                                     index * 9 + 1) * 1000;
+    lo = 0;
+    hi = kf->nelts - 1;
 
-        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                      "flv: lookup times index=%ui value=%ui",
-                      index, (ngx_uint_t) v);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
 
-        if (timestamp < v) {
-            break;
-        }
-    }
+        if ((uint32_t) timestamp < kf->elts[mid].timestamp) {
+            hi = mid;
 
-    if (index >= ctx->filepositions.nelts) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                     "flv: index out of bounds: %ui>=%ui",
-                     index, ctx->filepositions.nelts);
-        goto rewind;
-    }
-
-    /* take value from filepositions */
-    offset = NGX_RTMP_FLV_DATA_OFFSET + NGX_RTMP_FLV_TAG_HEADER +
-             ctx->filepositions.offset + index * 9;
-
-    n = ngx_read_file(f, ngx_rtmp_flv_buffer, 8, offset + 1);
-
-    if (n != 8) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                     "flv: could not read filepositions index");
-        goto rewind;
+        } else {
+            lo = mid + 1;
+        }
     }
 
-    ret = (ngx_uint_t) ngx_rtmp_flv_index_value(ngx_rtmp_flv_buffer);
-
-    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                  "flv: lookup index timestamp=%i offset=%ui",
-                   timestamp, ret);
+    ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                  "flv: lookup index timestamp=%i offset=%O index=%ui",
+                   timestamp, kf->elts[lo].offset, lo);
 
-    return ret;
+    return (ngx_int_t) kf->elts[lo].offset;
 
 rewind:
     ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
@@ -556,6 +786,7 @@ static ngx_int_t
 ngx_rtmp_flv_init(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_int_t aindex,
                   ngx_int_t vindex)
 {
+    ngx_file_info_t                 fi;
     ngx_rtmp_flv_ctx_t             *ctx;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_flv_module);
@@ -568,10 +799,23 @@ ngx_rtmp_flv_init(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_int_t aindex,
         }
 
         ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_flv_module);
+
+    } else if (ctx->keyframes) {
+        ngx_rtmp_flv_release(ctx->keyframes);
     }
 
     ngx_memzero(ctx, sizeof(*ctx));
 
+    /* keyframe tables are cached per file version */
+
+    if (ngx_fd_info(f->fd, &fi) != NGX_FILE_ERROR) {
+        ctx->dev = ngx_rtmp_file_dev(&fi);
+        ctx->uniq = ngx_file_uniq(&fi);
+        ctx->mtime = ngx_file_mtime(&fi);
+        ctx->size = ngx_file_size(&fi);
+        ctx->cacheable = 1;
+    }
+
     return NGX_OK;
 }
 
@@ -638,6 +882,24 @@ ngx_rtmp_flv_stop(ngx_rtmp_session_t *s, ngx_file_t *f)
 }
 
 
+static ngx_int_t
+ngx_rtmp_flv_done(ngx_rtmp_session_t *s, ngx_file_t *f)
+{
+    ngx_rtmp_flv_ctx_t             *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_flv_module);
+
+    if (ctx == NULL || ctx->keyframes == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_rtmp_flv_release(ctx->keyframes);
+    ctx->keyframes = NULL;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_flv_postconfiguration(ngx_conf_t *cf)
 {
@@ -666,6 +928,7 @@ ngx_rtmp_flv_postconfiguration(ngx_conf_t *cf)
     ngx_str_set(&fmt->sfx, ".flv");
 
     fmt->init  = ngx_rtmp_flv_init;
+    fmt->done  = ngx_rtmp_flv_done;
     fmt->start = ngx_rtmp_flv_start;
     fmt->seek  = ngx_rtmp_flv_seek;
     fmt->stop  = ngx_rtmp_flv_stop;
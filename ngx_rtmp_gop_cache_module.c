@@ -31,6 +31,8 @@ static void ngx_rtmp_gop_cache_cleanup(ngx_rtmp_session_t *s);
 static void ngx_rtmp_gop_cache_update(ngx_rtmp_session_t *s);
 static void ngx_rtmp_gop_cache_frame(ngx_rtmp_session_t *s, ngx_uint_t prio,
     ngx_rtmp_header_t *ch, ngx_chain_t *frame);
+static ngx_chain_t *ngx_rtmp_gop_cache_encode(ngx_rtmp_session_t *s,
+    ngx_uint_t protocol, ngx_rtmp_gop_frame_t *gf);
 static void ngx_rtmp_gop_cache_send(ngx_rtmp_session_t *s);
 static ngx_int_t ngx_rtmp_gop_cache_av(ngx_rtmp_session_t *s,
     ngx_rtmp_header_t *h, ngx_chain_t *in);
@@ -199,6 +201,8 @@ ngx_rtmp_gop_cache_free_frame(ngx_rtmp_session_t *s,
         frame->frame = NULL;
     }
 
+    ngx_rtmp_live_pkt_free(s, &frame->pkt);
+
     if (frame->h.type == NGX_RTMP_MSG_VIDEO) {
         ctx->video_frame_in_all--;
     } else if (frame->h.type == NGX_RTMP_MSG_AUDIO) {
@@ -376,6 +380,8 @@ ngx_rtmp_gop_cache_cleanup(ngx_rtmp_session_t *s)
     ctx->audio_seq_header = NULL;
     ctx->meta = NULL;
 
+    ngx_rtmp_live_pkt_free(s, &ctx->meta_pkt);
+
     if (ctx->cache_head) {
         ctx->cache_head->next = ctx->free_cache;
         ctx->free_cache = ctx->cache_head;
@@ -484,10 +490,22 @@ ngx_rtmp_gop_cache_frame(ngx_rtmp_session_t *s, ngx_uint_t prio,
     gf->h = *ch;
     gf->prio = prio;
     gf->next = NULL;
+
+    /* the only copy of the frame: it leaves the receive buffers as a
+     * ready to send absolute RTMP message, other encodings are built
+     * from its payload on demand */
+
     gf->frame = ngx_rtmp_append_shared_bufs(cscf, NULL, frame);
+    if (gf->frame) {
+        ngx_rtmp_prepare_message(s, &gf->h, NULL, gf->frame);
+    }
 
     if (ngx_rtmp_gop_cache_link_frame(s, gf) != NGX_OK) {
-        ngx_rtmp_free_shared_chain(cscf, gf->frame);
+        if (gf->frame) {
+            ngx_rtmp_free_shared_chain(cscf, gf->frame);
+            gf->frame = NULL;
+        }
+
         return;
     }
 
@@ -517,6 +535,68 @@ ngx_rtmp_gop_cache_frame(ngx_rtmp_session_t *s, ngx_uint_t prio,
 }
 
 
+static ngx_chain_t *
+ngx_rtmp_gop_cache_encode(ngx_rtmp_session_t *s, ngx_uint_t protocol,
+    ngx_rtmp_gop_frame_t *gf)
+{
+    ngx_uint_t                          n, i;
+    ngx_buf_t                          *b;
+    ngx_chain_t                        *cl, *l, *pkt;
+
+    if (gf->frame == NULL) {
+        return NULL;
+    }
+
+    n = ngx_rtmp_live_pkt_variant(s, protocol);
+
+    if (n == NGX_RTMP_LIVE_PKT_RTMP) {
+        return gf->frame;
+    }
+
+    if (n == NGX_RTMP_LIVE_PKT_MAX) {
+        return NULL;
+    }
+
+    if (gf->pkt.chain[n]) {
+        return gf->pkt.chain[n];
+    }
+
+    /* a payload view of the cached message: shared buffers keep the
+     * payload right after the chunk header room */
+
+    for (i = 0, l = gf->frame; l; l = l->next) {
+        i++;
+    }
+
+    cl = ngx_alloc(i * (sizeof(ngx_chain_t) + sizeof(ngx_buf_t)),
+                   s->connection->log);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    b = (ngx_buf_t *) (cl + i);
+
+    for (i = 0, l = gf->frame; l; l = l->next, i++) {
+        ngx_memzero(&b[i], sizeof(ngx_buf_t));
+
+        b[i].start = l->buf->start + NGX_RTMP_MAX_CHUNK_HEADER;
+        b[i].pos = b[i].start;
+        b[i].last = l->buf->last;
+        b[i].end = b[i].last;
+        b[i].memory = 1;
+
+        cl[i].buf = &b[i];
+        cl[i].next = l->next ? &cl[i + 1] : NULL;
+    }
+
+    pkt = ngx_rtmp_live_pkt_get(s, protocol, &gf->pkt, &gf->h, NULL, cl);
+
+    ngx_free(cl);
+
+    return pkt;
+}
+
+
 static void
 ngx_rtmp_gop_cache_send(ngx_rtmp_session_t *s)
 {
@@ -529,7 +609,6 @@ ngx_rtmp_gop_cache_send(ngx_rtmp_session_t *s)
     ngx_rtmp_gop_cache_t               *cache;
     ngx_rtmp_gop_frame_t               *gf;
     ngx_rtmp_header_t                   ch, lh;
-    ngx_uint_t                          meta_version;
     uint32_t                            delta;
     ngx_int_t                           csidx;
     ngx_rtmp_live_chunk_stream_t       *cs;
@@ -549,11 +628,8 @@ ngx_rtmp_gop_cache_send(ngx_rtmp_session_t *s)
         return;
     }
 
-    pkt = NULL;
     apkt = NULL;
     header = NULL;
-    meta = NULL;
-    meta_version = 0;
 
     pub_ctx = ctx->stream->pub_ctx;
     rs = pub_ctx->session;
@@ -583,20 +659,15 @@ ngx_rtmp_gop_cache_send(ngx_rtmp_session_t *s)
             }
         }
 
-        if (meta == NULL && meta_version != gctx->meta_version) {
-            meta = handler->meta_message_pt(s, gctx->meta);
+        /* send metadata */
+        if (gctx->meta && gctx->meta_version != ctx->meta_version) {
+            meta = ngx_rtmp_live_pkt_get(s, ctx->protocol, &gctx->meta_pkt,
+                                         NULL, NULL, gctx->meta);
             if (meta == NULL) {
                 ngx_rtmp_finalize_session(s);
                 return;
             }
-        }
 
-        if (meta) {
-            meta_version = gctx->meta_version;
-        }
-
-        /* send metadata */
-        if (meta && meta_version != ctx->meta_version) {
             ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                     "gop cache send: meta");
 
@@ -605,8 +676,7 @@ ngx_rtmp_gop_cache_send(ngx_rtmp_session_t *s)
                 return;
             }
 
-            ctx->meta_version = meta_version;
-            handler->free_message_pt(s, meta);
+            ctx->meta_version = gctx->meta_version;
         }
 
         for (gf = cache->frame_head; gf; gf = gf->next) {
@@ -653,7 +723,9 @@ ngx_rtmp_gop_cache_send(ngx_rtmp_session_t *s)
                 s->current_time = cs->timestamp;
             }
 
-            pkt = handler->append_message_pt(s, &ch, &lh, gf->frame);
+            /* cached encodings are shared by all joining subscribers */
+
+            pkt = ngx_rtmp_gop_cache_encode(s, ctx->protocol, gf);
             if (pkt == NULL) {
                 error = 1;
                 goto next;
@@ -678,11 +750,6 @@ ngx_rtmp_gop_cache_send(ngx_rtmp_session_t *s)
 
         next:
 
-            if (pkt) {
-                handler->free_message_pt(s, pkt);
-                pkt = NULL;
-            }
-
             if (apkt) {
                 handler->free_message_pt(s, apkt);
                 apkt = NULL;
@@ -18,7 +18,8 @@ typedef struct ngx_rtmp_gop_cache_s ngx_rtmp_gop_cache_t;
 struct ngx_rtmp_gop_frame_s {
     ngx_rtmp_header_t     h;
     ngx_uint_t            prio;
-    ngx_chain_t          *frame;
+    ngx_chain_t          *frame;    /* absolute RTMP message */
+    ngx_rtmp_live_pkt_t   pkt;      /* FLV encodings, built on join */
     ngx_rtmp_gop_frame_t *next;
 };
 
@@ -51,8 +52,9 @@ typedef struct ngx_rtmp_gop_cache_ctx_s {
     ngx_chain_t                *video_seq_header;
     ngx_chain_t                *audio_seq_header;
     ngx_chain_t                *meta;
+    ngx_rtmp_live_pkt_t         meta_pkt;
     ngx_chain_t                *free;
-    
+
     ngx_uint_t                  meta_version;
 
     size_t                      gop_cache_count;
@@ -10,11 +10,18 @@
 #include "ngx_rtmp.h"
 #include "ngx_rtmp_amf.h"
 #include "ngx_rtmp_cmd_module.h"
+#include "ngx_rtmp_steer.h"
+#include "ngx_rtmp_ssl_module.h"
 
 
 static void ngx_rtmp_recv(ngx_event_t *rev);
+static void ngx_rtmp_recv_bulk(ngx_event_t *rev);
+static ngx_int_t ngx_rtmp_count_in(ngx_rtmp_session_t *s, ssize_t n);
 static void ngx_rtmp_send(ngx_event_t *rev);
 static void ngx_rtmp_ping(ngx_event_t *rev);
+#if !(NGX_WIN32)
+static ngx_int_t ngx_rtmp_send_vectored(ngx_rtmp_session_t *s);
+#endif
 
 
 ngx_uint_t                  ngx_rtmp_naccepted;
@@ -22,6 +29,8 @@ ngx_uint_t                  ngx_rtmp_naccepted;
 
 ngx_rtmp_bandwidth_t        ngx_rtmp_bw_out;
 ngx_rtmp_bandwidth_t        ngx_rtmp_bw_in;
+ngx_rtmp_bandwidth_t        ngx_rtmp_bw_out_calls;
+ngx_rtmp_bandwidth_t        ngx_rtmp_bw_in_calls;
 
 
 #ifdef NGX_DEBUG
@@ -85,18 +94,22 @@ void
 ngx_rtmp_cycle(ngx_rtmp_session_t *s)
 {
     ngx_connection_t           *c;
+    ngx_rtmp_core_srv_conf_t   *cscf;
 
     c = s->connection;
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
-    c->read->handler =  ngx_rtmp_recv;
+    c->read->handler =  cscf->in_bulk ? ngx_rtmp_recv_bulk : ngx_rtmp_recv;
     c->write->handler = ngx_rtmp_send;
 
+    s->in_bulk = (cscf->in_bulk != 0);
+
     s->ping_evt.data = c;
     s->ping_evt.log = c->log;
     s->ping_evt.handler = ngx_rtmp_ping;
     ngx_rtmp_reset_ping(s);
 
-    ngx_rtmp_recv(c->read);
+    c->read->handler(c->read);
 }
 
 
@@ -269,29 +282,11 @@ ngx_rtmp_recv(ngx_event_t *rev)
                 return;
             }
 
-            s->ping_reset = 1;
-            ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_in, n);
             b->last += n;
-            s->in_bytes += n;
-
-            if (s->in_bytes >= 0xf0000000) {
-                ngx_log_debug0(NGX_LOG_DEBUG_RTMP, c->log, 0,
-                               "resetting byte counter");
-                s->in_bytes = 0;
-                s->in_last_ack = 0;
-            }
-
-            if (s->ack_size && s->in_bytes - s->in_last_ack >= s->ack_size) {
-
-                s->in_last_ack = s->in_bytes;
-
-                ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0,
-                        "sending RTMP ACK(%uD)", s->in_bytes);
 
-                if (ngx_rtmp_send_ack(s, s->in_bytes)) {
-                    ngx_rtmp_finalize_session(s);
-                    return;
-                }
+            if (ngx_rtmp_count_in(s, n) != NGX_OK) {
+                ngx_rtmp_finalize_session(s);
+                return;
             }
         }
 
@@ -497,6 +492,399 @@ ngx_rtmp_recv(ngx_event_t *rev)
 }
 
 
+static ngx_int_t
+ngx_rtmp_count_in(ngx_rtmp_session_t *s, ssize_t n)
+{
+    s->ping_reset = 1;
+    ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_in, n);
+    ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_in_calls, 1);
+    s->in_bytes += n;
+
+    if (s->in_bytes >= 0xf0000000) {
+        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "resetting byte counter");
+        s->in_bytes = 0;
+        s->in_last_ack = 0;
+    }
+
+    if (s->ack_size && s->in_bytes - s->in_last_ack >= s->ack_size) {
+
+        s->in_last_ack = s->in_bytes;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                "sending RTMP ACK(%uD)", s->in_bytes);
+
+        if (ngx_rtmp_send_ack(s, s->in_bytes)) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_rtmp_in_block_t *
+ngx_rtmp_alloc_in_block(ngx_rtmp_session_t *s, size_t size)
+{
+    ngx_rtmp_in_block_t        *blk;
+
+    /* blocks left from a smaller chunk size are dropped */
+
+    while (s->in_free_blocks) {
+        blk = s->in_free_blocks;
+        s->in_free_blocks = blk->next;
+
+        if ((size_t) (blk->end - blk->start) >= size) {
+            blk->pos = blk->last = blk->start;
+            return blk;
+        }
+
+        ngx_pfree(s->in_pool, blk);
+    }
+
+    blk = ngx_palloc(s->in_pool, sizeof(ngx_rtmp_in_block_t) + size);
+    if (blk == NULL) {
+        return NULL;
+    }
+
+    blk->next = NULL;
+    blk->refs = 0;
+    blk->start = (u_char *) blk + sizeof(ngx_rtmp_in_block_t);
+    blk->end = blk->start + size;
+    blk->pos = blk->last = blk->start;
+
+    return blk;
+}
+
+
+static void
+ngx_rtmp_free_in_chain(ngx_rtmp_session_t *s, ngx_chain_t *in)
+{
+    ngx_chain_t                *next;
+    ngx_rtmp_in_block_t        *blk;
+
+    for (; in; in = next) {
+        next = in->next;
+
+        blk = in->buf->tag;
+
+        if (--blk->refs == 0 && blk != s->in_block) {
+            blk->next = s->in_free_blocks;
+            s->in_free_blocks = blk;
+        }
+
+        in->next = s->in_streams[0].in;
+        s->in_streams[0].in = in;
+    }
+}
+
+
+/*
+ * Parses all the chunks complete in the block, a chunk is only taken
+ * with its whole payload so an incomplete one is parsed again from its
+ * basic header once more data is read.
+ */
+static ngx_int_t
+ngx_rtmp_parse_in_block(ngx_rtmp_session_t *s, ngx_rtmp_in_block_t *blk)
+{
+    ngx_connection_t           *c;
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    ngx_rtmp_header_t          *h;
+    ngx_rtmp_stream_t          *st;
+    ngx_chain_t                *cl, *head;
+    ngx_buf_t                  *b;
+    ngx_int_t                   rc;
+    u_char                     *p, *pp, *last;
+    size_t                      size;
+    uint8_t                     fmt, ext, type;
+    uint32_t                    csid, timestamp, mlen, msid;
+
+    c = s->connection;
+    last = blk->last;
+
+    for ( ;; ) {
+        p = blk->pos;
+
+        if (p == last) {
+            return NGX_OK;
+        }
+
+        cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+        /* chunk basic header */
+        fmt  = (*p >> 6) & 0x03;
+        csid = *p++ & 0x3f;
+
+        if (csid == 0) {
+            if (last - p < 1) {
+                return NGX_OK;
+            }
+            csid = 64;
+            csid += *p++;
+
+        } else if (csid == 1) {
+            if (last - p < 2) {
+                return NGX_OK;
+            }
+            csid = 64;
+            csid += *p++;
+            csid += (uint32_t) 256 * (*p++);
+        }
+
+        if (csid >= (uint32_t) cscf->max_streams) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                "RTMP in chunk stream too big: %D >= %D",
+                csid, cscf->max_streams);
+            return NGX_ERROR;
+        }
+
+        st = &s->in_streams[csid];
+        h = &st->hdr;
+
+        /* message header, taken as is into locals */
+        ext = st->ext;
+        timestamp = st->dtime;
+        mlen = h->mlen;
+        type = h->type;
+        msid = h->msid;
+
+        if (fmt <= 2) {
+            if (last - p < 3) {
+                return NGX_OK;
+            }
+            pp = (u_char *) &timestamp;
+            pp[2] = *p++;
+            pp[1] = *p++;
+            pp[0] = *p++;
+            pp[3] = 0;
+
+            ext = (timestamp == 0x00ffffff);
+
+            if (fmt <= 1) {
+                if (last - p < 4) {
+                    return NGX_OK;
+                }
+                pp = (u_char *) &mlen;
+                pp[2] = *p++;
+                pp[1] = *p++;
+                pp[0] = *p++;
+                pp[3] = 0;
+                type = *p++;
+
+                if (fmt == 0) {
+                    if (last - p < 4) {
+                        return NGX_OK;
+                    }
+                    pp = (u_char *) &msid;
+                    pp[0] = *p++;
+                    pp[1] = *p++;
+                    pp[2] = *p++;
+                    pp[3] = *p++;
+                }
+            }
+        }
+
+        if (ext) {
+            if (last - p < 4) {
+                return NGX_OK;
+            }
+            pp = (u_char *) &timestamp;
+            pp[3] = *p++;
+            pp[2] = *p++;
+            pp[1] = *p++;
+            pp[0] = *p++;
+        }
+
+        if (mlen > cscf->max_message) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                    "too big message: %uD, %uz", mlen, cscf->max_message);
+            return NGX_ERROR;
+        }
+
+        size = ngx_min(mlen - st->len, s->in_chunk_size);
+
+        if ((size_t) (last - p) < size) {
+            return NGX_OK;
+        }
+
+        /* the whole chunk is there */
+
+        h->csid = csid;
+        h->mlen = mlen;
+        h->type = type;
+        h->msid = msid;
+
+        if (st->len == 0) {
+            st->ext = (ext && cscf->publish_time_fix);
+            if (fmt) {
+                st->dtime = timestamp;
+            } else {
+                h->timestamp = timestamp;
+                st->dtime = 0;
+            }
+        }
+
+        ngx_log_debug8(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                "RTMP bulk fmt=%d csid=%D %s (%d) "
+                "time=%uD+%uD mlen=%D len=%D",
+                (int) fmt, csid, ngx_rtmp_message_type(h->type),
+                (int) h->type, h->timestamp, st->dtime, h->mlen, st->len);
+
+        cl = s->in_streams[0].in;
+
+        if (cl) {
+            s->in_streams[0].in = cl->next;
+
+        } else {
+            cl = ngx_alloc_chain_link(s->in_pool);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl->buf = ngx_calloc_buf(s->in_pool);
+            if (cl->buf == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        b = cl->buf;
+        b->start = b->pos = p;
+        b->end = b->last = p + size;
+        b->tag = (ngx_buf_tag_t) blk;
+
+        blk->refs++;
+        blk->pos = p + size;
+
+        /* stream chain is circular, pointing to its last link */
+
+        if (st->in == NULL) {
+            cl->next = cl;
+
+        } else {
+            cl->next = st->in->next;
+            st->in->next = cl;
+        }
+
+        st->in = cl;
+        st->len += size;
+
+        if (st->len < h->mlen) {
+            continue;
+        }
+
+        /* handle! */
+
+        head = st->in->next;
+        st->in->next = NULL;
+        st->in = NULL;
+        st->len = 0;
+        h->timestamp += st->dtime;
+
+        s->in_csid = csid;
+
+        rc = ngx_rtmp_receive_message(s, h, head);
+
+        ngx_rtmp_free_in_chain(s, head);
+
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        /* in_streams may have been moved due to virtual server match */
+        s->server_changed = 0;
+        s->in_csid = 0;
+    }
+}
+
+
+static void
+ngx_rtmp_recv_bulk(ngx_event_t *rev)
+{
+    ssize_t                     n;
+    size_t                      size;
+    ngx_connection_t           *c;
+    ngx_rtmp_session_t         *s;
+    ngx_rtmp_in_block_t        *blk, *nblk;
+    ngx_rtmp_core_srv_conf_t   *cscf;
+
+    c = rev->data;
+    s = c->data;
+
+    if (c->destroyed) {
+        return;
+    }
+
+    for ( ;; ) {
+
+        blk = s->in_block;
+
+        /*
+         * a chunk being read has to fit in what is left of the block,
+         * otherwise it goes to the start of another one; pending
+         * messages keep the old block until they are handled
+         */
+
+        size = s->in_chunk_size + NGX_RTMP_MAX_CHUNK_HEADER;
+
+        if (blk && blk->refs == 0 && blk->pos == blk->last) {
+            blk->pos = blk->last = blk->start;
+        }
+
+        if (blk == NULL || (size_t) (blk->end - blk->pos) < size) {
+            cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+            nblk = ngx_rtmp_alloc_in_block(s, ngx_max(cscf->in_bulk, size));
+            if (nblk == NULL) {
+                ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                        "in block alloc failed");
+                ngx_rtmp_finalize_session(s);
+                return;
+            }
+
+            if (blk) {
+                ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                        "moving partial chunk: %uz", blk->last - blk->pos);
+
+                nblk->last = ngx_cpymem(nblk->last, blk->pos,
+                                        blk->last - blk->pos);
+                blk->pos = blk->last;
+
+                if (blk->refs == 0) {
+                    blk->next = s->in_free_blocks;
+                    s->in_free_blocks = blk;
+                }
+            }
+
+            s->in_block = nblk;
+            blk = nblk;
+        }
+
+        n = c->recv(c, blk->last, blk->end - blk->last);
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_rtmp_finalize_session(s);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                ngx_rtmp_finalize_session(s);
+            }
+            return;
+        }
+
+        blk->last += n;
+
+        if (ngx_rtmp_count_in(s, n) != NGX_OK
+            || ngx_rtmp_parse_in_block(s, blk) != NGX_OK)
+        {
+            ngx_rtmp_finalize_session(s);
+            return;
+        }
+    }
+}
+
+
 static void
 ngx_rtmp_send(ngx_event_t *wev)
 {
@@ -529,8 +917,37 @@ ngx_rtmp_send(ngx_event_t *wev)
         s->out_bpos = s->out_chain->buf->pos;
     }
 
+#if !(NGX_WIN32)
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    /* with kernel TLS the socket takes the plain messages as well */
+
+    if (cscf->out_vectored && s->out_chain && !ngx_rtmp_steer_muted(c)
+#if (NGX_SSL)
+        && (c->ssl == NULL || ngx_rtmp_ssl_ktls(c))
+#endif
+       )
+    {
+        n = ngx_rtmp_send_vectored(s);
+
+        if (n == NGX_AGAIN) {
+            ngx_add_timer(c->write, s->timeout);
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                ngx_rtmp_finalize_session(s);
+            }
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_rtmp_finalize_session(s);
+            return;
+        }
+    }
+#endif
+
     while (s->out_chain) {
         n = c->send(c, s->out_bpos, s->out_chain->buf->last - s->out_bpos);
+        ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out_calls, 1);
 
         if (n == NGX_AGAIN || n == 0) {
             ngx_add_timer(c->write, s->timeout);
@@ -546,6 +963,7 @@ ngx_rtmp_send(ngx_event_t *wev)
         }
 
         s->out_bytes += n;
+        s->out_queued -= n;
         s->ping_reset = 1;
         ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out, n);
         s->out_bpos += n;
@@ -573,6 +991,134 @@ ngx_rtmp_send(ngx_event_t *wev)
 }
 
 
+#if !(NGX_WIN32)
+
+/* Send as many queued buffers as fit into one iovec array
+ * with a single writev(), even if they belong to several messages.
+ * Shared buffers are never modified, the position is kept in
+ * s->out_pos/out_chain/out_bpos exactly as in the plain path */
+
+static ngx_int_t
+ngx_rtmp_send_vectored(ngx_rtmp_session_t *s)
+{
+    struct iovec                iovs[NGX_IOVS_PREALLOCATE];
+    ngx_connection_t           *c;
+    ngx_chain_t                *cl;
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    ngx_uint_t                  niovs, pos;
+    ngx_err_t                   err;
+    u_char                     *p;
+    size_t                      size, total, len;
+    ssize_t                     n;
+
+    c = s->connection;
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    while (s->out_chain) {
+
+        niovs = 0;
+        size = 0;
+
+        pos = s->out_pos;
+        cl = s->out_chain;
+        p = s->out_bpos;
+
+        while (niovs < NGX_IOVS_PREALLOCATE) {
+
+            if (p != cl->buf->last) {
+                iovs[niovs].iov_base = (void *) p;
+                iovs[niovs].iov_len = cl->buf->last - p;
+                size += iovs[niovs].iov_len;
+                ++niovs;
+            }
+
+            cl = cl->next;
+            if (cl == NULL) {
+                pos = (pos + 1) % s->out_queue;
+                if (pos == s->out_last) {
+                    break;
+                }
+                cl = s->out[pos];
+            }
+
+            p = cl->buf->pos;
+        }
+
+        n = 0;
+        total = size;
+
+        if (total) {
+            n = writev(c->fd, iovs, niovs);
+            ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out_calls, 1);
+
+            if (n == -1) {
+                err = ngx_socket_errno;
+
+                if (err == NGX_EINTR) {
+                    continue;
+                }
+
+                if (err == NGX_EAGAIN) {
+                    c->write->ready = 0;
+                    return NGX_AGAIN;
+                }
+
+                c->write->error = 1;
+                ngx_connection_error(c, err, "writev() failed");
+                return NGX_ERROR;
+            }
+
+            ngx_log_debug3(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                    "RTMP writev niovs=%ui size=%uz sent=%z",
+                    niovs, total, n);
+
+            c->sent += n;
+            s->out_bytes += n;
+            s->out_queued -= n;
+            s->ping_reset = 1;
+            ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out, n);
+        }
+
+        /* advance output position, releasing completed messages */
+
+        len = n;
+
+        for ( ;; ) {
+            size = s->out_chain->buf->last - s->out_bpos;
+
+            if (len < size) {
+                s->out_bpos += len;
+                break;
+            }
+
+            len -= size;
+
+            s->out_chain = s->out_chain->next;
+            if (s->out_chain == NULL) {
+                ngx_rtmp_free_shared_chain(cscf, s->out[s->out_pos]);
+                ++s->out_pos;
+                s->out_pos %= s->out_queue;
+                if (s->out_pos == s->out_last) {
+                    return NGX_OK;
+                }
+                s->out_chain = s->out[s->out_pos];
+            }
+
+            s->out_bpos = s->out_chain->buf->pos;
+        }
+
+        if ((size_t) n < total) {
+            c->write->ready = 0;
+            return NGX_AGAIN;
+        }
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
 void
 ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         ngx_rtmp_header_t *lh, ngx_chain_t *out)
@@ -717,11 +1263,71 @@ ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 }
 
 
+/*
+ * The age of the oldest message still queued, that is how far behind
+ * the live edge the client is.  It grows while the queue is stalled, so
+ * the maximum is updated by whoever asks, not only by senders.
+ */
+
+ngx_msec_t
+ngx_rtmp_out_delay(ngx_rtmp_session_t *s)
+{
+    ngx_msec_t                      delay;
+
+    if (s->out_pos == s->out_last) {
+        return 0;
+    }
+
+    delay = ngx_current_msec - s->out_time[s->out_pos];
+
+    if (delay > s->out_delay_max) {
+        s->out_delay_max = delay;
+    }
+
+    return delay;
+}
+
+
+/*
+ * Bytes and milliseconds queued are limited like the slots are, each
+ * priority level giving up a quarter of the budget.  A message is not
+ * dropped for its own size when nothing is queued.
+ */
+
+ngx_uint_t
+ngx_rtmp_out_over_budget(ngx_rtmp_session_t *s, size_t size,
+        ngx_uint_t priority)
+{
+    ngx_msec_t                      delay;
+    ngx_rtmp_core_srv_conf_t       *cscf;
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    delay = ngx_rtmp_out_delay(s);
+
+    if (cscf->out_queue_size && s->out_queued
+        && s->out_queued + size > cscf->out_queue_size * (4 - priority) / 4)
+    {
+        return 1;
+    }
+
+    if (cscf->out_queue_duration
+        && delay >= cscf->out_queue_duration * (4 - priority) / 4)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+
 ngx_int_t
 ngx_rtmp_send_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
         ngx_uint_t priority)
 {
     ngx_uint_t                      nmsg;
+    ngx_chain_t                    *cl;
+    size_t                          size;
 
     nmsg = (s->out_last + s->out_queue - s->out_pos) % s->out_queue + 1;
 
@@ -729,19 +1335,34 @@ ngx_rtmp_send_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
         priority = 3;
     }
 
+    size = 0;
+
+    for (cl = out; cl; cl = cl->next) {
+        size += cl->buf->last - cl->buf->pos;
+    }
+
     /* drop packet?
      * Note we always leave 1 slot free */
-    if (nmsg + priority * s->out_queue / 4 >= s->out_queue) {
-        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                "RTMP drop message bufs=%ui, priority=%ui",
-                nmsg, priority);
+    if (nmsg + priority * s->out_queue / 4 >= s->out_queue
+        || ngx_rtmp_out_over_budget(s, size, priority))
+    {
+        ngx_log_debug4(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                "RTMP drop message bufs=%ui, queued=%uz+%uz, priority=%ui",
+                nmsg, s->out_queued, size, priority);
 
         return NGX_AGAIN;
     }
 
+    s->out_time[s->out_last] = ngx_current_msec;
     s->out[s->out_last++] = out;
     s->out_last %= s->out_queue;
 
+    s->out_queued += size;
+
+    if (s->out_queued > s->out_queued_max) {
+        s->out_queued_max = s->out_queued;
+    }
+
     ngx_rtmp_acquire_shared_chain(out);
 
     ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
@@ -841,6 +1462,12 @@ ngx_rtmp_set_chunk_size(ngx_rtmp_session_t *s, ngx_uint_t size)
 
     cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
+    /* chunks are parsed in place, each with the size set when it comes */
+    if (s->in_bulk) {
+        s->in_chunk_size = size;
+        return NGX_OK;
+    }
+
     s->in_old_pool = s->in_pool;
     s->in_chunk_size = size;
     s->in_pool = ngx_create_pool(4096, s->connection->log);
@@ -9,6 +9,8 @@
 #include <ngx_core.h>
 #include "ngx_rtmp.h"
 #include "ngx_rtmp_proxy_protocol.h"
+#include "ngx_rtmp_steer.h"
+#include "ngx_rtmp_ssl_module.h"
 
 
 static void ngx_rtmp_close_connection(ngx_connection_t *c);
@@ -146,9 +148,16 @@ ngx_rtmp_init_connection(ngx_connection_t *c)
 
     s->auto_pushed = unix_socket;
 
+    if (rconn->addr_conf->steer) {
+        ngx_rtmp_steer_record(c);
+    }
+
     if (rconn->proxy_protocol) {
         ngx_rtmp_proxy_protocol(s);
 
+    } else if (rconn->addr_conf->ssl && !unix_socket) {
+        ngx_rtmp_ssl_handshake(s);
+
     } else {
         ngx_rtmp_handshake(s);
     }
@@ -161,6 +170,7 @@ ngx_rtmp_init_session(ngx_connection_t *c, ngx_rtmp_addr_conf_t *addr_conf)
     ngx_rtmp_session_t             *s;
     ngx_rtmp_core_srv_conf_t       *cscf;
     ngx_rtmp_error_log_ctx_t       *ctx;
+    ngx_rtmp_steer_conn_t          *sc;
 
     s = ngx_pcalloc(c->pool, sizeof(ngx_rtmp_session_t));
     if (s == NULL) {
@@ -202,14 +212,16 @@ ngx_rtmp_init_session(ngx_connection_t *c, ngx_rtmp_addr_conf_t *addr_conf)
         goto failed;
     }
 
-    s->out = ngx_pcalloc(s->out_pool, sizeof(ngx_chain_t *)
-                         * ((ngx_rtmp_core_srv_conf_t *)
-                            addr_conf->default_server->ctx->srv_conf
-                            [ngx_rtmp_core_module.ctx_index])->out_queue);
+    cscf = addr_conf->default_server->ctx->srv_conf
+               [ngx_rtmp_core_module.ctx_index];
+
+    s->out = ngx_pcalloc(s->out_pool, ngx_rtmp_out_ring_size(cscf->out_queue));
     if (s->out == NULL) {
         goto failed;
     }
 
+    s->out_time = (ngx_msec_t *) &s->out[cscf->out_queue];
+
     s->in_streams_pool = ngx_create_pool(4096, c->log);
     if (s->in_streams_pool == NULL) {
         goto failed;
@@ -234,6 +246,8 @@ ngx_rtmp_init_session(ngx_connection_t *c, ngx_rtmp_addr_conf_t *addr_conf)
     s->buflen = cscf->buflen;
     ngx_rtmp_set_chunk_size(s, NGX_RTMP_DEFAULT_CHUNK_SIZE);
 
+    sc = ngx_rtmp_steer_conn(c);
+    s->steered_in = (sc && sc->steered);
 
     if (ngx_rtmp_fire_event(s, NGX_RTMP_CONNECT, NULL, NULL) != NGX_OK) {
         ngx_rtmp_finalize_session(s);
@@ -298,6 +312,15 @@ ngx_rtmp_close_connection(ngx_connection_t *c)
 
     ngx_log_debug0(NGX_LOG_DEBUG_RTMP, c->log, 0, "close connection");
 
+#if (NGX_SSL)
+    if (c->ssl) {
+        if (ngx_ssl_shutdown(c) == NGX_AGAIN) {
+            c->ssl->handler = ngx_rtmp_close_connection;
+            return;
+        }
+    }
+#endif
+
 #if (NGX_STAT_STUB)
     (void) ngx_atomic_fetch_add(ngx_stat_active, -1);
 #endif
@@ -353,10 +376,29 @@ ngx_rtmp_close_session_handler(ngx_event_t *e)
         ngx_destroy_pool(s->out_pool);
     }
 
+    s->closed = 1;
+
+    if (s->count) {
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                       "close session, count:%ui", s->count);
+        return;
+    }
+
     ngx_rtmp_close_connection(c);
 }
 
 
+void
+ngx_rtmp_release_session(ngx_rtmp_session_t *s)
+{
+    if (--s->count || !s->closed) {
+        return;
+    }
+
+    ngx_rtmp_close_connection(s->connection);
+}
+
+
 void
 ngx_rtmp_finalize_session(ngx_rtmp_session_t *s)
 {
@@ -28,6 +28,15 @@ static char * ngx_rtmp_live_merge_app_conf(ngx_conf_t *cf,
        void *parent, void *child);
 static char *ngx_rtmp_live_set_msec_slot(ngx_conf_t *cf, ngx_command_t *cmd,
        void *conf);
+static ngx_rtmp_live_slot_t *ngx_rtmp_live_lookup(
+       ngx_rtmp_live_app_conf_t *lacf, ngx_uint_t hash, u_char *name,
+       size_t len);
+static ngx_int_t ngx_rtmp_live_resize(ngx_rtmp_live_app_conf_t *lacf,
+       ngx_uint_t nslots, ngx_log_t *log);
+static ngx_uint_t ngx_rtmp_live_congestion(ngx_rtmp_session_t *s,
+       ngx_rtmp_live_ctx_t *ctx, size_t limit);
+static ngx_uint_t ngx_rtmp_live_disposable(ngx_rtmp_codec_ctx_t *codec_ctx,
+       ngx_chain_t *in);
 static void ngx_rtmp_live_start(ngx_rtmp_session_t *s);
 static void ngx_rtmp_live_stop(ngx_rtmp_session_t *s);
 
@@ -43,12 +52,11 @@ static void ngx_rtmp_live_free_message(ngx_rtmp_session_t *s, ngx_chain_t *in);
 #define ACTION_VAR_LEN  128
 #define STREAM_VAR_LEN  1024
 
+/* how long the kernel send queue size of a subscriber is trusted */
+#define NGX_RTMP_LIVE_BACKLOG_TTL   100
+
 
 ngx_rtmp_live_proc_handler_t  ngx_rtmp_live_proc_handler = {
-    NULL,
-    NULL,
-    NULL,
-    NULL,
     ngx_rtmp_live_send_message,
     ngx_rtmp_live_meta_message,
     ngx_rtmp_live_append_message,
@@ -139,6 +147,13 @@ static ngx_command_t  ngx_rtmp_live_commands[] = {
       offsetof(ngx_rtmp_live_app_conf_t, idle_timeout),
       NULL },
 
+    { ngx_string("congestion_backlog"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_app_conf_t, backlog),
+      NULL },
+
       ngx_null_command
 };
 
@@ -228,6 +243,71 @@ ngx_rtmp_live_free_message(ngx_rtmp_session_t *s, ngx_chain_t *in)
 }
 
 
+ngx_uint_t
+ngx_rtmp_live_pkt_variant(ngx_rtmp_session_t *s, ngx_uint_t protocol)
+{
+    ngx_http_request_t             *r;
+
+    if (protocol != NGX_RTMP_PROTOCOL_HTTP) {
+        return NGX_RTMP_LIVE_PKT_RTMP;
+    }
+
+    r = s->data;
+    if (r == NULL || (r->connection && r->connection->destroyed)) {
+        return NGX_RTMP_LIVE_PKT_MAX;
+    }
+
+    return r->chunked ? NGX_RTMP_LIVE_PKT_FLV_CHUNKED : NGX_RTMP_LIVE_PKT_FLV;
+}
+
+
+ngx_chain_t *
+ngx_rtmp_live_pkt_get(ngx_rtmp_session_t *s, ngx_uint_t protocol,
+    ngx_rtmp_live_pkt_t *pkt, ngx_rtmp_header_t *h, ngx_rtmp_header_t *lh,
+    ngx_chain_t *in)
+{
+    ngx_uint_t                      n;
+    ngx_rtmp_live_proc_handler_t   *handler;
+
+    n = ngx_rtmp_live_pkt_variant(s, protocol);
+    if (n == NGX_RTMP_LIVE_PKT_MAX) {
+        return NULL;
+    }
+
+    if (pkt->chain[n]) {
+        return pkt->chain[n];
+    }
+
+    handler = ngx_rtmp_live_proc_handlers[protocol];
+
+    if (h == NULL) {
+        pkt->chain[n] = handler->meta_message_pt(s, in);
+
+    } else {
+        pkt->chain[n] = handler->append_message_pt(s, h, lh, in);
+    }
+
+    return pkt->chain[n];
+}
+
+
+void
+ngx_rtmp_live_pkt_free(ngx_rtmp_session_t *s, ngx_rtmp_live_pkt_t *pkt)
+{
+    ngx_uint_t                      n;
+    ngx_rtmp_core_srv_conf_t       *cscf;
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    for (n = 0; n < NGX_RTMP_LIVE_PKT_MAX; n++) {
+        if (pkt->chain[n]) {
+            ngx_rtmp_free_shared_chain(cscf, pkt->chain[n]);
+            pkt->chain[n] = NULL;
+        }
+    }
+}
+
+
 static void *
 ngx_rtmp_live_create_app_conf(ngx_conf_t *cf)
 {
@@ -249,6 +329,7 @@ ngx_rtmp_live_create_app_conf(ngx_conf_t *cf)
     lacf->publish_notify = NGX_CONF_UNSET;
     lacf->play_restart = NGX_CONF_UNSET;
     lacf->idle_streams = NGX_CONF_UNSET;
+    lacf->backlog = NGX_CONF_UNSET_SIZE;
 
     return lacf;
 }
@@ -271,14 +352,15 @@ ngx_rtmp_live_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->publish_notify, prev->publish_notify, 0);
     ngx_conf_merge_value(conf->play_restart, prev->play_restart, 0);
     ngx_conf_merge_value(conf->idle_streams, prev->idle_streams, 1);
+    ngx_conf_merge_size_value(conf->backlog, prev->backlog, 0);
 
     conf->pool = ngx_create_pool(4096, &cf->cycle->new_log);
     if (conf->pool == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    conf->streams = ngx_pcalloc(cf->pool,
-            sizeof(ngx_rtmp_live_stream_t *) * conf->nbuckets);
+    /* the table itself is allocated on first use in a worker */
+    ngx_queue_init(&conf->streams);
 
     return NGX_CONF_OK;
 }
@@ -306,12 +388,108 @@ ngx_rtmp_live_set_msec_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
-ngx_rtmp_live_stream_t **
+/* minimum number of slots, the stream_buckets value rounded up */
+static ngx_uint_t
+ngx_rtmp_live_min_slots(ngx_rtmp_live_app_conf_t *lacf)
+{
+    ngx_uint_t                  n;
+
+    for (n = 16; n < (ngx_uint_t) lacf->nbuckets; n <<= 1) { /* void */ }
+
+    return n;
+}
+
+
+/*
+ * Returns the slot holding the stream or the empty slot terminating
+ * the probe sequence, where the stream would be inserted.  The load
+ * factor is kept below 3/4 so such a slot always exists.
+ */
+static ngx_rtmp_live_slot_t *
+ngx_rtmp_live_lookup(ngx_rtmp_live_app_conf_t *lacf, ngx_uint_t hash,
+    u_char *name, size_t len)
+{
+    ngx_uint_t                  i, mask;
+    ngx_rtmp_live_slot_t       *slot;
+
+    mask = lacf->nslots - 1;
+
+    for (i = hash & mask; /* void */ ; i = (i + 1) & mask) {
+        slot = &lacf->slots[i];
+
+        if (slot->stream == NULL
+            || (slot->hash == hash && slot->stream->len == len
+                && ngx_memcmp(slot->stream->name, name, len) == 0))
+        {
+            return slot;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_resize(ngx_rtmp_live_app_conf_t *lacf, ngx_uint_t nslots,
+    ngx_log_t *log)
+{
+    ngx_uint_t                  i, n, mask;
+    ngx_rtmp_live_slot_t       *slots;
+
+    slots = ngx_calloc(sizeof(ngx_rtmp_live_slot_t) * nslots, log);
+    if (slots == NULL) {
+        return NGX_ERROR;
+    }
+
+    mask = nslots - 1;
+
+    for (i = 0; i < lacf->nslots; i++) {
+        if (lacf->slots[i].stream == NULL) {
+            continue;
+        }
+
+        for (n = lacf->slots[i].hash & mask; slots[n].stream;
+             n = (n + 1) & mask)
+        { /* void */ }
+
+        slots[n] = lacf->slots[i];
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, log, 0,
+                   "live: resize stream table %ui -> %ui",
+                   lacf->nslots, nslots);
+
+    if (lacf->slots) {
+        ngx_free(lacf->slots);
+    }
+
+    lacf->slots = slots;
+    lacf->nslots = nslots;
+
+    return NGX_OK;
+}
+
+
+ngx_rtmp_live_stream_t *
+ngx_rtmp_live_find_stream(ngx_rtmp_live_app_conf_t *lacf, u_char *name,
+    size_t len)
+{
+    if (lacf->nslots == 0) {
+        return NULL;
+    }
+
+    return ngx_rtmp_live_lookup(lacf, ngx_hash_key(name, len), name, len)
+           ->stream;
+}
+
+
+ngx_rtmp_live_stream_t *
 ngx_rtmp_live_get_stream(ngx_rtmp_session_t *s, u_char *name, int create)
 {
     ngx_rtmp_live_app_conf_t   *lacf;
-    ngx_rtmp_live_stream_t    **stream;
+    ngx_rtmp_live_stream_t     *stream;
+    ngx_rtmp_live_slot_t       *slot;
+    ngx_uint_t                  hash;
     size_t                      len;
+    u_char                     *p;
 
     lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
     if (lacf == NULL) {
@@ -319,11 +497,12 @@ ngx_rtmp_live_get_stream(ngx_rtmp_session_t *s, u_char *name, int create)
     }
 
     len = ngx_strlen(name);
-    stream = &lacf->streams[ngx_hash_key(name, len) % lacf->nbuckets];
+    hash = ngx_hash_key(name, len);
 
-    for (; *stream; stream = &(*stream)->next) {
-        if (ngx_strcmp(name, (*stream)->name) == 0) {
-            return stream;
+    if (lacf->nslots) {
+        slot = ngx_rtmp_live_lookup(lacf, hash, name, len);
+        if (slot->stream) {
+            return slot->stream;
         }
     }
 
@@ -334,21 +513,293 @@ ngx_rtmp_live_get_stream(ngx_rtmp_session_t *s, u_char *name, int create)
     ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
             "live: create stream '%s'", name);
 
+    if ((lacf->nstreams + 1) * 4 > lacf->nslots * 3) {
+        if (ngx_rtmp_live_resize(lacf, lacf->nslots
+                                       ? lacf->nslots * 2
+                                       : ngx_rtmp_live_min_slots(lacf),
+                                 s->connection->log)
+            != NGX_OK)
+        {
+            return NULL;
+        }
+    }
+
+    p = ngx_alloc(len + 1, s->connection->log);
+    if (p == NULL) {
+        return NULL;
+    }
+
     if (lacf->free_streams) {
-        *stream = lacf->free_streams;
+        stream = lacf->free_streams;
         lacf->free_streams = lacf->free_streams->next;
+
     } else {
-        *stream = ngx_palloc(lacf->pool, sizeof(ngx_rtmp_live_stream_t));
+        stream = ngx_palloc(lacf->pool, sizeof(ngx_rtmp_live_stream_t));
+        if (stream == NULL) {
+            ngx_free(p);
+            return NULL;
+        }
     }
-    ngx_memzero(*stream, sizeof(ngx_rtmp_live_stream_t));
-    ngx_memcpy((*stream)->name, name,
-            ngx_min(sizeof((*stream)->name) - 1, len));
-    (*stream)->epoch = ngx_current_msec;
+
+    ngx_memzero(stream, sizeof(ngx_rtmp_live_stream_t));
+    ngx_memcpy(p, name, len + 1);
+
+    stream->name = p;
+    stream->len = len;
+    stream->hash = hash;
+    stream->epoch = ngx_current_msec;
+
+    slot = ngx_rtmp_live_lookup(lacf, hash, name, len);
+    slot->hash = hash;
+    slot->stream = stream;
+
+    lacf->nstreams++;
+    ngx_queue_insert_tail(&lacf->streams, &stream->queue);
 
     return stream;
 }
 
 
+void
+ngx_rtmp_live_free_stream(ngx_rtmp_live_app_conf_t *lacf,
+    ngx_rtmp_live_stream_t *stream)
+{
+    ngx_uint_t                  i, j, k, mask;
+
+    mask = lacf->nslots - 1;
+
+    for (i = stream->hash & mask; lacf->slots[i].stream != stream;
+         i = (i + 1) & mask)
+    { /* void */ }
+
+    /* backward shift: move up entries whose probe sequence crosses i */
+
+    for (j = (i + 1) & mask; lacf->slots[j].stream; j = (j + 1) & mask) {
+        k = lacf->slots[j].hash & mask;
+
+        if (((j - k) & mask) >= ((j - i) & mask)) {
+            lacf->slots[i] = lacf->slots[j];
+            i = j;
+        }
+    }
+
+    lacf->slots[i].stream = NULL;
+    lacf->nstreams--;
+
+    ngx_queue_remove(&stream->queue);
+
+    ngx_free(stream->name);
+    stream->name = NULL;
+
+    stream->next = lacf->free_streams;
+    lacf->free_streams = stream;
+
+    /* shrinking is best effort, a failure leaves the table as is */
+
+    if (lacf->nslots > ngx_rtmp_live_min_slots(lacf)
+        && lacf->nstreams * 8 < lacf->nslots)
+    {
+        (void) ngx_rtmp_live_resize(lacf, lacf->nslots / 2, ngx_cycle->log);
+    }
+}
+
+
+/* bytes written to the socket but not yet acknowledged by the peer */
+static size_t
+ngx_rtmp_live_socket_backlog(ngx_connection_t *c)
+{
+#if defined(TIOCOUTQ)
+    int                         n;
+
+    if (ioctl(c->fd, TIOCOUTQ, &n) == -1 || n < 0) {
+        return 0;
+    }
+
+    return (size_t) n;
+
+#elif defined(SO_NWRITE)
+    int                         n;
+    socklen_t                   len;
+
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_NWRITE, (void *) &n, &len) == -1
+        || n < 0)
+    {
+        return 0;
+    }
+
+    return (size_t) n;
+
+#else
+    return 0;
+#endif
+}
+
+
+/*
+ * Congestion level of a subscriber from what is queued for it both in
+ * the session output queue and in the kernel.  Below half of the limit
+ * everything is sent, above it non-reference video frames are dropped
+ * and past the limit the subscriber skips to the next keyframe.
+ */
+static ngx_uint_t
+ngx_rtmp_live_congestion(ngx_rtmp_session_t *s, ngx_rtmp_live_ctx_t *ctx,
+    size_t limit)
+{
+    size_t                      backlog;
+
+    if (ngx_current_msec - ctx->backlog_time >= NGX_RTMP_LIVE_BACKLOG_TTL) {
+        ctx->backlog = ngx_rtmp_live_socket_backlog(s->connection);
+        ctx->backlog_time = ngx_current_msec;
+    }
+
+    backlog = s->out_queued + ctx->backlog;
+
+    if (backlog >= limit) {
+        return NGX_RTMP_LIVE_CONGESTION_KEY;
+    }
+
+    if (backlog >= limit / 2) {
+        return NGX_RTMP_LIVE_CONGESTION_NONREF;
+    }
+
+    return NGX_RTMP_LIVE_CONGESTION_NONE;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_copy(void *dst, u_char **src, size_t n, ngx_chain_t **in)
+{
+    u_char                     *last;
+    size_t                      pn;
+
+    if (*in == NULL) {
+        return NGX_ERROR;
+    }
+
+    for ( ;; ) {
+        last = (*in)->buf->last;
+
+        if ((size_t) (last - *src) >= n) {
+            if (dst) {
+                ngx_memcpy(dst, *src, n);
+            }
+
+            *src += n;
+
+            while (*in && *src == (*in)->buf->last) {
+                *in = (*in)->next;
+                if (*in) {
+                    *src = (*in)->buf->pos;
+                }
+            }
+
+            return NGX_OK;
+        }
+
+        pn = last - *src;
+
+        if (dst) {
+            ngx_memcpy(dst, *src, pn);
+            dst = (u_char *) dst + pn;
+        }
+
+        n -= pn;
+        *in = (*in)->next;
+
+        if (*in == NULL) {
+            return NGX_ERROR;
+        }
+
+        *src = (*in)->buf->pos;
+    }
+}
+
+
+/* a video frame no other frame is predicted from */
+static ngx_uint_t
+ngx_rtmp_live_disposable(ngx_rtmp_codec_ctx_t *codec_ctx, ngx_chain_t *in)
+{
+    u_char                     *p, hdr[5];
+    uint32_t                    len;
+    ngx_uint_t                  n, type, vcl;
+    ngx_chain_t                *cl;
+
+    if (ngx_rtmp_get_video_frame_type(in) == NGX_RTMP_VIDEO_DISPOSABLE_FRAME) {
+        return 1;
+    }
+
+    if (codec_ctx == NULL
+        || (codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H264
+            && codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H265)
+        || codec_ctx->avc_nal_bytes == 0
+        || codec_ctx->avc_nal_bytes > 4)
+    {
+        return 0;
+    }
+
+    cl = in;
+    p = in->buf->pos;
+
+    /* frame type & codec, packet type, composition time */
+
+    if (ngx_rtmp_live_copy(hdr, &p, 5, &cl) != NGX_OK || hdr[1] != 1) {
+        return 0;
+    }
+
+    vcl = 0;
+
+    while (cl) {
+        if (ngx_rtmp_live_copy(hdr, &p, codec_ctx->avc_nal_bytes, &cl)
+            != NGX_OK)
+        {
+            return 0;
+        }
+
+        len = 0;
+        for (n = 0; n < codec_ctx->avc_nal_bytes; n++) {
+            len = (len << 8) | hdr[n];
+        }
+
+        if (len == 0 || ngx_rtmp_live_copy(hdr, &p, 1, &cl) != NGX_OK) {
+            return 0;
+        }
+
+        if (codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H264) {
+            type = hdr[0] & 0x1f;
+
+            if (type >= 1 && type <= 5) {
+                if (hdr[0] & 0x60) {
+                    /* nal_ref_idc */
+                    return 0;
+                }
+
+                vcl = 1;
+            }
+
+        } else {
+            type = (hdr[0] >> 1) & 0x3f;
+
+            if (type < 32) {
+                if (type > 14 || (type & 1)) {
+                    /* not a sub-layer non-reference picture */
+                    return 0;
+                }
+
+                vcl = 1;
+            }
+        }
+
+        if (len > 1 && ngx_rtmp_live_copy(NULL, &p, len - 1, &cl) != NGX_OK) {
+            return 0;
+        }
+    }
+
+    return vcl;
+}
+
+
 static void
 ngx_rtmp_live_idle(ngx_event_t *pev)
 {
@@ -584,7 +1035,7 @@ static void
 ngx_rtmp_live_join(ngx_rtmp_session_t *s, u_char *name, unsigned publisher)
 {
     ngx_rtmp_live_ctx_t            *ctx;
-    ngx_rtmp_live_stream_t        **stream;
+    ngx_rtmp_live_stream_t         *stream;
     ngx_rtmp_live_app_conf_t       *lacf;
 
     lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
@@ -615,7 +1066,7 @@ ngx_rtmp_live_join(ngx_rtmp_session_t *s, u_char *name, unsigned publisher)
     stream = ngx_rtmp_live_get_stream(s, name, publisher || lacf->idle_streams);
 
     if (stream == NULL ||
-        !(publisher || (*stream)->publishing || lacf->idle_streams))
+        !(publisher || stream->publishing || lacf->idle_streams))
     {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                       "live: stream not found");
@@ -629,7 +1080,7 @@ ngx_rtmp_live_join(ngx_rtmp_session_t *s, u_char *name, unsigned publisher)
     }
 
     if (publisher) {
-        if ((*stream)->publishing) {
+        if (stream->publishing) {
             ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                           "live: already publishing");
 
@@ -639,15 +1090,15 @@ ngx_rtmp_live_join(ngx_rtmp_session_t *s, u_char *name, unsigned publisher)
             return;
         }
 
-        (*stream)->publishing = 1;
-        (*stream)->pub_ctx = ctx;
+        stream->publishing = 1;
+        stream->pub_ctx = ctx;
     }
 
-    ctx->stream = *stream;
+    ctx->stream = stream;
     ctx->publishing = publisher;
-    ctx->next = (*stream)->ctx;
+    ctx->next = stream->ctx;
 
-    (*stream)->ctx = ctx;
+    stream->ctx = ctx;
 
     if (lacf->buflen) {
         s->out_buffer = 1;
@@ -667,7 +1118,6 @@ ngx_rtmp_live_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
 {
     ngx_rtmp_session_t             *ss;
     ngx_rtmp_live_ctx_t            *ctx, **cctx, *pctx;
-    ngx_rtmp_live_stream_t        **stream;
     ngx_rtmp_live_app_conf_t       *lacf;
 
     lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
@@ -732,14 +1182,7 @@ ngx_rtmp_live_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
                    "live: delete empty stream '%s'",
                    ctx->stream->name);
 
-    stream = ngx_rtmp_live_get_stream(s, ctx->stream->name, 0);
-    if (stream == NULL) {
-        goto next;
-    }
-    *stream = (*stream)->next;
-
-    ctx->stream->next = lacf->free_streams;
-    lacf->free_streams = ctx->stream;
+    ngx_rtmp_live_free_stream(lacf, ctx->stream);
     ctx->stream = NULL;
 
     if (!ctx->silent && !ctx->publishing && !lacf->play_restart) {
@@ -803,12 +1246,13 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_rtmp_live_proc_handler_t     *handler;
     ngx_rtmp_live_ctx_t              *ctx, *pctx;
     ngx_rtmp_codec_ctx_t             *codec_ctx;
-    ngx_chain_t                      *header, *coheader;
+    ngx_chain_t                      *header, *coheader, *pkt;
+    ngx_rtmp_live_pkt_t               meta, rpkt, apkt, acopkt, dpkt;
     ngx_rtmp_live_app_conf_t         *lacf;
     ngx_rtmp_session_t               *ss;
     ngx_rtmp_header_t                 ch, lh, clh;
-    ngx_int_t                         rc, mandatory, i;
-    ngx_uint_t                        prio;
+    ngx_int_t                         rc, mandatory, disposable;
+    ngx_uint_t                        prio, level;
     ngx_uint_t                        peers;
     ngx_uint_t                        meta_version;
     ngx_uint_t                        csidx;
@@ -861,15 +1305,13 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     coheader = NULL;
     meta_version = 0;
     mandatory = 0;
+    disposable = -1;
 
-    for (i = 0; i <= NGX_RTMP_PROTOCOL_HTTP; i++) {
-        handler = ngx_rtmp_live_proc_handlers[i];
-
-        handler->meta = NULL;
-        handler->rpkt = NULL;
-        handler->apkt = NULL;
-        handler->acopkt = NULL;
-    }
+    ngx_memzero(&meta, sizeof(meta));
+    ngx_memzero(&rpkt, sizeof(rpkt));
+    ngx_memzero(&apkt, sizeof(apkt));
+    ngx_memzero(&acopkt, sizeof(acopkt));
+    ngx_memzero(&dpkt, sizeof(dpkt));
 
     prio = (h->type == NGX_RTMP_MSG_VIDEO ?
             ngx_rtmp_get_video_frame_type(in) : 0);
@@ -980,18 +1422,17 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
             }
         }
 
-        if (handler->meta == NULL && meta_version != pctx->meta_version) {
-            handler->meta = handler->meta_message_pt(ss, codec_ctx->meta);
-            if (handler->meta == NULL) {
+        if (meta_version != pctx->meta_version) {
+            pkt = ngx_rtmp_live_pkt_get(ss, pctx->protocol, &meta, NULL, NULL,
+                                        codec_ctx->meta);
+            if (pkt == NULL) {
                 continue;
             }
-        }
 
-        if (handler->meta && meta_version != pctx->meta_version) {
             ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
                            "live: meta");
 
-            if (handler->send_message_pt(ss, handler->meta, 0) == NGX_OK) {
+            if (handler->send_message_pt(ss, pkt, 0) == NGX_OK) {
                 pctx->meta_version = meta_version;
             }
         }
@@ -1006,6 +1447,53 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
             cs->dropped = 0;
         }
 
+        /* congestion control */
+
+        if (lacf->backlog && cs->active && !mandatory) {
+            level = ngx_rtmp_live_congestion(ss, pctx, lacf->backlog);
+
+            if (h->type == NGX_RTMP_MSG_VIDEO) {
+
+                if (pctx->congestion == NGX_RTMP_LIVE_CONGESTION_KEY
+                    && prio != NGX_RTMP_VIDEO_KEY_FRAME)
+                {
+                    level = NGX_RTMP_LIVE_CONGESTION_KEY;
+                }
+
+                if (level != pctx->congestion) {
+                    ngx_log_debug3(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
+                                   "live: congestion %ui -> %ui backlog=%uz",
+                                   pctx->congestion, level,
+                                   ss->out_queued + pctx->backlog);
+
+                    pctx->congestion = level;
+                }
+
+                if (level == NGX_RTMP_LIVE_CONGESTION_KEY) {
+                    ++pctx->nskipped;
+                    cs->absolute = 1;
+                    continue;
+                }
+
+                if (level == NGX_RTMP_LIVE_CONGESTION_NONREF) {
+                    if (disposable == -1) {
+                        disposable = ngx_rtmp_live_disposable(codec_ctx, in);
+                    }
+
+                    if (disposable) {
+                        ++pctx->ndropped_nonref;
+                        cs->absolute = 1;
+                        continue;
+                    }
+                }
+
+            } else if (level == NGX_RTMP_LIVE_CONGESTION_KEY) {
+                ++pctx->nskipped;
+                cs->absolute = 1;
+                continue;
+            }
+        }
+
         /* absolute packet */
 
         if (!cs->active) {
@@ -1043,30 +1531,26 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                                type_s, lh.timestamp);
 
                 if (header) {
-                    if (handler->apkt == NULL) {
-                        handler->apkt = handler->append_message_pt(ss, &lh,
-                                                             NULL, header);
-                        if (handler->apkt == NULL) {
-                            continue;
-                        }
+                    pkt = ngx_rtmp_live_pkt_get(ss, pctx->protocol, &apkt,
+                                                &lh, NULL, header);
+                    if (pkt == NULL) {
+                        continue;
                     }
 
-                    rc = handler->send_message_pt(ss, handler->apkt, 0);
+                    rc = handler->send_message_pt(ss, pkt, 0);
                     if (rc != NGX_OK) {
                         continue;
                     }
                 }
 
                 if (coheader) {
-                    if (handler->acopkt == NULL) {
-                        handler->acopkt = handler->append_message_pt(ss, &clh,
-                                                              NULL, coheader);
-                        if (handler->acopkt == NULL) {
-                            continue;
-                        }
+                    pkt = ngx_rtmp_live_pkt_get(ss, pctx->protocol, &acopkt,
+                                                &clh, NULL, coheader);
+                    if (pkt == NULL) {
+                        continue;
                     }
 
-                    rc = handler->send_message_pt(ss, handler->acopkt, 0);
+                    rc = handler->send_message_pt(ss, pkt, 0);
                     if (rc != NGX_OK) {
                         continue;
                     }
@@ -1085,15 +1569,13 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                                "live: abs %s packet timestamp=%uD",
                                type_s, ch.timestamp);
 
-                if (handler->apkt == NULL) {
-                    handler->apkt = handler->append_message_pt(ss, &ch,
-                                                             NULL, in);
-                    if (handler->apkt == NULL) {
-                        continue;
-                    }
+                pkt = ngx_rtmp_live_pkt_get(ss, pctx->protocol, &apkt,
+                                            &ch, NULL, in);
+                if (pkt == NULL) {
+                    continue;
                 }
 
-                rc = handler->send_message_pt(ss, handler->apkt, prio);
+                rc = handler->send_message_pt(ss, pkt, prio);
                 if (rc != NGX_OK) {
                     continue;
                 }
@@ -1108,20 +1590,28 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
             }
         }
 
-        if (handler->rpkt == NULL) {
-            handler->rpkt = handler->append_message_pt(ss, &ch, &lh, in);
-            if (handler->rpkt == NULL) {
-                continue;
-            }
+        if (cs->absolute) {
+
+            /* resume with an absolute timestamp after congestion drops */
+
+            pkt = ngx_rtmp_live_pkt_get(ss, pctx->protocol, &dpkt, &ch, NULL,
+                                        in);
+        } else {
+            pkt = ngx_rtmp_live_pkt_get(ss, pctx->protocol, &rpkt, &ch, &lh,
+                                        in);
+        }
+
+        if (pkt == NULL) {
+            continue;
         }
 
         /* send relative packet */
 
-        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
-                       "live: rel %s packet delta=%uD",
-                       type_s, delta);
+        ngx_log_debug3(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
+                       "live: rel %s packet delta=%uD absolute=%ui",
+                       type_s, delta, (ngx_uint_t) cs->absolute);
 
-        if (handler->send_message_pt(ss, handler->rpkt, prio) != NGX_OK) {
+        if (handler->send_message_pt(ss, pkt, prio) != NGX_OK) {
             ++pctx->ndropped;
 
             cs->dropped += delta;
@@ -1135,35 +1625,24 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
             continue;
         }
 
-        cs->timestamp += delta;
-        ++peers;
-        ss->current_time = cs->timestamp;
-    }
-
-    for (i = 0; i <= NGX_RTMP_PROTOCOL_HTTP; i++) {
-        handler = ngx_rtmp_live_proc_handlers[i];
-
-        if (handler->meta) {
-            handler->free_message_pt(s, handler->meta);
-            handler->meta = NULL;
-        }
-
-        if (handler->rpkt) {
-            handler->free_message_pt(s, handler->rpkt);
-            handler->rpkt = NULL;
-        }
+        if (cs->absolute) {
+            cs->absolute = 0;
+            cs->timestamp = ch.timestamp;
 
-        if (handler->apkt) {
-            handler->free_message_pt(s, handler->apkt);
-            handler->apkt = NULL;
+        } else {
+            cs->timestamp += delta;
         }
 
-        if (handler->acopkt) {
-            handler->free_message_pt(s, handler->acopkt);
-            handler->acopkt = NULL;
-        }
+        ++peers;
+        ss->current_time = cs->timestamp;
     }
 
+    ngx_rtmp_live_pkt_free(s, &meta);
+    ngx_rtmp_live_pkt_free(s, &rpkt);
+    ngx_rtmp_live_pkt_free(s, &apkt);
+    ngx_rtmp_live_pkt_free(s, &acopkt);
+    ngx_rtmp_live_pkt_free(s, &dpkt);
+
     ngx_rtmp_update_bandwidth(&ctx->stream->bw_in, h->mlen);
     ngx_rtmp_update_bandwidth(&ctx->stream->bw_out, h->mlen * peers);
 
@@ -1182,7 +1661,8 @@ ngx_rtmp_live_data(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 {
     ngx_rtmp_live_proc_handler_t   *handler;
     ngx_rtmp_live_ctx_t            *ctx, *pctx;
-    ngx_chain_t                    *data, *rpkt;
+    ngx_chain_t                    *data, *rpkt, *pkt;
+    ngx_rtmp_live_pkt_t             flv;
     ngx_rtmp_core_srv_conf_t       *cscf;
     ngx_rtmp_live_app_conf_t       *lacf;
     ngx_rtmp_session_t             *ss;
@@ -1259,6 +1739,8 @@ ngx_rtmp_live_data(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     rpkt = ngx_rtmp_append_shared_bufs(cscf, data, in);
 
+    ngx_memzero(&flv, sizeof(flv));
+
     for (pctx = ctx->stream->ctx; pctx; pctx = pctx->next) {
         if (pctx == ctx || pctx->paused) {
             continue;
@@ -1272,21 +1754,17 @@ ngx_rtmp_live_data(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                 continue;
             }
 
-            handler->meta = handler->append_message_pt(ss, &ch, NULL, rpkt);
-            if (handler->meta == NULL) {
+            pkt = ngx_rtmp_live_pkt_get(ss, pctx->protocol, &flv, &ch, NULL,
+                                        rpkt);
+            if (pkt == NULL) {
                 continue;
             }
 
-            if (handler->send_message_pt(ss, handler->meta, 0) != NGX_OK) {
+            if (handler->send_message_pt(ss, pkt, 0) != NGX_OK) {
                 ++pctx->ndropped;
                 cs->dropped += delta;
-                handler->free_message_pt(ss, handler->meta);
-                handler->meta = NULL;
                 continue;
             }
-
-            handler->free_message_pt(ss, handler->meta);
-            handler->meta = NULL;
         } else {
             ngx_rtmp_prepare_message(s, &ch, NULL, rpkt);
             if (ngx_rtmp_send_message(ss, rpkt, prio) != NGX_OK) {
@@ -1309,6 +1787,8 @@ ngx_rtmp_live_data(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         ngx_rtmp_free_shared_chain(cscf, rpkt);
     }
 
+    ngx_rtmp_live_pkt_free(s, &flv);
+
     ngx_rtmp_update_bandwidth(&ctx->stream->bw_in, h->mlen);
     ngx_rtmp_update_bandwidth(&ctx->stream->bw_out, h->mlen * peers);
     ngx_rtmp_update_bandwidth(&ctx->stream->bw_in_data, h->mlen);
@@ -21,8 +21,29 @@ typedef struct ngx_rtmp_live_ctx_s ngx_rtmp_live_ctx_t;
 typedef struct ngx_rtmp_live_stream_s ngx_rtmp_live_stream_t;
 
 
+/* wire encodings a live frame is serialized to */
+#define NGX_RTMP_LIVE_PKT_RTMP          0
+#define NGX_RTMP_LIVE_PKT_FLV           1
+#define NGX_RTMP_LIVE_PKT_FLV_CHUNKED   2
+#define NGX_RTMP_LIVE_PKT_MAX           3
+
+
+/* A frame serialized at most once per encoding; subscribers queue the
+ * shared chains by reference */
+typedef struct {
+    ngx_chain_t                        *chain[NGX_RTMP_LIVE_PKT_MAX];
+} ngx_rtmp_live_pkt_t;
+
+
+/* per subscriber congestion level, see congestion_backlog */
+#define NGX_RTMP_LIVE_CONGESTION_NONE   0
+#define NGX_RTMP_LIVE_CONGESTION_NONREF 1   /* drop non-reference frames */
+#define NGX_RTMP_LIVE_CONGESTION_KEY    2   /* skip to the next keyframe */
+
+
 typedef struct {
     unsigned                            active:1;
+    unsigned                            absolute:1; /* after congestion drop */
     uint32_t                            timestamp;
     uint32_t                            csid;
     uint32_t                            dropped;
@@ -34,6 +55,11 @@ struct ngx_rtmp_live_ctx_s {
     ngx_rtmp_live_stream_t             *stream;
     ngx_rtmp_live_ctx_t                *next;
     ngx_uint_t                          ndropped;
+    ngx_uint_t                          ndropped_nonref;
+    ngx_uint_t                          nskipped;
+    ngx_uint_t                          congestion;
+    size_t                              backlog;   /* kernel send queue */
+    ngx_msec_t                          backlog_time;
     ngx_rtmp_live_chunk_stream_t        cs[2];
     ngx_uint_t                          meta_version;
     ngx_event_t                         idle_evt;
@@ -46,8 +72,11 @@ struct ngx_rtmp_live_ctx_s {
 
 
 struct ngx_rtmp_live_stream_s {
-    u_char                              name[NGX_RTMP_MAX_NAME];
-    ngx_rtmp_live_stream_t             *next;
+    u_char                             *name;      /* null-terminated */
+    size_t                              len;
+    ngx_uint_t                          hash;
+    ngx_queue_t                         queue;     /* all streams of app */
+    ngx_rtmp_live_stream_t             *next;      /* free list */
     ngx_rtmp_live_ctx_t                *ctx;
     ngx_rtmp_live_ctx_t                *pub_ctx;
     ngx_rtmp_bandwidth_t                bw_in;
@@ -62,8 +91,20 @@ struct ngx_rtmp_live_stream_s {
 
 
 typedef struct {
-    ngx_int_t                           nbuckets;
-    ngx_rtmp_live_stream_t            **streams;
+    ngx_uint_t                          hash;
+    ngx_rtmp_live_stream_t             *stream;    /* NULL: empty slot */
+} ngx_rtmp_live_slot_t;
+
+
+typedef struct {
+    ngx_int_t                           nbuckets;  /* initial table size */
+
+    /* open addressing with linear probing, grown and shrunk on demand */
+    ngx_rtmp_live_slot_t               *slots;
+    ngx_uint_t                          nslots;    /* power of 2 */
+    ngx_uint_t                          nstreams;
+    ngx_queue_t                         streams;
+
     ngx_flag_t                          live;
     ngx_flag_t                          meta;
     ngx_msec_t                          sync;
@@ -76,6 +117,7 @@ typedef struct {
     ngx_flag_t                          play_restart;
     ngx_flag_t                          idle_streams;
     ngx_msec_t                          buflen;
+    size_t                              backlog;
     ngx_pool_t                         *pool;
     ngx_rtmp_live_stream_t             *free_streams;
 } ngx_rtmp_live_app_conf_t;
@@ -84,8 +126,21 @@ typedef struct {
 extern ngx_module_t  ngx_rtmp_live_module;
 
 
-ngx_rtmp_live_stream_t **ngx_rtmp_live_get_stream(ngx_rtmp_session_t *s,
+ngx_rtmp_live_stream_t *ngx_rtmp_live_get_stream(ngx_rtmp_session_t *s,
     u_char *name, int create);
+ngx_rtmp_live_stream_t *ngx_rtmp_live_find_stream(
+    ngx_rtmp_live_app_conf_t *lacf, u_char *name, size_t len);
+void ngx_rtmp_live_free_stream(ngx_rtmp_live_app_conf_t *lacf,
+    ngx_rtmp_live_stream_t *stream);
+
+ngx_uint_t ngx_rtmp_live_pkt_variant(ngx_rtmp_session_t *s,
+    ngx_uint_t protocol);
+
+/* h == NULL serializes a metadata message */
+ngx_chain_t *ngx_rtmp_live_pkt_get(ngx_rtmp_session_t *s, ngx_uint_t protocol,
+    ngx_rtmp_live_pkt_t *pkt, ngx_rtmp_header_t *h, ngx_rtmp_header_t *lh,
+    ngx_chain_t *in);
+void ngx_rtmp_live_pkt_free(ngx_rtmp_session_t *s, ngx_rtmp_live_pkt_t *pkt);
 
 
 #endif /* _NGX_RTMP_LIVE_H_INCLUDED_ */
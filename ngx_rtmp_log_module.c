@@ -1123,7 +1123,7 @@ ngx_rtmp_log_disconnect(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_rtmp_log_ctx_t         *ctx;
     size_t                      len;
 
-    if (s->auto_pushed || s->relay) {
+    if (s->auto_pushed || s->relay || s->steered_out) {
         return NGX_OK;
     }
 
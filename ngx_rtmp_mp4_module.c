@@ -12,6 +12,9 @@
 
 
 static ngx_int_t ngx_rtmp_mp4_postconfiguration(ngx_conf_t *cf);
+static ngx_int_t ngx_rtmp_mp4_init_process(ngx_cycle_t *cycle);
+static void ngx_rtmp_mp4_cache_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 static ngx_int_t ngx_rtmp_mp4_init(ngx_rtmp_session_t *s,  ngx_file_t *f,
        ngx_int_t aindex, ngx_int_t vindex);
 static ngx_int_t ngx_rtmp_mp4_done(ngx_rtmp_session_t *s,  ngx_file_t *f);
@@ -178,11 +181,40 @@ typedef struct {
 } ngx_rtmp_mp4_track_t;
 
 
+/*
+ * A parsed moov box.  The sample tables are left where they are in the
+ * mapped box, sessions playing the file take copies of the tracks for
+ * their cursors and point to the same tables.
+ */
 typedef struct {
+    ngx_rbtree_node_t                   node;       /* key: inode */
+    ngx_queue_t                         queue;      /* least recent first */
+    uint64_t                            dev;
+    ngx_file_uniq_t                     uniq;
+    time_t                              mtime;
+    off_t                               size;
+    ngx_int_t                           aindex, vindex;
+    ngx_uint_t                          refs;
+    unsigned                            cached:1;
+
     void                               *mmaped;
     size_t                              mmaped_size;
     ngx_fd_t                            extra;
 
+    ngx_rtmp_mp4_track_t                tracks[2];
+    ngx_uint_t                          ntracks;
+
+    ngx_uint_t                          width;
+    ngx_uint_t                          height;
+    ngx_uint_t                          nchannels;
+    ngx_uint_t                          sample_size;
+    ngx_uint_t                          sample_rate;
+} ngx_rtmp_mp4_index_t;
+
+
+typedef struct {
+    ngx_rtmp_mp4_index_t               *index;
+
     unsigned                            meta_sent:1;
 
     ngx_rtmp_mp4_track_t                tracks[2];
@@ -226,6 +258,18 @@ ngx_rtmp_mp4_from_rtmp_timestamp(ngx_rtmp_mp4_track_t *t, uint32_t ts)
 static u_char                           ngx_rtmp_mp4_buffer[1024*1024];
 
 
+/* files whose moov boxes are kept mapped by a worker */
+#define NGX_RTMP_MP4_CACHE_FILES        64
+
+
+static ngx_rbtree_t                     ngx_rtmp_mp4_cache;
+static ngx_rbtree_node_t                ngx_rtmp_mp4_cache_sentinel;
+static ngx_queue_t                      ngx_rtmp_mp4_cache_queue;
+
+
+ngx_rtmp_mp4_stat_t                     ngx_rtmp_mp4_stat;
+
+
 #if (NGX_WIN32)
 static void *
 ngx_rtmp_mp4_mmap(ngx_fd_t fd, size_t size, off_t offset, ngx_fd_t *extra)
@@ -426,7 +470,7 @@ ngx_module_t  ngx_rtmp_mp4_module = {
     NGX_RTMP_MODULE,                        /* module type */
     NULL,                                   /* init master */
     NULL,                                   /* init module */
-    NULL,                                   /* init process */
+    ngx_rtmp_mp4_init_process,              /* init process */
     NULL,                                   /* init thread */
     NULL,                                   /* exit thread */
     NULL,                                   /* exit process */
@@ -435,6 +479,187 @@ ngx_module_t  ngx_rtmp_mp4_module = {
 };
 
 
+static ngx_int_t
+ngx_rtmp_mp4_init_process(ngx_cycle_t *cycle)
+{
+    ngx_rbtree_init(&ngx_rtmp_mp4_cache, &ngx_rtmp_mp4_cache_sentinel,
+                    ngx_rtmp_mp4_cache_insert_value);
+    ngx_queue_init(&ngx_rtmp_mp4_cache_queue);
+
+    ngx_memzero(&ngx_rtmp_mp4_stat, sizeof(ngx_rtmp_mp4_stat));
+
+    return NGX_OK;
+}
+
+
+/* files are ordered by inode, then by device */
+
+static void
+ngx_rtmp_mp4_cache_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t     **p;
+    ngx_rtmp_mp4_index_t   *idx, *idxt;
+
+    for ( ;; ) {
+
+        if (node->key != temp->key) {
+            p = (node->key < temp->key) ? &temp->left : &temp->right;
+
+        } else {
+            idx = (ngx_rtmp_mp4_index_t *) node;
+            idxt = (ngx_rtmp_mp4_index_t *) temp;
+
+            p = (idx->dev < idxt->dev) ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_rtmp_mp4_index_t *
+ngx_rtmp_mp4_cache_lookup(ngx_rbtree_key_t key, uint64_t dev)
+{
+    ngx_rbtree_node_t     *node, *sentinel;
+    ngx_rtmp_mp4_index_t  *idx;
+
+    node = ngx_rtmp_mp4_cache.root;
+    sentinel = ngx_rtmp_mp4_cache.sentinel;
+
+    while (node != sentinel) {
+
+        if (key != node->key) {
+            node = (key < node->key) ? node->left : node->right;
+            continue;
+        }
+
+        idx = (ngx_rtmp_mp4_index_t *) node;
+
+        if (dev != idx->dev) {
+            node = (dev < idx->dev) ? node->left : node->right;
+            continue;
+        }
+
+        return idx;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_rtmp_mp4_free_index(ngx_rtmp_mp4_index_t *idx, ngx_log_t *log)
+{
+    if (ngx_rtmp_mp4_munmap(idx->mmaped, idx->mmaped_size, &idx->extra)
+        != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "mp4: munmap failed");
+    }
+
+    ngx_rtmp_mp4_stat.mapped -= idx->mmaped_size;
+
+    ngx_free(idx);
+}
+
+
+static void
+ngx_rtmp_mp4_uncache(ngx_rtmp_mp4_index_t *idx, ngx_log_t *log)
+{
+    ngx_rbtree_delete(&ngx_rtmp_mp4_cache, &idx->node);
+    ngx_queue_remove(&idx->queue);
+
+    ngx_rtmp_mp4_stat.files--;
+    idx->cached = 0;
+
+    /* sessions still playing it keep it until they are done */
+
+    if (idx->refs == 0) {
+        ngx_rtmp_mp4_free_index(idx, log);
+    }
+}
+
+
+static void
+ngx_rtmp_mp4_release(ngx_rtmp_mp4_index_t *idx, ngx_log_t *log)
+{
+    if (--idx->refs == 0 && !idx->cached) {
+        ngx_rtmp_mp4_free_index(idx, log);
+    }
+}
+
+
+static ngx_rtmp_mp4_index_t *
+ngx_rtmp_mp4_cache_get(ngx_file_info_t *fi, ngx_int_t aindex,
+    ngx_int_t vindex, ngx_log_t *log)
+{
+    ngx_rtmp_mp4_index_t      *idx;
+
+    idx = ngx_rtmp_mp4_cache_lookup((ngx_rbtree_key_t) ngx_file_uniq(fi),
+                                    ngx_rtmp_file_dev(fi));
+    if (idx == NULL) {
+        return NULL;
+    }
+
+    if (idx->uniq != ngx_file_uniq(fi)
+        || idx->mtime != ngx_file_mtime(fi)
+        || idx->size != ngx_file_size(fi))
+    {
+        /* the file has been replaced since */
+        ngx_rtmp_mp4_uncache(idx, log);
+        return NULL;
+    }
+
+    if (idx->aindex != aindex || idx->vindex != vindex) {
+        /* other tracks selected, replaced by the ones parsed next */
+        return NULL;
+    }
+
+    ngx_queue_remove(&idx->queue);
+    ngx_queue_insert_tail(&ngx_rtmp_mp4_cache_queue, &idx->queue);
+
+    idx->refs++;
+
+    return idx;
+}
+
+
+static void
+ngx_rtmp_mp4_cache_add(ngx_rtmp_mp4_index_t *idx, ngx_log_t *log)
+{
+    ngx_queue_t           *q;
+    ngx_rtmp_mp4_index_t  *old;
+
+    old = ngx_rtmp_mp4_cache_lookup(idx->node.key, idx->dev);
+    if (old) {
+        ngx_rtmp_mp4_uncache(old, log);
+    }
+
+    if (ngx_rtmp_mp4_stat.files >= NGX_RTMP_MP4_CACHE_FILES) {
+        q = ngx_queue_head(&ngx_rtmp_mp4_cache_queue);
+        ngx_rtmp_mp4_uncache(ngx_queue_data(q, ngx_rtmp_mp4_index_t, queue),
+                             log);
+        ngx_rtmp_mp4_stat.evicted++;
+    }
+
+    ngx_rbtree_insert(&ngx_rtmp_mp4_cache, &idx->node);
+    ngx_queue_insert_tail(&ngx_rtmp_mp4_cache_queue, &idx->queue);
+
+    ngx_rtmp_mp4_stat.files++;
+    idx->cached = 1;
+}
+
+
 static ngx_int_t
 ngx_rtmp_mp4_parse_trak(ngx_rtmp_session_t *s, u_char *pos, u_char *last)
 {
@@ -2311,15 +2536,37 @@ next:
 }
 
 
+static void
+ngx_rtmp_mp4_use_index(ngx_rtmp_mp4_ctx_t *ctx, ngx_rtmp_mp4_index_t *idx)
+{
+    ctx->index = idx;
+
+    ngx_memcpy(ctx->tracks, idx->tracks, sizeof(ctx->tracks));
+    ctx->ntracks = idx->ntracks;
+
+    ctx->width = idx->width;
+    ctx->height = idx->height;
+    ctx->nchannels = idx->nchannels;
+    ctx->sample_size = idx->sample_size;
+    ctx->sample_rate = idx->sample_rate;
+}
+
+
 static ngx_int_t
 ngx_rtmp_mp4_init(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_int_t aindex,
                   ngx_int_t vindex)
 {
     ngx_rtmp_mp4_ctx_t         *ctx;
+    ngx_rtmp_mp4_index_t       *idx;
     uint32_t                    hdr[2];
     ssize_t                     n;
     size_t                      offset, page_offset, size, shift;
+    size_t                      mmaped_size;
     uint64_t                    extended_size;
+    void                       *mmaped;
+    ngx_fd_t                    extra;
+    ngx_int_t                   rc;
+    ngx_uint_t                  cacheable;
     ngx_file_info_t             fi;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_mp4_module);
@@ -2332,6 +2579,9 @@ ngx_rtmp_mp4_init(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_int_t aindex,
         }
 
         ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_mp4_module);
+
+    } else if (ctx->index) {
+        ngx_rtmp_mp4_release(ctx->index, s->connection->log);
     }
 
     ngx_memzero(ctx, sizeof(*ctx));
@@ -2339,6 +2589,27 @@ ngx_rtmp_mp4_init(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_int_t aindex,
     ctx->aindex = aindex;
     ctx->vindex = vindex;
 
+    /* parsed moov boxes are cached per file version */
+
+    cacheable = (ngx_fd_info(f->fd, &fi) != NGX_FILE_ERROR);
+
+    if (cacheable) {
+        idx = ngx_rtmp_mp4_cache_get(&fi, aindex, vindex, s->connection->log);
+
+        if (idx) {
+            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                           "mp4: cached moov box, %ui track(s)",
+                           idx->ntracks);
+
+            ngx_rtmp_mp4_stat.hits++;
+            ngx_rtmp_mp4_use_index(ctx, idx);
+
+            return NGX_OK;
+        }
+    }
+
+    ngx_rtmp_mp4_stat.misses++;
+
     offset = 0;
     size   = 0;
 
@@ -2398,19 +2669,71 @@ ngx_rtmp_mp4_init(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_int_t aindex,
     offset += shift;
 
     page_offset = offset & (ngx_pagesize - 1);
-    ctx->mmaped_size = page_offset + size;
+    mmaped_size = page_offset + size;
+    extra = NGX_INVALID_FILE;
 
-    ctx->mmaped = ngx_rtmp_mp4_mmap(f->fd, ctx->mmaped_size,
-                                    offset - page_offset, &ctx->extra);
-    if (ctx->mmaped == NULL) {
+    mmaped = ngx_rtmp_mp4_mmap(f->fd, mmaped_size, offset - page_offset,
+                               &extra);
+    if (mmaped == NULL) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
                       "mp4: mmap failed at offset=%ui, size=%uz",
                       offset, size);
         return NGX_ERROR;
     }
 
-    return ngx_rtmp_mp4_parse(s, (u_char *) ctx->mmaped + page_offset,
-                                 (u_char *) ctx->mmaped + page_offset + size);
+    rc = ngx_rtmp_mp4_parse(s, (u_char *) mmaped + page_offset,
+                               (u_char *) mmaped + page_offset + size);
+
+    idx = NULL;
+
+    if (rc == NGX_OK) {
+        idx = ngx_alloc(sizeof(ngx_rtmp_mp4_index_t), s->connection->log);
+    }
+
+    if (idx == NULL) {
+        if (ngx_rtmp_mp4_munmap(mmaped, mmaped_size, &extra) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                          "mp4: munmap failed");
+        }
+
+        ctx->ntracks = 0;
+
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(idx, sizeof(ngx_rtmp_mp4_index_t));
+
+    idx->refs = 1;
+    idx->mmaped = mmaped;
+    idx->mmaped_size = mmaped_size;
+    idx->extra = extra;
+
+    ngx_memcpy(idx->tracks, ctx->tracks, sizeof(idx->tracks));
+    idx->ntracks = ctx->ntracks;
+
+    idx->width = ctx->width;
+    idx->height = ctx->height;
+    idx->nchannels = ctx->nchannels;
+    idx->sample_size = ctx->sample_size;
+    idx->sample_rate = ctx->sample_rate;
+
+    ctx->index = idx;
+
+    ngx_rtmp_mp4_stat.mapped += mmaped_size;
+
+    if (cacheable) {
+        idx->node.key = (ngx_rbtree_key_t) ngx_file_uniq(&fi);
+        idx->dev = ngx_rtmp_file_dev(&fi);
+        idx->uniq = ngx_file_uniq(&fi);
+        idx->mtime = ngx_file_mtime(&fi);
+        idx->size = ngx_file_size(&fi);
+        idx->aindex = aindex;
+        idx->vindex = vindex;
+
+        ngx_rtmp_mp4_cache_add(idx, s->connection->log);
+    }
+
+    return NGX_OK;
 }
 
 
@@ -2421,20 +2744,14 @@ ngx_rtmp_mp4_done(ngx_rtmp_session_t *s, ngx_file_t *f)
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_mp4_module);
 
-    if (ctx == NULL || ctx->mmaped == NULL) {
+    if (ctx == NULL || ctx->index == NULL) {
         return NGX_OK;
     }
 
-    if (ngx_rtmp_mp4_munmap(ctx->mmaped, ctx->mmaped_size, &ctx->extra)
-        != NGX_OK)
-    {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "mp4: munmap failed");
-        return NGX_ERROR;
-    }
+    ngx_rtmp_mp4_release(ctx->index, s->connection->log);
 
-    ctx->mmaped = NULL;
-    ctx->mmaped_size = 0;
+    ctx->index = NULL;
+    ctx->ntracks = 0;
 
     return NGX_OK;
 }
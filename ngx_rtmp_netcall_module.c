@@ -14,24 +14,75 @@ static void * ngx_rtmp_netcall_create_srv_conf(ngx_conf_t *cf);
 static char * ngx_rtmp_netcall_merge_srv_conf(ngx_conf_t *cf,
        void *parent, void *child);
 
-static void ngx_rtmp_netcall_close(ngx_connection_t *cc);
-static void ngx_rtmp_netcall_detach(ngx_connection_t *cc);
-
 static void ngx_rtmp_netcall_recv(ngx_event_t *rev);
 static void ngx_rtmp_netcall_send(ngx_event_t *wev);
 
+static void ngx_rtmp_netcall_wait_handler(ngx_event_t *ev);
+static void ngx_rtmp_netcall_keepalive_close_handler(ngx_event_t *ev);
+static void ngx_rtmp_netcall_keepalive_dummy_handler(ngx_event_t *ev);
+
+
+/* recycled request pools kept per upstream */
+#define NGX_RTMP_NETCALL_POOLS                          16
+
+/* first bytes of a response header line looked at */
+#define NGX_RTMP_NETCALL_LINE                           128
+
+/* response framing states of keepalive calls */
+#define NGX_RTMP_NETCALL_HTTP_HEADER                    0
+#define NGX_RTMP_NETCALL_HTTP_BODY                      1
+#define NGX_RTMP_NETCALL_HTTP_UNTIL_CLOSE               2
+#define NGX_RTMP_NETCALL_HTTP_CHUNK_SIZE                3
+#define NGX_RTMP_NETCALL_HTTP_CHUNK_EXT                 4
+#define NGX_RTMP_NETCALL_HTTP_CHUNK_DATA                5
+#define NGX_RTMP_NETCALL_HTTP_CHUNK_END                 6
+#define NGX_RTMP_NETCALL_HTTP_TRAILER                   7
+#define NGX_RTMP_NETCALL_HTTP_DONE                      8
+
 
 typedef struct {
     ngx_msec_t                                  timeout;
     size_t                                      bufsize;
+    ngx_uint_t                                  keepalive;
+    ngx_msec_t                                  keepalive_timeout;
+    ngx_uint_t                                  max_conns;
+    ngx_queue_t                                 upstreams;
     ngx_log_t                                  *log;
 } ngx_rtmp_netcall_srv_conf_t;
 
 
+/* idle connections, active calls and waiting calls of one peer,
+ * allocated in the worker at the first call to it */
+typedef struct {
+    ngx_queue_t                                 queue;
+    ngx_url_t                                  *url;
+    ngx_queue_t                                 cache;   /* MRU first */
+    ngx_queue_t                                 free;
+    ngx_queue_t                                 waiting;
+    ngx_uint_t                                  active;
+    ngx_uint_t                                  npools;
+    ngx_pool_t                                 *pools[NGX_RTMP_NETCALL_POOLS];
+} ngx_rtmp_netcall_upstream_t;
+
+
+typedef struct {
+    ngx_queue_t                                 queue;
+    ngx_connection_t                           *connection;
+    ngx_rtmp_netcall_upstream_t                *upstream;
+} ngx_rtmp_netcall_cache_t;
+
+
 typedef struct ngx_rtmp_netcall_session_s {
     ngx_rtmp_session_t                         *session;
     ngx_peer_connection_t                      *pc;
+    ngx_connection_t                           *connection;
+    ngx_pool_t                                 *pool;
     ngx_url_t                                  *url;
+    ngx_rtmp_netcall_srv_conf_t                *conf;
+    ngx_rtmp_netcall_upstream_t                *upstream;
+    ngx_queue_t                                 queue;   /* waiting */
+    ngx_event_t                                 wait_evt;
+    ngx_msec_t                                  queued;
     struct ngx_rtmp_netcall_session_s          *next;
     void                                       *arg;
     ngx_rtmp_netcall_handle_pt                  handle;
@@ -40,9 +91,24 @@ typedef struct ngx_rtmp_netcall_session_s {
     ngx_chain_t                                *in;
     ngx_chain_t                                *inlast;
     ngx_chain_t                                *out;
+    ngx_chain_t                                *request;
     ngx_msec_t                                  timeout;
     unsigned                                    detached:1;
+    unsigned                                    keepalive:1;
+    unsigned                                    reused:1;
+    unsigned                                    received:1;
+    unsigned                                    waiting:1;
+    unsigned                                    chunked:1;
+    unsigned                                    close:1;
     size_t                                      bufsize;
+
+    /* response framing */
+    ngx_uint_t                                  state;
+    ngx_int_t                                   status;
+    off_t                                       content_length;
+    off_t                                       rest;
+    size_t                                      nline;
+    u_char                                      line[NGX_RTMP_NETCALL_LINE];
 } ngx_rtmp_netcall_session_t;
 
 
@@ -52,6 +118,10 @@ typedef struct {
 } ngx_rtmp_netcall_ctx_t;
 
 
+static void ngx_rtmp_netcall_close(ngx_rtmp_netcall_session_t *cs,
+       ngx_uint_t keep);
+
+
 static ngx_command_t  ngx_rtmp_netcall_commands[] = {
 
     { ngx_string("netcall_timeout"),
@@ -68,6 +138,27 @@ static ngx_command_t  ngx_rtmp_netcall_commands[] = {
       offsetof(ngx_rtmp_netcall_srv_conf_t, bufsize),
       NULL },
 
+    { ngx_string("netcall_keepalive"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_netcall_srv_conf_t, keepalive),
+      NULL },
+
+    { ngx_string("netcall_keepalive_timeout"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_netcall_srv_conf_t, keepalive_timeout),
+      NULL },
+
+    { ngx_string("netcall_max_conns"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_netcall_srv_conf_t, max_conns),
+      NULL },
+
       ngx_null_command
 };
 
@@ -112,6 +203,11 @@ ngx_rtmp_netcall_create_srv_conf(ngx_conf_t *cf)
 
     nscf->timeout = NGX_CONF_UNSET_MSEC;
     nscf->bufsize = NGX_CONF_UNSET_SIZE;
+    nscf->keepalive = NGX_CONF_UNSET_UINT;
+    nscf->keepalive_timeout = NGX_CONF_UNSET_MSEC;
+    nscf->max_conns = NGX_CONF_UNSET_UINT;
+
+    ngx_queue_init(&nscf->upstreams);
 
     nscf->log = &cf->cycle->new_log;
 
@@ -127,6 +223,10 @@ ngx_rtmp_netcall_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_msec_value(conf->timeout, prev->timeout, 10000);
     ngx_conf_merge_size_value(conf->bufsize, prev->bufsize, 1024);
+    ngx_conf_merge_uint_value(conf->keepalive, prev->keepalive, 0);
+    ngx_conf_merge_msec_value(conf->keepalive_timeout,
+                              prev->keepalive_timeout, 60000);
+    ngx_conf_merge_uint_value(conf->max_conns, prev->max_conns, 0);
 
     return NGX_CONF_OK;
 }
@@ -143,7 +243,7 @@ ngx_rtmp_netcall_disconnect(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     if (ctx) {
         for (cs = ctx->cs; cs; cs = cs->next) {
-            ngx_rtmp_netcall_detach(cs->pc->connection);
+            cs->detached = 1;
         }
     }
 
@@ -171,16 +271,164 @@ ngx_rtmp_netcall_free_peer(ngx_peer_connection_t *pc, void *data,
 }
 
 
+static ngx_rtmp_netcall_upstream_t *
+ngx_rtmp_netcall_get_upstream(ngx_rtmp_netcall_srv_conf_t *nscf,
+        ngx_url_t *url)
+{
+    ngx_rtmp_netcall_upstream_t    *up;
+    ngx_rtmp_netcall_cache_t       *cache;
+    ngx_queue_t                    *q;
+    ngx_uint_t                      n;
+
+    /* callbacks to the same address share connections */
+
+    for (q = ngx_queue_head(&nscf->upstreams);
+         q != ngx_queue_sentinel(&nscf->upstreams);
+         q = ngx_queue_next(q))
+    {
+        up = ngx_queue_data(q, ngx_rtmp_netcall_upstream_t, queue);
+
+        if (up->url == url ||
+            (up->url->socklen == url->socklen &&
+             ngx_memcmp(&up->url->sockaddr, &url->sockaddr, url->socklen)
+             == 0))
+        {
+            return up;
+        }
+    }
+
+    up = ngx_pcalloc(ngx_cycle->pool, sizeof(ngx_rtmp_netcall_upstream_t) +
+                     nscf->keepalive * sizeof(ngx_rtmp_netcall_cache_t));
+    if (up == NULL) {
+        return NULL;
+    }
+
+    up->url = url;
+
+    ngx_queue_init(&up->cache);
+    ngx_queue_init(&up->free);
+    ngx_queue_init(&up->waiting);
+
+    cache = (ngx_rtmp_netcall_cache_t *) &up[1];
+
+    for (n = 0; n < nscf->keepalive; n++) {
+        cache[n].upstream = up;
+        ngx_queue_insert_head(&up->free, &cache[n].queue);
+    }
+
+    ngx_queue_insert_tail(&nscf->upstreams, &up->queue);
+
+    return up;
+}
+
+
+static ngx_pool_t *
+ngx_rtmp_netcall_get_pool(ngx_rtmp_netcall_srv_conf_t *nscf,
+        ngx_rtmp_netcall_upstream_t *up)
+{
+    if (up->npools) {
+        return up->pools[--up->npools];
+    }
+
+    return ngx_create_pool(4096, nscf->log);
+}
+
+
+static void
+ngx_rtmp_netcall_free_pool(ngx_rtmp_netcall_upstream_t *up,
+        ngx_pool_t *pool)
+{
+    /* pools that grew while receiving a large reply are not kept */
+
+    if (up->npools < NGX_RTMP_NETCALL_POOLS &&
+        pool->d.next == NULL && pool->cleanup == NULL)
+    {
+        ngx_reset_pool(pool);
+        up->pools[up->npools++] = pool;
+        return;
+    }
+
+    ngx_destroy_pool(pool);
+}
+
+
+static ngx_int_t
+ngx_rtmp_netcall_connect(ngx_rtmp_netcall_session_t *cs, ngx_uint_t cached)
+{
+    ngx_rtmp_netcall_upstream_t    *up;
+    ngx_rtmp_netcall_cache_t       *item;
+    ngx_peer_connection_t          *pc;
+    ngx_connection_t               *cc;
+    ngx_queue_t                    *q;
+    ngx_int_t                       rc;
+
+    up = cs->upstream;
+
+    if (cs->keepalive && cached && !ngx_queue_empty(&up->cache)) {
+        q = ngx_queue_head(&up->cache);
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&up->free, q);
+
+        item = ngx_queue_data(q, ngx_rtmp_netcall_cache_t, queue);
+        cc = item->connection;
+
+        if (cc->read->timer_set) {
+            ngx_del_timer(cc->read);
+        }
+
+        cc->idle = 0;
+        cs->reused = 1;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, cc->log, 0,
+                "netcall: reusing connection to '%V'", &cs->url->url);
+
+    } else {
+        pc = cs->pc;
+
+        if (pc == NULL) {
+            pc = ngx_pcalloc(cs->pool, sizeof(ngx_peer_connection_t));
+            if (pc == NULL) {
+                return NGX_ERROR;
+            }
+
+            pc->log = cs->conf->log;
+            pc->get = ngx_rtmp_netcall_get_peer;
+            pc->free = ngx_rtmp_netcall_free_peer;
+            pc->data = cs;
+
+            cs->pc = pc;
+        }
+
+        rc = ngx_event_connect_peer(pc);
+        if (rc != NGX_OK && rc != NGX_AGAIN) {
+            return NGX_ERROR;
+        }
+
+        cc = pc->connection;
+        cs->reused = 0;
+    }
+
+    cc->data = cs;
+    cc->pool = cs->pool;
+    cc->write->handler = ngx_rtmp_netcall_send;
+    cc->read->handler = ngx_rtmp_netcall_recv;
+
+    cs->connection = cc;
+    up->active++;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_rtmp_netcall_create(ngx_rtmp_session_t *s, ngx_rtmp_netcall_init_t *ci)
 {
     ngx_rtmp_netcall_ctx_t         *ctx;
-    ngx_peer_connection_t          *pc;
     ngx_rtmp_netcall_session_t     *cs;
     ngx_rtmp_netcall_srv_conf_t    *nscf;
-    ngx_connection_t               *c, *cc;
+    ngx_rtmp_netcall_upstream_t    *up;
+    ngx_connection_t               *c;
     ngx_pool_t                     *pool;
-    ngx_int_t                       rc;
 
     pool = NULL;
     c = s->connection;
@@ -206,20 +454,20 @@ ngx_rtmp_netcall_create(ngx_rtmp_session_t *s, ngx_rtmp_netcall_init_t *ci)
         }
     }
 
-    /* Create netcall pool, connection, session.
+    up = ngx_rtmp_netcall_get_upstream(nscf, ci->url);
+    if (up == NULL) {
+        goto error;
+    }
+
+    /* Create (or take a recycled) netcall pool and session.
      * Note we use shared (app-wide) log because
      * s->connection->log might be unavailable
      * in detached netcall when it's being closed */
-    pool = ngx_create_pool(4096, nscf->log);
+    pool = ngx_rtmp_netcall_get_pool(nscf, up);
     if (pool == NULL) {
         goto error;
     }
 
-    pc = ngx_pcalloc(pool, sizeof(ngx_peer_connection_t));
-    if (pc == NULL) {
-        goto error;
-    }
-
     cs = ngx_pcalloc(pool, sizeof(ngx_rtmp_netcall_session_t));
     if (cs == NULL) {
         goto error;
@@ -237,6 +485,9 @@ ngx_rtmp_netcall_create(ngx_rtmp_session_t *s, ngx_rtmp_netcall_init_t *ci)
     cs->timeout = nscf->timeout;
     cs->bufsize = nscf->bufsize;
     cs->url = ci->url;
+    cs->conf = nscf;
+    cs->upstream = up;
+    cs->pool = pool;
     cs->session = s;
     cs->filter = ci->filter;
     cs->sink = ci->sink;
@@ -245,34 +496,44 @@ ngx_rtmp_netcall_create(ngx_rtmp_session_t *s, ngx_rtmp_netcall_init_t *ci)
         cs->detached = 1;
     }
 
-    pc->log = nscf->log;
-    pc->get = ngx_rtmp_netcall_get_peer;
-    pc->free = ngx_rtmp_netcall_free_peer;
-    pc->data = cs;
-
-    /* connect */
-    rc = ngx_event_connect_peer(pc);
-    if (rc != NGX_OK && rc != NGX_AGAIN ) {
-        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                "netcall: connection failed");
-        goto error;
+    if (ci->keepalive && nscf->keepalive) {
+        cs->keepalive = 1;
+        cs->content_length = -1;
     }
 
-    cc = pc->connection;
-    cc->data = cs;
-    cc->pool = pool;
-    cs->pc = pc;
+    cs->out = ci->create(s, ci->arg, pool, cs->keepalive);
 
-    cs->out = ci->create(s, ci->arg, pool);
     if (cs->out == NULL) {
         ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                 "netcall: creation failed");
-        ngx_close_connection(pc->connection);
         goto error;
     }
 
-    cc->write->handler = ngx_rtmp_netcall_send;
-    cc->read->handler = ngx_rtmp_netcall_recv;
+    cs->request = cs->out;
+
+    if (nscf->max_conns && up->active >= nscf->max_conns) {
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                "netcall: waiting for a connection to '%V'", &ci->url->url);
+
+        ngx_queue_insert_tail(&up->waiting, &cs->queue);
+        cs->waiting = 1;
+
+        /* the call has to be done in "netcall_timeout" from now on */
+
+        cs->queued = ngx_current_msec;
+
+        cs->wait_evt.data = cs;
+        cs->wait_evt.log = nscf->log;
+        cs->wait_evt.handler = ngx_rtmp_netcall_wait_handler;
+        cs->wait_evt.cancelable = 1;
+
+        ngx_add_timer(&cs->wait_evt, nscf->timeout);
+
+    } else if (ngx_rtmp_netcall_connect(cs, 1) != NGX_OK) {
+        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                "netcall: connection failed");
+        goto error;
+    }
 
     if (!cs->detached) {
         cs->next = ctx->cs;
@@ -280,7 +541,11 @@ ngx_rtmp_netcall_create(ngx_rtmp_session_t *s, ngx_rtmp_netcall_init_t *ci)
         ctx->nb_cs++;
     }
 
-    ngx_rtmp_netcall_send(cc->write);
+    if (cs->waiting) {
+        return NGX_OK;
+    }
+
+    ngx_rtmp_netcall_send(cs->connection->write);
 
     return c->destroyed ? NGX_ERROR : NGX_OK;
 
@@ -294,21 +559,189 @@ error:
 
 
 static void
-ngx_rtmp_netcall_close(ngx_connection_t *cc)
+ngx_rtmp_netcall_next(ngx_rtmp_netcall_srv_conf_t *nscf,
+        ngx_rtmp_netcall_upstream_t *up)
 {
-    ngx_rtmp_netcall_session_t         *cs, **css;
+    ngx_msec_t                          waited;
+    ngx_rtmp_netcall_session_t         *cs;
+    ngx_queue_t                        *q;
+
+    while (!ngx_queue_empty(&up->waiting)
+           && (nscf->max_conns == 0 || up->active < nscf->max_conns))
+    {
+        q = ngx_queue_head(&up->waiting);
+        ngx_queue_remove(q);
+
+        cs = ngx_queue_data(q, ngx_rtmp_netcall_session_t, queue);
+        cs->waiting = 0;
+
+        if (cs->wait_evt.timer_set) {
+            ngx_del_timer(&cs->wait_evt);
+        }
+
+        waited = ngx_current_msec - cs->queued;
+        cs->timeout = (waited < cs->timeout) ? cs->timeout - waited : 1;
+
+        if (ngx_rtmp_netcall_connect(cs, 1) != NGX_OK) {
+            ngx_rtmp_netcall_close(cs, 0);
+            continue;
+        }
+
+        ngx_rtmp_netcall_send(cs->connection->write);
+    }
+}
+
+
+static void
+ngx_rtmp_netcall_wait_handler(ngx_event_t *ev)
+{
+    ngx_rtmp_netcall_session_t         *cs;
+
+    cs = ev->data;
+
+    ngx_log_error(NGX_LOG_INFO, ev->log, NGX_ETIMEDOUT,
+                  "netcall: no connection to '%V' in time", &cs->url->url);
+
+    ngx_queue_remove(&cs->queue);
+    cs->waiting = 0;
+
+    ngx_rtmp_netcall_close(cs, 0);
+}
+
+
+static void
+ngx_rtmp_netcall_keepalive(ngx_rtmp_netcall_session_t *cs)
+{
+    ngx_rtmp_netcall_upstream_t        *up;
+    ngx_rtmp_netcall_cache_t           *item;
+    ngx_connection_t                   *cc;
+    ngx_queue_t                        *q;
+
+    cc = cs->connection;
+    up = cs->upstream;
+
+    if (cc->read->timer_set) {
+        ngx_del_timer(cc->read);
+    }
+
+    if (cc->write->timer_set) {
+        ngx_del_timer(cc->write);
+    }
+
+    if (cc->error || cc->close
+        || ngx_handle_read_event(cc->read, 0) != NGX_OK)
+    {
+        ngx_close_connection(cc);
+        return;
+    }
+
+    if (ngx_queue_empty(&up->free)) {
+        q = ngx_queue_last(&up->cache);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_rtmp_netcall_cache_t, queue);
+        ngx_close_connection(item->connection);
+
+    } else {
+        q = ngx_queue_head(&up->free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_rtmp_netcall_cache_t, queue);
+    }
+
+    ngx_queue_insert_head(&up->cache, q);
+
+    item->connection = cc;
+
+    cc->data = item;
+    cc->pool = NULL;
+    cc->idle = 1;
+    cc->read->handler = ngx_rtmp_netcall_keepalive_close_handler;
+    cc->write->handler = ngx_rtmp_netcall_keepalive_dummy_handler;
+
+    ngx_add_timer(cc->read, cs->conf->keepalive_timeout);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, cc->log, 0,
+            "netcall: keeping connection to '%V'", &cs->url->url);
+
+    if (cc->read->ready) {
+        ngx_rtmp_netcall_keepalive_close_handler(cc->read);
+    }
+}
+
+
+static void
+ngx_rtmp_netcall_keepalive_close_handler(ngx_event_t *ev)
+{
+    ngx_rtmp_netcall_cache_t           *item;
+    ngx_connection_t                   *cc;
+    ssize_t                             n;
+    u_char                              buf[1];
+
+    cc = ev->data;
+
+    if (cc->close || ev->timedout) {
+        goto close;
+    }
+
+    /* an idle peer sends nothing but the end of the connection */
+
+    n = recv(cc->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+close:
+
+    item = cc->data;
+
+    ngx_queue_remove(&item->queue);
+    ngx_close_connection(item->connection);
+    ngx_queue_insert_head(&item->upstream->free, &item->queue);
+}
+
+
+static void
+ngx_rtmp_netcall_keepalive_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ev->log, 0,
+            "netcall: keepalive dummy handler");
+}
+
+
+static void
+ngx_rtmp_netcall_close(ngx_rtmp_netcall_session_t *cs, ngx_uint_t keep)
+{
+    ngx_rtmp_netcall_session_t        **css;
+    ngx_rtmp_netcall_srv_conf_t        *nscf;
+    ngx_rtmp_netcall_upstream_t        *up;
     ngx_pool_t                         *pool;
     ngx_rtmp_session_t                 *s;
     ngx_rtmp_netcall_ctx_t             *ctx;
     ngx_buf_t                          *b;
 
-    cs = cc->data;
+    nscf = cs->conf;
+    up = cs->upstream;
+    pool = cs->pool;
 
-    if (cc->destroyed) {
-        return;
-    }
+    if (cs->connection) {
+        if (keep) {
+            ngx_rtmp_netcall_keepalive(cs);
 
-    cc->destroyed = 1;
+        } else {
+            ngx_close_connection(cs->connection);
+        }
+
+        cs->connection = NULL;
+        up->active--;
+    }
 
     if (!cs->detached) {
         s = cs->session;
@@ -335,19 +768,281 @@ ngx_rtmp_netcall_close(ngx_connection_t *cc)
         }
     }
 
-    pool = cc->pool;
-    ngx_close_connection(cc);
-    ngx_destroy_pool(pool);
+    ngx_rtmp_netcall_free_pool(up, pool);
+
+    ngx_rtmp_netcall_next(nscf, up);
 }
 
 
-static void
-ngx_rtmp_netcall_detach(ngx_connection_t *cc)
+static ngx_int_t
+ngx_rtmp_netcall_retry(ngx_rtmp_netcall_session_t *cs)
 {
-    ngx_rtmp_netcall_session_t         *cs;
+    ngx_chain_t                        *cl;
 
-    cs = cc->data;
-    cs->detached = 1;
+    /* the peer may have closed a cached connection just before
+     * it was reused; send the request once more on a new one */
+
+    if (!cs->reused || cs->received) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, cs->connection->log, 0,
+            "netcall: cached connection to '%V' failed, retrying",
+            &cs->url->url);
+
+    ngx_close_connection(cs->connection);
+    cs->connection = NULL;
+    cs->upstream->active--;
+
+    /* request buffers are all temporary ones written from start */
+
+    for (cl = cs->request; cl; cl = cl->next) {
+        cl->buf->pos = cl->buf->start;
+    }
+
+    cs->out = cs->request;
+
+    if (ngx_rtmp_netcall_connect(cs, 0) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    ngx_rtmp_netcall_send(cs->connection->write);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_netcall_http_value(u_char *p, u_char *last, char *name, size_t len,
+        ngx_str_t *value)
+{
+    if ((size_t) (last - p) < len
+        || ngx_strncasecmp(p, (u_char *) name, len) != 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    for (p += len; p < last && (*p == ' ' || *p == '\t'); p++);
+    for ( /* void */ ; last > p && (last[-1] == ' ' || last[-1] == '\t');
+         last--);
+
+    value->data = p;
+    value->len = last - p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_netcall_http_header(ngx_rtmp_netcall_session_t *cs)
+{
+    u_char                             *p, *last;
+    ngx_str_t                           v;
+
+    p = cs->line;
+    last = p + cs->nline;
+
+    cs->nline = 0;
+
+    if (cs->status == 0) {
+
+        /* HTTP/1.x NNN */
+
+        if (last - p < 12 || ngx_strncmp(p, "HTTP/1.", 7) != 0) {
+            return NGX_ERROR;
+        }
+
+        cs->status = ngx_atoi(p + 9, 3);
+        if (cs->status < 100) {
+            return NGX_ERROR;
+        }
+
+        if (p[7] == '0') {
+            cs->close = 1;
+        }
+
+        return NGX_OK;
+    }
+
+    if (p != last) {
+
+        if (ngx_rtmp_netcall_http_value(p, last, "content-length:",
+                    sizeof("content-length:") - 1, &v) == NGX_OK)
+        {
+            cs->content_length = ngx_atoof(v.data, v.len);
+            if (cs->content_length == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+        } else if (ngx_rtmp_netcall_http_value(p, last, "transfer-encoding:",
+                    sizeof("transfer-encoding:") - 1, &v) == NGX_OK)
+        {
+            if (ngx_strlcasestrn(v.data, v.data + v.len,
+                                 (u_char *) "chunked",
+                                 sizeof("chunked") - 2) != NULL)
+            {
+                cs->chunked = 1;
+            }
+
+        } else if (ngx_rtmp_netcall_http_value(p, last, "connection:",
+                    sizeof("connection:") - 1, &v) == NGX_OK)
+        {
+            if (ngx_strlcasestrn(v.data, v.data + v.len,
+                                 (u_char *) "close",
+                                 sizeof("close") - 2) != NULL)
+            {
+                cs->close = 1;
+            }
+        }
+
+        return NGX_OK;
+    }
+
+    /* end of header */
+
+    if (cs->status < 200) {
+        cs->status = 0;
+        cs->chunked = 0;
+        cs->content_length = -1;
+        return NGX_OK;
+    }
+
+    if (cs->status == 204 || cs->status == 304) {
+        cs->state = NGX_RTMP_NETCALL_HTTP_DONE;
+
+    } else if (cs->chunked) {
+        cs->state = NGX_RTMP_NETCALL_HTTP_CHUNK_SIZE;
+        cs->rest = 0;
+
+    } else if (cs->content_length >= 0) {
+        cs->state = cs->content_length ? NGX_RTMP_NETCALL_HTTP_BODY
+                                       : NGX_RTMP_NETCALL_HTTP_DONE;
+        cs->rest = cs->content_length;
+
+    } else {
+        cs->state = NGX_RTMP_NETCALL_HTTP_UNTIL_CLOSE;
+        cs->close = 1;
+    }
+
+    return NGX_OK;
+}
+
+
+/* NGX_OK once the response of a keepalive call is complete */
+static ngx_int_t
+ngx_rtmp_netcall_http_parse(ngx_rtmp_netcall_session_t *cs, u_char *p,
+        u_char *last)
+{
+    off_t                               n;
+    ngx_int_t                           d;
+    u_char                              c, ch;
+
+    while (p < last) {
+
+        switch (cs->state) {
+
+        case NGX_RTMP_NETCALL_HTTP_BODY:
+        case NGX_RTMP_NETCALL_HTTP_CHUNK_DATA:
+            n = ngx_min(cs->rest, last - p);
+            p += n;
+            cs->rest -= n;
+
+            if (cs->rest == 0) {
+                cs->state = (cs->state == NGX_RTMP_NETCALL_HTTP_BODY)
+                            ? NGX_RTMP_NETCALL_HTTP_DONE
+                            : NGX_RTMP_NETCALL_HTTP_CHUNK_END;
+            }
+
+            continue;
+
+        case NGX_RTMP_NETCALL_HTTP_UNTIL_CLOSE:
+            return NGX_AGAIN;
+
+        case NGX_RTMP_NETCALL_HTTP_DONE:
+            /* the peer sent more than one response */
+            cs->close = 1;
+            return NGX_OK;
+        }
+
+        c = *p++;
+
+        if (c == '\r') {
+            continue;
+        }
+
+        switch (cs->state) {
+
+        case NGX_RTMP_NETCALL_HTTP_HEADER:
+            if (c != '\n') {
+                if (cs->nline < NGX_RTMP_NETCALL_LINE) {
+                    cs->line[cs->nline++] = c;
+                }
+                break;
+            }
+
+            if (ngx_rtmp_netcall_http_header(cs) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            break;
+
+        case NGX_RTMP_NETCALL_HTTP_CHUNK_SIZE:
+            ch = (u_char) (c | 0x20);
+
+            if (c >= '0' && c <= '9') {
+                d = c - '0';
+
+            } else if (ch >= 'a' && ch <= 'f') {
+                d = ch - 'a' + 10;
+
+            } else {
+                d = -1;
+            }
+
+            if (d >= 0) {
+                if (cs->rest > (NGX_MAX_OFF_T_VALUE - 15) / 16) {
+                    return NGX_ERROR;
+                }
+
+                cs->rest = cs->rest * 16 + d;
+                break;
+            }
+
+            cs->state = NGX_RTMP_NETCALL_HTTP_CHUNK_EXT;
+
+            /* fall through */
+
+        case NGX_RTMP_NETCALL_HTTP_CHUNK_EXT:
+            if (c == '\n') {
+                cs->state = cs->rest ? NGX_RTMP_NETCALL_HTTP_CHUNK_DATA
+                                     : NGX_RTMP_NETCALL_HTTP_TRAILER;
+            }
+
+            break;
+
+        case NGX_RTMP_NETCALL_HTTP_CHUNK_END:
+            if (c == '\n') {
+                cs->state = NGX_RTMP_NETCALL_HTTP_CHUNK_SIZE;
+            }
+
+            break;
+
+        case NGX_RTMP_NETCALL_HTTP_TRAILER:
+            if (c != '\n') {
+                cs->nline = 1;
+                break;
+            }
+
+            if (cs->nline == 0) {
+                cs->state = NGX_RTMP_NETCALL_HTTP_DONE;
+            }
+
+            cs->nline = 0;
+            break;
+        }
+    }
+
+    return cs->state == NGX_RTMP_NETCALL_HTTP_DONE ? NGX_OK : NGX_AGAIN;
 }
 
 
@@ -357,19 +1052,15 @@ ngx_rtmp_netcall_recv(ngx_event_t *rev)
     ngx_rtmp_netcall_session_t         *cs;
     ngx_connection_t                   *cc;
     ngx_chain_t                        *cl;
-    ngx_int_t                           n;
+    ngx_int_t                           n, rc;
     ngx_buf_t                          *b;
 
     cc = rev->data;
     cs = cc->data;
 
-    if (cc->destroyed) {
-        return;
-    }
-
     if (rev->timedout) {
         cc->timedout = 1;
-        ngx_rtmp_netcall_close(cc);
+        ngx_rtmp_netcall_close(cs, 0);
         return;
     }
 
@@ -385,7 +1076,7 @@ ngx_rtmp_netcall_recv(ngx_event_t *rev)
             if (cs->in && cs->sink) {
                 if (!cs->detached) {
                     if (cs->sink(cs->session, cs->in) != NGX_OK) {
-                        ngx_rtmp_netcall_close(cc);
+                        ngx_rtmp_netcall_close(cs, 0);
                         return;
                     }
                 }
@@ -394,17 +1085,17 @@ ngx_rtmp_netcall_recv(ngx_event_t *rev)
                 b->pos = b->last = b->start;
 
             } else {
-                cl = ngx_alloc_chain_link(cc->pool);
+                cl = ngx_alloc_chain_link(cs->pool);
                 if (cl == NULL) {
-                    ngx_rtmp_netcall_close(cc);
+                    ngx_rtmp_netcall_close(cs, 0);
                     return;
                 }
 
                 cl->next = NULL;
 
-                cl->buf = ngx_create_temp_buf(cc->pool, cs->bufsize);
+                cl->buf = ngx_create_temp_buf(cs->pool, cs->bufsize);
                 if (cl->buf == NULL) {
-                    ngx_rtmp_netcall_close(cc);
+                    ngx_rtmp_netcall_close(cs, 0);
                     return;
                 }
 
@@ -423,7 +1114,9 @@ ngx_rtmp_netcall_recv(ngx_event_t *rev)
         n = cc->recv(cc, b->last, b->end - b->last);
 
         if (n == NGX_ERROR || n == 0) {
-            ngx_rtmp_netcall_close(cc);
+            if (ngx_rtmp_netcall_retry(cs) != NGX_OK) {
+                ngx_rtmp_netcall_close(cs, 0);
+            }
             return;
         }
 
@@ -431,18 +1124,28 @@ ngx_rtmp_netcall_recv(ngx_event_t *rev)
             if (cs->filter && cs->in
                 && cs->filter(cs->in) != NGX_AGAIN)
             {
-                ngx_rtmp_netcall_close(cc);
+                ngx_rtmp_netcall_close(cs, 0);
                 return;
             }
 
             ngx_add_timer(rev, cs->timeout);
             if (ngx_handle_read_event(rev, 0) != NGX_OK) {
-                ngx_rtmp_netcall_close(cc);
+                ngx_rtmp_netcall_close(cs, 0);
             }
             return;
         }
 
+        cs->received = 1;
         b->last += n;
+
+        if (cs->keepalive) {
+            rc = ngx_rtmp_netcall_http_parse(cs, b->last - n, b->last);
+
+            if (rc != NGX_AGAIN) {
+                ngx_rtmp_netcall_close(cs, rc == NGX_OK && !cs->close);
+                return;
+            }
+        }
     }
 }
 
@@ -457,15 +1160,11 @@ ngx_rtmp_netcall_send(ngx_event_t *wev)
     cc = wev->data;
     cs = cc->data;
 
-    if (cc->destroyed) {
-        return;
-    }
-
     if (wev->timedout) {
         ngx_log_error(NGX_LOG_INFO, cc->log, NGX_ETIMEDOUT,
                 "netcall: client send timed out");
         cc->timedout = 1;
-        ngx_rtmp_netcall_close(cc);
+        ngx_rtmp_netcall_close(cs, 0);
         return;
     }
 
@@ -476,7 +1175,9 @@ ngx_rtmp_netcall_send(ngx_event_t *wev)
     cl = cc->send_chain(cc, cs->out, 0);
 
     if (cl == NGX_CHAIN_ERROR) {
-        ngx_rtmp_netcall_close(cc);
+        if (ngx_rtmp_netcall_retry(cs) != NGX_OK) {
+            ngx_rtmp_netcall_close(cs, 0);
+        }
         return;
     }
 
@@ -486,7 +1187,7 @@ ngx_rtmp_netcall_send(ngx_event_t *wev)
     if (cl) {
         ngx_add_timer(wev, cs->timeout);
         if (ngx_handle_write_event(wev, 0) != NGX_OK) {
-            ngx_rtmp_netcall_close(cc);
+            ngx_rtmp_netcall_close(cs, 0);
         }
         return;
     }
@@ -503,16 +1204,17 @@ ngx_chain_t *
 ngx_rtmp_netcall_http_format_request(ngx_int_t method, ngx_str_t *host,
                                      ngx_str_t *uri, ngx_chain_t *args,
                                      ngx_chain_t *body, ngx_pool_t *pool,
-                                     ngx_str_t *content_type)
+                                     ngx_str_t *content_type,
+                                     ngx_uint_t keepalive)
 {
     ngx_chain_t                    *al, *bl, *ret;
     ngx_buf_t                      *b;
     size_t                          content_length;
     static const char              *methods[2] = { "GET", "POST" };
-    static const char               rq_tmpl[] = " HTTP/1.0\r\n"
+    static const char               rq_tmpl[] = " HTTP/1.%c\r\n"
                                                 "Host: %V\r\n"
                                                 "Content-Type: %V\r\n"
-                                                "Connection: Close\r\n"
+                                                "Connection: %s\r\n"
                                                 "Content-Length: %uz\r\n"
                                                 "\r\n";
 
@@ -556,15 +1258,20 @@ ngx_rtmp_netcall_http_format_request(ngx_int_t method, ngx_str_t *host,
     }
 
     b = ngx_create_temp_buf(pool, sizeof(rq_tmpl) + host->len +
-                            content_type->len + NGX_SIZE_T_LEN);
+                            content_type->len + NGX_SIZE_T_LEN +
+                            sizeof("keep-alive"));
     if (b == NULL) {
         return NULL;
     }
 
     bl->buf = b;
 
+    /* keepalive calls have their response delimited by its header */
+
     b->last = ngx_snprintf(b->last, b->end - b->last, rq_tmpl,
-                           host, content_type, content_length);
+                           keepalive ? '1' : '0', host, content_type,
+                           keepalive ? "keep-alive" : "Close",
+                           content_length);
 
     al->next = bl;
     bl->next = body;
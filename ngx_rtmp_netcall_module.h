@@ -14,7 +14,7 @@
 
 
 typedef ngx_chain_t * (*ngx_rtmp_netcall_create_pt)(ngx_rtmp_session_t *s,
-        void *arg, ngx_pool_t *pool);
+        void *arg, ngx_pool_t *pool, ngx_uint_t keepalive);
 typedef ngx_int_t (*ngx_rtmp_netcall_filter_pt)(ngx_chain_t *in);
 typedef ngx_int_t (*ngx_rtmp_netcall_sink_pt)(ngx_rtmp_session_t *s,
         ngx_chain_t *in);
@@ -33,7 +33,14 @@ typedef ngx_int_t (*ngx_rtmp_netcall_handle_pt)(ngx_rtmp_session_t *s,
  * netcalls from disconect handlers. Netcall disconnect
  * handler which detaches active netcalls is executed
  * BEFORE your handler. It leads to a crash
- * after netcall connection is closed */
+ * after netcall connection is closed
+ *
+ * Setting keepalive lets an HTTP call go over a connection
+ * cached by "netcall_keepalive".  The create handler is told
+ * whether the call does and passes it on to
+ * ngx_rtmp_netcall_http_format_request(): the request is then
+ * HTTP/1.1 and the reply ends with its body instead of the
+ * connection */
 typedef struct {
     ngx_url_t                      *url;
     ngx_rtmp_netcall_create_pt      create;
@@ -42,6 +49,7 @@ typedef struct {
     ngx_rtmp_netcall_handle_pt      handle;
     void                           *arg;
     size_t                          argsize;
+    ngx_uint_t                      keepalive;
 } ngx_rtmp_netcall_init_t;
 
 
@@ -54,7 +62,7 @@ ngx_chain_t * ngx_rtmp_netcall_http_format_session(ngx_rtmp_session_t *s,
         ngx_pool_t *pool);
 ngx_chain_t * ngx_rtmp_netcall_http_format_request(ngx_int_t method,
         ngx_str_t *host, ngx_str_t *uri, ngx_chain_t *args, ngx_chain_t *body,
-        ngx_pool_t *pool, ngx_str_t *content_type);
+        ngx_pool_t *pool, ngx_str_t *content_type, ngx_uint_t keepalive);
 ngx_chain_t * ngx_rtmp_netcall_http_skip_header(ngx_chain_t *in);
 
 
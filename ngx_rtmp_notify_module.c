@@ -44,6 +44,8 @@ static ngx_int_t ngx_rtmp_notify_done(ngx_rtmp_session_t *s, char *cbname,
 ngx_str_t   ngx_rtmp_notify_urlencoded =
             ngx_string("application/x-www-form-urlencoded");
 
+static ngx_str_t   ngx_rtmp_notify_text = ngx_string("text/plain");
+
 
 #define NGX_RTMP_NOTIFY_PUBLISHING              0x01
 #define NGX_RTMP_NOTIFY_PLAYING                 0x02
@@ -74,8 +76,14 @@ typedef struct {
     ngx_uint_t                                  method;
     ngx_msec_t                                  update_timeout;
     ngx_flag_t                                  update_strict;
+    ngx_flag_t                                  update_batch;
     ngx_flag_t                                  relay_redirect;
     ngx_flag_t                                  no_resolve;
+
+    /* sessions of the worker reported by one batched update */
+    ngx_queue_t                                 batch;
+    ngx_event_t                                 batch_evt;
+    ngx_uint_t                                  batch_seq;
 } ngx_rtmp_notify_app_conf_t;
 
 
@@ -91,6 +99,10 @@ typedef struct {
     u_char                                      args[NGX_RTMP_MAX_ARGS];
     ngx_event_t                                 update_evt;
     time_t                                      start;
+    ngx_rtmp_session_t                         *session;
+    ngx_queue_t                                 batch;
+    ngx_uint_t                                  batch_seq;
+    unsigned                                    batched:1;
 } ngx_rtmp_notify_ctx_t;
 
 
@@ -187,6 +199,13 @@ static ngx_command_t  ngx_rtmp_notify_commands[] = {
       offsetof(ngx_rtmp_notify_app_conf_t, update_strict),
       NULL },
 
+    { ngx_string("notify_update_batch"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_notify_app_conf_t, update_batch),
+      NULL },
+
     { ngx_string("notify_relay_redirect"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_flag_slot,
@@ -251,9 +270,12 @@ ngx_rtmp_notify_create_app_conf(ngx_conf_t *cf)
     nacf->method = NGX_CONF_UNSET_UINT;
     nacf->update_timeout = NGX_CONF_UNSET_MSEC;
     nacf->update_strict = NGX_CONF_UNSET;
+    nacf->update_batch = NGX_CONF_UNSET;
     nacf->relay_redirect = NGX_CONF_UNSET;
     nacf->no_resolve = NGX_CONF_UNSET;
 
+    ngx_queue_init(&nacf->batch);
+
     return nacf;
 }
 
@@ -281,6 +303,7 @@ ngx_rtmp_notify_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_msec_value(conf->update_timeout, prev->update_timeout,
                               30000);
     ngx_conf_merge_value(conf->update_strict, prev->update_strict, 0);
+    ngx_conf_merge_value(conf->update_batch, prev->update_batch, 0);
     ngx_conf_merge_value(conf->relay_redirect, prev->relay_redirect, 0);
     ngx_conf_merge_value(conf->no_resolve, prev->no_resolve, 1);
 
@@ -329,7 +352,8 @@ ngx_rtmp_notify_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
 static ngx_chain_t *
 ngx_rtmp_notify_create_request(ngx_rtmp_session_t *s, ngx_pool_t *pool,
-                                   ngx_uint_t url_idx, ngx_chain_t *args)
+                                   ngx_uint_t url_idx, ngx_chain_t *args,
+                                   ngx_uint_t keepalive)
 {
     ngx_rtmp_notify_app_conf_t *nacf;
     ngx_chain_t                *al, *bl, *cl;
@@ -356,13 +380,14 @@ ngx_rtmp_notify_create_request(ngx_rtmp_session_t *s, ngx_pool_t *pool,
 
     return ngx_rtmp_netcall_http_format_request(nacf->method, &url->host,
                                                 &url->uri, al, bl, pool,
-                                                &ngx_rtmp_notify_urlencoded);
+                                                &ngx_rtmp_notify_urlencoded,
+                                                keepalive);
 }
 
 
 static ngx_chain_t *
 ngx_rtmp_notify_connect_create(ngx_rtmp_session_t *s, void *arg,
-        ngx_pool_t *pool)
+        ngx_pool_t *pool, ngx_uint_t keepalive)
 {
     ngx_rtmp_connect_t             *v = arg;
 
@@ -463,13 +488,14 @@ ngx_rtmp_notify_connect_create(ngx_rtmp_session_t *s, void *arg,
 
     return ngx_rtmp_netcall_http_format_request(nscf->method, &url->host,
                                                 &url->uri, al, bl, pool,
-                                                &ngx_rtmp_notify_urlencoded);
+                                                &ngx_rtmp_notify_urlencoded,
+                                                keepalive);
 }
 
 
 static ngx_chain_t *
 ngx_rtmp_notify_disconnect_create(ngx_rtmp_session_t *s, void *arg,
-        ngx_pool_t *pool)
+        ngx_pool_t *pool, ngx_uint_t keepalive)
 {
     ngx_rtmp_notify_srv_conf_t     *nscf;
     ngx_url_t                      *url;
@@ -524,13 +550,14 @@ ngx_rtmp_notify_disconnect_create(ngx_rtmp_session_t *s, void *arg,
 
     return ngx_rtmp_netcall_http_format_request(nscf->method, &url->host,
                                                 &url->uri, al, bl, pool,
-                                                &ngx_rtmp_notify_urlencoded);
+                                                &ngx_rtmp_notify_urlencoded,
+                                                keepalive);
 }
 
 
 static ngx_chain_t *
 ngx_rtmp_notify_publish_create(ngx_rtmp_session_t *s, void *arg,
-        ngx_pool_t *pool)
+        ngx_pool_t *pool, ngx_uint_t keepalive)
 {
     ngx_rtmp_publish_t             *v = arg;
 
@@ -575,13 +602,14 @@ ngx_rtmp_notify_publish_create(ngx_rtmp_session_t *s, void *arg,
         b->last = (u_char *) ngx_cpymem(b->last, v->args, args_len);
     }
 
-    return ngx_rtmp_notify_create_request(s, pool, NGX_RTMP_NOTIFY_PUBLISH, pl);
+    return ngx_rtmp_notify_create_request(s, pool, NGX_RTMP_NOTIFY_PUBLISH, pl,
+                                          keepalive);
 }
 
 
 static ngx_chain_t *
 ngx_rtmp_notify_play_create(ngx_rtmp_session_t *s, void *arg,
-        ngx_pool_t *pool)
+        ngx_pool_t *pool, ngx_uint_t keepalive)
 {
     ngx_rtmp_play_t                *v = arg;
 
@@ -626,13 +654,14 @@ ngx_rtmp_notify_play_create(ngx_rtmp_session_t *s, void *arg,
         b->last = (u_char *) ngx_cpymem(b->last, v->args, args_len);
     }
 
-    return ngx_rtmp_notify_create_request(s, pool, NGX_RTMP_NOTIFY_PLAY, pl);
+    return ngx_rtmp_notify_create_request(s, pool, NGX_RTMP_NOTIFY_PLAY, pl,
+                                          keepalive);
 }
 
 
 static ngx_chain_t *
 ngx_rtmp_notify_done_create(ngx_rtmp_session_t *s, void *arg,
-        ngx_pool_t *pool)
+        ngx_pool_t *pool, ngx_uint_t keepalive)
 {
     ngx_rtmp_notify_done_t         *ds = arg;
 
@@ -677,13 +706,14 @@ ngx_rtmp_notify_done_create(ngx_rtmp_session_t *s, void *arg,
         b->last = (u_char *) ngx_cpymem(b->last, ctx->args, args_len);
     }
 
-    return ngx_rtmp_notify_create_request(s, pool, ds->url_idx, pl);
+    return ngx_rtmp_notify_create_request(s, pool, ds->url_idx, pl,
+                                          keepalive);
 }
 
 
 static ngx_chain_t *
 ngx_rtmp_notify_update_create(ngx_rtmp_session_t *s, void *arg,
-        ngx_pool_t *pool)
+        ngx_pool_t *pool, ngx_uint_t keepalive)
 {
     ngx_chain_t                    *pl;
     ngx_buf_t                      *b;
@@ -745,13 +775,14 @@ ngx_rtmp_notify_update_create(ngx_rtmp_session_t *s, void *arg,
         b->last = (u_char *) ngx_cpymem(b->last, ctx->args, args_len);
     }
 
-    return ngx_rtmp_notify_create_request(s, pool, NGX_RTMP_NOTIFY_UPDATE, pl);
+    return ngx_rtmp_notify_create_request(s, pool, NGX_RTMP_NOTIFY_UPDATE, pl,
+                                          keepalive);
 }
 
 
 static ngx_chain_t *
 ngx_rtmp_notify_record_done_create(ngx_rtmp_session_t *s, void *arg,
-                                   ngx_pool_t *pool)
+                                   ngx_pool_t *pool, ngx_uint_t keepalive)
 {
     ngx_rtmp_record_done_t         *v = arg;
 
@@ -805,7 +836,7 @@ ngx_rtmp_notify_record_done_create(ngx_rtmp_session_t *s, void *arg,
     }
 
     return ngx_rtmp_notify_create_request(s, pool, NGX_RTMP_NOTIFY_RECORD_DONE,
-                                          pl);
+                                          pl, keepalive);
 }
 
 
@@ -1247,6 +1278,7 @@ ngx_rtmp_notify_update(ngx_event_t *e)
     ngx_memzero(&ci, sizeof(ci));
 
     ci.url = url;
+    ci.keepalive = 1;
     ci.create = ngx_rtmp_notify_update_create;
     ci.handle = ngx_rtmp_notify_update_handle;
 
@@ -1260,6 +1292,335 @@ ngx_rtmp_notify_update(ngx_event_t *e)
 }
 
 
+static ngx_chain_t *
+ngx_rtmp_notify_batch_create(ngx_rtmp_session_t *s, void *arg,
+        ngx_pool_t *pool, ngx_uint_t keepalive)
+{
+    ngx_rtmp_notify_app_conf_t     *nacf;
+    ngx_rtmp_notify_ctx_t          *ctx;
+    ngx_rtmp_session_t             *ss;
+    ngx_chain_t                    *al, *bl;
+    ngx_buf_t                      *b;
+    ngx_queue_t                    *q;
+    ngx_url_t                      *url;
+    ngx_uint_t                      n;
+    size_t                          len;
+
+    nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
+
+    url = nacf->url[NGX_RTMP_NOTIFY_UPDATE];
+
+    n = 0;
+    len = 0;
+
+    for (q = ngx_queue_head(&nacf->batch);
+         q != ngx_queue_sentinel(&nacf->batch);
+         q = ngx_queue_next(q))
+    {
+        ctx = ngx_queue_data(q, ngx_rtmp_notify_ctx_t, batch);
+
+        len += NGX_INT_T_LEN + sizeof(" publish ") - 1 + NGX_TIME_T_LEN +
+               1 + NGX_INT32_LEN + 1 + NGX_INT32_LEN + 1 +
+               ngx_strlen(ctx->name) * 3 + 1;
+        n++;
+    }
+
+    al = ngx_alloc_chain_link(pool);
+    if (al == NULL) {
+        return NULL;
+    }
+
+    b = ngx_create_temp_buf(pool,
+                            sizeof("call=update&app=") - 1 + s->app.len * 3 +
+                            sizeof("&sessions=") - 1 + NGX_INT_T_LEN);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    al->buf = b;
+    al->next = NULL;
+
+    b->last = ngx_cpymem(b->last, (u_char *) "call=update&app=",
+                         sizeof("call=update&app=") - 1);
+    b->last = (u_char *) ngx_escape_uri(b->last, s->app.data, s->app.len,
+                                        NGX_ESCAPE_ARGS);
+    b->last = ngx_sprintf(b->last, "&sessions=%ui", n);
+
+    bl = ngx_alloc_chain_link(pool);
+    if (bl == NULL) {
+        return NULL;
+    }
+
+    b = ngx_create_temp_buf(pool, len);
+    if (b == NULL) {
+        return NULL;
+    }
+
+    bl->buf = b;
+    bl->next = NULL;
+
+    /* one line per session: clientid, type, time, bytes in and out, name */
+
+    for (q = ngx_queue_head(&nacf->batch);
+         q != ngx_queue_sentinel(&nacf->batch);
+         q = ngx_queue_next(q))
+    {
+        ctx = ngx_queue_data(q, ngx_rtmp_notify_ctx_t, batch);
+        ss = ctx->session;
+
+        b->last = ngx_sprintf(b->last, "%ui %s %T %uD %uD ",
+                              (ngx_uint_t) ss->connection->number,
+                              (ctx->flags & NGX_RTMP_NOTIFY_PUBLISHING)
+                              ? "publish" : "play",
+                              ngx_cached_time->sec - ctx->start,
+                              ss->in_bytes, ss->out_bytes);
+
+        b->last = (u_char *) ngx_escape_uri(b->last, ctx->name,
+                                            ngx_strlen(ctx->name),
+                                            NGX_ESCAPE_ARGS);
+        *b->last++ = '\n';
+    }
+
+    return ngx_rtmp_netcall_http_format_request(NGX_RTMP_NETCALL_HTTP_POST,
+                                                &url->host, &url->uri,
+                                                al, bl, pool,
+                                                &ngx_rtmp_notify_text,
+                                                keepalive);
+}
+
+
+static ngx_uint_t
+ngx_rtmp_notify_parse_ids(ngx_chain_t *in, ngx_uint_t *ids)
+{
+    u_char         *p;
+    ngx_uint_t      n, id;
+    ngx_flag_t      digit, skip;
+
+    n = 0;
+    id = 0;
+    digit = 0;
+    skip = 0;
+
+    for ( /* void */ ; in; in = in->next) {
+        for (p = in->buf->pos; p != in->buf->last; p++) {
+            if (*p >= '0' && *p <= '9') {
+
+                /* too long to be a clientid, kept out of the list */
+
+                if (id > ((ngx_uint_t) -1 - (*p - '0')) / 10) {
+                    skip = 1;
+                }
+
+                id = skip ? 0 : id * 10 + (*p - '0');
+                digit = 1;
+                continue;
+            }
+
+            if (digit && !skip) {
+                if (ids) {
+                    ids[n] = id;
+                }
+
+                n++;
+            }
+
+            id = 0;
+            digit = 0;
+            skip = 0;
+        }
+    }
+
+    if (digit && !skip) {
+        if (ids) {
+            ids[n] = id;
+        }
+
+        n++;
+    }
+
+    return n;
+}
+
+
+static int ngx_libc_cdecl
+ngx_rtmp_notify_cmp_ids(const void *one, const void *two)
+{
+    ngx_uint_t      a, b;
+
+    a = *(ngx_uint_t *) one;
+    b = *(ngx_uint_t *) two;
+
+    return (a > b) - (a < b);
+}
+
+
+/* a queued session is in every batch sent since it joined */
+
+static ngx_inline ngx_flag_t
+ngx_rtmp_notify_batch_sent(ngx_rtmp_notify_ctx_t *ctx, ngx_uint_t seq)
+{
+    return (ngx_int_t) (seq - ctx->batch_seq) >= 0;
+}
+
+
+static ngx_int_t
+ngx_rtmp_notify_batch_handle(ngx_rtmp_session_t *s,
+        void *arg, ngx_chain_t *in)
+{
+    ngx_rtmp_notify_app_conf_t *nacf;
+    ngx_rtmp_notify_ctx_t      *ctx;
+    ngx_rtmp_session_t         *ss;
+    ngx_queue_t                *q;
+    ngx_uint_t                 *ids, n, id, lo, hi, mid, seq;
+    ngx_int_t                   rc;
+
+    nacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_notify_module);
+
+    seq = *(ngx_uint_t *) arg;
+
+    rc = ngx_rtmp_notify_parse_http_retcode(s, in);
+
+    if ((!nacf->update_strict && rc == NGX_ERROR) ||
+         (nacf->update_strict && rc != NGX_OK))
+    {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                      "notify: batch update failed");
+
+        if (!nacf->update_strict) {
+            return NGX_OK;
+        }
+
+        for (q = ngx_queue_head(&nacf->batch);
+             q != ngx_queue_sentinel(&nacf->batch);
+             q = ngx_queue_next(q))
+        {
+            ctx = ngx_queue_data(q, ngx_rtmp_notify_ctx_t, batch);
+
+            if (ngx_rtmp_notify_batch_sent(ctx, seq)) {
+                ngx_rtmp_finalize_session(ctx->session);
+            }
+        }
+
+        return NGX_OK;
+    }
+
+    /* the body lists the clientids to drop */
+
+    in = ngx_rtmp_netcall_http_skip_header(in);
+
+    n = ngx_rtmp_notify_parse_ids(in, NULL);
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    ids = ngx_alloc(n * sizeof(ngx_uint_t), s->connection->log);
+    if (ids == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_rtmp_notify_parse_ids(in, ids);
+    ngx_qsort(ids, n, sizeof(ngx_uint_t), ngx_rtmp_notify_cmp_ids);
+
+    for (q = ngx_queue_head(&nacf->batch);
+         q != ngx_queue_sentinel(&nacf->batch);
+         q = ngx_queue_next(q))
+    {
+        ctx = ngx_queue_data(q, ngx_rtmp_notify_ctx_t, batch);
+        ss = ctx->session;
+
+        if (!ngx_rtmp_notify_batch_sent(ctx, seq)) {
+            continue;
+        }
+
+        id = (ngx_uint_t) ss->connection->number;
+
+        lo = 0;
+        hi = n;
+
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+
+            if (ids[mid] < id) {
+                lo = mid + 1;
+
+            } else {
+                hi = mid;
+            }
+        }
+
+        if (lo == n || ids[lo] != id) {
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_INFO, ss->connection->log, 0,
+                      "notify: dropped by batch update");
+
+        /* closing is posted, the queue stays intact meanwhile */
+        ngx_rtmp_finalize_session(ss);
+    }
+
+    ngx_free(ids);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_notify_batch(ngx_event_t *e)
+{
+    ngx_rtmp_notify_app_conf_t *nacf;
+    ngx_rtmp_notify_ctx_t      *ctx;
+    ngx_rtmp_netcall_init_t     ci;
+    ngx_url_t                  *url;
+    ngx_uint_t                  seq;
+
+    nacf = e->data;
+
+    if (ngx_queue_empty(&nacf->batch)) {
+        return;
+    }
+
+    url = nacf->url[NGX_RTMP_NOTIFY_UPDATE];
+
+    /* The call is made on behalf of the oldest session; if it
+     * disconnects first, the reply is lost and the sessions are
+     * reported again in the next period */
+
+    ctx = ngx_queue_data(ngx_queue_head(&nacf->batch),
+                         ngx_rtmp_notify_ctx_t, batch);
+
+    ngx_log_error(NGX_LOG_INFO, e->log, 0,
+                  "notify: batch update '%V'", &url->url);
+
+    ngx_add_timer(e, nacf->update_timeout);
+
+    /* the reply only concerns the sessions queued by now */
+
+    seq = nacf->batch_seq++;
+
+    ngx_memzero(&ci, sizeof(ci));
+
+    ci.url = url;
+    ci.keepalive = 1;
+    ci.create = ngx_rtmp_notify_batch_create;
+    ci.handle = ngx_rtmp_notify_batch_handle;
+    ci.arg = &seq;
+    ci.argsize = sizeof(seq);
+
+    ngx_rtmp_netcall_create(ctx->session, &ci);
+}
+
+
+static void
+ngx_rtmp_notify_unbatch(ngx_rtmp_notify_ctx_t *ctx)
+{
+    if (ctx->batched) {
+        ngx_queue_remove(&ctx->batch);
+        ctx->batched = 0;
+    }
+}
+
+
 static void
 ngx_rtmp_notify_init(ngx_rtmp_session_t *s,
         u_char name[NGX_RTMP_MAX_NAME], u_char args[NGX_RTMP_MAX_ARGS],
@@ -1296,6 +1657,29 @@ ngx_rtmp_notify_init(ngx_rtmp_session_t *s,
         return;
     }
 
+    if (nacf->update_batch) {
+        if (!ctx->batched) {
+            ctx->start = ngx_cached_time->sec;
+            ctx->session = s;
+            ctx->batch_seq = nacf->batch_seq;
+            ctx->batched = 1;
+            ngx_queue_insert_tail(&nacf->batch, &ctx->batch);
+        }
+
+        e = &nacf->batch_evt;
+
+        if (!e->timer_set) {
+            e->data = nacf;
+            e->log = ngx_cycle->log;
+            e->handler = ngx_rtmp_notify_batch;
+            e->cancelable = 1;
+
+            ngx_add_timer(e, nacf->update_timeout);
+        }
+
+        return;
+    }
+
     if (ctx->update_evt.timer_set) {
         return;
     }
@@ -1323,7 +1707,7 @@ ngx_rtmp_notify_connect(ngx_rtmp_session_t *s, ngx_rtmp_connect_t *v)
     ngx_rtmp_netcall_init_t         ci;
     ngx_url_t                      *url;
 
-    if (s->auto_pushed || s->relay) {
+    if (s->auto_pushed || s->relay || s->steered_in) {
         goto next;
     }
 
@@ -1340,6 +1724,7 @@ ngx_rtmp_notify_connect(ngx_rtmp_session_t *s, ngx_rtmp_connect_t *v)
     ngx_memzero(&ci, sizeof(ci));
 
     ci.url = url;
+    ci.keepalive = 1;
     ci.create = ngx_rtmp_notify_connect_create;
     ci.handle = ngx_rtmp_notify_connect_handle;
     ci.arg = v;
@@ -1358,10 +1743,16 @@ static ngx_int_t
 ngx_rtmp_notify_disconnect(ngx_rtmp_session_t *s)
 {
     ngx_rtmp_notify_srv_conf_t     *nscf;
+    ngx_rtmp_notify_ctx_t          *ctx;
     ngx_rtmp_netcall_init_t         ci;
     ngx_url_t                      *url;
 
-    if (s->auto_pushed || s->relay) {
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_notify_module);
+    if (ctx) {
+        ngx_rtmp_notify_unbatch(ctx);
+    }
+
+    if (s->auto_pushed || s->relay || s->steered_out) {
         goto next;
     }
 
@@ -1378,6 +1769,7 @@ ngx_rtmp_notify_disconnect(ngx_rtmp_session_t *s)
     ngx_memzero(&ci, sizeof(ci));
 
     ci.url = url;
+    ci.keepalive = 1;
     ci.create = ngx_rtmp_notify_disconnect_create;
 
     ngx_rtmp_netcall_create(s, &ci);
@@ -1417,6 +1809,7 @@ ngx_rtmp_notify_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
     ngx_memzero(&ci, sizeof(ci));
 
     ci.url = url;
+    ci.keepalive = 1;
     ci.create = ngx_rtmp_notify_publish_create;
     ci.handle = ngx_rtmp_notify_publish_handle;
     ci.arg = v;
@@ -1459,6 +1852,7 @@ ngx_rtmp_notify_play(ngx_rtmp_session_t *s, ngx_rtmp_play_t *v)
     ngx_memzero(&ci, sizeof(ci));
 
     ci.url = url;
+    ci.keepalive = 1;
     ci.create = ngx_rtmp_notify_play_create;
     ci.handle = ngx_rtmp_notify_play_handle;
     ci.arg = v;
@@ -1512,6 +1906,8 @@ ngx_rtmp_notify_close_stream(ngx_rtmp_session_t *s,
         ngx_del_timer(&ctx->update_evt);
     }
 
+    ngx_rtmp_notify_unbatch(ctx);
+
     ctx->flags = 0;
 
 next:
@@ -1541,9 +1937,10 @@ ngx_rtmp_notify_record_done(ngx_rtmp_session_t *s, ngx_rtmp_record_done_t *v)
 
     ngx_memzero(&ci, sizeof(ci));
 
-    ci.url    = nacf->url[NGX_RTMP_NOTIFY_RECORD_DONE];
-    ci.create = ngx_rtmp_notify_record_done_create;
-    ci.arg    = v;
+    ci.url       = nacf->url[NGX_RTMP_NOTIFY_RECORD_DONE];
+    ci.keepalive = 1;
+    ci.create    = ngx_rtmp_notify_record_done_create;
+    ci.arg       = v;
 
     ngx_rtmp_netcall_create(s, &ci);
 
@@ -1576,6 +1973,7 @@ ngx_rtmp_notify_done(ngx_rtmp_session_t *s, char *cbname, ngx_uint_t url_idx)
     ngx_memzero(&ci, sizeof(ci));
 
     ci.url = url;
+    ci.keepalive = 1;
     ci.arg = &ds;
     ci.create = ngx_rtmp_notify_done_create;
 
@@ -87,7 +87,18 @@ typedef struct {
 } ngx_rtmp_play_main_conf_t;
 
 
+/* per-worker counters of the moov boxes kept by the mp4 format */
+typedef struct {
+    ngx_uint_t              hits;
+    ngx_uint_t              misses;
+    ngx_uint_t              evicted;
+    ngx_uint_t              files;
+    size_t                  mapped;  /* cached or still played */
+} ngx_rtmp_mp4_stat_t;
+
+
 extern ngx_module_t         ngx_rtmp_play_module;
+extern ngx_rtmp_mp4_stat_t  ngx_rtmp_mp4_stat;
 
 
 #endif /* _NGX_RTMP_PLAY_H_INCLUDED_ */
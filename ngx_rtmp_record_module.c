@@ -22,6 +22,15 @@ static ngx_rtmp_stream_begin_pt     next_stream_begin;
 static ngx_rtmp_stream_eof_pt       next_stream_eof;
 
 
+/* a file reported once the writes queued for it are done */
+typedef struct {
+    ngx_rtmp_session_t                 *session;
+    ngx_rtmp_record_rec_ctx_t          *rctx;
+    ngx_str_t                           path;
+    unsigned                            done:1;
+} ngx_rtmp_record_closed_t;
+
+
 static char *ngx_rtmp_record_recorder(ngx_conf_t *cf, ngx_command_t *cmd,
        void *conf);
 static ngx_int_t ngx_rtmp_record_postconfiguration(ngx_conf_t *cf);
@@ -39,6 +48,14 @@ static ngx_int_t ngx_rtmp_record_node_open(ngx_rtmp_session_t *s,
        ngx_rtmp_record_rec_ctx_t *rctx);
 static ngx_int_t ngx_rtmp_record_node_close(ngx_rtmp_session_t *s,
        ngx_rtmp_record_rec_ctx_t *rctx);
+static void ngx_rtmp_record_flush_handler(ngx_event_t *ev);
+static ngx_int_t ngx_rtmp_record_flush(ngx_rtmp_session_t *s,
+       ngx_rtmp_record_rec_ctx_t *rctx);
+static ngx_int_t ngx_rtmp_record_fail(ngx_rtmp_session_t *s,
+       ngx_rtmp_record_rec_ctx_t *rctx);
+static ngx_int_t ngx_rtmp_record_close_file(ngx_rtmp_session_t *s,
+       ngx_rtmp_record_rec_ctx_t *rctx, ngx_uint_t done);
+static void ngx_rtmp_record_closed(void *data, ngx_uint_t errors);
 static void  ngx_rtmp_record_make_path(ngx_rtmp_session_t *s,
        ngx_rtmp_record_rec_ctx_t *rctx, ngx_str_t *path);
 static ngx_int_t ngx_rtmp_record_init(ngx_rtmp_session_t *s);
@@ -122,6 +139,30 @@ static ngx_command_t  ngx_rtmp_record_commands[] = {
       offsetof(ngx_rtmp_record_app_conf_t, max_frames),
       NULL },
 
+    { ngx_string("record_buffer"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|
+                         NGX_RTMP_REC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_record_app_conf_t, buffer),
+      NULL },
+
+    { ngx_string("record_flush_interval"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|
+                         NGX_RTMP_REC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_record_app_conf_t, flush_interval),
+      NULL },
+
+    { ngx_string("record_aio"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|
+                         NGX_RTMP_REC_CONF|NGX_CONF_TAKE12,
+      ngx_rtmp_aio_set_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_record_app_conf_t, aio),
+      NULL },
+
     { ngx_string("record_interval"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|
                          NGX_RTMP_REC_CONF|NGX_CONF_TAKE1,
@@ -191,6 +232,9 @@ ngx_rtmp_record_create_app_conf(ngx_conf_t *cf)
 
     racf->max_size = NGX_CONF_UNSET_SIZE;
     racf->max_frames = NGX_CONF_UNSET_SIZE;
+    racf->buffer = NGX_CONF_UNSET_SIZE;
+    racf->flush_interval = NGX_CONF_UNSET_MSEC;
+    racf->aio = NGX_CONF_UNSET_PTR;
     racf->interval = NGX_CONF_UNSET_MSEC;
     racf->unique = NGX_CONF_UNSET;
     racf->append = NGX_CONF_UNSET;
@@ -217,6 +261,9 @@ ngx_rtmp_record_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_str_value(conf->suffix, prev->suffix, ".flv");
     ngx_conf_merge_size_value(conf->max_size, prev->max_size, 0);
     ngx_conf_merge_size_value(conf->max_frames, prev->max_frames, 0);
+    ngx_conf_merge_size_value(conf->buffer, prev->buffer, 0);
+    ngx_conf_merge_msec_value(conf->flush_interval, prev->flush_interval,
+                              1000);
     ngx_conf_merge_value(conf->unique, prev->unique, 0);
     ngx_conf_merge_value(conf->append, prev->append, 0);
     ngx_conf_merge_value(conf->lock_file, prev->lock_file, 0);
@@ -225,6 +272,7 @@ ngx_rtmp_record_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
                               (ngx_msec_t) NGX_CONF_UNSET);
     ngx_conf_merge_bitmask_value(conf->flags, prev->flags, 0);
     ngx_conf_merge_ptr_value(conf->url, prev->url, NULL);
+    ngx_conf_merge_ptr_value(conf->aio, prev->aio, NULL);
 
     if (conf->flags) {
         rracf = ngx_array_push(&conf->rec);
@@ -240,7 +288,7 @@ ngx_rtmp_record_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
 
 
 static ngx_int_t
-ngx_rtmp_record_write_header(ngx_file_t *file)
+ngx_rtmp_record_write_header(ngx_rtmp_record_rec_ctx_t *rctx)
 {
     static u_char       flv_header[] = {
         0x46, /* 'F' */
@@ -258,9 +306,21 @@ ngx_rtmp_record_write_header(ngx_file_t *file)
         0x00  /* PreviousTagSize0 (not actually a header) */
     };
 
-    return ngx_write_file(file, flv_header, sizeof(flv_header), 0) == NGX_ERROR
-           ? NGX_ERROR
-           : NGX_OK;
+    if (rctx->aio) {
+        if (ngx_rtmp_aio_write(rctx->aio, rctx->file.fd, 0, flv_header,
+                               sizeof(flv_header))
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        rctx->file.offset = sizeof(flv_header);
+
+        return NGX_OK;
+    }
+
+    return ngx_write_file(&rctx->file, flv_header, sizeof(flv_header), 0)
+           == NGX_ERROR ? NGX_ERROR : NGX_OK;
 }
 
 
@@ -439,9 +499,14 @@ ngx_rtmp_record_node_open(ngx_rtmp_session_t *s,
     ngx_err_t                   err;
     ngx_str_t                   path;
     ngx_int_t                   mode, create_mode;
+    ngx_buf_t                  *wbuf;
+    ngx_rtmp_aio_queue_t       *aio;
+    ngx_uint_t                  closing, aio_errors;
+    ngx_str_t                   closing_path;
     u_char                      buf[8], *p;
     off_t                       file_size;
     uint32_t                    tag_size, mlen, timestamp;
+    time_t                      opened;
 
     rracf = rctx->conf;
     tag_size = 0;
@@ -453,10 +518,75 @@ ngx_rtmp_record_node_open(ngx_rtmp_session_t *s,
     ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "record: %V opening", &rracf->id);
 
+    /* the file being closed must be complete before it is reused */
+
+    if (rctx->closing) {
+        opened = rctx->timestamp;
+        rctx->timestamp = ngx_cached_time->sec;
+
+        ngx_rtmp_record_make_path(s, rctx, &path);
+
+        rctx->timestamp = opened;
+
+        if (path.len == rctx->closing_path.len
+            && ngx_strncmp(path.data, rctx->closing_path.data, path.len)
+               == 0)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                           "record: %V previous file still closing",
+                           &rracf->id);
+            return NGX_AGAIN;
+        }
+    }
+
+    /* write buffer and queue survive reopening */
+    wbuf = rctx->wbuf;
+    aio = rctx->aio;
+    aio_errors = rctx->aio_errors;
+    closing = rctx->closing;
+    closing_path = rctx->closing_path;
+
     ngx_memzero(rctx, sizeof(*rctx));
     rctx->conf = rracf;
+    rctx->closing = closing;
+    rctx->closing_path = closing_path;
+    rctx->session = s;
     rctx->last = *ngx_cached_time;
     rctx->timestamp = ngx_cached_time->sec;
+    rctx->flushed = ngx_current_msec;
+
+    if (wbuf == NULL && rracf->buffer) {
+        wbuf = ngx_create_temp_buf(s->connection->pool, rracf->buffer);
+        if (wbuf == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (wbuf) {
+        wbuf->pos = wbuf->start;
+        wbuf->last = wbuf->start;
+    }
+
+    rctx->wbuf = wbuf;
+
+    /* what is buffered is written in time even if the stream stalls */
+    rctx->flush_evt.data = rctx;
+    rctx->flush_evt.log = s->connection->log;
+    rctx->flush_evt.handler = ngx_rtmp_record_flush_handler;
+    rctx->flush_evt.cancelable = 1;
+
+    if (aio == NULL && rracf->aio) {
+        aio = ngx_rtmp_aio_create_queue(rracf->aio, s->connection->pool,
+                                        s->connection->log);
+        if (aio == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    rctx->aio = aio;
+
+    /* otherwise set when the last file being closed is done */
+    rctx->aio_errors = closing ? aio_errors : (aio ? aio->errors : 0);
 
     ngx_rtmp_record_make_path(s, rctx, &path);
 
@@ -786,10 +916,7 @@ ngx_rtmp_record_node_close(ngx_rtmp_session_t *s,
                            ngx_rtmp_record_rec_ctx_t *rctx)
 {
     ngx_rtmp_record_app_conf_t *rracf;
-    ngx_err_t                   err;
-    void                      **app_conf;
     ngx_int_t                   rc;
-    ngx_rtmp_record_done_t      v;
     u_char                      av;
 
     rracf = rctx->conf;
@@ -798,6 +925,17 @@ ngx_rtmp_record_node_close(ngx_rtmp_session_t *s,
         return NGX_AGAIN;
     }
 
+    if (rctx->flush_evt.timer_set) {
+        ngx_del_timer(&rctx->flush_evt);
+    }
+
+    if (ngx_rtmp_record_flush(s, rctx) != NGX_OK) {
+        ngx_log_error(NGX_LOG_CRIT, s->connection->log, ngx_errno,
+                      "record: %V error flushing buffer", &rracf->id);
+
+        ngx_rtmp_record_notify_error(s, rctx);
+    }
+
     if (rctx->initialized) {
         av = 0;
 
@@ -809,15 +947,49 @@ ngx_rtmp_record_node_close(ngx_rtmp_session_t *s,
             av |= 0x04;
         }
 
-        if (ngx_write_file(&rctx->file, &av, 1, 4) == NGX_ERROR) {
+        rc = rctx->aio
+             ? ngx_rtmp_aio_write(rctx->aio, rctx->file.fd, 4, &av, 1)
+             : ngx_write_file(&rctx->file, &av, 1, 4);
+
+        if (rc == NGX_ERROR) {
             ngx_log_error(NGX_LOG_CRIT, s->connection->log, ngx_errno,
                           "record: %V error writing av mask", &rracf->id);
         }
     }
 
-    if (ngx_close_file(rctx->file.fd) == NGX_FILE_ERROR) {
-        err = ngx_errno;
-        ngx_log_error(NGX_LOG_CRIT, s->connection->log, err,
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "record: %V closed", &rracf->id);
+
+    if (rracf->notify) {
+        ngx_rtmp_send_status(s, "NetStream.Record.Stop", "status",
+                             rracf->id.data ? (char *) rracf->id.data : "");
+    }
+
+    return ngx_rtmp_record_close_file(s, rctx, 1);
+}
+
+
+/*
+ * The descriptor is closed after the writes queued for it, and the file
+ * is only reported as done then: the worker never waits for the disk.
+ * The session is kept until that, even if the client is gone.
+ */
+
+static ngx_int_t
+ngx_rtmp_record_close_file(ngx_rtmp_session_t *s,
+                           ngx_rtmp_record_rec_ctx_t *rctx, ngx_uint_t done)
+{
+    ngx_rtmp_record_app_conf_t *rracf;
+    ngx_rtmp_record_closed_t   *cl;
+    ngx_str_t                   path;
+
+    rracf = rctx->conf;
+
+    if (rctx->aio) {
+        (void) ngx_rtmp_aio_close(rctx->aio, rctx->file.fd);
+
+    } else if (ngx_close_file(rctx->file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, s->connection->log, ngx_errno,
                       "record: %V error closing file", &rracf->id);
 
         ngx_rtmp_record_notify_error(s, rctx);
@@ -825,28 +997,98 @@ ngx_rtmp_record_node_close(ngx_rtmp_session_t *s,
 
     rctx->file.fd = NGX_INVALID_FILE;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                   "record: %V closed", &rracf->id);
+    ngx_rtmp_record_make_path(s, rctx, &path);
 
-    if (rracf->notify) {
-        ngx_rtmp_send_status(s, "NetStream.Record.Stop", "status",
-                             rracf->id.data ? (char *) rracf->id.data : "");
+    cl = ngx_alloc(sizeof(ngx_rtmp_record_closed_t) + path.len + 1,
+                   s->connection->log);
+    if (cl == NULL) {
+        return NGX_ERROR;
     }
 
-    app_conf = s->app_conf;
+    cl->session = s;
+    cl->rctx = rctx;
+    cl->done = done;
+
+    cl->path.data = (u_char *) &cl[1];
+    cl->path.len = path.len;
+    ngx_memcpy(cl->path.data, path.data, path.len + 1);
 
-    if (rracf->rec_conf) {
-        s->app_conf = rracf->rec_conf;
+    s->count++;
+    rctx->closing++;
+    rctx->closing_path = cl->path;
+
+    if (ngx_rtmp_aio_notify(rctx->aio, ngx_rtmp_record_closed, cl)
+        != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_CRIT, s->connection->log, 0,
+                      "record: %V file '%V' is not reported",
+                      &rracf->id, &path);
+
+        rctx->closing--;
+        s->count--;
+
+        ngx_free(cl);
+
+        return NGX_ERROR;
     }
 
-    v.recorder = rracf->id;
-    ngx_rtmp_record_make_path(s, rctx, &v.path);
+    return NGX_OK;
+}
+
 
-    rc = ngx_rtmp_record_done(s, &v);
+static void
+ngx_rtmp_record_closed(void *data, ngx_uint_t errors)
+{
+    ngx_rtmp_record_closed_t   *cl = data;
+
+    ngx_rtmp_session_t         *s;
+    ngx_rtmp_record_rec_ctx_t  *rctx;
+    ngx_rtmp_record_app_conf_t *rracf;
+    ngx_rtmp_record_done_t      v;
+    void                      **app_conf;
+
+    s = cl->session;
+    rctx = cl->rctx;
+    rracf = rctx->conf;
+
+    /* what the queue counts from now on is for the file being written */
+
+    if (--rctx->closing == 0) {
+        ngx_str_null(&rctx->closing_path);
+
+        if (rctx->aio) {
+            rctx->aio_errors = rctx->aio->errors;
+        }
+    }
+
+    if (errors && cl->done) {
+        ngx_log_error(NGX_LOG_CRIT, s->connection->log, 0,
+                      "record: %V error writing file '%V'",
+                      &rracf->id, &cl->path);
+
+        if (!s->closed) {
+            ngx_rtmp_record_notify_error(s, rctx);
+        }
+    }
+
+    if (cl->done) {
+        app_conf = s->app_conf;
+
+        if (rracf->rec_conf) {
+            s->app_conf = rracf->rec_conf;
+        }
 
-    s->app_conf = app_conf;
+        v.recorder = rracf->id;
+        v.path = cl->path;
 
-    return rc;
+        (void) ngx_rtmp_record_done(s, &v);
+
+        s->app_conf = app_conf;
+    }
+
+    ngx_free(cl);
+
+    ngx_rtmp_release_session(s);
 }
 
 
@@ -868,14 +1110,295 @@ next:
 }
 
 
+static void
+ngx_rtmp_record_flush_handler(ngx_event_t *ev)
+{
+    ngx_rtmp_session_t         *s;
+    ngx_rtmp_record_rec_ctx_t  *rctx;
+
+    rctx = ev->data;
+    s = rctx->session;
+
+    if (rctx->file.fd == NGX_INVALID_FILE) {
+        return;
+    }
+
+    if (ngx_rtmp_record_flush(s, rctx) != NGX_OK) {
+        ngx_log_error(NGX_LOG_CRIT, s->connection->log, ngx_errno,
+                      "record: %V error flushing buffer", &rctx->conf->id);
+
+        (void) ngx_rtmp_record_fail(s, rctx);
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_record_flush(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx)
+{
+    ngx_int_t                   rc;
+    ngx_buf_t                  *wb;
+
+    wb = rctx->wbuf;
+
+    if (wb == NULL || wb->last == wb->pos) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "record: %V flush %uz bytes",
+                   &rctx->conf->id, (size_t) (wb->last - wb->pos));
+
+    if (rctx->aio) {
+        rc = ngx_rtmp_aio_write(rctx->aio, rctx->file.fd, rctx->file.offset,
+                                wb->pos, wb->last - wb->pos);
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        rctx->file.offset += wb->last - wb->pos;
+
+    } else if (ngx_write_file(&rctx->file, wb->pos, wb->last - wb->pos,
+                              rctx->file.offset)
+               == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    wb->last = wb->pos;
+    rctx->flushed = ngx_current_msec;
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_PWRITEV)
+
+static ngx_int_t
+ngx_rtmp_record_pwritev(ngx_file_t *file, struct iovec *iov, ngx_uint_t niov,
+                        size_t size)
+{
+    ssize_t                     n;
+    ngx_err_t                   err;
+
+    for ( ;; ) {
+        n = pwritev(file->fd, iov, niov, file->offset);
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            ngx_log_error(NGX_LOG_CRIT, file->log, err,
+                          "pwritev() \"%V\" failed", &file->name);
+            return NGX_ERROR;
+        }
+
+        file->offset += n;
+        size -= n;
+
+        if (size == 0) {
+            return NGX_OK;
+        }
+
+        /* partial write, skip what is already on disk */
+        while ((size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+
+        iov->iov_base = (u_char *) iov->iov_base + n;
+        iov->iov_len -= n;
+    }
+}
+
+#endif
+
+
+/* Writes pending buffered data followed by a complete tag,
+ * with one pwritev() call where available */
+static ngx_int_t
+ngx_rtmp_record_write_tag(ngx_rtmp_session_t *s,
+                          ngx_rtmp_record_rec_ctx_t *rctx, u_char *hdr,
+                          ngx_chain_t *in, u_char *tail)
+{
+    size_t                      size;
+    ngx_chain_t                *cl;
+    ngx_rtmp_aio_op_t          *op;
+#if (NGX_HAVE_PWRITEV)
+    struct iovec                iovs[NGX_IOVS_PREALLOCATE];
+    ngx_uint_t                  niov;
+    size_t                      len;
+#endif
+    ngx_buf_t                  *wb;
+
+    wb = rctx->wbuf;
+
+    if (ngx_rtmp_aio_threaded(rctx->aio)) {
+
+        size = 11 + 4;
+
+        if (wb) {
+            size += wb->last - wb->pos;
+        }
+
+        for (cl = in; cl; cl = cl->next) {
+            size += cl->buf->last - cl->buf->pos;
+        }
+
+        /* refused if the queue is full, the record fails then */
+
+        op = ngx_rtmp_aio_alloc(rctx->aio, size);
+        if (op == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (wb) {
+            op->last = ngx_cpymem(op->last, wb->pos, wb->last - wb->pos);
+        }
+
+        op->last = ngx_cpymem(op->last, hdr, 11);
+
+        for (cl = in; cl; cl = cl->next) {
+            op->last = ngx_cpymem(op->last, cl->buf->pos,
+                                  cl->buf->last - cl->buf->pos);
+        }
+
+        op->last = ngx_cpymem(op->last, tail, 4);
+
+        op->fd = rctx->file.fd;
+        op->offset = rctx->file.offset;
+
+        rctx->file.offset += size;
+
+        ngx_rtmp_aio_post(rctx->aio, op);
+
+        if (wb) {
+            wb->last = wb->pos;
+            rctx->flushed = ngx_current_msec;
+        }
+
+        return NGX_OK;
+    }
+
+#if (NGX_HAVE_PWRITEV)
+
+    niov = 0;
+    size = 0;
+
+    if (wb && wb->last != wb->pos) {
+        iovs[niov].iov_base = wb->pos;
+        iovs[niov++].iov_len = wb->last - wb->pos;
+        size += wb->last - wb->pos;
+    }
+
+    iovs[niov].iov_base = hdr;
+    iovs[niov++].iov_len = 11;
+    size += 11;
+
+    for (; in; in = in->next) {
+        len = in->buf->last - in->buf->pos;
+
+        if (len == 0) {
+            continue;
+        }
+
+        /* keep the last slot for tag size */
+        if (niov == NGX_IOVS_PREALLOCATE - 1) {
+            if (ngx_rtmp_record_pwritev(&rctx->file, iovs, niov, size)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            niov = 0;
+            size = 0;
+        }
+
+        iovs[niov].iov_base = in->buf->pos;
+        iovs[niov++].iov_len = len;
+        size += len;
+    }
+
+    iovs[niov].iov_base = tail;
+    iovs[niov++].iov_len = 4;
+    size += 4;
+
+    if (ngx_rtmp_record_pwritev(&rctx->file, iovs, niov, size) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (wb) {
+        wb->last = wb->pos;
+        rctx->flushed = ngx_current_msec;
+    }
+
+    return NGX_OK;
+
+#else
+
+    if (ngx_rtmp_record_flush(s, rctx) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_write_file(&rctx->file, hdr, 11, rctx->file.offset)
+        == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    for(; in; in = in->next) {
+        if (in->buf->pos == in->buf->last) {
+            continue;
+        }
+
+        if (ngx_write_file(&rctx->file, in->buf->pos, in->buf->last
+                           - in->buf->pos, rctx->file.offset)
+            == NGX_ERROR)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_write_file(&rctx->file, tail, 4, rctx->file.offset)
+        == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+
+#endif
+}
+
+
+static ngx_int_t
+ngx_rtmp_record_fail(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx)
+{
+    ngx_rtmp_record_notify_error(s, rctx);
+
+    if (rctx->flush_evt.timer_set) {
+        ngx_del_timer(&rctx->flush_evt);
+    }
+
+    (void) ngx_rtmp_record_close_file(s, rctx, 0);
+
+    return NGX_ERROR;
+}
+
+
 static ngx_int_t
 ngx_rtmp_record_write_frame(ngx_rtmp_session_t *s,
                             ngx_rtmp_record_rec_ctx_t *rctx,
                             ngx_rtmp_header_t *h, ngx_chain_t *in,
                             ngx_int_t inc_nframes)
 {
-    u_char                      hdr[11], *p, *ph;
+    u_char                      hdr[11], tail[4], *p, *ph;
     uint32_t                    timestamp, tag_size;
+    off_t                       offset;
+    ngx_buf_t                  *wb;
     ngx_rtmp_record_app_conf_t *rracf;
 
     rracf = rctx->conf;
@@ -899,7 +1422,7 @@ ngx_rtmp_record_write_frame(ngx_rtmp_session_t *s,
         timestamp = 0;
     }
 
-    /* write tag header */
+    /* tag header */
     ph = hdr;
 
     *ph++ = (u_char)h->type;
@@ -921,55 +1444,65 @@ ngx_rtmp_record_write_frame(ngx_rtmp_session_t *s,
 
     tag_size = (ph - hdr) + h->mlen;
 
-    if (ngx_write_file(&rctx->file, hdr, ph - hdr, rctx->file.offset)
-        == NGX_ERROR)
-    {
-        ngx_rtmp_record_notify_error(s, rctx);
+    /* tag size */
+    ph = tail;
+    p = (u_char*)&tag_size;
 
-        ngx_close_file(rctx->file.fd);
+    *ph++ = p[3];
+    *ph++ = p[2];
+    *ph++ = p[1];
+    *ph++ = p[0];
 
-        return NGX_ERROR;
-    }
+    wb = rctx->wbuf;
 
-    /* write tag body
-     * FIXME: NGINX
-     * ngx_write_chain seems to fit best
-     * but it suffers from uncontrollable
-     * allocations.
-     * we're left with plain writing */
-    for(; in; in = in->next) {
-        if (in->buf->pos == in->buf->last) {
-            continue;
-        }
+    if (wb && (size_t) (wb->end - wb->last) >= tag_size + 4) {
 
-        if (ngx_write_file(&rctx->file, in->buf->pos, in->buf->last
-                           - in->buf->pos, rctx->file.offset)
-            == NGX_ERROR)
-        {
-            return NGX_ERROR;
+        /* coalesce in write buffer */
+        wb->last = ngx_cpymem(wb->last, hdr, sizeof(hdr));
+
+        for (; in; in = in->next) {
+            wb->last = ngx_cpymem(wb->last, in->buf->pos,
+                                  in->buf->last - in->buf->pos);
         }
+
+        wb->last = ngx_cpymem(wb->last, tail, sizeof(tail));
+
+    } else if (ngx_rtmp_record_write_tag(s, rctx, hdr, in, tail) != NGX_OK) {
+        return ngx_rtmp_record_fail(s, rctx);
     }
 
-    /* write tag size */
-    ph = hdr;
-    p = (u_char*)&tag_size;
+    rctx->nframes += inc_nframes;
 
-    *ph++ = p[3];
-    *ph++ = p[2];
-    *ph++ = p[1];
-    *ph++ = p[0];
+    offset = rctx->file.offset;
 
-    if (ngx_write_file(&rctx->file, hdr, ph - hdr,
-                       rctx->file.offset)
-        == NGX_ERROR)
-    {
-        return NGX_ERROR;
+    if (wb && wb->last != wb->pos) {
+        offset += wb->last - wb->pos;
+
+        if (ngx_current_msec - rctx->flushed >= rracf->flush_interval) {
+            if (ngx_rtmp_record_flush(s, rctx) != NGX_OK) {
+                return ngx_rtmp_record_fail(s, rctx);
+            }
+
+        } else if (!rctx->flush_evt.timer_set) {
+            ngx_add_timer(&rctx->flush_evt, rracf->flush_interval
+                          - (ngx_current_msec - rctx->flushed));
+        }
     }
 
-    rctx->nframes += inc_nframes;
+    /* a queued write has failed, the rest of the file would be useless;
+     * the errors of a file still being closed are its own */
+
+    if (rctx->aio && rctx->closing == 0
+        && rctx->aio->errors != rctx->aio_errors)
+    {
+        ngx_log_error(NGX_LOG_CRIT, s->connection->log, 0,
+                      "record: %V error writing file", &rracf->id);
+
+        return ngx_rtmp_record_fail(s, rctx);
+    }
 
     /* watch max size */
-    if ((rracf->max_size && rctx->file.offset >= (ngx_int_t) rracf->max_size) ||
+    if ((rracf->max_size && offset >= (off_t) rracf->max_size) ||
         (rracf->max_frames && rctx->nframes >= rracf->max_frames))
     {
         ngx_rtmp_record_node_close(s, rctx);
@@ -1092,7 +1625,7 @@ ngx_rtmp_record_node_av(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx,
         rctx->epoch = h->timestamp - rctx->time_shift;
 
         if (rctx->file.offset == 0 &&
-            ngx_rtmp_record_write_header(&rctx->file) != NGX_OK)
+            ngx_rtmp_record_write_header(rctx) != NGX_OK)
         {
             ngx_rtmp_record_node_close(s, rctx);
             return NGX_OK;
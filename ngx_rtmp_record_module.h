@@ -11,6 +11,7 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include "ngx_rtmp.h"
+#include "ngx_rtmp_aio.h"
 
 
 #define NGX_RTMP_RECORD_OFF             0x01
@@ -26,6 +27,9 @@ typedef struct {
     ngx_str_t                           path;
     size_t                              max_size;
     size_t                              max_frames;
+    size_t                              buffer;
+    ngx_msec_t                          flush_interval;
+    ngx_rtmp_aio_conf_t                *aio;
     ngx_msec_t                          interval;
     ngx_str_t                           suffix;
     ngx_flag_t                          unique;
@@ -41,7 +45,15 @@ typedef struct {
 
 typedef struct {
     ngx_rtmp_record_app_conf_t         *conf;
+    ngx_rtmp_session_t                 *session;
     ngx_file_t                          file;
+    ngx_buf_t                          *wbuf;
+    ngx_event_t                         flush_evt;
+    ngx_rtmp_aio_queue_t               *aio;
+    ngx_uint_t                          aio_errors;  /* when opened */
+    ngx_uint_t                          closing;     /* files being closed */
+    ngx_str_t                           closing_path;  /* the last one */
+    ngx_msec_t                          flushed;
     ngx_uint_t                          nframes;
     uint32_t                            epoch, time_shift;
     ngx_time_t                          last;
@@ -0,0 +1,298 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <nginx.h>
+#include "ngx_rtmp_ssl_module.h"
+
+
+#define NGX_RTMP_SSL_DEFAULT_CIPHERS    "HIGH:!aNULL:!MD5"
+
+
+static void ngx_rtmp_ssl_handshake_handler(ngx_connection_t *c);
+static void *ngx_rtmp_ssl_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_rtmp_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+
+
+static ngx_conf_bitmask_t  ngx_rtmp_ssl_protocols[] = {
+    { ngx_string("TLSv1"), NGX_SSL_TLSv1 },
+    { ngx_string("TLSv1.1"), NGX_SSL_TLSv1_1 },
+    { ngx_string("TLSv1.2"), NGX_SSL_TLSv1_2 },
+#ifdef NGX_SSL_TLSv1_3
+    { ngx_string("TLSv1.3"), NGX_SSL_TLSv1_3 },
+#endif
+    { ngx_null_string, 0 }
+};
+
+
+static ngx_command_t  ngx_rtmp_ssl_commands[] = {
+
+    { ngx_string("ssl_certificate"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_ssl_srv_conf_t, certificate),
+      NULL },
+
+    { ngx_string("ssl_certificate_key"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_ssl_srv_conf_t, certificate_key),
+      NULL },
+
+    { ngx_string("ssl_protocols"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_ssl_srv_conf_t, protocols),
+      &ngx_rtmp_ssl_protocols },
+
+    { ngx_string("ssl_ciphers"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_ssl_srv_conf_t, ciphers),
+      NULL },
+
+    { ngx_string("ssl_ktls"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_ssl_srv_conf_t, ktls),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_rtmp_module_t  ngx_rtmp_ssl_module_ctx = {
+    NULL,                                   /* preconfiguration */
+    NULL,                                   /* postconfiguration */
+    NULL,                                   /* create main configuration */
+    NULL,                                   /* init main configuration */
+    ngx_rtmp_ssl_create_srv_conf,           /* create server configuration */
+    ngx_rtmp_ssl_merge_srv_conf,            /* merge server configuration */
+    NULL,                                   /* create app configuration */
+    NULL                                    /* merge app configuration */
+};
+
+
+ngx_module_t  ngx_rtmp_ssl_module = {
+    NGX_MODULE_V1,
+    &ngx_rtmp_ssl_module_ctx,               /* module context */
+    ngx_rtmp_ssl_commands,                  /* module directives */
+    NGX_RTMP_MODULE,                        /* module type */
+    NULL,                                   /* init master */
+    NULL,                                   /* init module */
+    NULL,                                   /* init process */
+    NULL,                                   /* init thread */
+    NULL,                                   /* exit thread */
+    NULL,                                   /* exit process */
+    NULL,                                   /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+void
+ngx_rtmp_ssl_listen(ngx_conf_t *cf)
+{
+    ngx_rtmp_ssl_srv_conf_t    *sscf;
+
+    sscf = ngx_rtmp_conf_get_module_srv_conf(cf, ngx_rtmp_ssl_module);
+    sscf->listen = 1;
+}
+
+
+void
+ngx_rtmp_ssl_handshake(ngx_rtmp_session_t *s)
+{
+    ngx_int_t                   rc;
+    ngx_connection_t           *c;
+    ngx_rtmp_ssl_srv_conf_t    *sscf;
+
+    c = s->connection;
+    sscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_ssl_module);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_RTMP, c->log, 0, "ssl: start handshake");
+
+    if (ngx_ssl_create_connection(&sscf->ssl, c, 0) != NGX_OK) {
+        ngx_rtmp_finalize_session(s);
+        return;
+    }
+
+    rc = ngx_ssl_handshake(c);
+
+    if (rc == NGX_AGAIN) {
+        if (!c->read->timer_set) {
+            ngx_add_timer(c->read, s->timeout);
+        }
+
+        c->ssl->handler = ngx_rtmp_ssl_handshake_handler;
+        return;
+    }
+
+    ngx_rtmp_ssl_handshake_handler(c);
+}
+
+
+static void
+ngx_rtmp_ssl_handshake_handler(ngx_connection_t *c)
+{
+    ngx_rtmp_session_t         *s;
+
+    s = c->data;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if (!c->ssl->handshaked) {
+        ngx_log_error(NGX_LOG_INFO, c->log, c->read->timedout ? NGX_ETIMEDOUT
+                      : 0, "ssl: handshake failed");
+        ngx_rtmp_finalize_session(s);
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                   "ssl: handshaked, ktls=%ui", ngx_rtmp_ssl_ktls(c));
+
+    ngx_rtmp_handshake(s);
+}
+
+
+ngx_uint_t
+ngx_rtmp_ssl_ktls(ngx_connection_t *c)
+{
+    if (c->ssl == NULL || !c->ssl->handshaked) {
+        return 0;
+    }
+
+#ifdef BIO_get_ktls_send
+    return BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)) ? 1 : 0;
+#else
+    return 0;
+#endif
+}
+
+
+static void *
+ngx_rtmp_ssl_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_rtmp_ssl_srv_conf_t    *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_ssl_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->protocols = 0;
+     *     conf->certificate = { 0, NULL };
+     *     conf->certificate_key = { 0, NULL };
+     *     conf->ciphers = { 0, NULL };
+     */
+
+    conf->ktls = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+static char *
+ngx_rtmp_ssl_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_rtmp_ssl_srv_conf_t    *prev = parent;
+    ngx_rtmp_ssl_srv_conf_t    *conf = child;
+
+    ngx_pool_cleanup_t         *cln;
+
+    ngx_conf_merge_bitmask_value(conf->protocols, prev->protocols,
+                                 (NGX_CONF_BITMASK_SET
+#ifdef NGX_SSL_TLSv1_3
+                                  |NGX_SSL_TLSv1_3
+#endif
+                                  |NGX_SSL_TLSv1_2));
+
+    ngx_conf_merge_str_value(conf->certificate, prev->certificate, "");
+    ngx_conf_merge_str_value(conf->certificate_key, prev->certificate_key,
+                             "");
+    ngx_conf_merge_str_value(conf->ciphers, prev->ciphers,
+                             NGX_RTMP_SSL_DEFAULT_CIPHERS);
+    ngx_conf_merge_value(conf->ktls, prev->ktls, 0);
+
+    if (conf->certificate.len == 0) {
+        if (conf->listen) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "no \"ssl_certificate\" is defined for "
+                          "the \"listen ... ssl\" directive");
+            return NGX_CONF_ERROR;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    if (conf->certificate_key.len == 0) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "no \"ssl_certificate_key\" is defined "
+                      "for certificate \"%V\"", &conf->certificate);
+        return NGX_CONF_ERROR;
+    }
+
+    conf->ssl.log = cf->log;
+
+    if (ngx_ssl_create(&conf->ssl, conf->protocols, NULL) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        ngx_ssl_cleanup_ctx(&conf->ssl);
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_ssl_cleanup_ctx;
+    cln->data = &conf->ssl;
+
+#if (nginx_version >= 1007003)
+    if (ngx_ssl_certificate(cf, &conf->ssl, &conf->certificate,
+                            &conf->certificate_key, NULL)
+        != NGX_OK)
+#else
+    if (ngx_ssl_certificate(cf, &conf->ssl, &conf->certificate,
+                            &conf->certificate_key)
+        != NGX_OK)
+#endif
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    if (SSL_CTX_set_cipher_list(conf->ssl.ctx,
+                                (const char *) conf->ciphers.data)
+        == 0)
+    {
+        ngx_ssl_error(NGX_LOG_EMERG, cf->log, 0,
+                      "SSL_CTX_set_cipher_list(\"%V\") failed",
+                      &conf->ciphers);
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+        SSL_CTX_set_options(conf->ssl.ctx, SSL_OP_ENABLE_KTLS);
+#else
+        ngx_log_error(NGX_LOG_WARN, cf->log, 0,
+                      "\"ssl_ktls\" is not supported by the OpenSSL "
+                      "library, ignored");
+#endif
+    }
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,44 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#ifndef _NGX_RTMP_SSL_MODULE_H_INCLUDED_
+#define _NGX_RTMP_SSL_MODULE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include "ngx_rtmp.h"
+
+
+typedef struct {
+    ngx_ssl_t                           ssl;
+
+    ngx_uint_t                          protocols;
+    ngx_str_t                           certificate;
+    ngx_str_t                           certificate_key;
+    ngx_str_t                           ciphers;
+    ngx_flag_t                          ktls;
+
+    unsigned                            listen:1;
+} ngx_rtmp_ssl_srv_conf_t;
+
+
+extern ngx_module_t                     ngx_rtmp_ssl_module;
+
+
+/* called while parsing the configuration by every "listen ... ssl" */
+void ngx_rtmp_ssl_listen(ngx_conf_t *cf);
+
+/* TLS handshake of an accepted connection, then the RTMP one */
+void ngx_rtmp_ssl_handshake(ngx_rtmp_session_t *s);
+
+/* the kernel encrypts what is written on the socket of a TLS connection,
+ * so it may be written directly, bypassing the library */
+ngx_uint_t ngx_rtmp_ssl_ktls(ngx_connection_t *c);
+
+
+#endif /* _NGX_RTMP_SSL_MODULE_H_INCLUDED_ */
@@ -15,6 +15,9 @@
 #include "ngx_rtmp_live_module.h"
 #include "ngx_rtmp_play_module.h"
 #include "ngx_rtmp_codec_module.h"
+#include "ngx_rtmp_aio.h"
+#include "ngx_rtmp_ssl_module.h"
+#include "dash/ngx_rtmp_dash_module.h"
 
 
 static ngx_int_t ngx_rtmp_stat_init_process(ngx_cycle_t *cycle);
@@ -321,7 +324,168 @@ ngx_rtmp_stat_bw(ngx_http_request_t *r, ngx_chain_t ***lll,
 }
 
 
-#ifdef NGX_RTMP_POOL_DEBUG
+static void
+ngx_rtmp_stat_syscalls(ngx_http_request_t *r, ngx_chain_t ***lll,
+    ngx_rtmp_bandwidth_t *bw_calls, ngx_rtmp_bandwidth_t *bw, char *name)
+{
+    u_char                          buf[sizeof("</bytes_per_syscall_"
+                                               "out>\r\n")];
+    uint64_t                        calls, rate, bpc;
+    ngx_rtmp_stat_loc_conf_t       *slcf;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_rtmp_stat_module);
+
+    ngx_rtmp_update_bandwidth(bw_calls, 0);
+
+    calls = bw_calls->bytes;
+    rate = bw_calls->bandwidth;
+    bpc = calls ? bw->bytes / calls : 0;
+
+    if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "<syscalls_%s>",
+                                        name) - buf);
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uL", calls)
+                           - buf);
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "</syscalls_%s>",
+                                        name) - buf);
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                        "\r\n<syscalls_%s_rate>",
+                                        name) - buf);
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uL", rate)
+                           - buf);
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                        "</syscalls_%s_rate>", name) - buf);
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                        "\r\n<bytes_per_syscall_%s>",
+                                        name) - buf);
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uL", bpc)
+                           - buf);
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                        "</bytes_per_syscall_%s>\r\n",
+                                        name) - buf);
+    } else {
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                        "\"syscalls_%s\":", name) - buf);
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uL", calls)
+                           - buf);
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                        ",\"syscalls_%s_rate\":",
+                                        name) - buf);
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uL", rate)
+                           - buf);
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                        ",\"bytes_per_syscall_%s\":",
+                                        name) - buf);
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uL", bpc)
+                           - buf);
+        NGX_RTMP_STAT_L(",");
+    }
+}
+
+
+typedef struct {
+    char                           *name;
+    uint64_t                        value;
+} ngx_rtmp_stat_counter_t;
+
+
+static void
+ngx_rtmp_stat_counters(ngx_http_request_t *r, ngx_chain_t ***lll,
+    ngx_rtmp_stat_counter_t *counters, ngx_uint_t ncounters)
+{
+    u_char                          buf[NGX_INT64_LEN + 32];
+    ngx_uint_t                      n;
+    ngx_rtmp_stat_loc_conf_t       *slcf;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_rtmp_stat_module);
+
+    for (n = 0; n < ncounters; n++) {
+        if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
+            NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "<%s>",
+                                            counters[n].name) - buf);
+            NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uL",
+                                            counters[n].value) - buf);
+            NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "</%s>\r\n",
+                                            counters[n].name) - buf);
+        } else {
+            NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "\"%s\":",
+                                            counters[n].name) - buf);
+            NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uL,",
+                                            counters[n].value) - buf);
+        }
+    }
+}
+
+
+static void
+ngx_rtmp_stat_aio(ngx_http_request_t *r, ngx_chain_t ***lll)
+{
+    ngx_rtmp_stat_counter_t         counters[8];
+
+    counters[0].name = "aio_queues";
+    counters[0].value = ngx_rtmp_aio_stat.queues;
+    counters[1].name = "aio_ops";
+    counters[1].value = ngx_rtmp_aio_stat.ops;
+    counters[2].name = "aio_bytes";
+    counters[2].value = ngx_rtmp_aio_stat.bytes;
+    counters[3].name = "aio_queued";
+    counters[3].value = ngx_rtmp_aio_stat.queued;
+    counters[4].name = "aio_max_queued";
+    counters[4].value = ngx_rtmp_aio_stat.max_queued;
+    counters[5].name = "aio_dropped";
+    counters[5].value = ngx_rtmp_aio_stat.dropped;
+    counters[6].name = "aio_dropped_bytes";
+    counters[6].value = ngx_rtmp_aio_stat.dropped_bytes;
+    counters[7].name = "aio_errors";
+    counters[7].value = ngx_rtmp_aio_stat.errors;
+
+    ngx_rtmp_stat_counters(r, lll, counters,
+                           sizeof(counters) / sizeof(counters[0]));
+}
+
+
+static void
+ngx_rtmp_stat_dash(ngx_http_request_t *r, ngx_chain_t ***lll)
+{
+    ngx_rtmp_stat_counter_t         counters[5];
+
+    counters[0].name = "dash_segments";
+    counters[0].value = ngx_rtmp_dash_stat.segments;
+    counters[1].name = "dash_bytes";
+    counters[1].value = ngx_rtmp_dash_stat.bytes;
+    counters[2].name = "dash_last_segment_bytes";
+    counters[2].value = ngx_rtmp_dash_stat.last_bytes;
+    counters[3].name = "dash_max_segment_bytes";
+    counters[3].value = ngx_rtmp_dash_stat.max_bytes;
+    counters[4].name = "dash_spilled_segments";
+    counters[4].value = ngx_rtmp_dash_stat.spilled;
+
+    ngx_rtmp_stat_counters(r, lll, counters,
+                           sizeof(counters) / sizeof(counters[0]));
+}
+
+
+static void
+ngx_rtmp_stat_mp4(ngx_http_request_t *r, ngx_chain_t ***lll)
+{
+    ngx_rtmp_stat_counter_t         counters[5];
+
+    counters[0].name = "mp4_cache_hits";
+    counters[0].value = ngx_rtmp_mp4_stat.hits;
+    counters[1].name = "mp4_cache_misses";
+    counters[1].value = ngx_rtmp_mp4_stat.misses;
+    counters[2].name = "mp4_cache_evicted";
+    counters[2].value = ngx_rtmp_mp4_stat.evicted;
+    counters[3].name = "mp4_cache_files";
+    counters[3].value = ngx_rtmp_mp4_stat.files;
+    counters[4].name = "mp4_mapped_bytes";
+    counters[4].value = ngx_rtmp_mp4_stat.mapped;
+
+    ngx_rtmp_stat_counters(r, lll, counters,
+                           sizeof(counters) / sizeof(counters[0]));
+}
+
+
 static void
 ngx_rtmp_stat_get_pool_size(ngx_pool_t *pool, ngx_uint_t *nlarge,
         ngx_uint_t *size)
@@ -344,6 +508,36 @@ ngx_rtmp_stat_get_pool_size(ngx_pool_t *pool, ngx_uint_t *nlarge,
 }
 
 
+/* what a session takes besides its connection */
+static size_t
+ngx_rtmp_stat_session_memory(ngx_rtmp_session_t *s)
+{
+    size_t                          total;
+    ngx_uint_t                      nlarge, size, n;
+    ngx_pool_t                     *pools[3];
+
+    total = sizeof(ngx_rtmp_session_t) + sizeof(void *) * ngx_rtmp_max_module;
+
+    pools[0] = s->out_pool;
+    pools[1] = s->in_streams_pool;
+    pools[2] = s->in_pool;
+
+    for (n = 0; n < sizeof(pools) / sizeof(pools[0]); n++) {
+        if (pools[n]) {
+            ngx_rtmp_stat_get_pool_size(pools[n], &nlarge, &size);
+            total += size;
+        }
+    }
+
+    if (s->out_pool == NULL && s->out) {
+        total += ngx_rtmp_out_ring_size(s->out_queue);
+    }
+
+    return total;
+}
+
+
+#ifdef NGX_RTMP_POOL_DEBUG
 static void
 ngx_rtmp_stat_dump_pool(ngx_http_request_t *r, ngx_chain_t ***lll,
         ngx_pool_t *pool)
@@ -405,6 +599,31 @@ ngx_rtmp_stat_client(ngx_http_request_t *r, ngx_chain_t ***lll,
                       (ngx_int_t) (ngx_current_msec - s->epoch)) - buf);
         NGX_RTMP_STAT_L("</time>");
 
+        NGX_RTMP_STAT_L("<memory>");
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uz",
+                      ngx_rtmp_stat_session_memory(s)) - buf);
+        NGX_RTMP_STAT_L("</memory>");
+
+        NGX_RTMP_STAT_L("<out_queued_max>");
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uz",
+                      s->out_queued_max) - buf);
+        NGX_RTMP_STAT_L("</out_queued_max>");
+
+        (void) ngx_rtmp_out_delay(s);
+
+        NGX_RTMP_STAT_L("<out_delay_max>");
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%M",
+                      s->out_delay_max) - buf);
+        NGX_RTMP_STAT_L("</out_delay_max>");
+
+        if (s->connection->ssl) {
+            NGX_RTMP_STAT_L("<ssl/>");
+        }
+
+        if (ngx_rtmp_ssl_ktls(s->connection)) {
+            NGX_RTMP_STAT_L("<ktls/>");
+        }
+
         if (s->flashver.len) {
             NGX_RTMP_STAT_L("<flashver>");
             NGX_RTMP_STAT_ES(&s->flashver);
@@ -433,7 +652,34 @@ ngx_rtmp_stat_client(ngx_http_request_t *r, ngx_chain_t ***lll,
         NGX_RTMP_STAT_L("\",\"time\":");
         NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%i",
                       (ngx_int_t) (ngx_current_msec - s->epoch)) - buf);
-        NGX_RTMP_STAT_L(",");
+
+        NGX_RTMP_STAT_L(",\"memory\":");
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uz",
+                      ngx_rtmp_stat_session_memory(s)) - buf);
+
+        NGX_RTMP_STAT_L(",\"out_queued_max\":");
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%uz",
+                      s->out_queued_max) - buf);
+
+        (void) ngx_rtmp_out_delay(s);
+
+        NGX_RTMP_STAT_L(",\"out_delay_max\":");
+        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%M",
+                      s->out_delay_max) - buf);
+
+        NGX_RTMP_STAT_L(",\"ssl\":");
+        if (s->connection->ssl) {
+            NGX_RTMP_STAT_L("true");
+        } else {
+            NGX_RTMP_STAT_L("false");
+        }
+
+        NGX_RTMP_STAT_L(",\"ktls\":");
+        if (ngx_rtmp_ssl_ktls(s->connection)) {
+            NGX_RTMP_STAT_L("true,");
+        } else {
+            NGX_RTMP_STAT_L("false,");
+        }
 
         if (s->flashver.len) {
             NGX_RTMP_STAT_L("\"flashver\":\"");
@@ -504,7 +750,7 @@ ngx_rtmp_stat_live(ngx_http_request_t *r, ngx_chain_t ***lll,
     ngx_rtmp_codec_ctx_t           *codec;
     ngx_rtmp_live_ctx_t            *ctx;
     ngx_rtmp_session_t             *s;
-    ngx_int_t                       n;
+    ngx_queue_t                    *q;
     ngx_uint_t                      nclients, total_nclients;
     ngx_uint_t                      f;
     ngx_flag_t                      prev;
@@ -528,346 +774,376 @@ ngx_rtmp_stat_live(ngx_http_request_t *r, ngx_chain_t ***lll,
 
     total_nclients = 0;
     prev = 0;
-    for (n = 0; n < lacf->nbuckets; ++n) {
-        for (stream = lacf->streams[n]; stream; stream = stream->next) {
-            if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
-                NGX_RTMP_STAT_L("<stream>\r\n");
-            } else {
-                if (prev) {
-                    NGX_RTMP_STAT_L(",");
-                }
+    for (q = ngx_queue_head(&lacf->streams);
+         q != ngx_queue_sentinel(&lacf->streams);
+         q = ngx_queue_next(q))
+    {
+        stream = ngx_queue_data(q, ngx_rtmp_live_stream_t, queue);
 
-                prev = 1;
-                NGX_RTMP_STAT_L("{");
-            }
-
-            if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
-                NGX_RTMP_STAT_L("<name>");
-                NGX_RTMP_STAT_ECS(stream->name);
-                NGX_RTMP_STAT_L("</name>\r\n");
-
-                NGX_RTMP_STAT_L("<time>");
-                NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%i",
-                              (ngx_int_t) (ngx_current_msec - stream->epoch))
-                              - buf);
-                NGX_RTMP_STAT_L("</time>");
-            } else {
-                NGX_RTMP_STAT_L("\"name\":\"");
-                NGX_RTMP_STAT_ECS(stream->name);
-                NGX_RTMP_STAT_L("\",");
-
-                NGX_RTMP_STAT_L("\"time\":");
-                NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%i",
-                              (ngx_int_t) (ngx_current_msec - stream->epoch))
-                              - buf);
+        if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
+            NGX_RTMP_STAT_L("<stream>\r\n");
+        } else {
+            if (prev) {
                 NGX_RTMP_STAT_L(",");
             }
 
-            ngx_rtmp_stat_bw(r, lll, &stream->bw_in, "in",
-                             NGX_RTMP_STAT_BW_BYTES);
-            ngx_rtmp_stat_bw(r, lll, &stream->bw_out, "out",
-                             NGX_RTMP_STAT_BW_BYTES);
-            ngx_rtmp_stat_bw(r, lll, &stream->bw_in_audio, "audio",
-                             NGX_RTMP_STAT_BW);
-            ngx_rtmp_stat_bw(r, lll, &stream->bw_in_video, "video",
-                             NGX_RTMP_STAT_BW);
-
-            nclients = 0;
-            codec = NULL;
-
-            if (slcf->stat & NGX_RTMP_STAT_CLIENTS &&
-                slcf->format & NGX_RTMP_STAT_FORMAT_JSON)
-            {
-                NGX_RTMP_STAT_L("\"clients\":[");
-            }
+            prev = 1;
+            NGX_RTMP_STAT_L("{");
+        }
 
-            for (ctx = stream->ctx; ctx; ctx = ctx->next, ++nclients) {
-                s = ctx->session;
-                if (slcf->stat & NGX_RTMP_STAT_CLIENTS) {
+        if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
+            NGX_RTMP_STAT_L("<name>");
+            NGX_RTMP_STAT_ECS(stream->name);
+            NGX_RTMP_STAT_L("</name>\r\n");
+
+            NGX_RTMP_STAT_L("<time>");
+            NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%i",
+                          (ngx_int_t) (ngx_current_msec - stream->epoch))
+                          - buf);
+            NGX_RTMP_STAT_L("</time>");
+        } else {
+            NGX_RTMP_STAT_L("\"name\":\"");
+            NGX_RTMP_STAT_ECS(stream->name);
+            NGX_RTMP_STAT_L("\",");
 
-                    if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
-                        NGX_RTMP_STAT_L("<client>");
-                    } else {
-                        NGX_RTMP_STAT_L("{");
-                    }
+            NGX_RTMP_STAT_L("\"time\":");
+            NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf), "%i",
+                          (ngx_int_t) (ngx_current_msec - stream->epoch))
+                          - buf);
+            NGX_RTMP_STAT_L(",");
+        }
 
-                    ngx_rtmp_stat_client(r, lll, s);
+        ngx_rtmp_stat_bw(r, lll, &stream->bw_in, "in",
+                         NGX_RTMP_STAT_BW_BYTES);
+        ngx_rtmp_stat_bw(r, lll, &stream->bw_out, "out",
+                         NGX_RTMP_STAT_BW_BYTES);
+        ngx_rtmp_stat_bw(r, lll, &stream->bw_in_audio, "audio",
+                         NGX_RTMP_STAT_BW);
+        ngx_rtmp_stat_bw(r, lll, &stream->bw_in_video, "video",
+                         NGX_RTMP_STAT_BW);
 
-                    if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
-                        NGX_RTMP_STAT_L("<dropped>");
-                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                      "%ui", ctx->ndropped) - buf);
-                        NGX_RTMP_STAT_L("</dropped>");
-
-                        NGX_RTMP_STAT_L("<avsync>");
-                        if (!lacf->interleave) {
-                            NGX_RTMP_STAT(bbuf, ngx_snprintf(bbuf, sizeof(bbuf),
-                                          "%D", ctx->cs[1].timestamp -
-                                          ctx->cs[0].timestamp) - bbuf);
-                        }
-                        NGX_RTMP_STAT_L("</avsync>");
+        nclients = 0;
+        codec = NULL;
 
-                        NGX_RTMP_STAT_L("<timestamp>");
-                        NGX_RTMP_STAT(bbuf, ngx_snprintf(bbuf, sizeof(bbuf),
-                                      "%D", s->current_time) - bbuf);
-                        NGX_RTMP_STAT_L("</timestamp>");
-
-                        if (ctx->publishing) {
-                            NGX_RTMP_STAT_L("<publishing/>");
-                        }
-
-                        if (ctx->active) {
-                            NGX_RTMP_STAT_L("<active/>");
-                        }
-                    } else {
-                        NGX_RTMP_STAT_L("\"dropped\":");
-                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                      "%ui", ctx->ndropped) - buf);
-
-                        NGX_RTMP_STAT_L(",\"avsync\":");
-                        if (!lacf->interleave) {
-                            NGX_RTMP_STAT(bbuf, ngx_snprintf(bbuf, sizeof(bbuf),
-                                          "%D", ctx->cs[1].timestamp -
-                                          ctx->cs[0].timestamp) - bbuf);
-                        }
-
-                        NGX_RTMP_STAT_L(",\"timestamp\":");
-                        NGX_RTMP_STAT(bbuf, ngx_snprintf(bbuf, sizeof(bbuf),
-                                      "%D", s->current_time) - bbuf);
+        if (slcf->stat & NGX_RTMP_STAT_CLIENTS &&
+            slcf->format & NGX_RTMP_STAT_FORMAT_JSON)
+        {
+            NGX_RTMP_STAT_L("\"clients\":[");
+        }
 
-                        NGX_RTMP_STAT_L(",\"publishing\":");
-                        if (ctx->publishing) {
-                            NGX_RTMP_STAT_L("true");
-                        } else {
-                            NGX_RTMP_STAT_L("false");
-                        }
-
-                        NGX_RTMP_STAT_L(",\"active\":");
-                        if (ctx->active) {
-                            NGX_RTMP_STAT_L("true");
-                        } else {
-                            NGX_RTMP_STAT_L("false");
-                        }
-                    }
+        for (ctx = stream->ctx; ctx; ctx = ctx->next, ++nclients) {
+            s = ctx->session;
+            if (slcf->stat & NGX_RTMP_STAT_CLIENTS) {
 
-                    if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
-                       NGX_RTMP_STAT_L("</client>\r\n");
-                    } else {
-                        NGX_RTMP_STAT_L("}");
-                        if (ctx->next) {
-                            NGX_RTMP_STAT_L(",");
-                        }
-                    }
-                }
-                if (ctx->publishing) {
-                    codec = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+                if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
+                    NGX_RTMP_STAT_L("<client>");
+                } else {
+                    NGX_RTMP_STAT_L("{");
                 }
-            }
-            total_nclients += nclients;
 
-            if (slcf->stat & NGX_RTMP_STAT_CLIENTS &&
-                slcf->format & NGX_RTMP_STAT_FORMAT_JSON)
-            {
-                NGX_RTMP_STAT_L("],");
-            }
+                ngx_rtmp_stat_client(r, lll, s);
 
-            if (codec) {
                 if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
-                    NGX_RTMP_STAT_L("<meta>");
+                    NGX_RTMP_STAT_L("<dropped>");
+                    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                  "%ui", ctx->ndropped) - buf);
+                    NGX_RTMP_STAT_L("</dropped>");
 
-                    NGX_RTMP_STAT_L("<video>");
-                    NGX_RTMP_STAT_L("<width>");
+                    NGX_RTMP_STAT_L("<dropped_nonref>");
                     NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                  "%ui", codec->width) - buf);
-                    NGX_RTMP_STAT_L("</width><height>");
+                                  "%ui", ctx->ndropped_nonref) - buf);
+                    NGX_RTMP_STAT_L("</dropped_nonref>");
+
+                    NGX_RTMP_STAT_L("<skipped>");
                     NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                  "%ui", codec->height) - buf);
-                    NGX_RTMP_STAT_L("</height><frame_rate>");
+                                  "%ui", ctx->nskipped) - buf);
+                    NGX_RTMP_STAT_L("</skipped>");
+
+                    NGX_RTMP_STAT_L("<congestion>");
                     NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                  "%ui", codec->frame_rate) - buf);
-                    NGX_RTMP_STAT_L("</frame_rate>");
-
-                    cname = ngx_rtmp_get_video_codec_name(codec->video_codec_id);
-                    if (*cname) {
-                        NGX_RTMP_STAT_L("<codec>");
-                        NGX_RTMP_STAT_ECS(cname);
-                        NGX_RTMP_STAT_L("</codec>");
-                    }
-                    if (codec->avc_profile) {
-                        NGX_RTMP_STAT_L("<profile>");
-                        NGX_RTMP_STAT_CS(
-                            ngx_rtmp_stat_get_avc_profile(codec->avc_profile));
-                        NGX_RTMP_STAT_L("</profile>");
-                    }
-                    if (codec->avc_compat) {
-                        NGX_RTMP_STAT_L("<compat>");
-                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                      "%ui", codec->avc_compat) - buf);
-                        NGX_RTMP_STAT_L("</compat>");
-                    }
-                    if (codec->avc_level) {
-                        NGX_RTMP_STAT_L("<level>");
-                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                      "%.1f", codec->avc_level / 10.) - buf);
-                        NGX_RTMP_STAT_L("</level>");
-                    }
-                    NGX_RTMP_STAT_L("</video>");
-
-                    NGX_RTMP_STAT_L("<audio>");
-                    cname = ngx_rtmp_get_audio_codec_name(codec->audio_codec_id);
-                    if (*cname) {
-                        NGX_RTMP_STAT_L("<codec>");
-                        NGX_RTMP_STAT_ECS(cname);
-                        NGX_RTMP_STAT_L("</codec>");
-                    }
-                    if (codec->aac_profile) {
-                        NGX_RTMP_STAT_L("<profile>");
-                        NGX_RTMP_STAT_CS(
-                            ngx_rtmp_stat_get_aac_profile(codec->aac_profile,
-                                                          codec->aac_sbr,
-                                                          codec->aac_ps));
-                        NGX_RTMP_STAT_L("</profile>");
-                    }
-                    if (codec->aac_chan_conf) {
-                        NGX_RTMP_STAT_L("<channels>");
-                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                      "%ui", codec->aac_chan_conf) - buf);
-                        NGX_RTMP_STAT_L("</channels>");
-                    } else if (codec->audio_channels) {
-                        NGX_RTMP_STAT_L("<channels>");
-                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                      "%ui", codec->audio_channels) - buf);
-                        NGX_RTMP_STAT_L("</channels>");
+                                  "%ui", ctx->congestion) - buf);
+                    NGX_RTMP_STAT_L("</congestion>");
+
+                    NGX_RTMP_STAT_L("<avsync>");
+                    if (!lacf->interleave) {
+                        NGX_RTMP_STAT(bbuf, ngx_snprintf(bbuf, sizeof(bbuf),
+                                      "%D", ctx->cs[1].timestamp -
+                                      ctx->cs[0].timestamp) - bbuf);
                     }
-                    if (codec->sample_rate) {
-                        NGX_RTMP_STAT_L("<sample_rate>");
-                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                      "%ui", codec->sample_rate) - buf);
-                        NGX_RTMP_STAT_L("</sample_rate>");
+                    NGX_RTMP_STAT_L("</avsync>");
+
+                    NGX_RTMP_STAT_L("<timestamp>");
+                    NGX_RTMP_STAT(bbuf, ngx_snprintf(bbuf, sizeof(bbuf),
+                                  "%D", s->current_time) - bbuf);
+                    NGX_RTMP_STAT_L("</timestamp>");
+
+                    if (ctx->publishing) {
+                        NGX_RTMP_STAT_L("<publishing/>");
                     }
-                    NGX_RTMP_STAT_L("</audio>");
 
-                    NGX_RTMP_STAT_L("</meta>\r\n");
+                    if (ctx->active) {
+                        NGX_RTMP_STAT_L("<active/>");
+                    }
                 } else {
-                    NGX_RTMP_STAT_L("\"meta\":{");
+                    NGX_RTMP_STAT_L("\"dropped\":");
+                    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                  "%ui", ctx->ndropped) - buf);
 
-                    NGX_RTMP_STAT_L("\"video\":{");
-                    NGX_RTMP_STAT_L("\"width\":");
+                    NGX_RTMP_STAT_L(",\"dropped_nonref\":");
                     NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                  "%ui", codec->width) - buf);
-                    NGX_RTMP_STAT_L(",\"height\":");
+                                  "%ui", ctx->ndropped_nonref) - buf);
+
+                    NGX_RTMP_STAT_L(",\"skipped\":");
                     NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                  "%ui", codec->height) - buf);
-                    NGX_RTMP_STAT_L(",\"frame_rate\":");
+                                  "%ui", ctx->nskipped) - buf);
+
+                    NGX_RTMP_STAT_L(",\"congestion\":");
                     NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                  "%ui", codec->frame_rate) - buf);
+                                  "%ui", ctx->congestion) - buf);
 
-                    cname = ngx_rtmp_get_video_codec_name(codec->video_codec_id);
-                    if (*cname) {
-                        NGX_RTMP_STAT_L(",\"codec\":\"");
-                        NGX_RTMP_STAT_ECS(cname);
-                        NGX_RTMP_STAT_L("\"");
-                    }
-                    if (codec->avc_profile) {
-                        NGX_RTMP_STAT_L(",\"profile\":\"");
-                        NGX_RTMP_STAT_CS(
-                            ngx_rtmp_stat_get_avc_profile(codec->avc_profile));
-                        NGX_RTMP_STAT_L("\"");
-                    }
-                    if (codec->avc_compat) {
-                        NGX_RTMP_STAT_L(",\"compat\":");
-                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                      "%ui", codec->avc_compat) - buf);
-                    }
-                    if (codec->avc_level) {
-                        NGX_RTMP_STAT_L(",\"level\":");
-                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                      "%.1f", codec->avc_level / 10.) - buf);
+                    NGX_RTMP_STAT_L(",\"avsync\":");
+                    if (!lacf->interleave) {
+                        NGX_RTMP_STAT(bbuf, ngx_snprintf(bbuf, sizeof(bbuf),
+                                      "%D", ctx->cs[1].timestamp -
+                                      ctx->cs[0].timestamp) - bbuf);
                     }
 
-                    NGX_RTMP_STAT_L("},\"audio\":{");
-                    cname = ngx_rtmp_get_audio_codec_name(codec->audio_codec_id);
-                    f = 0;
-                    if (*cname) {
-                        f = 1;
-                        NGX_RTMP_STAT_L("\"codec\":\"");
-                        NGX_RTMP_STAT_ECS(cname);
-                    }
-                    if (codec->aac_profile) {
-                        if (f == 1) NGX_RTMP_STAT_L("\",");
-                        f = 2;
-                        NGX_RTMP_STAT_L("\"profile\":\"");
-                        NGX_RTMP_STAT_CS(
-                            ngx_rtmp_stat_get_aac_profile(codec->aac_profile,
-                                                          codec->aac_sbr,
-                                                          codec->aac_ps));
-                    }
-                    if (codec->aac_chan_conf) {
-                        if (f >= 1) NGX_RTMP_STAT_L("\",");
-                        f = 3;
-                        NGX_RTMP_STAT_L("\"channels\":");
-                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                      "%ui", codec->aac_chan_conf) - buf);
-                    } else if (codec->audio_channels) {
-                        if (f >= 1) NGX_RTMP_STAT_L(",");
-                        f = 3;
-                        NGX_RTMP_STAT_L("\"channels\":");
-                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                      "%ui", codec->audio_channels) - buf);
+                    NGX_RTMP_STAT_L(",\"timestamp\":");
+                    NGX_RTMP_STAT(bbuf, ngx_snprintf(bbuf, sizeof(bbuf),
+                                  "%D", s->current_time) - bbuf);
+
+                    NGX_RTMP_STAT_L(",\"publishing\":");
+                    if (ctx->publishing) {
+                        NGX_RTMP_STAT_L("true");
+                    } else {
+                        NGX_RTMP_STAT_L("false");
                     }
-                    if (codec->sample_rate) {
-                        if (f >= 1) NGX_RTMP_STAT_L(",");
-                        f = 4;
-                        NGX_RTMP_STAT_L("\"sample_rate\":");
-                        NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                                      "%ui", codec->sample_rate) - buf);
+
+                    NGX_RTMP_STAT_L(",\"active\":");
+                    if (ctx->active) {
+                        NGX_RTMP_STAT_L("true");
+                    } else {
+                        NGX_RTMP_STAT_L("false");
                     }
-                    if (f >= 1 && f <= 3) {
-                        NGX_RTMP_STAT_L("\"");
+                }
+
+                if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
+                   NGX_RTMP_STAT_L("</client>\r\n");
+                } else {
+                    NGX_RTMP_STAT_L("}");
+                    if (ctx->next) {
+                        NGX_RTMP_STAT_L(",");
                     }
-                    NGX_RTMP_STAT_L("}}");
                 }
             }
+            if (ctx->publishing) {
+                codec = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+            }
+        }
+        total_nclients += nclients;
 
+        if (slcf->stat & NGX_RTMP_STAT_CLIENTS &&
+            slcf->format & NGX_RTMP_STAT_FORMAT_JSON)
+        {
+            NGX_RTMP_STAT_L("],");
+        }
+
+        if (codec) {
             if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
-                NGX_RTMP_STAT_L("<nclients>");
-                NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                              "%ui", nclients) - buf);
-                NGX_RTMP_STAT_L("</nclients>\r\n");
+                NGX_RTMP_STAT_L("<meta>");
 
-                if (stream->publishing) {
-                    NGX_RTMP_STAT_L("<publishing/>\r\n");
+                NGX_RTMP_STAT_L("<video>");
+                NGX_RTMP_STAT_L("<width>");
+                NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                              "%ui", codec->width) - buf);
+                NGX_RTMP_STAT_L("</width><height>");
+                NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                              "%ui", codec->height) - buf);
+                NGX_RTMP_STAT_L("</height><frame_rate>");
+                NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                              "%ui", codec->frame_rate) - buf);
+                NGX_RTMP_STAT_L("</frame_rate>");
+
+                cname = ngx_rtmp_get_video_codec_name(codec->video_codec_id);
+                if (*cname) {
+                    NGX_RTMP_STAT_L("<codec>");
+                    NGX_RTMP_STAT_ECS(cname);
+                    NGX_RTMP_STAT_L("</codec>");
                 }
-
-                if (stream->active) {
-                    NGX_RTMP_STAT_L("<active/>\r\n");
+                if (codec->avc_profile) {
+                    NGX_RTMP_STAT_L("<profile>");
+                    NGX_RTMP_STAT_CS(
+                        ngx_rtmp_stat_get_avc_profile(codec->avc_profile));
+                    NGX_RTMP_STAT_L("</profile>");
+                }
+                if (codec->avc_compat) {
+                    NGX_RTMP_STAT_L("<compat>");
+                    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                  "%ui", codec->avc_compat) - buf);
+                    NGX_RTMP_STAT_L("</compat>");
+                }
+                if (codec->avc_level) {
+                    NGX_RTMP_STAT_L("<level>");
+                    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                  "%.1f", codec->avc_level / 10.) - buf);
+                    NGX_RTMP_STAT_L("</level>");
+                }
+                NGX_RTMP_STAT_L("</video>");
+
+                NGX_RTMP_STAT_L("<audio>");
+                cname = ngx_rtmp_get_audio_codec_name(codec->audio_codec_id);
+                if (*cname) {
+                    NGX_RTMP_STAT_L("<codec>");
+                    NGX_RTMP_STAT_ECS(cname);
+                    NGX_RTMP_STAT_L("</codec>");
+                }
+                if (codec->aac_profile) {
+                    NGX_RTMP_STAT_L("<profile>");
+                    NGX_RTMP_STAT_CS(
+                        ngx_rtmp_stat_get_aac_profile(codec->aac_profile,
+                                                      codec->aac_sbr,
+                                                      codec->aac_ps));
+                    NGX_RTMP_STAT_L("</profile>");
+                }
+                if (codec->aac_chan_conf) {
+                    NGX_RTMP_STAT_L("<channels>");
+                    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                  "%ui", codec->aac_chan_conf) - buf);
+                    NGX_RTMP_STAT_L("</channels>");
+                } else if (codec->audio_channels) {
+                    NGX_RTMP_STAT_L("<channels>");
+                    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                  "%ui", codec->audio_channels) - buf);
+                    NGX_RTMP_STAT_L("</channels>");
+                }
+                if (codec->sample_rate) {
+                    NGX_RTMP_STAT_L("<sample_rate>");
+                    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                  "%ui", codec->sample_rate) - buf);
+                    NGX_RTMP_STAT_L("</sample_rate>");
                 }
+                NGX_RTMP_STAT_L("</audio>");
 
-                NGX_RTMP_STAT_L("</stream>\r\n");
+                NGX_RTMP_STAT_L("</meta>\r\n");
             } else {
-                if (codec) {
-                    NGX_RTMP_STAT_L(",");
-                }
-                NGX_RTMP_STAT_L("\"nclients\":");
+                NGX_RTMP_STAT_L("\"meta\":{");
+
+                NGX_RTMP_STAT_L("\"video\":{");
+                NGX_RTMP_STAT_L("\"width\":");
                 NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
-                              "%ui", nclients) - buf);
+                              "%ui", codec->width) - buf);
+                NGX_RTMP_STAT_L(",\"height\":");
+                NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                              "%ui", codec->height) - buf);
+                NGX_RTMP_STAT_L(",\"frame_rate\":");
+                NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                              "%ui", codec->frame_rate) - buf);
 
-                NGX_RTMP_STAT_L(",\"publishing\":");
-                if (stream->publishing) {
-                    NGX_RTMP_STAT_L("true");
-                } else {
-                    NGX_RTMP_STAT_L("false");
+                cname = ngx_rtmp_get_video_codec_name(codec->video_codec_id);
+                if (*cname) {
+                    NGX_RTMP_STAT_L(",\"codec\":\"");
+                    NGX_RTMP_STAT_ECS(cname);
+                    NGX_RTMP_STAT_L("\"");
+                }
+                if (codec->avc_profile) {
+                    NGX_RTMP_STAT_L(",\"profile\":\"");
+                    NGX_RTMP_STAT_CS(
+                        ngx_rtmp_stat_get_avc_profile(codec->avc_profile));
+                    NGX_RTMP_STAT_L("\"");
+                }
+                if (codec->avc_compat) {
+                    NGX_RTMP_STAT_L(",\"compat\":");
+                    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                  "%ui", codec->avc_compat) - buf);
+                }
+                if (codec->avc_level) {
+                    NGX_RTMP_STAT_L(",\"level\":");
+                    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                  "%.1f", codec->avc_level / 10.) - buf);
                 }
 
-                NGX_RTMP_STAT_L(",\"active\":");
-                if (stream->active) {
-                    NGX_RTMP_STAT_L("true");
-                } else {
-                    NGX_RTMP_STAT_L("false");
+                NGX_RTMP_STAT_L("},\"audio\":{");
+                cname = ngx_rtmp_get_audio_codec_name(codec->audio_codec_id);
+                f = 0;
+                if (*cname) {
+                    f = 1;
+                    NGX_RTMP_STAT_L("\"codec\":\"");
+                    NGX_RTMP_STAT_ECS(cname);
+                }
+                if (codec->aac_profile) {
+                    if (f == 1) NGX_RTMP_STAT_L("\",");
+                    f = 2;
+                    NGX_RTMP_STAT_L("\"profile\":\"");
+                    NGX_RTMP_STAT_CS(
+                        ngx_rtmp_stat_get_aac_profile(codec->aac_profile,
+                                                      codec->aac_sbr,
+                                                      codec->aac_ps));
+                }
+                if (codec->aac_chan_conf) {
+                    if (f >= 1) NGX_RTMP_STAT_L("\",");
+                    f = 3;
+                    NGX_RTMP_STAT_L("\"channels\":");
+                    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                  "%ui", codec->aac_chan_conf) - buf);
+                } else if (codec->audio_channels) {
+                    if (f >= 1) NGX_RTMP_STAT_L(",");
+                    f = 3;
+                    NGX_RTMP_STAT_L("\"channels\":");
+                    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                  "%ui", codec->audio_channels) - buf);
+                }
+                if (codec->sample_rate) {
+                    if (f >= 1) NGX_RTMP_STAT_L(",");
+                    f = 4;
+                    NGX_RTMP_STAT_L("\"sample_rate\":");
+                    NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                                  "%ui", codec->sample_rate) - buf);
                 }
+                if (f >= 1 && f <= 3) {
+                    NGX_RTMP_STAT_L("\"");
+                }
+                NGX_RTMP_STAT_L("}}");
+            }
+        }
 
-                NGX_RTMP_STAT_L("}");
+        if (slcf->format & NGX_RTMP_STAT_FORMAT_XML) {
+            NGX_RTMP_STAT_L("<nclients>");
+            NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                          "%ui", nclients) - buf);
+            NGX_RTMP_STAT_L("</nclients>\r\n");
+
+            if (stream->publishing) {
+                NGX_RTMP_STAT_L("<publishing/>\r\n");
+            }
+
+            if (stream->active) {
+                NGX_RTMP_STAT_L("<active/>\r\n");
+            }
+
+            NGX_RTMP_STAT_L("</stream>\r\n");
+        } else {
+            if (codec) {
+                NGX_RTMP_STAT_L(",");
             }
+            NGX_RTMP_STAT_L("\"nclients\":");
+            NGX_RTMP_STAT(buf, ngx_snprintf(buf, sizeof(buf),
+                          "%ui", nclients) - buf);
+
+            NGX_RTMP_STAT_L(",\"publishing\":");
+            if (stream->publishing) {
+                NGX_RTMP_STAT_L("true");
+            } else {
+                NGX_RTMP_STAT_L("false");
+            }
+
+            NGX_RTMP_STAT_L(",\"active\":");
+            if (stream->active) {
+                NGX_RTMP_STAT_L("true");
+            } else {
+                NGX_RTMP_STAT_L("false");
+            }
+
+            NGX_RTMP_STAT_L("}");
         }
     }
 
@@ -1192,7 +1468,14 @@ ngx_rtmp_stat_handler(ngx_http_request_t *r)
 
     ngx_rtmp_stat_bw(r, lll, &ngx_rtmp_bw_in, "in", NGX_RTMP_STAT_BW_BYTES);
     ngx_rtmp_stat_bw(r, lll, &ngx_rtmp_bw_out, "out", NGX_RTMP_STAT_BW_BYTES);
-    
+    ngx_rtmp_stat_syscalls(r, lll, &ngx_rtmp_bw_out_calls, &ngx_rtmp_bw_out,
+                           "out");
+    ngx_rtmp_stat_syscalls(r, lll, &ngx_rtmp_bw_in_calls, &ngx_rtmp_bw_in,
+                           "in");
+    ngx_rtmp_stat_aio(r, lll);
+    ngx_rtmp_stat_dash(r, lll);
+    ngx_rtmp_stat_mp4(r, lll);
+
     if (slcf->format & NGX_RTMP_STAT_FORMAT_JSON) {
         NGX_RTMP_STAT_L("\"servers\":[");
     }
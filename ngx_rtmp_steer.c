@@ -0,0 +1,855 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include "ngx_rtmp.h"
+#include "ngx_rtmp_cmd_module.h"
+#include "ngx_rtmp_steer.h"
+
+
+/*
+ * Stream affinity: every app/name is owned by one worker, chosen by a
+ * jump consistent hash over the worker numbers.  A connection accepted
+ * by another worker keeps the bytes it has read until the stream name
+ * is known, then the socket travels to the owner over a datagram
+ * socketpair created by the master (SCM_RIGHTS) together with these
+ * bytes.  The owner replays them as if it had read them itself.
+ */
+
+
+static void *ngx_rtmp_steer_create_conf(ngx_cycle_t *cycle);
+static ngx_int_t ngx_rtmp_steer_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_rtmp_steer_init_process(ngx_cycle_t *cycle);
+
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+static void ngx_rtmp_steer_close_channels(void *data);
+static void ngx_rtmp_steer_read_handler(ngx_event_t *ev);
+static void ngx_rtmp_steer_accept(ngx_socket_t fd, u_char *data, size_t len);
+static ssize_t ngx_rtmp_steer_record_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ssize_t ngx_rtmp_steer_replay_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ssize_t ngx_rtmp_steer_closed_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ngx_int_t ngx_rtmp_steer_publish(ngx_rtmp_session_t *s,
+    ngx_rtmp_publish_t *v);
+static ngx_int_t ngx_rtmp_steer_play(ngx_rtmp_session_t *s,
+    ngx_rtmp_play_t *v);
+
+
+static ngx_rtmp_publish_pt              next_publish;
+static ngx_rtmp_play_pt                 next_play;
+#endif
+
+
+typedef struct {
+    uint32_t                            listening;
+    uint32_t                            flags;
+} ngx_rtmp_steer_msg_t;
+
+
+typedef struct {
+    ngx_uint_t                          n;
+    ngx_socket_t                      (*fds)[2];
+} ngx_rtmp_steer_channels_t;
+
+
+static ngx_rtmp_steer_channels_t       *ngx_rtmp_steer_channels;
+static ngx_rtmp_steer_conn_t          **ngx_rtmp_steer_conns;
+
+
+static ngx_core_module_t  ngx_rtmp_steer_module_ctx = {
+    ngx_string("rtmp_steer"),
+    ngx_rtmp_steer_create_conf,             /* create conf */
+    NULL                                    /* init conf */
+};
+
+
+ngx_module_t  ngx_rtmp_steer_module = {
+    NGX_MODULE_V1,
+    &ngx_rtmp_steer_module_ctx,             /* module context */
+    NULL,                                   /* module directives */
+    NGX_CORE_MODULE,                        /* module type */
+    NULL,                                   /* init master */
+    ngx_rtmp_steer_init_module,             /* init module */
+    ngx_rtmp_steer_init_process,            /* init process */
+    NULL,                                   /* init thread */
+    NULL,                                   /* exit thread */
+    NULL,                                   /* exit process */
+    NULL,                                   /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void *
+ngx_rtmp_steer_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_rtmp_steer_conf_t      *scf;
+
+    scf = ngx_pcalloc(cycle->pool, sizeof(ngx_rtmp_steer_conf_t));
+    if (scf == NULL) {
+        return NULL;
+    }
+
+    return scf;
+}
+
+
+void
+ngx_rtmp_steer_enable(ngx_conf_t *cf)
+{
+    ngx_rtmp_steer_conf_t      *scf;
+
+    scf = (ngx_rtmp_steer_conf_t *) ngx_get_conf(cf->cycle->conf_ctx,
+                                                  ngx_rtmp_steer_module);
+    scf->enabled = 1;
+}
+
+
+ngx_int_t
+ngx_rtmp_steer_owner(ngx_str_t *app, ngx_str_t *name)
+{
+    uint32_t                    crc;
+    uint64_t                    key;
+    int64_t                     b, j;
+
+    if (ngx_rtmp_steer_channels == NULL || ngx_exiting || ngx_terminate) {
+        return NGX_DECLINED;
+    }
+
+    ngx_crc32_init(crc);
+    ngx_crc32_update(&crc, app->data, app->len);
+    ngx_crc32_update(&crc, (u_char *) "/", 1);
+    ngx_crc32_update(&crc, name->data, name->len);
+    ngx_crc32_final(crc);
+
+    /* Lamping & Veach, "A Fast, Minimal Memory, Consistent Hash" */
+
+    key = crc;
+    b = -1;
+    j = 0;
+
+    while (j < (int64_t) ngx_rtmp_steer_channels->n) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t) ((b + 1) * ((double) (1LL << 31)
+                                  / (double) ((key >> 33) + 1)));
+    }
+
+    return (ngx_int_t) b;
+}
+
+
+ngx_rtmp_steer_conn_t *
+ngx_rtmp_steer_conn(ngx_connection_t *c)
+{
+    ngx_rtmp_steer_conn_t      *sc;
+
+    if (ngx_rtmp_steer_conns == NULL) {
+        return NULL;
+    }
+
+    sc = ngx_rtmp_steer_conns[c - ngx_cycle->connections];
+
+    if (sc == NULL || sc->number != c->number) {
+        return NULL;
+    }
+
+    return sc;
+}
+
+
+ssize_t
+ngx_rtmp_steer_mute_send(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    return size;
+}
+
+
+#if (NGX_HAVE_MSGHDR_MSG_CONTROL)
+
+static ngx_int_t
+ngx_rtmp_steer_init_module(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                  n;
+    ngx_core_conf_t            *ccf;
+    ngx_pool_cleanup_t         *cln;
+    ngx_rtmp_steer_conf_t      *scf;
+    ngx_rtmp_steer_channels_t  *ch;
+
+    ngx_rtmp_steer_channels = NULL;
+
+    scf = (ngx_rtmp_steer_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_rtmp_steer_module);
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    if (!scf->enabled || !ccf->master || ccf->worker_processes < 2) {
+        return NGX_OK;
+    }
+
+    ch = ngx_pcalloc(cycle->pool, sizeof(ngx_rtmp_steer_channels_t));
+    if (ch == NULL) {
+        return NGX_ERROR;
+    }
+
+    ch->fds = ngx_palloc(cycle->pool,
+                         ccf->worker_processes * sizeof(ngx_socket_t [2]));
+    if (ch->fds == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_rtmp_steer_close_channels;
+    cln->data = ch;
+
+    for (n = 0; n < (ngx_uint_t) ccf->worker_processes; n++) {
+
+        if (socketpair(AF_UNIX, SOCK_DGRAM, 0, ch->fds[n]) == -1) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                          "steer: socketpair() failed");
+            return NGX_ERROR;
+        }
+
+        ch->n++;
+
+        if (ngx_nonblocking(ch->fds[n][0]) == -1
+            || ngx_nonblocking(ch->fds[n][1]) == -1)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                          "steer: " ngx_nonblocking_n " failed");
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_rtmp_steer_channels = ch;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_steer_close_channels(void *data)
+{
+    ngx_rtmp_steer_channels_t  *ch = data;
+
+    ngx_uint_t                  n;
+
+    for (n = 0; n < ch->n; n++) {
+        ngx_close_socket(ch->fds[n][0]);
+        ngx_close_socket(ch->fds[n][1]);
+    }
+
+    if (ngx_rtmp_steer_channels == ch) {
+        ngx_rtmp_steer_channels = NULL;
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_steer_init_process(ngx_cycle_t *cycle)
+{
+    ngx_connection_t           *c;
+
+    if (ngx_rtmp_steer_channels == NULL
+        || ngx_process != NGX_PROCESS_WORKER
+        || ngx_worker >= ngx_rtmp_steer_channels->n)
+    {
+        ngx_rtmp_steer_channels = NULL;
+        return NGX_OK;
+    }
+
+    ngx_rtmp_steer_conns = ngx_pcalloc(cycle->pool,
+                                 cycle->connection_n * sizeof(void *));
+    if (ngx_rtmp_steer_conns == NULL) {
+        return NGX_ERROR;
+    }
+
+    c = ngx_get_connection(ngx_rtmp_steer_channels->fds[ngx_worker][1],
+                           cycle->log);
+    if (c == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->recv = ngx_recv;
+    c->send = ngx_send;
+    c->log = cycle->log;
+    c->read->log = cycle->log;
+    c->write->log = cycle->log;
+    c->read->handler = ngx_rtmp_steer_read_handler;
+
+    if (ngx_add_event(c->read, NGX_READ_EVENT, 0) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    next_publish = ngx_rtmp_publish;
+    ngx_rtmp_publish = ngx_rtmp_steer_publish;
+
+    next_play = ngx_rtmp_play;
+    ngx_rtmp_play = ngx_rtmp_steer_play;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_rtmp_steer_record(ngx_connection_t *c)
+{
+    ngx_rtmp_steer_conn_t      *sc;
+
+    if (ngx_rtmp_steer_channels == NULL || ngx_rtmp_steer_conn(c)) {
+        return;
+    }
+
+    sc = ngx_pcalloc(c->pool, sizeof(ngx_rtmp_steer_conn_t));
+    if (sc == NULL) {
+        return;
+    }
+
+    sc->start = ngx_palloc(c->pool, NGX_RTMP_STEER_MAX_DATA);
+    if (sc->start == NULL) {
+        return;
+    }
+
+    sc->number = c->number;
+    sc->pos = sc->last = sc->start;
+    sc->end = sc->start + NGX_RTMP_STEER_MAX_DATA;
+    sc->record = 1;
+
+    ngx_rtmp_steer_conns[c - ngx_cycle->connections] = sc;
+
+    c->recv = ngx_rtmp_steer_record_recv;
+}
+
+
+static ssize_t
+ngx_rtmp_steer_record_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ssize_t                     n;
+    ngx_rtmp_steer_conn_t      *sc;
+
+    n = ngx_recv(c, buf, size);
+
+    sc = ngx_rtmp_steer_conn(c);
+
+    if (n <= 0 || sc == NULL) {
+        return n;
+    }
+
+    if ((size_t) n > (size_t) (sc->end - sc->last)) {
+        sc->overflow = 1;
+        sc->record = 0;
+        c->recv = ngx_recv;
+        return n;
+    }
+
+    sc->last = ngx_cpymem(sc->last, buf, n);
+
+    return n;
+}
+
+
+static ssize_t
+ngx_rtmp_steer_replay_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    size_t                      n;
+    ngx_rtmp_steer_conn_t      *sc;
+
+    sc = ngx_rtmp_steer_conn(c);
+
+    if (sc == NULL || !sc->replay) {
+        c->recv = ngx_recv;
+        return ngx_recv(c, buf, size);
+    }
+
+    n = ngx_min(size, (size_t) (sc->last - sc->pos));
+
+    ngx_memcpy(buf, sc->pos, n);
+    sc->pos += n;
+
+    if (sc->pos == sc->last) {
+        sc->replay = 0;
+        c->recv = ngx_recv;
+    }
+
+    return n;
+}
+
+
+static ssize_t
+ngx_rtmp_steer_closed_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    return 0;
+}
+
+
+ngx_int_t
+ngx_rtmp_steer_handoff(ngx_connection_t *c, ngx_int_t worker,
+    ngx_uint_t flags, u_char *data, size_t len)
+{
+    ssize_t                     n;
+    ngx_err_t                   err;
+    ngx_uint_t                  i;
+    struct iovec                iov[2];
+    struct msghdr               msg;
+    ngx_listening_t            *ls;
+    ngx_rtmp_steer_msg_t        sm;
+
+    union {
+        struct cmsghdr          cm;
+        char                    space[CMSG_SPACE(sizeof(int))];
+    } cmsg;
+
+    if (ngx_rtmp_steer_channels == NULL
+        || worker < 0 || (ngx_uint_t) worker >= ngx_rtmp_steer_channels->n
+        || (ngx_uint_t) worker == ngx_worker
+        || len > NGX_RTMP_STEER_MAX_DATA)
+    {
+        return NGX_DECLINED;
+    }
+
+    ls = ngx_cycle->listening.elts;
+
+    for (i = 0; i < ngx_cycle->listening.nelts; i++) {
+        if (&ls[i] == c->listening) {
+            break;
+        }
+    }
+
+    if (i == ngx_cycle->listening.nelts) {
+        return NGX_DECLINED;
+    }
+
+    sm.listening = (uint32_t) i;
+    sm.flags = (uint32_t) flags;
+
+    iov[0].iov_base = (char *) &sm;
+    iov[0].iov_len = sizeof(sm);
+    iov[1].iov_base = (char *) data;
+    iov[1].iov_len = len;
+
+    ngx_memzero(&msg, sizeof(struct msghdr));
+    ngx_memzero(&cmsg, sizeof(cmsg));
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = (caddr_t) &cmsg;
+    msg.msg_controllen = sizeof(cmsg);
+
+    cmsg.cm.cmsg_len = CMSG_LEN(sizeof(int));
+    cmsg.cm.cmsg_level = SOL_SOCKET;
+    cmsg.cm.cmsg_type = SCM_RIGHTS;
+
+    ngx_memcpy(CMSG_DATA(&cmsg.cm), &c->fd, sizeof(int));
+
+    n = sendmsg(ngx_rtmp_steer_channels->fds[worker][0], &msg, 0);
+
+    if (n == -1) {
+        err = ngx_socket_errno;
+
+        ngx_log_error(err == NGX_EAGAIN ? NGX_LOG_INFO : NGX_LOG_ALERT,
+                      c->log, err, "steer: sendmsg() to worker %i failed",
+                      worker);
+        return NGX_DECLINED;
+    }
+
+    /*
+     * the socket is shared with the owner now, remove it from this
+     * worker's event set explicitly as closing the descriptor does
+     * not do it while the socket stays open elsewhere
+     */
+
+    if (ngx_del_conn) {
+        if (c->read->active || c->write->active) {
+            ngx_del_conn(c, 0);
+        }
+
+    } else {
+        if (c->read->active) {
+            ngx_del_event(c->read, NGX_READ_EVENT, 0);
+        }
+
+        if (c->write->active) {
+            ngx_del_event(c->write, NGX_WRITE_EVENT, 0);
+        }
+    }
+
+    c->recv = ngx_rtmp_steer_closed_recv;
+    c->send = ngx_rtmp_steer_mute_send;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                   "steer: handed off to worker %i, replay=%uz",
+                   worker, len);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_steer_read_handler(ngx_event_t *ev)
+{
+    ssize_t                     n;
+    ngx_err_t                   err;
+    ngx_socket_t                fd;
+    struct iovec                iov[1];
+    struct msghdr               msg;
+    ngx_connection_t           *c;
+
+    static u_char               buf[sizeof(ngx_rtmp_steer_msg_t)
+                                    + NGX_RTMP_STEER_MAX_DATA];
+
+    union {
+        struct cmsghdr          cm;
+        char                    space[CMSG_SPACE(sizeof(int))];
+    } cmsg;
+
+    c = ev->data;
+
+    for ( ;; ) {
+        iov[0].iov_base = (char *) buf;
+        iov[0].iov_len = sizeof(buf);
+
+        ngx_memzero(&msg, sizeof(struct msghdr));
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = (caddr_t) &cmsg;
+        msg.msg_controllen = sizeof(cmsg);
+
+        n = recvmsg(c->fd, &msg, 0);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                              "steer: recvmsg() failed");
+            }
+
+            return;
+        }
+
+        if (msg.msg_controllen < CMSG_LEN(sizeof(int))
+            || cmsg.cm.cmsg_level != SOL_SOCKET
+            || cmsg.cm.cmsg_type != SCM_RIGHTS)
+        {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                          "steer: recvmsg() returned no socket");
+            continue;
+        }
+
+        ngx_memcpy(&fd, CMSG_DATA(&cmsg.cm), sizeof(int));
+
+        if ((size_t) n < sizeof(ngx_rtmp_steer_msg_t)
+            || (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)))
+        {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                          "steer: truncated message");
+            ngx_close_socket(fd);
+            continue;
+        }
+
+        ngx_rtmp_steer_accept(fd, buf, n);
+    }
+}
+
+
+static void
+ngx_rtmp_steer_accept(ngx_socket_t fd, u_char *data, size_t len)
+{
+    ngx_log_t                  *log;
+    ngx_event_t                *rev, *wev;
+    ngx_connection_t           *c;
+    ngx_listening_t            *ls;
+    ngx_rtmp_steer_msg_t        sm;
+    ngx_rtmp_steer_conn_t      *sc;
+
+    ngx_memcpy(&sm, data, sizeof(sm));
+
+    data += sizeof(sm);
+    len -= sizeof(sm);
+
+    if (sm.listening >= ngx_cycle->listening.nelts) {
+        ngx_close_socket(fd);
+        return;
+    }
+
+    ls = ngx_cycle->listening.elts;
+    ls = &ls[sm.listening];
+
+    c = ngx_get_connection(fd, ngx_cycle->log);
+    if (c == NULL) {
+        ngx_close_socket(fd);
+        return;
+    }
+
+    c->type = SOCK_STREAM;
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
+#endif
+
+    c->pool = ngx_create_pool(ls->pool_size, ngx_cycle->log);
+    if (c->pool == NULL) {
+        goto failed;
+    }
+
+    c->socklen = sizeof(ngx_sockaddr_t);
+
+    c->sockaddr = ngx_palloc(c->pool, c->socklen);
+    if (c->sockaddr == NULL) {
+        goto failed;
+    }
+
+    if (getpeername(fd, c->sockaddr, &c->socklen) == -1) {
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, ngx_socket_errno,
+                      "steer: getpeername() failed");
+        goto failed;
+    }
+
+    log = ngx_palloc(c->pool, sizeof(ngx_log_t));
+    if (log == NULL) {
+        goto failed;
+    }
+
+    *log = ls->log;
+
+    c->recv = ngx_recv;
+    c->send = ngx_send;
+    c->recv_chain = ngx_recv_chain;
+    c->send_chain = ngx_send_chain;
+
+    c->log = log;
+    c->pool->log = log;
+
+    c->listening = ls;
+    c->local_sockaddr = ls->sockaddr;
+    c->local_socklen = ls->socklen;
+
+    rev = c->read;
+    wev = c->write;
+
+    /* the replayed bytes are available without a read event */
+
+    rev->ready = 1;
+    wev->ready = 1;
+
+    rev->log = log;
+    wev->log = log;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    if (ls->addr_ntop) {
+        c->addr_text.data = ngx_pnalloc(c->pool, ls->addr_text_max_len);
+        if (c->addr_text.data == NULL) {
+            goto failed;
+        }
+
+        c->addr_text.len = ngx_sock_ntop(c->sockaddr,
+#if (nginx_version >= 1005003)
+                                         c->socklen,
+#endif
+                                         c->addr_text.data,
+                                         ls->addr_text_max_len, 0);
+        if (c->addr_text.len == 0) {
+            goto failed;
+        }
+    }
+
+    if (ngx_add_conn && (ngx_event_flags & NGX_USE_EPOLL_EVENT) == 0) {
+        if (ngx_add_conn(c) == NGX_ERROR) {
+            goto failed;
+        }
+    }
+
+    sc = ngx_pcalloc(c->pool, sizeof(ngx_rtmp_steer_conn_t) + len);
+    if (sc == NULL) {
+        goto failed;
+    }
+
+    sc->number = c->number;
+    sc->start = sc->pos = (u_char *) &sc[1];
+    sc->last = sc->end = ngx_cpymem(sc->start, data, len);
+    sc->replay = (len != 0);
+    sc->steered = 1;
+
+    ngx_rtmp_steer_conns[c - ngx_cycle->connections] = sc;
+
+    if (sc->replay) {
+        c->recv = ngx_rtmp_steer_replay_recv;
+    }
+
+    if (sm.flags & NGX_RTMP_STEER_MUTE) {
+        c->send = ngx_rtmp_steer_mute_send;
+    }
+
+    log->data = NULL;
+    log->handler = NULL;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, log, 0,
+                   "steer: accepted *%uA, replay=%uz", c->number, len);
+
+    ls->handler(c);
+
+    return;
+
+failed:
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, -1);
+#endif
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+        c->pool = NULL;
+    }
+
+    ngx_close_connection(c);
+}
+
+
+static ngx_int_t
+ngx_rtmp_steer_stream(ngx_rtmp_session_t *s, u_char *stream)
+{
+    ngx_int_t                   owner;
+    ngx_str_t                   name;
+    ngx_connection_t           *c;
+    ngx_rtmp_steer_conn_t      *sc;
+
+    c = s->connection;
+
+    if (c->listening == NULL
+        || c->listening->handler != ngx_rtmp_init_connection)
+    {
+        return NGX_DECLINED;
+    }
+
+    sc = ngx_rtmp_steer_conn(c);
+    if (sc == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (sc->steered) {
+
+        /* the owner has caught up with the worker that handed it over */
+
+        if (ngx_rtmp_steer_muted(c)) {
+            c->send = ngx_send;
+        }
+
+        return NGX_DECLINED;
+    }
+
+    if (!sc->record) {
+        return NGX_DECLINED;
+    }
+
+    sc->record = 0;
+    c->recv = ngx_recv;
+
+    name.data = stream;
+    name.len = ngx_strlen(stream);
+
+    owner = ngx_rtmp_steer_owner(&s->app, &name);
+
+    if (owner == NGX_DECLINED || (ngx_uint_t) owner == ngx_worker) {
+        return NGX_DECLINED;
+    }
+
+    /* whatever this worker has answered must be on the wire already */
+
+    if (s->out_chain || s->out_pos != s->out_last) {
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                       "steer: output pending, serving '%V' locally",
+                       &name);
+        return NGX_DECLINED;
+    }
+
+    if (ngx_rtmp_steer_handoff(c, owner, NGX_RTMP_STEER_MUTE, sc->start,
+                               sc->last - sc->start)
+        != NGX_OK)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "steer: stream '%V/%V' handed off to worker %i",
+                  &s->app, &name, owner);
+
+    s->steered_out = 1;
+
+    ngx_rtmp_finalize_session(s);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_steer_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
+{
+    if (ngx_rtmp_steer_stream(s, v->name) == NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return next_publish(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_steer_play(ngx_rtmp_session_t *s, ngx_rtmp_play_t *v)
+{
+    if (ngx_rtmp_steer_stream(s, v->name) == NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return next_play(s, v);
+}
+
+#else
+
+
+static ngx_int_t
+ngx_rtmp_steer_init_module(ngx_cycle_t *cycle)
+{
+    ngx_rtmp_steer_conf_t      *scf;
+
+    scf = (ngx_rtmp_steer_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                  ngx_rtmp_steer_module);
+    if (scf->enabled) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "steer: not supported on this platform, ignored");
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_steer_init_process(ngx_cycle_t *cycle)
+{
+    return NGX_OK;
+}
+
+
+void
+ngx_rtmp_steer_record(ngx_connection_t *c)
+{
+}
+
+
+ngx_int_t
+ngx_rtmp_steer_handoff(ngx_connection_t *c, ngx_int_t worker,
+    ngx_uint_t flags, u_char *data, size_t len)
+{
+    return NGX_DECLINED;
+}
+
+#endif
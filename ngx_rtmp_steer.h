@@ -0,0 +1,66 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#ifndef _NGX_RTMP_STEER_H_INCLUDED_
+#define _NGX_RTMP_STEER_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/* bytes of a connection kept for the worker it is handed off to */
+#define NGX_RTMP_STEER_MAX_DATA         16384
+
+/* the receiving worker discards its output until the stream command */
+#define NGX_RTMP_STEER_MUTE             0x01
+
+
+typedef struct {
+    ngx_flag_t                          enabled;
+} ngx_rtmp_steer_conf_t;
+
+
+typedef struct {
+    ngx_atomic_uint_t                   number;   /* c->number */
+    u_char                             *start;
+    u_char                             *pos;
+    u_char                             *last;
+    u_char                             *end;
+
+    unsigned                            record:1;
+    unsigned                            replay:1;
+    unsigned                            overflow:1;
+    unsigned                            steered:1;
+} ngx_rtmp_steer_conn_t;
+
+
+extern ngx_module_t                     ngx_rtmp_steer_module;
+
+
+/* called while parsing the configuration by every "steer" user */
+void ngx_rtmp_steer_enable(ngx_conf_t *cf);
+
+/* worker owning the stream, NGX_DECLINED if steering is not active */
+ngx_int_t ngx_rtmp_steer_owner(ngx_str_t *app, ngx_str_t *name);
+
+/* starts keeping the bytes read from a freshly accepted connection */
+void ngx_rtmp_steer_record(ngx_connection_t *c);
+
+ngx_rtmp_steer_conn_t *ngx_rtmp_steer_conn(ngx_connection_t *c);
+
+/* passes the socket and the bytes to replay on it to another worker;
+ * on success the connection must be closed without any more i/o */
+ngx_int_t ngx_rtmp_steer_handoff(ngx_connection_t *c, ngx_int_t worker,
+    ngx_uint_t flags, u_char *data, size_t len);
+
+ssize_t ngx_rtmp_steer_mute_send(ngx_connection_t *c, u_char *buf,
+    size_t size);
+
+#define ngx_rtmp_steer_muted(c)         ((c)->send == ngx_rtmp_steer_mute_send)
+
+
+#endif /* _NGX_RTMP_STEER_H_INCLUDED_ */
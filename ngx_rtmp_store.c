@@ -0,0 +1,739 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp_store.h"
+
+
+static ngx_int_t ngx_rtmp_store_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_rtmp_store_chunk_t *ngx_rtmp_store_chunk(ngx_rtmp_store_t *st,
+    size_t size);
+static void ngx_rtmp_store_expire_locked(ngx_rtmp_store_t *st, time_t now);
+static void ngx_rtmp_store_unlink_locked(ngx_rtmp_store_t *st,
+    ngx_rtmp_store_node_t *node);
+static void ngx_rtmp_store_free_locked(ngx_rtmp_store_t *st,
+    ngx_rtmp_store_node_t *node);
+static void ngx_rtmp_store_notify(ngx_rtmp_store_t *st);
+static void ngx_rtmp_store_close_channels(void *data);
+static void ngx_rtmp_store_read_handler(ngx_event_t *ev);
+
+
+/* a datagram socketpair per worker, created by the master */
+typedef struct {
+    ngx_uint_t                          n;
+    ngx_socket_t                      (*fds)[2];
+} ngx_rtmp_store_channels_t;
+
+
+/* the same zone is looked up by the rtmp and the http configuration */
+static ngx_uint_t                       ngx_rtmp_store_tag;
+
+static ngx_rtmp_store_channels_t       *ngx_rtmp_store_channels;
+static ngx_event_handler_pt             ngx_rtmp_store_wake;
+
+
+char *
+ngx_rtmp_store_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char  *p = conf;
+
+    u_char             *c;
+    ssize_t             size;
+    ngx_str_t          *value, name, s;
+    ngx_rtmp_store_t  **field;
+
+    field = (ngx_rtmp_store_t **) (p + cmd->offset);
+
+    if (*field != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        *field = NULL;
+        return NGX_CONF_OK;
+    }
+
+    name = value[1];
+    size = 0;
+
+    c = ngx_strlchr(name.data, name.data + name.len, ':');
+
+    if (c) {
+        name.len = c - name.data;
+
+        s.data = c + 1;
+        s.len = value[1].data + value[1].len - s.data;
+
+        size = ngx_parse_size(&s);
+        if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid store size \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid store name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    *field = ngx_rtmp_store_add(cf, &name, (size_t) size);
+    if (*field == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+ngx_rtmp_store_t *
+ngx_rtmp_store_add(ngx_conf_t *cf, ngx_str_t *name, size_t size)
+{
+    ngx_shm_zone_t    *shm_zone;
+    ngx_rtmp_store_t  *st;
+
+    shm_zone = ngx_shared_memory_add(cf, name, size, &ngx_rtmp_store_tag);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->data) {
+        return shm_zone->data;
+    }
+
+    st = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_store_t));
+    if (st == NULL) {
+        return NULL;
+    }
+
+    shm_zone->init = ngx_rtmp_store_init_zone;
+    shm_zone->data = st;
+
+    st->shm_zone = shm_zone;
+
+    return st;
+}
+
+
+static ngx_int_t
+ngx_rtmp_store_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_rtmp_store_t  *ost = data;
+
+    size_t             len;
+    ngx_rtmp_store_t  *st;
+
+    st = shm_zone->data;
+
+    if (ost) {
+        st->sh = ost->sh;
+        st->shpool = ost->shpool;
+        return NGX_OK;
+    }
+
+    st->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        st->sh = st->shpool->data;
+        return NGX_OK;
+    }
+
+    st->sh = ngx_slab_alloc(st->shpool, sizeof(ngx_rtmp_store_sh_t));
+    if (st->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    st->shpool->data = st->sh;
+
+    ngx_rbtree_init(&st->sh->rbtree, &st->sh->sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    ngx_queue_init(&st->sh->queue);
+
+    len = sizeof(" in rtmp store zone \"\"") + shm_zone->shm.name.len;
+
+    st->shpool->log_ctx = ngx_slab_alloc(st->shpool, len);
+    if (st->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(st->shpool->log_ctx, " in rtmp store zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    /* running out of memory is normal, old files are evicted then */
+
+    st->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_rtmp_store_alloc_locked(ngx_rtmp_store_t *st, size_t size)
+{
+    void                   *p;
+    ngx_queue_t            *q;
+    ngx_rtmp_store_node_t  *node;
+
+    for ( ;; ) {
+        p = ngx_slab_alloc_locked(st->shpool, size);
+        if (p) {
+            return p;
+        }
+
+        /* the oldest file nobody is reading makes room */
+
+        for (q = ngx_queue_head(&st->sh->queue);
+             q != ngx_queue_sentinel(&st->sh->queue);
+             q = ngx_queue_next(q))
+        {
+            node = ngx_queue_data(q, ngx_rtmp_store_node_t, queue);
+
+            if (node->refs == 0) {
+                break;
+            }
+        }
+
+        if (q == ngx_queue_sentinel(&st->sh->queue)) {
+            return NULL;
+        }
+
+        ngx_rtmp_store_unlink_locked(st, node);
+    }
+}
+
+
+static ngx_rtmp_store_chunk_t *
+ngx_rtmp_store_chunk(ngx_rtmp_store_t *st, size_t size)
+{
+    ngx_rtmp_store_chunk_t  *cl;
+
+    ngx_shmtx_lock(&st->shpool->mutex);
+    cl = ngx_rtmp_store_alloc_locked(st, size);
+    ngx_shmtx_unlock(&st->shpool->mutex);
+
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->next = NULL;
+    cl->last = (u_char *) (cl + 1);
+    cl->end = (u_char *) cl + size;
+
+    return cl;
+}
+
+
+ngx_rtmp_store_node_t *
+ngx_rtmp_store_open(ngx_rtmp_store_t *st, u_char *path, size_t len,
+    ngx_log_t *log)
+{
+    ngx_rtmp_store_node_t  *node;
+
+    ngx_shmtx_lock(&st->shpool->mutex);
+
+    ngx_rtmp_store_expire_locked(st, ngx_time());
+
+    node = ngx_rtmp_store_alloc_locked(st,
+                                       sizeof(ngx_rtmp_store_node_t) + len);
+
+    ngx_shmtx_unlock(&st->shpool->mutex);
+
+    if (node == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "store: no memory for \"%*s\"", len, path);
+        return NULL;
+    }
+
+    ngx_memzero(node, sizeof(ngx_rtmp_store_node_t));
+
+    node->sn.str.data = (u_char *) (node + 1);
+    node->sn.str.len = len;
+    node->sn.node.key = ngx_crc32_short(path, len);
+
+    ngx_memcpy(node->sn.str.data, path, len);
+
+    /* held by the writer until the file is published */
+    node->refs = 1;
+
+    return node;
+}
+
+
+ngx_int_t
+ngx_rtmp_store_append(ngx_rtmp_store_t *st, ngx_rtmp_store_node_t *node,
+    u_char *data, size_t size)
+{
+    size_t                   n;
+    ngx_rtmp_store_chunk_t  *cl;
+
+    /* nobody reads past the size, data are copied without the lock */
+
+    while (size) {
+        cl = node->last;
+
+        if (cl == NULL || cl->last == cl->end) {
+            cl = ngx_rtmp_store_chunk(st, NGX_RTMP_STORE_CHUNK_SIZE);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            if (node->last) {
+                node->last->next = cl;
+
+            } else {
+                node->chunks = cl;
+            }
+
+            node->last = cl;
+        }
+
+        n = ngx_min(size, (size_t) (cl->end - cl->last));
+
+        cl->last = ngx_cpymem(cl->last, data, n);
+
+        data += n;
+        size -= n;
+
+        /* readers of a growing file see the data before the size */
+
+        ngx_memory_barrier();
+
+        node->size += n;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_rtmp_store_publish(ngx_rtmp_store_t *st, ngx_rtmp_store_node_t *node,
+    time_t ttl, ngx_uint_t flags)
+{
+    ngx_str_node_t  *sn;
+
+    node->mtime = ngx_time();
+    node->expire = (flags & NGX_RTMP_STORE_GROWING) ? NGX_MAX_TIME_T_VALUE
+                                                    : node->mtime + ttl;
+    node->flags = flags;
+
+    ngx_shmtx_lock(&st->shpool->mutex);
+
+    sn = ngx_str_rbtree_lookup(&st->sh->rbtree, &node->sn.str,
+                               node->sn.node.key);
+    if (sn) {
+        ngx_rtmp_store_unlink_locked(st, (ngx_rtmp_store_node_t *) sn);
+    }
+
+    ngx_rbtree_insert(&st->sh->rbtree, &node->sn.node);
+    ngx_queue_insert_tail(&st->sh->queue, &node->queue);
+
+    node->linked = 1;
+
+    if (!(flags & NGX_RTMP_STORE_GROWING)) {
+        node->refs--;
+    }
+
+    ngx_shmtx_unlock(&st->shpool->mutex);
+
+    ngx_rtmp_store_notify(st);
+}
+
+
+void
+ngx_rtmp_store_commit(ngx_rtmp_store_t *st, ngx_rtmp_store_node_t *node,
+    size_t size)
+{
+    /* the lock orders the size before the count of waiters */
+
+    ngx_shmtx_lock(&st->shpool->mutex);
+    node->ready = size;
+    ngx_shmtx_unlock(&st->shpool->mutex);
+
+    ngx_rtmp_store_notify(st);
+}
+
+
+void
+ngx_rtmp_store_finish(ngx_rtmp_store_t *st, ngx_rtmp_store_node_t *node,
+    time_t ttl)
+{
+    ngx_shmtx_lock(&st->shpool->mutex);
+
+    node->mtime = ngx_time();
+    node->expire = node->mtime + ttl;
+    node->ready = node->size;
+    node->flags &= ~NGX_RTMP_STORE_GROWING;
+
+    if (--node->refs == 0 && !node->linked) {
+        ngx_rtmp_store_free_locked(st, node);
+    }
+
+    ngx_shmtx_unlock(&st->shpool->mutex);
+
+    ngx_rtmp_store_notify(st);
+}
+
+
+void
+ngx_rtmp_store_abort(ngx_rtmp_store_t *st, ngx_rtmp_store_node_t *node)
+{
+    ngx_shmtx_lock(&st->shpool->mutex);
+
+    /* a truncated growing file must not be found any more */
+
+    if (node->linked) {
+        ngx_rtmp_store_unlink_locked(st, node);
+    }
+
+    if (--node->refs == 0) {
+        ngx_rtmp_store_free_locked(st, node);
+    }
+
+    ngx_shmtx_unlock(&st->shpool->mutex);
+
+    /* whoever waits for it should give up */
+
+    ngx_rtmp_store_notify(st);
+}
+
+
+ngx_int_t
+ngx_rtmp_store_put(ngx_rtmp_store_t *st, ngx_str_t *path, u_char *data,
+    size_t size, time_t ttl, ngx_uint_t flags, uint64_t version,
+    ngx_log_t *log)
+{
+    ngx_rtmp_store_node_t   *node;
+    ngx_rtmp_store_chunk_t  *cl;
+
+    node = ngx_rtmp_store_open(st, path->data, path->len, log);
+    if (node == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (size) {
+
+        /* sized to fit, small files do not take a whole chunk */
+
+        cl = ngx_rtmp_store_chunk(st, sizeof(ngx_rtmp_store_chunk_t) + size);
+        if (cl == NULL) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "store: no memory for \"%V\"", path);
+            ngx_rtmp_store_abort(st, node);
+            return NGX_ERROR;
+        }
+
+        cl->last = ngx_cpymem(cl->last, data, size);
+
+        node->chunks = cl;
+        node->last = cl;
+        node->size = size;
+    }
+
+    node->version = version;
+
+    ngx_rtmp_store_publish(st, node, ttl, flags);
+
+    return NGX_OK;
+}
+
+
+ngx_rtmp_store_node_t *
+ngx_rtmp_store_get(ngx_rtmp_store_t *st, u_char *path, size_t len)
+{
+    ngx_str_t               str;
+    ngx_str_node_t         *sn;
+    ngx_rtmp_store_node_t  *node;
+
+    str.data = path;
+    str.len = len;
+
+    node = NULL;
+
+    ngx_shmtx_lock(&st->shpool->mutex);
+
+    sn = ngx_str_rbtree_lookup(&st->sh->rbtree, &str,
+                               ngx_crc32_short(path, len));
+    if (sn) {
+        node = (ngx_rtmp_store_node_t *) sn;
+
+        if (node->expire <= ngx_time()) {
+            ngx_rtmp_store_unlink_locked(st, node);
+            node = NULL;
+
+        } else {
+            node->refs++;
+        }
+    }
+
+    ngx_shmtx_unlock(&st->shpool->mutex);
+
+    return node;
+}
+
+
+void
+ngx_rtmp_store_release(ngx_rtmp_store_t *st, ngx_rtmp_store_node_t *node)
+{
+    ngx_shmtx_lock(&st->shpool->mutex);
+
+    if (--node->refs == 0 && !node->linked) {
+        ngx_rtmp_store_free_locked(st, node);
+    }
+
+    ngx_shmtx_unlock(&st->shpool->mutex);
+}
+
+
+static void
+ngx_rtmp_store_expire_locked(ngx_rtmp_store_t *st, time_t now)
+{
+    ngx_uint_t              n;
+    ngx_queue_t            *q;
+    ngx_rtmp_store_node_t  *node;
+
+    /* a couple of files at a time, like limit_req does */
+
+    for (n = 0; n < 2; n++) {
+
+        if (ngx_queue_empty(&st->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_head(&st->sh->queue);
+        node = ngx_queue_data(q, ngx_rtmp_store_node_t, queue);
+
+        if (node->expire > now) {
+            return;
+        }
+
+        ngx_rtmp_store_unlink_locked(st, node);
+    }
+}
+
+
+static void
+ngx_rtmp_store_unlink_locked(ngx_rtmp_store_t *st,
+    ngx_rtmp_store_node_t *node)
+{
+    ngx_rbtree_delete(&st->sh->rbtree, &node->sn.node);
+    ngx_queue_remove(&node->queue);
+
+    node->linked = 0;
+
+    if (node->refs == 0) {
+        ngx_rtmp_store_free_locked(st, node);
+    }
+}
+
+
+static void
+ngx_rtmp_store_free_locked(ngx_rtmp_store_t *st, ngx_rtmp_store_node_t *node)
+{
+    ngx_rtmp_store_chunk_t  *cl, *next;
+
+    for (cl = node->chunks; cl; cl = next) {
+        next = cl->next;
+        ngx_slab_free_locked(st->shpool, cl);
+    }
+
+    ngx_slab_free_locked(st->shpool, node);
+}
+
+
+ngx_int_t
+ngx_rtmp_store_init_notify(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                  i, n;
+    ngx_list_part_t            *part;
+    ngx_shm_zone_t             *shm_zone;
+    ngx_core_conf_t            *ccf;
+    ngx_pool_cleanup_t         *cln;
+    ngx_rtmp_store_channels_t  *ch;
+
+    ngx_rtmp_store_channels = NULL;
+
+    /* nothing to signal without a store */
+
+    part = &cycle->shared_memory.part;
+    shm_zone = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                return NGX_OK;
+            }
+
+            part = part->next;
+            shm_zone = part->elts;
+            i = 0;
+        }
+
+        if (shm_zone[i].tag == &ngx_rtmp_store_tag) {
+            break;
+        }
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    n = ccf->master ? (ngx_uint_t) ccf->worker_processes : 1;
+
+    ch = ngx_pcalloc(cycle->pool, sizeof(ngx_rtmp_store_channels_t));
+    if (ch == NULL) {
+        return NGX_ERROR;
+    }
+
+    ch->fds = ngx_palloc(cycle->pool, n * sizeof(ngx_socket_t [2]));
+    if (ch->fds == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_rtmp_store_close_channels;
+    cln->data = ch;
+
+    for (i = 0; i < n; i++) {
+
+        if (socketpair(AF_UNIX, SOCK_DGRAM, 0, ch->fds[i]) == -1) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                          "store: socketpair() failed");
+            return NGX_ERROR;
+        }
+
+        ch->n++;
+
+        if (ngx_nonblocking(ch->fds[i][0]) == -1
+            || ngx_nonblocking(ch->fds[i][1]) == -1)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                          "store: " ngx_nonblocking_n " failed");
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_rtmp_store_channels = ch;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_store_close_channels(void *data)
+{
+    ngx_rtmp_store_channels_t  *ch = data;
+
+    ngx_uint_t                  n;
+
+    for (n = 0; n < ch->n; n++) {
+        ngx_close_socket(ch->fds[n][0]);
+        ngx_close_socket(ch->fds[n][1]);
+    }
+
+    if (ngx_rtmp_store_channels == ch) {
+        ngx_rtmp_store_channels = NULL;
+    }
+}
+
+
+ngx_int_t
+ngx_rtmp_store_listen(ngx_cycle_t *cycle, ngx_event_handler_pt handler)
+{
+    ngx_uint_t                  n;
+    ngx_connection_t           *c;
+
+    if (ngx_process == NGX_PROCESS_WORKER) {
+        n = ngx_worker;
+
+    } else if (ngx_process == NGX_PROCESS_SINGLE) {
+        n = 0;
+
+    } else {
+        /* cache manager and loader hold no requests */
+        return NGX_OK;
+    }
+
+    if (ngx_rtmp_store_channels == NULL
+        || n >= ngx_rtmp_store_channels->n)
+    {
+        return NGX_OK;
+    }
+
+    c = ngx_get_connection(ngx_rtmp_store_channels->fds[n][1], cycle->log);
+    if (c == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->recv = ngx_recv;
+    c->log = cycle->log;
+    c->read->log = cycle->log;
+    c->write->log = cycle->log;
+    c->read->handler = ngx_rtmp_store_read_handler;
+
+    if (ngx_add_event(c->read, NGX_READ_EVENT, 0) == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    ngx_rtmp_store_wake = handler;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_rtmp_store_wait(ngx_rtmp_store_t *st, ngx_int_t n)
+{
+    (void) ngx_atomic_fetch_add(&st->sh->waiters, (ngx_atomic_int_t) n);
+}
+
+
+static void
+ngx_rtmp_store_notify(ngx_rtmp_store_t *st)
+{
+    ngx_uint_t  n;
+
+    if (ngx_rtmp_store_channels == NULL || st->sh->waiters == 0) {
+        return;
+    }
+
+    /* a full channel has a signal pending already */
+
+    for (n = 0; n < ngx_rtmp_store_channels->n; n++) {
+        (void) send(ngx_rtmp_store_channels->fds[n][0], "", 1, 0);
+    }
+}
+
+
+static void
+ngx_rtmp_store_read_handler(ngx_event_t *ev)
+{
+    u_char             buf[64];
+    ssize_t            n;
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    /* signals say nothing but "look again", all of them are taken */
+
+    do {
+        n = c->recv(c, buf, sizeof(buf));
+    } while (n > 0);
+
+    ev->ready = 0;
+
+    if (ngx_rtmp_store_wake) {
+        ngx_rtmp_store_wake(ev);
+    }
+}
@@ -0,0 +1,123 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#ifndef _NGX_RTMP_STORE_H_INCLUDED_
+#define _NGX_RTMP_STORE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+
+
+/* slab allocation unit of file data, header included */
+#define NGX_RTMP_STORE_CHUNK_SIZE       (64 * 1024)
+
+/* rewritten in place (playlists), must not be cached by clients */
+#define NGX_RTMP_STORE_VOLATILE         0x01
+/* published while still being written, until finished */
+#define NGX_RTMP_STORE_GROWING          0x02
+
+
+typedef struct ngx_rtmp_store_chunk_s   ngx_rtmp_store_chunk_t;
+
+
+struct ngx_rtmp_store_chunk_s {
+    ngx_rtmp_store_chunk_t             *next;
+    u_char                             *last;
+    u_char                             *end;
+};
+
+
+/*
+ * A file kept in the zone under its filesystem path.  Files being
+ * written are not in the tree unless published as growing; publishing
+ * one replaces any file of the same path at once, and readers keep
+ * what they have found until they release it, so a file is only freed
+ * after its last reader.  Of a growing file, readers may take what the
+ * writer has committed as ready, the writer only ever appends past it.
+ */
+typedef struct {
+    ngx_str_node_t                      sn;
+    ngx_queue_t                         queue;     /* oldest first */
+
+    ngx_uint_t                          refs;      /* under shpool mutex */
+    time_t                              mtime;
+    time_t                              expire;
+    size_t                              size;
+    size_t                              ready;     /* of a growing file */
+    ngx_uint_t                          flags;
+    uint64_t                            version;   /* set by the writer */
+
+    ngx_rtmp_store_chunk_t             *chunks;
+    ngx_rtmp_store_chunk_t             *last;
+
+    unsigned                            linked:1;
+} ngx_rtmp_store_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                        rbtree;
+    ngx_rbtree_node_t                   sentinel;
+    ngx_queue_t                         queue;
+    ngx_atomic_t                        waiters;   /* in all workers */
+} ngx_rtmp_store_sh_t;
+
+
+typedef struct {
+    ngx_rtmp_store_sh_t                *sh;
+    ngx_slab_pool_t                    *shpool;
+    ngx_shm_zone_t                     *shm_zone;
+} ngx_rtmp_store_t;
+
+
+/* "off" | "name[:size]", the size is needed in one place only;
+ * stores ngx_rtmp_store_t * (NULL for off) */
+char *ngx_rtmp_store_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+ngx_rtmp_store_t *ngx_rtmp_store_add(ngx_conf_t *cf, ngx_str_t *name,
+    size_t size);
+
+/* writer side; a failed append leaves the file to be aborted */
+ngx_rtmp_store_node_t *ngx_rtmp_store_open(ngx_rtmp_store_t *st,
+    u_char *path, size_t len, ngx_log_t *log);
+ngx_int_t ngx_rtmp_store_append(ngx_rtmp_store_t *st,
+    ngx_rtmp_store_node_t *node, u_char *data, size_t size);
+void ngx_rtmp_store_publish(ngx_rtmp_store_t *st,
+    ngx_rtmp_store_node_t *node, time_t ttl, ngx_uint_t flags);
+/* the first size bytes of a growing file will not change any more */
+void ngx_rtmp_store_commit(ngx_rtmp_store_t *st,
+    ngx_rtmp_store_node_t *node, size_t size);
+/* ends a file published with NGX_RTMP_STORE_GROWING */
+void ngx_rtmp_store_finish(ngx_rtmp_store_t *st,
+    ngx_rtmp_store_node_t *node, time_t ttl);
+void ngx_rtmp_store_abort(ngx_rtmp_store_t *st, ngx_rtmp_store_node_t *node);
+
+/* open, append and publish at once */
+ngx_int_t ngx_rtmp_store_put(ngx_rtmp_store_t *st, ngx_str_t *path,
+    u_char *data, size_t size, time_t ttl, ngx_uint_t flags,
+    uint64_t version, ngx_log_t *log);
+
+/* reader side, NULL if the file is not there or has expired */
+ngx_rtmp_store_node_t *ngx_rtmp_store_get(ngx_rtmp_store_t *st,
+    u_char *path, size_t len);
+void ngx_rtmp_store_release(ngx_rtmp_store_t *st,
+    ngx_rtmp_store_node_t *node);
+
+/*
+ * Readers waiting for a file to change count themselves in while they
+ * do, the writers then signal every worker on publish, commit and
+ * finish; a worker gets the signal through the handler it listens
+ * with.  A reader checks the file once more after counting itself in.
+ */
+ngx_int_t ngx_rtmp_store_init_notify(ngx_cycle_t *cycle);
+ngx_int_t ngx_rtmp_store_listen(ngx_cycle_t *cycle,
+    ngx_event_handler_pt handler);
+void ngx_rtmp_store_wait(ngx_rtmp_store_t *st, ngx_int_t n);
+
+
+#endif /* _NGX_RTMP_STORE_H_INCLUDED_ */
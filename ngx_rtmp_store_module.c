@@ -0,0 +1,683 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_rtmp_store.h"
+
+
+static char *ngx_rtmp_store(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static void *ngx_rtmp_store_create_loc_conf(ngx_conf_t *cf);
+static char *ngx_rtmp_store_merge_loc_conf(ngx_conf_t *cf,
+    void *parent, void *child);
+static ngx_int_t ngx_rtmp_store_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_rtmp_store_init_process(ngx_cycle_t *cycle);
+
+
+typedef struct {
+    ngx_rtmp_store_t               *store;
+    ngx_msec_t                      block_timeout;
+} ngx_rtmp_store_loc_conf_t;
+
+
+typedef struct {
+    ngx_rtmp_store_t               *store;
+    ngx_rtmp_store_node_t          *node;
+} ngx_rtmp_store_cleanup_t;
+
+
+/*
+ * A request held until the file has what it asks for: a playlist the
+ * version, a growing file the byte at "need" as part of a whole part,
+ * or all of it if need is -1.
+ */
+typedef struct {
+    ngx_http_request_t             *request;
+    ngx_rtmp_store_t               *store;
+    ngx_str_t                       path;
+    uint64_t                        version;
+    off_t                           need;
+    ngx_event_t                     event;     /* timeout */
+    ngx_queue_t                     queue;
+} ngx_rtmp_store_wait_t;
+
+
+/* requests held in this worker */
+static ngx_queue_t                  ngx_rtmp_store_waits;
+
+
+static ngx_command_t  ngx_rtmp_store_commands[] = {
+
+    { ngx_string("rtmp_store"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_rtmp_store,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_rtmp_store_loc_conf_t, store),
+      NULL },
+
+    { ngx_string("rtmp_store_block_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_rtmp_store_loc_conf_t, block_timeout),
+      NULL },
+
+    ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_rtmp_store_module_ctx = {
+    NULL,                               /* preconfiguration */
+    NULL,                               /* postconfiguration */
+
+    NULL,                               /* create main configuration */
+    NULL,                               /* init main configuration */
+
+    NULL,                               /* create server configuration */
+    NULL,                               /* merge server configuration */
+
+    ngx_rtmp_store_create_loc_conf,     /* create location configuration */
+    ngx_rtmp_store_merge_loc_conf,      /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_rtmp_store_module = {
+    NGX_MODULE_V1,
+    &ngx_rtmp_store_module_ctx,         /* module context */
+    ngx_rtmp_store_commands,            /* module directives */
+    NGX_HTTP_MODULE,                    /* module type */
+    NULL,                               /* init master */
+    ngx_rtmp_store_init_module,         /* init module */
+    ngx_rtmp_store_init_process,        /* init process */
+    NULL,                               /* init thread */
+    NULL,                               /* exit thread */
+    NULL,                               /* exit process */
+    NULL,                               /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_rtmp_store_cleanup(void *data)
+{
+    ngx_rtmp_store_cleanup_t  *sc = data;
+
+    ngx_rtmp_store_release(sc->store, sc->node);
+}
+
+
+static ngx_int_t
+ngx_rtmp_store_cache_control(ngx_http_request_t *r,
+    ngx_rtmp_store_node_t *node)
+{
+    time_t            age;
+    ngx_table_elt_t  *h;
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "Cache-Control");
+
+    /* playlists change in place, fragments never do once complete */
+
+    if (node->flags & (NGX_RTMP_STORE_VOLATILE|NGX_RTMP_STORE_GROWING)) {
+        ngx_str_set(&h->value, "no-cache");
+        return NGX_OK;
+    }
+
+    age = node->expire - ngx_time();
+    if (age < 0) {
+        age = 0;
+    }
+
+    h->value.data = ngx_pnalloc(r->pool, sizeof("max-age=") + NGX_TIME_T_LEN);
+    if (h->value.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->value.len = ngx_sprintf(h->value.data, "max-age=%T", age)
+                   - h->value.data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_store_send(ngx_http_request_t *r, ngx_rtmp_store_t *st,
+    ngx_rtmp_store_node_t *node)
+{
+    size_t                     size, n;
+    ngx_int_t                  rc;
+    ngx_buf_t                 *b;
+    ngx_chain_t               *out, **ll;
+    ngx_pool_cleanup_t        *cln;
+    ngx_rtmp_store_chunk_t    *ch;
+    ngx_rtmp_store_cleanup_t  *sc;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_rtmp_store_cleanup_t));
+    if (cln == NULL) {
+        ngx_rtmp_store_release(st, node);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_rtmp_store_cleanup;
+
+    sc = cln->data;
+    sc->store = st;
+    sc->node = node;
+
+    /* a growing file is sent as far as it is ready by now */
+
+    size = (node->flags & NGX_RTMP_STORE_GROWING) ? node->ready : node->size;
+    ngx_memory_barrier();
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = size;
+
+    /* playlists change more often than Last-Modified can tell */
+
+    if (!(node->flags & (NGX_RTMP_STORE_VOLATILE|NGX_RTMP_STORE_GROWING))) {
+        r->headers_out.last_modified_time = node->mtime;
+    }
+
+    if (ngx_http_set_content_type(r) != NGX_OK
+        || ngx_rtmp_store_cache_control(r, node) != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->allow_ranges = 1;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    /* sent right from the zone, the file is held until the request ends */
+
+    out = NULL;
+    ll = &out;
+    b = NULL;
+
+    for (ch = node->chunks; ch && size; ch = ch->next) {
+        *ll = ngx_alloc_chain_link(r->pool);
+        if (*ll == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        n = ngx_min((size_t) (ch->last - (u_char *) (ch + 1)), size);
+        size -= n;
+
+        b->pos = (u_char *) (ch + 1);
+        b->last = b->pos + n;
+        b->memory = 1;
+
+        (*ll)->buf = b;
+        ll = &(*ll)->next;
+    }
+
+    if (b == NULL) {
+        *ll = ngx_alloc_chain_link(r->pool);
+        if (*ll == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        (*ll)->buf = b;
+        ll = &(*ll)->next;
+    }
+
+    *ll = NULL;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    return ngx_http_output_filter(r, out);
+}
+
+
+static void
+ngx_rtmp_store_wait_cleanup(void *data)
+{
+    ngx_rtmp_store_wait_t  *sw = data;
+
+    if (sw->event.timer_set) {
+        ngx_del_timer(&sw->event);
+    }
+
+    if (sw->queue.next) {
+        ngx_queue_remove(&sw->queue);
+        sw->queue.next = NULL;
+
+        ngx_rtmp_store_wait(sw->store, -1);
+    }
+}
+
+
+static ngx_uint_t
+ngx_rtmp_store_ready(ngx_rtmp_store_node_t *node, uint64_t version,
+    off_t need)
+{
+    if (node->flags & NGX_RTMP_STORE_VOLATILE) {
+        return node->version >= version;
+    }
+
+    if (!(node->flags & NGX_RTMP_STORE_GROWING)) {
+        return 1;
+    }
+
+    return need >= 0 && (off_t) node->ready > need;
+}
+
+
+/* NGX_BUSY while the request is still to be held */
+
+static ngx_int_t
+ngx_rtmp_store_wait_check(ngx_rtmp_store_wait_t *sw)
+{
+    ngx_http_request_t     *r;
+    ngx_rtmp_store_node_t  *node;
+
+    r = sw->request;
+
+    node = ngx_rtmp_store_get(sw->store, sw->path.data, sw->path.len);
+
+    if (node == NULL) {
+        /* the stream is gone, whatever is on the disk will do */
+        return NGX_DECLINED;
+    }
+
+    if (ngx_rtmp_store_ready(node, sw->version, sw->need)) {
+        return ngx_rtmp_store_send(r, sw->store, node);
+    }
+
+    ngx_rtmp_store_release(sw->store, node);
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_rtmp_store_wait_done(ngx_rtmp_store_wait_t *sw, ngx_int_t rc)
+{
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = sw->request;
+    c = r->connection;
+
+    ngx_rtmp_store_wait_cleanup(sw);
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_rtmp_store_wait_handler(ngx_event_t *ev)
+{
+    ngx_int_t               rc;
+    ngx_rtmp_store_wait_t  *sw;
+
+    sw = ev->data;
+
+    rc = ngx_rtmp_store_wait_check(sw);
+
+    if (rc == NGX_BUSY) {
+        ngx_log_error(NGX_LOG_INFO, ev->log, 0,
+                      "rtmp_store: \"%V\" timed out waiting for update",
+                      &sw->path);
+
+        rc = NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    ngx_rtmp_store_wait_done(sw, rc);
+}
+
+
+/*
+ * A writer has changed something, every request held has a look.  One
+ * finished may end others of its connection, so each is moved aside
+ * before it looks, and the rest are put back.
+ */
+
+static void
+ngx_rtmp_store_wake_handler(ngx_event_t *ev)
+{
+    ngx_int_t               rc;
+    ngx_queue_t            *q, checked;
+    ngx_rtmp_store_wait_t  *sw;
+
+    ngx_queue_init(&checked);
+
+    while (!ngx_queue_empty(&ngx_rtmp_store_waits)) {
+        q = ngx_queue_head(&ngx_rtmp_store_waits);
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_tail(&checked, q);
+
+        sw = ngx_queue_data(q, ngx_rtmp_store_wait_t, queue);
+
+        rc = ngx_rtmp_store_wait_check(sw);
+
+        if (rc != NGX_BUSY) {
+            ngx_rtmp_store_wait_done(sw, rc);
+        }
+    }
+
+    if (!ngx_queue_empty(&checked)) {
+        ngx_queue_add(&ngx_rtmp_store_waits, &checked);
+    }
+}
+
+
+/*
+ * LL-HLS blocking playlist reload: _HLS_msn (and _HLS_part) ask for a
+ * playlist having that segment (part) in it, which is the writer's
+ * version number.  The version wanted is 0 if nothing is asked for.
+ */
+static ngx_int_t
+ngx_rtmp_store_wanted(ngx_http_request_t *r, uint64_t *version)
+{
+    ngx_int_t  msn, part;
+    ngx_str_t  value;
+
+    *version = 0;
+
+    if (ngx_http_arg(r, (u_char *) "_HLS_msn", sizeof("_HLS_msn") - 1,
+                     &value)
+        != NGX_OK)
+    {
+        return NGX_OK;
+    }
+
+    msn = ngx_atoi(value.data, value.len);
+    if (msn == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_arg(r, (u_char *) "_HLS_part", sizeof("_HLS_part") - 1,
+                     &value)
+        != NGX_OK)
+    {
+        /* the whole segment, i.e. the next one has been started */
+        *version = (uint64_t) (msn + 1) << 16;
+        return NGX_OK;
+    }
+
+    part = ngx_atoi(value.data, value.len);
+    if (part == NGX_ERROR || part > 0xffff) {
+        return NGX_ERROR;
+    }
+
+    *version = ((uint64_t) msn << 16) + part + 1;
+
+    return NGX_OK;
+}
+
+
+/*
+ * A growing file is served as far as whole parts of it are ready.  A
+ * range starting in or ending with the part being written (e.g. from
+ * a preload hint, "bytes=N-") is held until that part is complete,
+ * any other request until the file is.  The need is -1 for the latter.
+ */
+static off_t
+ngx_rtmp_store_need(ngx_http_request_t *r)
+{
+    u_char  *p, *last;
+    off_t    start, end;
+
+    if (r->headers_in.range == NULL
+        || r->headers_in.range->value.len < sizeof("bytes=0-") - 1
+        || ngx_strncasecmp(r->headers_in.range->value.data,
+                           (u_char *) "bytes=", 6)
+           != 0)
+    {
+        return -1;
+    }
+
+    p = r->headers_in.range->value.data + 6;
+    last = r->headers_in.range->value.data + r->headers_in.range->value.len;
+
+    start = 0;
+    end = 0;
+
+    if (p == last || *p < '0' || *p > '9') {
+        return -1;
+    }
+
+    while (p < last && *p >= '0' && *p <= '9') {
+        if (start >= NGX_MAX_OFF_T_VALUE / 10) {
+            return -1;
+        }
+
+        start = start * 10 + (*p++ - '0');
+    }
+
+    if (p == last || *p++ != '-') {
+        return -1;
+    }
+
+    if (p == last) {
+        return start;
+    }
+
+    while (p < last && *p >= '0' && *p <= '9') {
+        if (end >= NGX_MAX_OFF_T_VALUE / 10) {
+            return -1;
+        }
+
+        end = end * 10 + (*p++ - '0');
+    }
+
+    /* several ranges are only ever asked for a whole file */
+
+    if (p != last || end < start) {
+        return -1;
+    }
+
+    return end;
+}
+
+
+static ngx_int_t
+ngx_rtmp_store_handler(ngx_http_request_t *r)
+{
+    u_char                     *last;
+    size_t                      root;
+    off_t                       need;
+    uint64_t                    version;
+    ngx_int_t                   rc;
+    ngx_str_t                   path;
+    ngx_pool_cleanup_t         *cln;
+    ngx_rtmp_store_node_t      *node;
+    ngx_rtmp_store_wait_t      *sw;
+    ngx_rtmp_store_loc_conf_t  *slcf;
+
+    slcf = ngx_http_get_module_loc_conf(r, ngx_rtmp_store_module);
+    if (slcf->store == NULL) {
+        return NGX_DECLINED;
+    }
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))
+        || r->uri.data[r->uri.len - 1] == '/')
+    {
+        return NGX_DECLINED;
+    }
+
+    /* files are kept under the paths they are written to */
+
+    last = ngx_http_map_uri_to_path(r, &path, &root, 0);
+    if (last == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    path.len = last - path.data;
+
+    node = ngx_rtmp_store_get(slcf->store, path.data, path.len);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "rtmp_store: \"%V\" %s", &path, node ? "hit" : "miss");
+
+    if (node == NULL) {
+        /* the static module serves it from the disk */
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        ngx_rtmp_store_release(slcf->store, node);
+        return rc;
+    }
+
+    version = 0;
+    need = ngx_rtmp_store_need(r);
+
+    if ((node->flags & NGX_RTMP_STORE_VOLATILE)
+        && ngx_rtmp_store_wanted(r, &version) != NGX_OK)
+    {
+        ngx_rtmp_store_release(slcf->store, node);
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (ngx_rtmp_store_ready(node, version, need)) {
+        return ngx_rtmp_store_send(r, slcf->store, node);
+    }
+
+    /* more than two segments ahead will not come in time */
+
+    if ((node->flags & NGX_RTMP_STORE_VOLATILE)
+        && (version >> 16) > (node->version >> 16) + 2)
+    {
+        ngx_rtmp_store_release(slcf->store, node);
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    ngx_rtmp_store_release(slcf->store, node);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "rtmp_store: \"%V\" blocked for %uL.%uL, need %O",
+                   &path, version >> 16, version & 0xffff, need);
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_rtmp_store_wait_t));
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_rtmp_store_wait_cleanup;
+
+    sw = cln->data;
+    ngx_memzero(sw, sizeof(ngx_rtmp_store_wait_t));
+
+    sw->request = r;
+    sw->store = slcf->store;
+    sw->path = path;
+    sw->version = version;
+    sw->need = need;
+
+    /* counted in first, a change made before is seen by the check */
+
+    ngx_rtmp_store_wait(sw->store, 1);
+    ngx_queue_insert_tail(&ngx_rtmp_store_waits, &sw->queue);
+
+    rc = ngx_rtmp_store_wait_check(sw);
+
+    if (rc != NGX_BUSY) {
+        ngx_rtmp_store_wait_cleanup(sw);
+        return rc;
+    }
+
+    sw->event.handler = ngx_rtmp_store_wait_handler;
+    sw->event.data = sw;
+    sw->event.log = r->connection->log;
+
+    ngx_add_timer(&sw->event, slcf->block_timeout);
+
+    r->main->count++;
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    return NGX_DONE;
+}
+
+
+static char *
+ngx_rtmp_store(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char                      *rv;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    rv = ngx_rtmp_store_set_slot(cf, cmd, conf);
+    if (rv != NGX_CONF_OK) {
+        return rv;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_rtmp_store_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_rtmp_store_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_rtmp_store_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_store_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->store = NGX_CONF_UNSET_PTR;
+    conf->block_timeout = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_rtmp_store_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_rtmp_store_loc_conf_t  *prev = parent;
+    ngx_rtmp_store_loc_conf_t  *conf = child;
+
+    ngx_conf_merge_ptr_value(conf->store, prev->store, NULL);
+    ngx_conf_merge_msec_value(conf->block_timeout, prev->block_timeout,
+                              10000);
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_store_init_module(ngx_cycle_t *cycle)
+{
+    return ngx_rtmp_store_init_notify(cycle);
+}
+
+
+static ngx_int_t
+ngx_rtmp_store_init_process(ngx_cycle_t *cycle)
+{
+    ngx_queue_init(&ngx_rtmp_store_waits);
+
+    return ngx_rtmp_store_listen(cycle, ngx_rtmp_store_wake_handler);
+}
@@ -0,0 +1,410 @@
+
+/*
+ * Copyright (C) Winshining
+ */
+
+
+/*
+ * Replays a captured RTMP publishing stream through the receive path of
+ * a session, once reading chunk by chunk and once with "in_bulk", and
+ * prints the throughput and the number of recv() calls per megabyte of
+ * each.  The capture is what a client sends, handshake included, e.g.
+ *
+ *     socat -r capture.rtmp TCP-LISTEN:1936,reuseaddr TCP:localhost:1935
+ *
+ * while publishing to port 1936.  The messages are checksummed, both
+ * modes must hand the same ones to the handlers.
+ *
+ * Built against a configured and built nginx tree with this module:
+ *
+ *     make -C test bench NGINX=/path/to/nginx
+ *     test/bench_ingest [-n times] [-b in_bulk] [-r max_read] capture.rtmp
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include "ngx_rtmp.h"
+
+
+#define NGX_RTMP_BENCH_HANDSHAKE        (1 + 1536 * 2)
+
+
+typedef struct {
+    u_char                             *data;
+    size_t                              len;
+    size_t                              pos;
+    size_t                              max_read;
+    ngx_uint_t                          calls;
+    ngx_uint_t                          messages;
+    uint32_t                            crc;
+} ngx_rtmp_bench_t;
+
+
+static ngx_rtmp_bench_t                 bench;
+static ngx_log_t                        bench_log;
+static ngx_open_file_t                  bench_log_file;
+
+
+/* the socket always has data until the capture ends */
+
+static ssize_t
+ngx_rtmp_bench_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    size_t  n;
+
+    bench.calls++;
+
+    n = ngx_min(size, bench.len - bench.pos);
+    n = ngx_min(n, bench.max_read);
+
+    if (n == 0) {
+        c->read->ready = 0;
+        return NGX_AGAIN;
+    }
+
+    ngx_memcpy(buf, bench.data + bench.pos, n);
+    bench.pos += n;
+
+    return n;
+}
+
+
+static ngx_int_t
+ngx_rtmp_bench_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+    ngx_chain_t *in)
+{
+    bench.messages++;
+
+    for ( /* void */ ; in; in = in->next) {
+        ngx_crc32_update(&bench.crc, in->buf->pos,
+                         in->buf->last - in->buf->pos);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_bench_chunk_size(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+    ngx_chain_t *in)
+{
+    u_char  *p;
+
+    p = in->buf->pos;
+
+    if (in->buf->last - p < 4) {
+        return NGX_OK;
+    }
+
+    return ngx_rtmp_set_chunk_size(s, ((uint32_t) p[0] << 24)
+                                      | ((uint32_t) p[1] << 16)
+                                      | ((uint32_t) p[2] << 8)
+                                      | (uint32_t) p[3]);
+}
+
+
+static ngx_int_t
+ngx_rtmp_bench_run(ngx_rtmp_core_main_conf_t *cmcf,
+    ngx_rtmp_core_srv_conf_t *cscf, double *sec)
+{
+    void                *main_conf[1], *srv_conf[1];
+    ngx_event_t          rev, wev;
+    ngx_connection_t     c;
+    ngx_int_t            rc;
+    ngx_rtmp_session_t  *s;
+    struct timespec      start, end;
+
+    ngx_memzero(&c, sizeof(ngx_connection_t));
+    ngx_memzero(&rev, sizeof(ngx_event_t));
+    ngx_memzero(&wev, sizeof(ngx_event_t));
+
+    main_conf[0] = cmcf;
+    srv_conf[0] = cscf;
+
+    c.read = &rev;
+    c.write = &wev;
+    c.log = &bench_log;
+    c.recv = ngx_rtmp_bench_recv;
+    c.fd = (ngx_socket_t) -1;
+
+    rev.data = &c;
+    rev.log = &bench_log;
+    rev.active = 1;
+    rev.ready = 1;
+    wev.data = &c;
+    wev.log = &bench_log;
+
+    c.pool = ngx_create_pool(4096, &bench_log);
+    if (c.pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    s = ngx_pcalloc(c.pool, sizeof(ngx_rtmp_session_t));
+    if (s == NULL) {
+        return NGX_ERROR;
+    }
+
+    c.data = s;
+
+    s->connection = &c;
+    s->main_conf = main_conf;
+    s->srv_conf = srv_conf;
+
+    s->in_streams = ngx_pcalloc(c.pool, sizeof(ngx_rtmp_stream_t)
+                                        * cscf->max_streams);
+    if (s->in_streams == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rtmp_set_chunk_size(s, NGX_RTMP_DEFAULT_CHUNK_SIZE);
+
+    bench.pos = NGX_RTMP_BENCH_HANDSHAKE;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &start);
+
+    ngx_rtmp_cycle(s);
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *sec += (end.tv_sec - start.tv_sec)
+            + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    /* a parse error finalizes the session, the rest is left unread */
+
+    rc = c.destroyed ? NGX_ERROR : NGX_OK;
+
+    /* only the bulk parser reads into blocks */
+
+    if ((s->in_bulk != 0) != (cscf->in_bulk != 0)
+        || (s->in_block != NULL) != (cscf->in_bulk != 0))
+    {
+        fprintf(stderr, "the %s read handler was not used\n",
+                cscf->in_bulk ? "bulk" : "chunked");
+        rc = NGX_ERROR;
+    }
+
+    if (s->in_old_pool) {
+        ngx_destroy_pool(s->in_old_pool);
+    }
+
+    if (s->in_pool) {
+        ngx_destroy_pool(s->in_pool);
+    }
+
+    ngx_destroy_pool(c.pool);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_rtmp_bench_mode(const char *name, ngx_rtmp_core_main_conf_t *cmcf,
+    ngx_rtmp_core_srv_conf_t *cscf, ngx_uint_t times, uint32_t *crc)
+{
+    double      sec, mb;
+    ngx_uint_t  i;
+
+    sec = 0;
+    bench.calls = 0;
+    bench.messages = 0;
+
+    ngx_crc32_init(bench.crc);
+
+    for (i = 0; i < times; i++) {
+        if (ngx_rtmp_bench_run(cmcf, cscf, &sec) != NGX_OK) {
+            fprintf(stderr, "%s: stream error at byte %lu\n", name,
+                    (unsigned long) bench.pos);
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_crc32_final(bench.crc);
+
+    mb = (double) (bench.len - NGX_RTMP_BENCH_HANDSHAKE) * times
+         / (1024 * 1024);
+
+    printf("%-8s %10.1f MB/s %10.1f recv/MB %10lu messages  crc %08x\n",
+           name, sec > 0 ? mb / sec : 0, mb > 0 ? bench.calls / mb : 0,
+           (unsigned long) (bench.messages / times), bench.crc);
+
+    *crc = bench.crc;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_bench_read(const char *path)
+{
+    ssize_t          n;
+    ngx_fd_t         fd;
+    ngx_file_info_t  fi;
+
+    fd = ngx_open_file(path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        perror(path);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        perror(path);
+        return NGX_ERROR;
+    }
+
+    bench.len = (size_t) ngx_file_size(&fi);
+
+    if (bench.len <= NGX_RTMP_BENCH_HANDSHAKE) {
+        fprintf(stderr, "%s: no data past the handshake\n", path);
+        return NGX_ERROR;
+    }
+
+    bench.data = malloc(bench.len);
+    if (bench.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    n = ngx_read_fd(fd, bench.data, bench.len);
+    if (n < 0 || (size_t) n != bench.len) {
+        perror(path);
+        return NGX_ERROR;
+    }
+
+    (void) ngx_close_file(fd);
+
+    return NGX_OK;
+}
+
+
+int
+main(int argc, char *const *argv)
+{
+    int                         ch;
+    uint32_t                    crc1, crc2;
+    ngx_uint_t                  i, times;
+    ngx_pool_t                 *pool;
+    ngx_rtmp_handler_pt        *h;
+    ngx_rtmp_core_main_conf_t   cmcf;
+    ngx_rtmp_core_srv_conf_t    cscf, chunked;
+
+    times = 10;
+    bench.max_read = 256 * 1024;
+
+    ngx_memzero(&cscf, sizeof(ngx_rtmp_core_srv_conf_t));
+
+    cscf.in_bulk = 64 * 1024;
+
+    while ((ch = getopt(argc, argv, "n:b:r:")) != -1) {
+        switch (ch) {
+
+        case 'n':
+            times = (ngx_uint_t) atoi(optarg);
+            break;
+
+        case 'b':
+            cscf.in_bulk = (size_t) atoi(optarg);
+            break;
+
+        case 'r':
+            bench.max_read = (size_t) atoi(optarg);
+            break;
+
+        default:
+            goto usage;
+        }
+    }
+
+    if (optind != argc - 1 || times == 0 || cscf.in_bulk == 0
+        || bench.max_read == 0)
+    {
+        goto usage;
+    }
+
+    /* just enough of the process for pools, logging and timers */
+
+    ngx_pagesize = getpagesize();
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+
+    bench_log_file.fd = ngx_stderr;
+    bench_log.file = &bench_log_file;
+    bench_log.log_level = NGX_LOG_WARN;
+
+    ngx_time_init();
+
+    if (ngx_crc32_table_init() != NGX_OK) {
+        return 1;
+    }
+
+#if (nginx_version >= 1007005)
+    ngx_queue_init(&ngx_posted_events);
+#endif
+
+    /* the conf arrays of the session have the core module only */
+
+    ngx_rtmp_core_module.ctx_index = 0;
+
+    pool = ngx_create_pool(4096, &bench_log);
+    if (pool == NULL) {
+        return 1;
+    }
+
+    ngx_memzero(&cmcf, sizeof(ngx_rtmp_core_main_conf_t));
+
+    for (i = 1; i <= NGX_RTMP_MSG_MAX; i++) {
+        if (ngx_array_init(&cmcf.events[i], pool, 1,
+                           sizeof(ngx_rtmp_handler_pt))
+            != NGX_OK)
+        {
+            return 1;
+        }
+
+        h = ngx_array_push(&cmcf.events[i]);
+        if (h == NULL) {
+            return 1;
+        }
+
+        *h = (i == NGX_RTMP_MSG_CHUNK_SIZE) ? ngx_rtmp_bench_chunk_size
+                                            : ngx_rtmp_bench_message;
+    }
+
+    cscf.max_streams = 32;
+    cscf.max_message = 1024 * 1024;
+    cscf.publish_time_fix = 1;
+
+    if (ngx_rtmp_bench_read(argv[optind]) != NGX_OK) {
+        return 1;
+    }
+
+    printf("%s: %lu bytes, %lu times, max %lu bytes per recv\n",
+           argv[optind], (unsigned long) bench.len, (unsigned long) times,
+           (unsigned long) bench.max_read);
+
+    /* "in_bulk" picks the read handler, the baseline has it off */
+
+    chunked = cscf;
+    chunked.in_bulk = 0;
+
+    if (ngx_rtmp_bench_mode("chunked", &cmcf, &chunked, times, &crc1)
+        != NGX_OK)
+    {
+        return 1;
+    }
+
+    if (ngx_rtmp_bench_mode("bulk", &cmcf, &cscf, times, &crc2) != NGX_OK) {
+        return 1;
+    }
+
+    if (crc1 != crc2) {
+        fprintf(stderr, "messages differ between the modes\n");
+        return 1;
+    }
+
+    return 0;
+
+usage:
+
+    fprintf(stderr, "usage: %s [-n times] [-b in_bulk] [-r max_read] "
+                    "capture\n", argv[0]);
+    return 1;
+}